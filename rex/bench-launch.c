@@ -0,0 +1,538 @@
+/*
+Measures what rex adds to launching a program:
+
+  bench-launch [-options]
+
+For every combination of root dirs, non-root (bind) dirs and concurrency it
+launches
+
+  rex --cd / --timings-fd 3 <dirs> -- /bin/true
+
+--runs times, and for every concurrency the same program with a bare
+posix_spawn.  rex reports how long each phase of building the sandbox took
+(see timings.h), the benchmark adds the time until the program exited and
+removes the root afterwards with loggy_rmtree, like rex-clean would.  The
+results are printed one line per configuration, in microseconds:
+
+  mode=<exec|rex> roots=<n> binds=<n> jobs=<n> runs=<n> per_second=<n> total_p50=<us> total_p99=<us> <phase>_p50=<us> <phase>_p99=<us>...
+
+for the phases setup, mkdirs, overlay, binds, chroot, exec and rmtree.
+setup is whatever rex does outside of the other phases, exec is from the
+exec call until the program exited.
+
+The first root dir is made of the symlinks at the top of /, and the real
+directories there (/usr, /lib...) are always bound so the program can run;
+they are not counted in binds.  rex needs its capabilities, see set_rex_cap.
+*/
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <spawn.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <linux/limits.h>
+
+#include "common.h"
+#include "clean.h"
+#include "rootfs.h"
+#include "pool.h"
+
+#define MAX_LIST 16
+#define MAX_SYSTEM_DIRS 16
+
+enum field
+{
+  FIELD_TOTAL,
+  FIELD_SETUP,
+  FIELD_MKDIRS,
+  FIELD_OVERLAY,
+  FIELD_BINDS,
+  FIELD_CHROOT,
+  FIELD_EXEC,
+  FIELD_RMTREE,
+  FIELD_COUNT,
+};
+
+static const char *field_names[FIELD_COUNT] = {
+  "total", "setup", "mkdirs", "overlay", "binds", "chroot", "exec", "rmtree",
+};
+
+struct config
+{
+  const char **argv; // rex and its arguments, or just the program
+  unsigned char bare;
+  unsigned runs;
+  double *samples[FIELD_COUNT]; // microseconds, runs of each
+  atomic_uint next;
+  atomic_uint error_count;
+};
+
+static const char *rex_path = "./rex";
+static const char *program = "/bin/true";
+static const char *rex_options[MAX_LIST];
+static unsigned rex_option_count = 0;
+static char base[PATH_MAX];
+static char system_dirs[MAX_SYSTEM_DIRS][PATH_MAX];
+static unsigned system_dir_count = 0;
+
+static const char *get_opt_arg(int argc, const char *argv[], int *arg_index)
+{
+  (*arg_index)++;
+  if (*arg_index >= argc) {
+    errf("option '%s' requires an argument", argv[(*arg_index) - 1]);
+    exit(1);
+  }
+  return argv[*arg_index];
+}
+
+// parses "<n>,<n>..."
+static unsigned parse_list(const char *option, const char *str, unsigned *values)
+{
+  unsigned count = 0;
+  const char *next = str;
+  for (;;) {
+    char *end;
+    unsigned long value = strtoul(next, &end, 10);
+    if (end == next || (*end != ',' && *end != '\0') || count == MAX_LIST) {
+      errf("invalid list '%s' for '%s'", str, option);
+      exit(1);
+    }
+    values[count++] = value;
+    if (*end == '\0')
+      return count;
+    next = end + 1;
+  }
+}
+
+static unsigned long long now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static err_t make_dir_with_file(const char *dir)
+{
+  char file[PATH_MAX];
+  if (-1 == mkdir(dir, 0755)) {
+    errnof("mkdir '%s' failed", dir);
+    return current_error;
+  }
+  snprintf(file, sizeof(file), "%s/file", dir);
+  int fd = open(file, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+  if (fd == -1) {
+    errnof("create '%s' failed", file);
+    return current_error;
+  }
+  close(fd);
+  return 0;
+}
+
+// root0 gets the symlinks at the top of /, its real directories are bound
+static err_t make_system_root()
+{
+  char root0[PATH_MAX];
+  if (snprintf(root0, sizeof(root0), "%s/root0", base) >= (int)sizeof(root0)) {
+    errf("'%s' is too long", base);
+    return 1;
+  }
+  if (-1 == mkdir(root0, 0755)) {
+    errnof("mkdir '%s' failed", root0);
+    return current_error;
+  }
+  DIR *dir = opendir("/");
+  if (!dir) {
+    errnof("opendir '/' failed");
+    return current_error;
+  }
+  static const char *const system_names[] = { "usr", "bin", "sbin", "lib", "lib32", "lib64", "libx32", "etc" };
+  struct dirent *entry;
+  err_t result = 0;
+  while (result == 0 && (entry = readdir(dir))) {
+    char path[PATH_MAX];
+    struct stat st;
+    if (is_dot_or_dot_dot(entry->d_name))
+      continue;
+    snprintf(path, sizeof(path), "/%s", entry->d_name);
+    if (-1 == lstat(path, &st))
+      continue;
+    if (S_ISLNK(st.st_mode)) {
+      char target[PATH_MAX];
+      ssize_t length = readlink(path, target, sizeof(target) - 1);
+      if (length == -1)
+        continue;
+      target[length] = '\0';
+      if (snprintf(path, sizeof(path), "%s/%s", root0, entry->d_name) >= (int)sizeof(path)) {
+        errf("'%s/%s' is too long", root0, entry->d_name);
+        result = 1;
+        continue;
+      }
+      if (-1 == symlink(target, path)) {
+        errnof("symlink '%s' failed", path);
+        result = current_error;
+      }
+      continue;
+    }
+    if (!S_ISDIR(st.st_mode))
+      continue;
+    for (unsigned i = 0; i < sizeof(system_names) / sizeof(system_names[0]); i++) {
+      if (0 == strcmp(entry->d_name, system_names[i]) && system_dir_count < MAX_SYSTEM_DIRS)
+        strcpy(system_dirs[system_dir_count++], path);
+    }
+  }
+  closedir(dir);
+  return result;
+}
+
+static err_t make_fixtures(unsigned max_roots, unsigned max_binds)
+{
+  char dir[PATH_MAX];
+  err_t result = make_system_root();
+  if (result)
+    return result;
+  for (unsigned i = 1; i < max_roots; i++) {
+    if (snprintf(dir, sizeof(dir), "%s/root%u", base, i) >= (int)sizeof(dir)) {
+      errf("'%s' is too long", base);
+      return 1;
+    }
+    if ((result = make_dir_with_file(dir)))
+      return result;
+  }
+  for (unsigned i = 0; i < max_binds; i++) {
+    if (snprintf(dir, sizeof(dir), "%s/bind%u", base, i) >= (int)sizeof(dir)) {
+      errf("'%s' is too long", base);
+      return 1;
+    }
+    if ((result = make_dir_with_file(dir)))
+      return result;
+  }
+  return 0;
+}
+
+// returns: the rex command line for roots and binds, freed with free_argv
+static const char **make_argv(unsigned roots, unsigned binds)
+{
+  unsigned count = 0;
+  const char **argv = calloc(8 + rex_option_count + roots + system_dir_count + binds, sizeof(*argv));
+  if (!argv) {
+    errnof("calloc failed");
+    return NULL;
+  }
+  argv[count++] = rex_path;
+  argv[count++] = "--cd";
+  argv[count++] = "/";
+  argv[count++] = "--timings-fd";
+  argv[count++] = "3";
+  for (unsigned i = 0; i < rex_option_count; i++)
+    argv[count++] = rex_options[i];
+  for (unsigned i = 0; i < roots; i++)
+    asprintf((char**)&argv[count++], "%s/root%u:", base, i);
+  for (unsigned i = 0; i < system_dir_count; i++)
+    argv[count++] = strdup(system_dirs[i]);
+  for (unsigned i = 0; i < binds; i++)
+    asprintf((char**)&argv[count++], "%s/bind%u", base, i);
+  argv[count++] = "--";
+  argv[count++] = program;
+  return argv;
+}
+
+static void free_argv(const char **argv)
+{
+  for (unsigned i = 5 + rex_option_count; strcmp(argv[i], "--") != 0; i++)
+    free((char*)argv[i]);
+  free(argv);
+}
+
+// the pool and the private scratch dir are not ours to remove
+static unsigned char is_removable_root(const char *root)
+{
+  return 0 == strncmp(root, TMP_REX_DIR "/", sizeof(TMP_REX_DIR)) &&
+    0 != strncmp(root, REX_POOL_DIR, sizeof(REX_POOL_DIR) - 1) &&
+    0 != strcmp(root, REX_SCRATCH_DIR);
+}
+
+static err_t launch(struct config *config, unsigned run)
+{
+  int pipe_fds[2] = { -1, -1 };
+  posix_spawn_file_actions_t actions;
+  pid_t pid;
+  int status;
+  char report[PATH_MAX + 256];
+  size_t report_size = 0;
+
+  if (!config->bare && -1 == pipe2(pipe_fds, O_CLOEXEC)) {
+    errnof("pipe2 failed");
+    return current_error;
+  }
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+  if (!config->bare)
+    posix_spawn_file_actions_adddup2(&actions, pipe_fds[1], 3);
+
+  unsigned long long start = now_ns();
+  errno = posix_spawn(&pid, config->argv[0], &actions, NULL, (char *const*)config->argv, environ);
+  posix_spawn_file_actions_destroy(&actions);
+  if (!config->bare)
+    close(pipe_fds[1]);
+  if (errno) {
+    errnof("posix_spawn '%s' failed", config->argv[0]);
+    if (!config->bare)
+      close(pipe_fds[0]);
+    return current_error;
+  }
+  if (!config->bare) {
+    // rex closes it right before exec
+    for (;;) {
+      ssize_t length = read(pipe_fds[0], report + report_size, sizeof(report) - 1 - report_size);
+      if (length <= 0)
+        break;
+      report_size += length;
+    }
+    close(pipe_fds[0]);
+  }
+  report[report_size] = '\0';
+  while (-1 == waitpid(pid, &status, 0) && errno == EINTR)
+    ;
+  unsigned long long end = now_ns();
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    errf("'%s' failed with status 0x%x", config->argv[0], status);
+    return 1;
+  }
+  config->samples[FIELD_TOTAL][run] = (end - start) / 1e3;
+  if (config->bare)
+    return 0;
+
+  char root[PATH_MAX];
+  unsigned long long mkdirs_ns, overlay_ns, binds_ns, chroot_ns, exec_ns;
+  if (6 != sscanf(report, "root=%4095s mkdirs_ns=%llu overlay_ns=%llu binds_ns=%llu chroot_ns=%llu exec_ns=%llu",
+                  root, &mkdirs_ns, &overlay_ns, &binds_ns, &chroot_ns, &exec_ns)) {
+    errf("rex did not report its timings");
+    return 1;
+  }
+  config->samples[FIELD_MKDIRS][run] = mkdirs_ns / 1e3;
+  config->samples[FIELD_OVERLAY][run] = overlay_ns / 1e3;
+  config->samples[FIELD_BINDS][run] = binds_ns / 1e3;
+  config->samples[FIELD_CHROOT][run] = chroot_ns / 1e3;
+  config->samples[FIELD_EXEC][run] = (end - exec_ns) / 1e3;
+  config->samples[FIELD_SETUP][run] =
+    (exec_ns - start - mkdirs_ns - overlay_ns - binds_ns - chroot_ns) / 1e3;
+
+  config->samples[FIELD_RMTREE][run] = 0;
+  if (is_removable_root(root)) {
+    char lock_file[PATH_MAX + sizeof(REX_ROOT_LOCK_SUFFIX)];
+    unsigned long long rmtree_start = now_ns();
+    unsigned error_count = loggy_rmtree(root);
+    config->samples[FIELD_RMTREE][run] = (now_ns() - rmtree_start) / 1e3;
+    if (error_count) {
+      errf("rmtree '%s' failed to remove %u entries", root, error_count);
+      return 1;
+    }
+    snprintf(lock_file, sizeof(lock_file), "%s%s", root, REX_ROOT_LOCK_SUFFIX);
+    unlink(lock_file);
+  }
+  return 0;
+}
+
+static void *launch_thread(void *arg)
+{
+  struct config *config = arg;
+  for (;;) {
+    unsigned run = atomic_fetch_add(&config->next, 1);
+    if (run >= config->runs)
+      break;
+    if (launch(config, run))
+      atomic_fetch_add(&config->error_count, 1);
+  }
+  return NULL;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+  double x = *(const double*)a;
+  double y = *(const double*)b;
+  return (x > y) - (x < y);
+}
+
+// sorts samples
+static double percentile(double *samples, unsigned count, double fraction)
+{
+  qsort(samples, count, sizeof(*samples), compare_double);
+  return samples[(unsigned)((count - 1) * fraction + 0.5)];
+}
+
+static err_t run_config(const char **argv, unsigned char bare, unsigned roots, unsigned binds,
+                        unsigned jobs, unsigned runs)
+{
+  struct config config = { .argv = argv, .bare = bare, .runs = runs };
+  pthread_t threads[jobs];
+  err_t result = 0;
+  for (unsigned i = 0; i < FIELD_COUNT; i++) {
+    config.samples[i] = calloc(runs, sizeof(double));
+    if (!config.samples[i]) {
+      errnof("calloc failed");
+      result = 1;
+      goto out;
+    }
+  }
+  atomic_init(&config.next, 0);
+  atomic_init(&config.error_count, 0);
+
+  unsigned long long start = now_ns();
+  unsigned started = 0;
+  for (; started < jobs; started++) {
+    errno = pthread_create(&threads[started], NULL, launch_thread, &config);
+    if (errno) {
+      errnof("pthread_create failed");
+      break;
+    }
+  }
+  if (started == 0)
+    launch_thread(&config);
+  for (unsigned i = 0; i < started; i++)
+    pthread_join(threads[i], NULL);
+  double seconds = (now_ns() - start) / 1e9;
+  if (atomic_load(&config.error_count)) {
+    errf("%u of %u launches failed", atomic_load(&config.error_count), runs);
+    result = 1;
+    goto out;
+  }
+
+  fprintf(stderr, "mode=%s roots=%u binds=%u jobs=%u runs=%u per_second=%.1f",
+          bare ? "exec" : "rex", roots, binds, jobs, runs, runs / seconds);
+  for (unsigned i = 0; i < (bare ? 1 : FIELD_COUNT); i++) {
+    fprintf(stderr, " %s_p50=%.1f %s_p99=%.1f",
+            field_names[i], percentile(config.samples[i], runs, 0.5),
+            field_names[i], percentile(config.samples[i], runs, 0.99));
+  }
+  fprintf(stderr, "\n");
+out:
+  for (unsigned i = 0; i < FIELD_COUNT; i++)
+    free(config.samples[i]);
+  return result;
+}
+
+static unsigned max_of(const unsigned *values, unsigned count)
+{
+  unsigned max = 0;
+  for (unsigned i = 0; i < count; i++)
+    max = (values[i] > max) ? values[i] : max;
+  return max;
+}
+
+void usage()
+{
+  printf("Usage: bench-launch [-options]\n");
+  printf("Options:\n");
+  printf("  --rex <path>          The rex to measure (default ./rex)\n");
+  printf("  --dir|-d <dir>        Where to make the dirs to mount (default /tmp)\n");
+  printf("  --roots|-R <n>,...    Root dirs, overlaid, the first is made from / (default 1,4,16)\n");
+  printf("  --binds|-B <n>,...    Non-root dirs, bind mounted (default 0,4,16)\n");
+  printf("  --jobs|-j <n>,...     Launches running at the same time (default 1,nproc)\n");
+  printf("  --runs|-r <n>         Launches per configuration (default 100)\n");
+  printf("  --rex-option <opt>    Pass opt to rex, e.g. --legacy-mount, --private or --pool\n");
+}
+
+int main(int argc, const char *argv[])
+{
+  const char *base_parent = "/tmp";
+  unsigned roots[MAX_LIST] = { 1, 4, 16 };
+  unsigned root_count = 3;
+  unsigned binds[MAX_LIST] = { 0, 4, 16 };
+  unsigned bind_count = 3;
+  unsigned jobs[MAX_LIST] = { 1, 0 };
+  unsigned job_count = 2;
+  unsigned runs = 100;
+  for (int arg_index = 1; arg_index < argc; arg_index++) {
+    const char *arg = argv[arg_index];
+    if (0 == strcmp(arg, "--rex")) {
+      rex_path = get_opt_arg(argc, argv, &arg_index);
+    } else if (0 == strcmp(arg, "-d") || 0 == strcmp(arg, "--dir")) {
+      base_parent = get_opt_arg(argc, argv, &arg_index);
+    } else if (0 == strcmp(arg, "-R") || 0 == strcmp(arg, "--roots")) {
+      root_count = parse_list(arg, get_opt_arg(argc, argv, &arg_index), roots);
+    } else if (0 == strcmp(arg, "-B") || 0 == strcmp(arg, "--binds")) {
+      bind_count = parse_list(arg, get_opt_arg(argc, argv, &arg_index), binds);
+    } else if (0 == strcmp(arg, "-j") || 0 == strcmp(arg, "--jobs")) {
+      job_count = parse_list(arg, get_opt_arg(argc, argv, &arg_index), jobs);
+    } else if (0 == strcmp(arg, "-r") || 0 == strcmp(arg, "--runs")) {
+      runs = atoi(get_opt_arg(argc, argv, &arg_index));
+    } else if (0 == strcmp(arg, "--rex-option")) {
+      if (rex_option_count == MAX_LIST) {
+        errf("too many '%s'", arg);
+        return 1;
+      }
+      rex_options[rex_option_count++] = get_opt_arg(argc, argv, &arg_index);
+    } else {
+      usage();
+      return 1;
+    }
+  }
+  for (unsigned i = 0; i < job_count; i++) {
+    if (jobs[i] == 0) {
+      long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+      jobs[i] = (cpus > 0) ? cpus : 1;
+    }
+  }
+  for (unsigned i = 0; i < root_count; i++) {
+    if (roots[i] == 0) {
+      errf("every sandbox needs at least the root dir made from /");
+      return 1;
+    }
+  }
+  if (runs == 0) {
+    errf("need at least one run");
+    return 1;
+  }
+
+  snprintf(base, sizeof(base), "%s/bench-launch.XXXXXX", base_parent);
+  if (NULL == mkdtemp(base)) {
+    errnof("mkdtemp '%s' failed", base);
+    return 1;
+  }
+  int exit_code = make_fixtures(max_of(roots, root_count), max_of(binds, bind_count)) ? 1 : 0;
+
+  // loggy_rmtree logs every directory at debug level, keep that out of the
+  // timings
+  int saved_stdout = dup(STDOUT_FILENO);
+  int null_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+  if (saved_stdout == -1 || null_fd == -1) {
+    errnof("open '/dev/null' failed");
+    return 1;
+  }
+  fflush(stdout);
+  dup2(null_fd, STDOUT_FILENO);
+
+  for (unsigned j = 0; j < job_count && exit_code == 0; j++) {
+    const char *bare_argv[] = { program, NULL };
+    if (run_config(bare_argv, 1, 0, 0, jobs[j], runs)) {
+      exit_code = 1;
+      break;
+    }
+    for (unsigned r = 0; r < root_count && exit_code == 0; r++) {
+      for (unsigned b = 0; b < bind_count && exit_code == 0; b++) {
+        const char **rex_argv = make_argv(roots[r], binds[b]);
+        if (!rex_argv || run_config(rex_argv, 0, roots[r], binds[b], jobs[j], runs))
+          exit_code = 1;
+        if (rex_argv)
+          free_argv(rex_argv);
+      }
+    }
+  }
+
+  // only holds the dirs and the symlinks made above
+  if (loggy_rmtree_serial(base))
+    exit_code = 1;
+  fflush(stdout);
+  dup2(saved_stdout, STDOUT_FILENO);
+  return exit_code;
+}
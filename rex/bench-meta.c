@@ -0,0 +1,583 @@
+/*
+Replays the filesystem accesses of a compiler on a tree, to compare what
+each way of building a sandbox costs for metadata:
+
+  bench-meta --generate <dir> [-options]
+  bench-meta [-options] <dir>
+
+The first form makes the tree, the second replays it from as many threads
+as --jobs.  One compile reads its source file, then for each of its
+#includes probes every include dir in order until the header is found
+(failed opens, like gcc), stats and reads it, then maps the shared
+libraries a compiler links against.  Every 20th compile lists the big
+directory, like a build system globbing.  The tree is the same for every
+view of it, so the tree can be generated once and replayed natively, in a
+rex overlay, through the FUSE rexfs or through the rexfs kernel mount; see
+bench-meta.sh.  Results go to stdout, one line for the run and one per op:
+
+  backend=<label> jobs=<n> seconds=<s> compiles_per_second=<n> ops_per_second=<n>
+  backend=<label> op=<op> count=<n> p50_us=<us> p99_us=<us> p999_us=<us>
+*/
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include <linux/limits.h>
+
+#include "common.h"
+
+#define PARAMS_FILE "bench-meta.params"
+#define MAX_JOBS 256
+
+enum op
+{
+  OP_SOURCE,     // open and read the source file
+  OP_PROBE_MISS, // open of a header in an include dir that does not have it
+  OP_STAT,       // stat of the header found
+  OP_READ,       // open, read and close of the header found
+  OP_MMAP,       // open, map, touch and unmap a library
+  OP_READDIR,    // list the big directory
+  OP_COUNT,
+};
+
+static const char *op_names[OP_COUNT] = {
+  "source", "probe_miss", "stat", "read", "mmap", "readdir",
+};
+
+struct params
+{
+  unsigned include_dirs;
+  unsigned headers;
+  unsigned depth;
+  unsigned includes; // per compile
+  unsigned sources;
+  unsigned big_dir;
+  unsigned libs;
+  unsigned lib_size;
+};
+
+static struct params params = {
+  .include_dirs = 16,
+  .headers = 400,
+  .depth = 3,
+  .includes = 100,
+  .sources = 64,
+  .big_dir = 5000,
+  .libs = 8,
+  .lib_size = 1 << 20,
+};
+
+struct samples
+{
+  unsigned *ns;
+  size_t count;
+  size_t capacity;
+};
+
+struct job
+{
+  pthread_t thread;
+  unsigned index;
+  unsigned long long compiles;
+  unsigned random;
+  struct samples samples[OP_COUNT];
+  unsigned error_count;
+};
+
+static const char *tree;
+static double seconds = 5;
+static unsigned long long deadline_ns;
+
+static const char *get_opt_arg(int argc, const char *argv[], int *arg_index)
+{
+  (*arg_index)++;
+  if (*arg_index >= argc) {
+    errf("option '%s' requires an argument", argv[(*arg_index) - 1]);
+    exit(1);
+  }
+  return argv[*arg_index];
+}
+
+static unsigned long long now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// the directories of a header below an include dir, "pkg<n>/d1/d2..."
+static err_t format_header_dir(char *buf, size_t size, unsigned header)
+{
+  size_t length = snprintf(buf, size, "pkg%u", header % 32);
+  for (unsigned level = 1; level < params.depth && length < size; level++)
+    length += snprintf(buf + length, size - length, "/d%u", level);
+  if (length >= size) {
+    errf("header dir %u is too deep", header);
+    return 1;
+  }
+  return 0;
+}
+
+// each header lives in one include dir, the ones before it are probed first
+static unsigned header_home(unsigned header)
+{
+  return header % params.include_dirs;
+}
+
+static err_t format_header(char *buf, size_t size, unsigned include_dir, unsigned header)
+{
+  char dir[PATH_MAX];
+  if (format_header_dir(dir, sizeof(dir), header))
+    return 1; // error already logged
+  if (snprintf(buf, size, "%s/include/i%u/%s/h%u.h", tree, include_dir, dir, header) >= (int)size) {
+    errf("the path of header %u is too long", header);
+    return 1;
+  }
+  return 0;
+}
+
+static err_t write_file(const char *path, size_t size)
+{
+  int fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+  if (fd == -1) {
+    errnof("create '%s' failed", path);
+    return current_error;
+  }
+  char buf[4096];
+  memset(buf, 'x', sizeof(buf));
+  while (size) {
+    size_t chunk = (size < sizeof(buf)) ? size : sizeof(buf);
+    ssize_t written = write(fd, buf, chunk);
+    if (written <= 0) {
+      errnof("write '%s' failed", path);
+      close(fd);
+      return current_error;
+    }
+    size -= written;
+  }
+  close(fd);
+  return 0;
+}
+
+static err_t make_dirs(char *path)
+{
+  for (char *slash = strchr(path + 1, '/'); ; slash = strchr(slash + 1, '/')) {
+    if (slash)
+      *slash = '\0';
+    int result = mkdir(path, 0755);
+    if (slash)
+      *slash = '/';
+    if (result == -1 && errno != EEXIST) {
+      errnof("mkdir '%s' failed", path);
+      return current_error;
+    }
+    if (!slash)
+      return 0;
+  }
+}
+
+static err_t generate()
+{
+  char path[PATH_MAX];
+  char dir[PATH_MAX];
+  err_t result;
+  snprintf(path, sizeof(path), "%s", tree);
+  if ((result = make_dirs(path)))
+    return result;
+  // every include dir has every package dir, so misses go all the way down
+  for (unsigned i = 0; i < params.include_dirs; i++) {
+    for (unsigned header = 0; header < params.headers && header < 32; header++) {
+      if ((result = format_header_dir(dir, sizeof(dir), header)))
+        return result;
+      if (snprintf(path, sizeof(path), "%s/include/i%u/%s", tree, i, dir) >= (int)sizeof(path)) {
+        errf("the path of include dir %u is too long", i);
+        return 1;
+      }
+      if ((result = make_dirs(path)))
+        return result;
+    }
+  }
+  for (unsigned header = 0; header < params.headers; header++) {
+    if ((result = format_header(path, sizeof(path), header_home(header), header)))
+      return result;
+    if ((result = write_file(path, 2048)))
+      return result;
+  }
+  snprintf(path, sizeof(path), "%s/src", tree);
+  if ((result = make_dirs(path)))
+    return result;
+  for (unsigned i = 0; i < params.sources; i++) {
+    snprintf(path, sizeof(path), "%s/src/s%u.c", tree, i);
+    if ((result = write_file(path, 8192)))
+      return result;
+  }
+  snprintf(path, sizeof(path), "%s/big", tree);
+  if ((result = make_dirs(path)))
+    return result;
+  for (unsigned i = 0; i < params.big_dir; i++) {
+    snprintf(path, sizeof(path), "%s/big/entry%u", tree, i);
+    if ((result = write_file(path, 0)))
+      return result;
+  }
+  snprintf(path, sizeof(path), "%s/solib", tree);
+  if ((result = make_dirs(path)))
+    return result;
+  for (unsigned i = 0; i < params.libs; i++) {
+    snprintf(path, sizeof(path), "%s/solib/lib%u.so", tree, i);
+    if ((result = write_file(path, params.lib_size)))
+      return result;
+  }
+
+  // the replay reads back what it was generated with
+  snprintf(path, sizeof(path), "%s/" PARAMS_FILE, tree);
+  FILE *file = fopen(path, "w");
+  if (!file) {
+    errnof("create '%s' failed", path);
+    return current_error;
+  }
+  fprintf(file, "%u %u %u %u %u %u %u\n", params.include_dirs, params.headers, params.depth,
+          params.sources, params.big_dir, params.libs, params.lib_size);
+  fclose(file);
+  return 0;
+}
+
+static err_t read_params()
+{
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/" PARAMS_FILE, tree);
+  FILE *file = fopen(path, "r");
+  if (!file) {
+    errnof("open '%s' failed (generate the tree first)", path);
+    return current_error;
+  }
+  int count = fscanf(file, "%u %u %u %u %u %u %u", &params.include_dirs, &params.headers, &params.depth,
+                     &params.sources, &params.big_dir, &params.libs, &params.lib_size);
+  fclose(file);
+  if (count != 7) {
+    errf("'%s' is not a %s file", path, PARAMS_FILE);
+    return 1;
+  }
+  return 0;
+}
+
+static void add_sample(struct job *job, enum op op, unsigned long long start)
+{
+  struct samples *samples = &job->samples[op];
+  unsigned long long ns = now_ns() - start;
+  if (samples->count == samples->capacity) {
+    size_t capacity = samples->capacity ? samples->capacity * 2 : 4096;
+    unsigned *grown = realloc(samples->ns, capacity * sizeof(*grown));
+    if (!grown)
+      return; // a sample short
+    samples->ns = grown;
+    samples->capacity = capacity;
+  }
+  samples->ns[samples->count++] = (ns > ~0U) ? ~0U : ns;
+}
+
+// xorshift, the same sequence for a job on every backend
+static unsigned next_random(struct job *job)
+{
+  job->random ^= job->random << 13;
+  job->random ^= job->random >> 17;
+  job->random ^= job->random << 5;
+  return job->random;
+}
+
+static void read_file(struct job *job, enum op op, const char *path)
+{
+  char buf[8192];
+  unsigned long long start = now_ns();
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    errnof("open '%s' failed", path);
+    job->error_count++;
+    return;
+  }
+  while (read(fd, buf, sizeof(buf)) > 0)
+    ;
+  close(fd);
+  add_sample(job, op, start);
+}
+
+static void include(struct job *job, unsigned header)
+{
+  char path[PATH_MAX];
+  struct stat st;
+  unsigned home = header_home(header);
+  for (unsigned i = 0; i < home; i++) {
+    if (format_header(path, sizeof(path), i, header)) {
+      job->error_count++;
+      return;
+    }
+    unsigned long long start = now_ns();
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd != -1) {
+      errf("'%s' should not exist", path);
+      close(fd);
+      job->error_count++;
+      return;
+    }
+    add_sample(job, OP_PROBE_MISS, start);
+  }
+  if (format_header(path, sizeof(path), home, header)) {
+    job->error_count++;
+    return;
+  }
+  unsigned long long start = now_ns();
+  if (-1 == stat(path, &st)) {
+    errnof("stat '%s' failed", path);
+    job->error_count++;
+    return;
+  }
+  add_sample(job, OP_STAT, start);
+  read_file(job, OP_READ, path);
+}
+
+static void map_lib(struct job *job, unsigned lib)
+{
+  char path[PATH_MAX];
+  struct stat st;
+  snprintf(path, sizeof(path), "%s/solib/lib%u.so", tree, lib);
+  unsigned long long start = now_ns();
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1 || -1 == fstat(fd, &st)) {
+    errnof("open '%s' failed", path);
+    if (fd != -1)
+      close(fd);
+    job->error_count++;
+    return;
+  }
+  void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    errnof("mmap '%s' failed", path);
+    job->error_count++;
+    return;
+  }
+  // the loader touches the headers, the dynamic section and some text
+  volatile const char *bytes = map;
+  for (off_t offset = 0; offset < st.st_size; offset += 16 * 4096)
+    (void)bytes[offset];
+  munmap(map, st.st_size);
+  add_sample(job, OP_MMAP, start);
+}
+
+static void list_big_dir(struct job *job)
+{
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/big", tree);
+  unsigned long long start = now_ns();
+  DIR *dir = opendir(path);
+  if (!dir) {
+    errnof("opendir '%s' failed", path);
+    job->error_count++;
+    return;
+  }
+  while (readdir(dir))
+    ;
+  closedir(dir);
+  add_sample(job, OP_READDIR, start);
+}
+
+static void compile(struct job *job)
+{
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/src/s%u.c", tree, next_random(job) % params.sources);
+  read_file(job, OP_SOURCE, path);
+  for (unsigned i = 0; i < params.includes; i++)
+    include(job, next_random(job) % params.headers);
+  for (unsigned i = 0; i < params.libs && i < 4; i++)
+    map_lib(job, (job->index + i) % params.libs);
+  if (job->compiles % 20 == 0)
+    list_big_dir(job);
+  job->compiles++;
+}
+
+static void *job_thread(void *arg)
+{
+  struct job *job = arg;
+  while (now_ns() < deadline_ns && job->error_count == 0)
+    compile(job);
+  return NULL;
+}
+
+static int compare_unsigned(const void *a, const void *b)
+{
+  unsigned x = *(const unsigned*)a;
+  unsigned y = *(const unsigned*)b;
+  return (x > y) - (x < y);
+}
+
+static double percentile_us(const unsigned *sorted, size_t count, double fraction)
+{
+  if (count == 0)
+    return 0;
+  return sorted[(size_t)((count - 1) * fraction + 0.5)] / 1e3;
+}
+
+static err_t report(const char *label, struct job *jobs, unsigned job_count, double elapsed)
+{
+  unsigned long long compiles = 0;
+  size_t total_ops = 0;
+  for (unsigned j = 0; j < job_count; j++) {
+    compiles += jobs[j].compiles;
+    for (unsigned op = 0; op < OP_COUNT; op++)
+      total_ops += jobs[j].samples[op].count;
+  }
+  printf("backend=%s jobs=%u seconds=%.2f compiles_per_second=%.1f ops_per_second=%.1f\n",
+         label, job_count, elapsed, compiles / elapsed, total_ops / elapsed);
+  for (unsigned op = 0; op < OP_COUNT; op++) {
+    size_t count = 0;
+    for (unsigned j = 0; j < job_count; j++)
+      count += jobs[j].samples[op].count;
+    unsigned *all = malloc((count ? count : 1) * sizeof(*all));
+    if (!all) {
+      errnof("malloc failed");
+      return 1;
+    }
+    size_t offset = 0;
+    for (unsigned j = 0; j < job_count; j++) {
+      memcpy(all + offset, jobs[j].samples[op].ns, jobs[j].samples[op].count * sizeof(*all));
+      offset += jobs[j].samples[op].count;
+    }
+    qsort(all, count, sizeof(*all), compare_unsigned);
+    printf("backend=%s op=%s count=%zu p50_us=%.1f p99_us=%.1f p999_us=%.1f\n", label, op_names[op], count,
+           percentile_us(all, count, 0.5), percentile_us(all, count, 0.99), percentile_us(all, count, 0.999));
+    free(all);
+  }
+  return 0;
+}
+
+void usage()
+{
+  printf("Usage: bench-meta --generate <dir> [-options]\n");
+  printf("       bench-meta [-options] <dir>\n");
+  printf("Options:\n");
+  printf("  --generate <dir>      Make the tree in dir\n");
+  printf("  --label <name>        The backend name to report (default native)\n");
+  printf("  --jobs|-j <n>         Compiles running at the same time (default nproc)\n");
+  printf("  --seconds|-s <n>      How long to replay (default %.0f)\n", seconds);
+  printf("  --includes <n>        Headers included per compile (default %u)\n", params.includes);
+  printf("Options for --generate:\n");
+  printf("  --include-dirs <n>    Include dirs probed in order (default %u)\n", params.include_dirs);
+  printf("  --headers <n>         Headers, spread over the include dirs (default %u)\n", params.headers);
+  printf("  --depth <n>           Directory levels of a header name (default %u)\n", params.depth);
+  printf("  --big-dir <n>         Entries of the directory that is listed (default %u)\n", params.big_dir);
+  printf("  --libs <n>            Libraries, 4 are mapped per compile (default %u)\n", params.libs);
+}
+
+int main(int argc, const char *argv[])
+{
+  const char *label = "native";
+  unsigned job_count = 0;
+  unsigned char do_generate = 0;
+  for (int arg_index = 1; arg_index < argc; arg_index++) {
+    const char *arg = argv[arg_index];
+    if (0 == strcmp(arg, "--generate")) {
+      tree = get_opt_arg(argc, argv, &arg_index);
+      do_generate = 1;
+    } else if (0 == strcmp(arg, "--label")) {
+      label = get_opt_arg(argc, argv, &arg_index);
+    } else if (0 == strcmp(arg, "-j") || 0 == strcmp(arg, "--jobs")) {
+      job_count = atoi(get_opt_arg(argc, argv, &arg_index));
+    } else if (0 == strcmp(arg, "-s") || 0 == strcmp(arg, "--seconds")) {
+      seconds = atof(get_opt_arg(argc, argv, &arg_index));
+    } else if (0 == strcmp(arg, "--includes")) {
+      params.includes = atoi(get_opt_arg(argc, argv, &arg_index));
+    } else if (0 == strcmp(arg, "--include-dirs")) {
+      params.include_dirs = atoi(get_opt_arg(argc, argv, &arg_index));
+    } else if (0 == strcmp(arg, "--headers")) {
+      params.headers = atoi(get_opt_arg(argc, argv, &arg_index));
+    } else if (0 == strcmp(arg, "--depth")) {
+      params.depth = atoi(get_opt_arg(argc, argv, &arg_index));
+    } else if (0 == strcmp(arg, "--big-dir")) {
+      params.big_dir = atoi(get_opt_arg(argc, argv, &arg_index));
+    } else if (0 == strcmp(arg, "--libs")) {
+      params.libs = atoi(get_opt_arg(argc, argv, &arg_index));
+    } else if (arg[0] != '-' && !tree) {
+      tree = arg;
+    } else {
+      usage();
+      return 1;
+    }
+  }
+  if (!tree) {
+    usage();
+    return 1;
+  }
+  if (do_generate) {
+    if (params.include_dirs == 0 || params.headers == 0 || params.depth == 0) {
+      errf("need at least one include dir, header and level");
+      return 1;
+    }
+    return generate() ? 1 : 0;
+  }
+  // "/" in a sandbox, without doubling the slash of every path
+  if (0 == strcmp(tree, "/"))
+    tree = "";
+  if (read_params())
+    return 1; // error already logged
+  if (params.sources == 0) {
+    errf("the tree has no sources");
+    return 1;
+  }
+  if (job_count == 0) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    job_count = (cpus > 0) ? cpus : 1;
+  }
+  if (job_count > MAX_JOBS)
+    job_count = MAX_JOBS;
+
+  struct job *jobs = calloc(job_count, sizeof(*jobs));
+  if (!jobs) {
+    errnof("calloc failed");
+    return 1;
+  }
+  // one untimed compile per job first, so every backend starts warm
+  for (unsigned j = 0; j < job_count; j++) {
+    jobs[j].index = j;
+    jobs[j].random = 2463534242U + j;
+    compile(&jobs[j]);
+    for (unsigned op = 0; op < OP_COUNT; op++)
+      jobs[j].samples[op].count = 0;
+    jobs[j].compiles = 0;
+    if (jobs[j].error_count)
+      return 1; // error already logged
+  }
+
+  unsigned long long start = now_ns();
+  deadline_ns = start + (unsigned long long)(seconds * 1e9);
+  unsigned started = 0;
+  for (; started < job_count; started++) {
+    errno = pthread_create(&jobs[started].thread, NULL, job_thread, &jobs[started]);
+    if (errno) {
+      errnof("pthread_create failed");
+      break;
+    }
+  }
+  for (unsigned j = 0; j < started; j++)
+    pthread_join(jobs[j].thread, NULL);
+  double elapsed = (now_ns() - start) / 1e9;
+  if (started == 0)
+    return 1;
+
+  unsigned error_count = 0;
+  for (unsigned j = 0; j < started; j++)
+    error_count += jobs[j].error_count;
+  if (error_count) {
+    errf("%u accesses failed", error_count);
+    return 1;
+  }
+  return report(label, jobs, started, elapsed) ? 1 : 0;
+}
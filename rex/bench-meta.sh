@@ -0,0 +1,82 @@
+#!/bin/sh
+# Replays the same compiler access pattern natively, in a rex overlay,
+# through the FUSE rexfs and through the rexfs kernel mount when the module
+# is loaded, see bench-meta.c.  Backends that are not available are skipped.
+#
+#   bench-meta.sh [<work dir>] [<bench-meta options>...]
+#
+# REX, REX_CLEAN, BENCH_META and REXFS_FUSE point at the binaries (default:
+# the build dir, ./rex and ../rexfs/fuse/rexfs).  Needs to run as root, or with rex
+# and fusermount3 set up for the current user.
+set -e
+
+work=${1:-/tmp/bench-meta.$$}
+[ $# -gt 0 ] && shift
+here=$(cd "$(dirname "$0")" && pwd)
+REX=$(realpath "${REX:-$here/rex}")
+REX_CLEAN=${REX_CLEAN:-$(dirname "$REX")/rex-clean}
+BENCH_META=$(realpath "${BENCH_META:-$here/bench-meta}")
+REXFS_FUSE=${REXFS_FUSE:-$here/../rexfs/fuse/rexfs}
+
+mkdir -p "$work"
+work=$(realpath "$work")
+tree=$work/tree
+[ -e "$tree" ] || "$BENCH_META" --generate "$tree"
+
+echo "== native" >&2
+"$BENCH_META" --label native "$@" "$tree"
+
+if [ -x "$REX" ]; then
+  echo "== rex overlay" >&2
+  # the tree is the lowest root dir; the symlinks at the top of / and the real
+  # system directories make the benchmark itself runnable in the sandbox
+  links=$work/links
+  mkdir -p "$links"
+  for f in /*; do
+    if [ -L "$f" ] && [ ! -L "$links/${f#/}" ]; then
+      ln -s "$(readlink "$f")" "$links/${f#/}"
+    fi
+  done
+  system=
+  for d in /usr /bin /sbin /lib /lib32 /lib64 /etc; do
+    if [ -d "$d" ] && [ ! -L "$d" ]; then
+      system="$system $d"
+    fi
+  done
+  # rex logs what it mounts on stdout, only keep the results
+  "$REX" --cd / "$links:" "$tree:" $system "$(dirname "$BENCH_META")" -- \
+    "$BENCH_META" --label rex-overlay "$@" / | grep '^backend=' || true
+  # rex leaves its root behind once the program runs
+  if [ -x "$REX_CLEAN" ]; then
+    "$REX_CLEAN" --min-age 0 >/dev/null
+  fi
+else
+  echo "== rex overlay skipped, no $REX" >&2
+fi
+
+if [ -x "$REXFS_FUSE" ]; then
+  echo "== rexfs fuse" >&2
+  mnt=$work/fuse
+  mkdir -p "$mnt"
+  "$REXFS_FUSE" -o source="$tree" "$mnt"
+  "$BENCH_META" --label rexfs-fuse "$@" "$mnt" || true
+  fusermount3 -u "$mnt" 2>/dev/null || umount "$mnt"
+else
+  echo "== rexfs fuse skipped, no $REXFS_FUSE" >&2
+fi
+
+if grep -qw rexfs /proc/filesystems; then
+  echo "== rexfs kernel" >&2
+  mnt=/sys/fs/rex
+  mounted=
+  if ! grep -q " $mnt rexfs " /proc/mounts; then
+    mount -t rexfs "" "$mnt"
+    mounted=1
+  fi
+  "$BENCH_META" --label rexfs-kernel "$@" "$mnt$tree" || true
+  if [ -n "$mounted" ]; then
+    umount "$mnt"
+  fi
+else
+  echo "== rexfs kernel skipped, the module is not loaded" >&2
+fi
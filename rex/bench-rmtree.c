@@ -0,0 +1,195 @@
+/*
+Compares the serial and the parallel rmtree engines:
+
+  bench-rmtree [-options]
+
+Each run builds the same tree of empty files and removes it.  Results are
+printed one line per run:
+
+  engine=<serial|parallel> threads=<n> files=<n> dirs=<n> seconds=<s>
+*/
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include <sys/stat.h>
+
+#include <linux/limits.h>
+
+#include "common.h"
+#include "clean.h"
+
+static unsigned width = 8;
+static unsigned depth = 3;
+static unsigned files = 64;
+
+struct tree_counts
+{
+  unsigned long files;
+  unsigned long dirs;
+};
+
+static const char *get_opt_arg(int argc, const char *argv[], int *arg_index)
+{
+  (*arg_index)++;
+  if (*arg_index >= argc) {
+    errf("option '%s' requires an argument", argv[(*arg_index) - 1]);
+    exit(1);
+  }
+  return argv[*arg_index];
+}
+
+static err_t make_tree(int dir_fd, unsigned level, struct tree_counts *counts)
+{
+  char name[32];
+  for (unsigned i = 0; i < files; i++) {
+    sprintf(name, "f%u", i);
+    int fd = openat(dir_fd, name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd == -1) {
+      errnof("create '%s' failed", name);
+      return current_error;
+    }
+    close(fd);
+    counts->files++;
+  }
+  if (level == depth)
+    return 0;
+  for (unsigned i = 0; i < width; i++) {
+    sprintf(name, "d%u", i);
+    if (-1 == mkdirat(dir_fd, name, 0755)) {
+      errnof("mkdir '%s' failed", name);
+      return current_error;
+    }
+    counts->dirs++;
+    int sub_fd = openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (sub_fd == -1) {
+      errnof("open '%s' failed", name);
+      return current_error;
+    }
+    err_t result = make_tree(sub_fd, level + 1, counts);
+    close(sub_fd);
+    if (result)
+      return result;
+  }
+  return 0;
+}
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static err_t run(const char *base, unsigned threads)
+{
+  char dir[PATH_MAX];
+  snprintf(dir, sizeof(dir), "%s/tree", base);
+  if (-1 == mkdir(dir, 0755)) {
+    errnof("mkdir '%s' failed", dir);
+    return current_error;
+  }
+  int dir_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dir_fd == -1) {
+    errnof("open '%s' failed", dir);
+    return current_error;
+  }
+  struct tree_counts counts = {0};
+  err_t result = make_tree(dir_fd, 0, &counts);
+  close(dir_fd);
+  if (result)
+    return result;
+  sync();
+
+  double start = now();
+  unsigned error_count = threads ?
+    loggy_rmtree_threads(dir, threads) : loggy_rmtree_serial(dir);
+  double seconds = now() - start;
+  fprintf(stderr, "engine=%s threads=%u files=%lu dirs=%lu seconds=%.6f\n",
+          threads ? "parallel" : "serial", threads ? threads : 1,
+          counts.files, counts.dirs, seconds);
+  if (error_count) {
+    errf("rmtree '%s' failed to remove %u entries", dir, error_count);
+    return 1;
+  }
+  return 0;
+}
+
+void usage()
+{
+  printf("Usage: bench-rmtree [-options]\n");
+  printf("Options:\n");
+  printf("  --dir|-d <dir>       Where to build the trees (default /tmp)\n");
+  printf("  --width|-w <n>       Subdirectories per directory (default %u)\n", width);
+  printf("  --depth|-D <n>       Levels of subdirectories (default %u)\n", depth);
+  printf("  --files|-f <n>       Files per directory (default %u)\n", files);
+  printf("  --threads|-t <n>     Threads for the parallel engine (default nproc)\n");
+  printf("  --repeat|-r <n>      Runs per engine (default 3)\n");
+}
+
+int main(int argc, const char *argv[])
+{
+  const char *base_parent = "/tmp";
+  unsigned threads = 0;
+  unsigned repeat = 3;
+  for (int arg_index = 1; arg_index < argc; arg_index++) {
+    const char *arg = argv[arg_index];
+    if (0 == strcmp(arg, "-d") || 0 == strcmp(arg, "--dir")) {
+      base_parent = get_opt_arg(argc, argv, &arg_index);
+    } else if (0 == strcmp(arg, "-w") || 0 == strcmp(arg, "--width")) {
+      width = atoi(get_opt_arg(argc, argv, &arg_index));
+    } else if (0 == strcmp(arg, "-D") || 0 == strcmp(arg, "--depth")) {
+      depth = atoi(get_opt_arg(argc, argv, &arg_index));
+    } else if (0 == strcmp(arg, "-f") || 0 == strcmp(arg, "--files")) {
+      files = atoi(get_opt_arg(argc, argv, &arg_index));
+    } else if (0 == strcmp(arg, "-t") || 0 == strcmp(arg, "--threads")) {
+      threads = atoi(get_opt_arg(argc, argv, &arg_index));
+    } else if (0 == strcmp(arg, "-r") || 0 == strcmp(arg, "--repeat")) {
+      repeat = atoi(get_opt_arg(argc, argv, &arg_index));
+    } else {
+      usage();
+      return 1;
+    }
+  }
+  if (threads == 0) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = (cpus > 0) ? cpus : 1;
+  }
+
+  char base[PATH_MAX];
+  snprintf(base, sizeof(base), "%s/bench-rmtree.XXXXXX", base_parent);
+  if (NULL == mkdtemp(base)) {
+    errnof("mkdtemp '%s' failed", base);
+    return 1;
+  }
+
+  // the engines log every directory at debug level, keep that out of the
+  // timings
+  int saved_stdout = dup(STDOUT_FILENO);
+  int null_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+  if (saved_stdout == -1 || null_fd == -1) {
+    errnof("open '/dev/null' failed");
+    return 1;
+  }
+  fflush(stdout);
+  dup2(null_fd, STDOUT_FILENO);
+
+  int exit_code = 0;
+  for (unsigned i = 0; i < repeat && exit_code == 0; i++) {
+    if (run(base, 0) ||
+        run(base, 1) ||
+        (threads > 1 && run(base, threads)))
+      exit_code = 1;
+  }
+
+  fflush(stdout);
+  dup2(saved_stdout, STDOUT_FILENO);
+  if (-1 == rmdir(base))
+    errnof("rmdir '%s' failed", base);
+  return exit_code;
+}
@@ -0,0 +1,44 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include <sys/stat.h>
+
+#include <linux/limits.h>
+
+#include "common.h"
+#include "cachedir.h"
+
+// returns: 0 and the path of name in the cache dir, creating the dir.  Errors
+//          aren't logged, callers go without the cache.
+err_t cache_dir_file(const char *name, char *path, size_t size)
+{
+  char dir[PATH_MAX];
+  const char *env;
+  int length;
+  if ((env = getenv("REX_CACHE_DIR")) && env[0]) {
+    length = snprintf(dir, sizeof(dir), "%s", env);
+  } else if ((env = getenv("XDG_CACHE_HOME")) && env[0]) {
+    length = snprintf(dir, sizeof(dir), "%s/" CACHE_DIR_NAME, env);
+  } else if ((env = getenv("HOME")) && env[0]) {
+    length = snprintf(dir, sizeof(dir), "%s/.cache", env);
+    if (length < (int)sizeof(dir))
+      mkdir(dir, S_IRWXU);
+    length = snprintf(dir, sizeof(dir), "%s/.cache/" CACHE_DIR_NAME, env);
+  } else {
+    errno = ENOENT;
+    return 1;
+  }
+  if (length >= (int)sizeof(dir)) {
+    errno = ENAMETOOLONG;
+    return 1;
+  }
+  if (-1 == mkdir(dir, S_IRWXU) && errno != EEXIST)
+    return 1;
+  if (snprintf(path, size, "%s/%s", dir, name) >= (int)size) {
+    errno = ENAMETOOLONG;
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,4 @@
+// rex's per-user cache dir: $REX_CACHE_DIR, else $XDG_CACHE_HOME/rex, else ~/.cache/rex
+#define CACHE_DIR_NAME "rex"
+
+err_t cache_dir_file(const char *name, char *path, size_t size);
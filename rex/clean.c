@@ -1,12 +1,21 @@
+#define _GNU_SOURCE
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <dirent.h>
-#include <mntent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <time.h>
 
 #include <sys/stat.h>
 #include <sys/mount.h>
+#include <sys/sysmacros.h>
+
+#include <linux/limits.h>
 
 #include "common.h"
 
@@ -21,6 +30,33 @@ err_t loggy_remove(const char *path)
   return 0;
 }
 
+// returns: 0 with the time pid started in clock ticks after boot, which tells
+//          it apart from a later process that reuses the pid, or an errno,
+//          ENOENT if there is no such process
+err_t get_start_time(pid_t pid, unsigned long long *start_time)
+{
+  char path[32];
+  char buf[512];
+  snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return current_error;
+  ssize_t length = read(fd, buf, sizeof(buf) - 1);
+  int read_error = errno;
+  close(fd);
+  if (length <= 0)
+    return length ? read_error : EINVAL;
+  buf[length] = '\0';
+  // the command name can contain anything, the fields follow its last ')'
+  char *field = strrchr(buf, ')');
+  // starttime is field 22, the 20th after the command name
+  for (unsigned i = 0; field && i < 20; i++)
+    field = strchr(field + 1, ' ');
+  if (!field || 1 != sscanf(field, " %llu", start_time))
+    return EINVAL;
+  return 0;
+}
+
 unsigned char is_dot_or_dot_dot(const char *s)
 {
   return s[0] == '.' &&
@@ -83,86 +119,152 @@ static int loggy_umount(const char *dir)
   return 0; // success
 }
 
-static unsigned try_clean_mounts(const char *dir)
+struct mount_entry
 {
-  size_t dir_length = strlen(dir);
+  int id;
+  int parent_id;
+  int depth; // the number of ancestors that are also being unmounted
+  char *mount_point;
+};
+
+static int compare_mount_id(const void *a, const void *b)
+{
+  return ((const struct mount_entry*)a)->id - ((const struct mount_entry*)b)->id;
+}
+static int compare_mount_depth(const void *a, const void *b)
+{
+  return ((const struct mount_entry*)b)->depth - ((const struct mount_entry*)a)->depth;
+}
 
-  FILE *mnts = setmntent("/proc/mounts", "r");
-  if (mnts == NULL) {
-    errnof("setmntent 'proc/mounts' failed");
-    return 0;
+// decodes the octal escapes (i.e. "\040" for space) mountinfo uses in paths
+static void unescape_mount_path(char *path)
+{
+  char *out = path;
+  for (char *in = path; *in; ) {
+    if (in[0] == '\\' &&
+        in[1] >= '0' && in[1] <= '3' &&
+        in[2] >= '0' && in[2] <= '7' &&
+        in[3] >= '0' && in[3] <= '7') {
+      *out++ = ((in[1] - '0') << 6) | ((in[2] - '0') << 3) | (in[3] - '0');
+      in += 4;
+    } else {
+      *out++ = *in++;
+    }
   }
-  unsigned unmount_count = 0;
-  for (;;) {
-    struct mntent *entry = getmntent(mnts);
-    if (entry == NULL) {
-      // TODO: check errno
-      break;
+  *out = '\0';
+}
+
+static int get_mount_depth(struct mount_entry *entries, size_t count, struct mount_entry *entry)
+{
+  if (entry->depth == -1) {
+    struct mount_entry key = { .id = entry->parent_id };
+    struct mount_entry *parent = bsearch(&key, entries, count, sizeof(key), compare_mount_id);
+    // a mount stacked on top of itself cannot happen, but don't recurse forever
+    entry->depth = (parent && parent != entry) ? get_mount_depth(entries, count, parent) + 1 : 0;
+  }
+  return entry->depth;
+}
+
+/*
+Unmounts every mount at or below dir in one pass over /proc/self/mountinfo.
+Mounts are unmounted deepest first, where a mount stacked on another mount
+point counts as deeper, so no umount fails because of a mount below it.
+returns: the number of mounts that failed to unmount
+*/
+static unsigned unmount_tree(const char *dir)
+{
+  FILE *mountinfo = fopen("/proc/self/mountinfo", "re");
+  if (mountinfo == NULL) {
+    errnof("fopen '/proc/self/mountinfo' failed");
+    return 1;
+  }
+  size_t dir_length = strlen(dir);
+  size_t count = 0;
+  size_t capacity = 0;
+  struct mount_entry *entries = NULL;
+  unsigned error_count = 0;
+  char *line = NULL;
+  size_t line_capacity = 0;
+  while (-1 != getline(&line, &line_capacity, mountinfo)) {
+    // <id> <parent_id> <major>:<minor> <root> <mount_point> ...
+    int id, parent_id;
+    int mount_point_offset;
+    if (2 != sscanf(line, "%d %d %*s %*s %n", &id, &parent_id, &mount_point_offset)) {
+      errf("failed to parse mountinfo line '%s'", line);
+      error_count++;
+      continue;
     }
-    if (0 == strncmp(dir, entry->mnt_dir, dir_length)) {
-      if (-1 == loggy_umount(entry->mnt_dir)) {
-        // error already logged
-      } else {
-        unmount_count++;
+    char *mount_point = line + mount_point_offset;
+    mount_point[strcspn(mount_point, " ")] = '\0';
+    unescape_mount_path(mount_point);
+    if (0 != strncmp(mount_point, dir, dir_length) ||
+        (mount_point[dir_length] != '\0' && mount_point[dir_length] != '/'))
+      continue;
+    if (count == capacity) {
+      capacity = capacity ? capacity * 2 : 16;
+      struct mount_entry *new_entries = realloc(entries, capacity * sizeof(*entries));
+      if (!new_entries) {
+        errnof("realloc failed");
+        error_count++;
+        break;
       }
+      entries = new_entries;
+    }
+    entries[count].id = id;
+    entries[count].parent_id = parent_id;
+    entries[count].depth = -1;
+    entries[count].mount_point = strdup(mount_point);
+    if (!entries[count].mount_point) {
+      errnof("strdup failed");
+      error_count++;
+      break;
     }
+    count++;
   }
-  endmntent(mnts);
-  return unmount_count;
+  free(line);
+  fclose(mountinfo);
+
+  qsort(entries, count, sizeof(*entries), compare_mount_id);
+  for (size_t i = 0; i < count; i++)
+    get_mount_depth(entries, count, &entries[i]);
+  qsort(entries, count, sizeof(*entries), compare_mount_depth);
+  for (size_t i = 0; i < count; i++) {
+    if (-1 == loggy_umount(entries[i].mount_point))
+      error_count++; // error already logged
+    free(entries[i].mount_point);
+  }
+  free(entries);
+  return error_count;
 }
 
-static unsigned char is_bind_mount(const char *dir, size_t dir_length)
+// returns: 1 if dir is the root of a mount
+static unsigned char is_mount_root(const char *dir, dev_t root_dev, dev_t dir_dev)
 {
-  // http://blog.schmorp.de/2016-03-03-detecting-a-mount-point.html
-  // This is a hack to determine if a path is a bind mount. It attempts
-  // to do an invalid rename which will fail with a different error code
-  // depending on if it is a bind mount or not
-  char *from = alloca(dir_length + 6);
-  char *to = alloca(dir_length + 3);
-  memcpy(from, dir, dir_length);
-  memcpy(to  , dir, dir_length);
-  strcpy(from + dir_length, "/../.");
-  strcpy(to   + dir_length, "/.");
-  int result = rename(from, to);
-  if (result != -1) {
-    errf("rename '%s' to '%s' should not have worked!!!!", from, to);
-    exit(1);
-  }
-  return errno == EXDEV;
+  if (dir_dev != root_dev)
+    return 1;
+  // bind mounts from the same filesystem have the same device
+  struct statx dir_statx;
+  if (0 == statx(AT_FDCWD, dir, AT_SYMLINK_NOFOLLOW, 0, &dir_statx) &&
+      (dir_statx.stx_attributes_mask & STATX_ATTR_MOUNT_ROOT))
+    return (dir_statx.stx_attributes & STATX_ATTR_MOUNT_ROOT) != 0;
+  return 0;
 }
 
 /*
 returns: the number of entries it failed to remove
-assumption: dir is already verified to be a directory
+assumption: dir is already verified to be a directory and everything
+mounted below it has already been unmounted
 root_dev is the device number of the directory in the filesystem you
 are wanting to clean from
-clean_dir uses this to know when a subdirectory is just a mount point to
-another filesystem.  it will then proceed to unmount instead of removing
-files inside the mount point
+clean_dir uses this to detect a subdirectory that is still a mount point
+to another filesystem, it will not remove anything inside it
 */
 static unsigned clean_dir(dev_t root_dev, const char *dir, dev_t dir_dev)
 {
   logf("[DEBUG] clean_dir '%s' (root_dev=%lu, dev=%lu)", dir, root_dev, dir_dev);
-  // unmount the directory
-  while (dir_dev != root_dev || is_bind_mount(dir, strlen(dir))) {
-    // TODO: maybe this loop should have a max number of attempts?
-
-    //loggy.run(["sudo", "umount", dir])
-    if (-1 == loggy_umount(dir)) {
-      unsigned removed = try_clean_mounts(dir);
-      if (removed == 0) {
-        // errors already logged
-        return 1;
-      }
-      continue;
-    }
-
-    struct stat dir_stat;
-    if (-1 == stat(dir, &dir_stat)) {
-      errnof("stat on '%s' failed after unmounting it", dir);
-      return 1;
-    }
-    dir_dev = dir_stat.st_dev;
+  if (is_mount_root(dir, root_dev, dir_dev)) {
+    errf("'%s' is still a mount point, not removing it", dir);
+    return 1;
   }
 
   DIR *dir_handle = opendir(dir);
@@ -177,13 +279,28 @@ static unsigned clean_dir(dev_t root_dev, const char *dir, dev_t dir_dev)
   return error_count;
 }
 
-unsigned loggy_rmtree(const char *dir)
+// unmounts everything at or below dir and gets the device dir should be on
+// returns: the number of errors
+static unsigned prepare_rmtree(const char *dir, dev_t *root_dev)
 {
-  logf("[DEBUG] rmtree '%s'", dir);
+  {
+    // never remove anything through a mount that is still there
+    unsigned error_count = unmount_tree(dir);
+    if (error_count)
+      return error_count;
+  }
   struct stat dir_stat;
   if (0 == stat(dir, &dir_stat)) {
-    if (S_ISDIR(dir_stat.st_mode))
-      return clean_dir(dir_stat.st_dev, dir, dir_stat.st_dev);
+    if (S_ISDIR(dir_stat.st_mode)) {
+      // the parent tells us which filesystem dir belongs to now that
+      // anything mounted on it is gone
+      struct stat parent_stat;
+      char *parent = alloca(strlen(dir) + 4);
+      strcpy(parent, dir);
+      strcat(parent, "/..");
+      *root_dev = (0 == stat(parent, &parent_stat)) ? parent_stat.st_dev : dir_stat.st_dev;
+      return 0;
+    }
 
     errf("'%s' exists but is not a directory", dir);
     return 1;
@@ -191,3 +308,411 @@ unsigned loggy_rmtree(const char *dir)
   errnof("stat '%s' failed", dir);
   return 1;
 }
+
+// the original path based implementation, removes one entry at a time
+unsigned loggy_rmtree_serial(const char *dir)
+{
+  logf("[DEBUG] rmtree '%s'", dir);
+  dev_t root_dev;
+  unsigned error_count = prepare_rmtree(dir, &root_dev);
+  if (error_count)
+    return error_count;
+  struct stat dir_stat;
+  if (-1 == stat(dir, &dir_stat)) {
+    errnof("stat '%s' failed", dir);
+    return 1;
+  }
+  return clean_dir(root_dev, dir, dir_stat.st_dev);
+}
+
+/*
+The parallel rmtree engine.
+
+Every directory is a node that is opened relative to its parent's fd and
+removed with unlinkat relative to it, so no path strings are built and no
+entry is resolved from the root.  Entries whose d_type says they are not a
+directory are unlinked without an lstat.  Subdirectories become new nodes
+that are pushed onto the deque of the thread that found them.  Threads pop
+their own newest node first, which keeps the number of open directories
+around the depth of the tree, and steal the oldest node of another thread
+when they run out, which tends to be the biggest subtree left.
+
+A node's pending count is one for its own scan plus one for every
+subdirectory that has not been finished yet.  Whichever thread drops it to
+zero removes the directory and then drops its parent's count.
+*/
+#define RMTREE_MAX_THREADS 16
+// helper threads are only started once there is this much work queued up,
+// most trees rex removes are a handful of empty mount point directories
+#define RMTREE_SPAWN_THRESHOLD 4
+#define RMTREE_DENTS_BUFFER_SIZE (64 * 1024)
+
+struct rm_node
+{
+  struct rm_node *parent;
+  int fd;
+  unsigned char keep; // set if the directory cannot be removed
+  atomic_uint pending;
+  char name[]; // relative to the parent, the full path for the root node
+};
+
+struct rm_deque
+{
+  pthread_mutex_t lock;
+  struct rm_node **nodes;
+  size_t top;    // the oldest node, thieves take from here
+  size_t bottom; // one past the newest node, the owner pushes and pops here
+  size_t capacity;
+};
+
+struct rm_pool
+{
+  dev_t root_dev;
+  unsigned thread_count;
+  unsigned started; // threads started including the calling thread, only
+                    // changed by the calling thread
+  atomic_uint error_count;
+  atomic_size_t unscanned; // nodes that are queued or being scanned
+  pthread_mutex_t idle_lock;
+  pthread_cond_t idle_cond;
+  pthread_t threads[RMTREE_MAX_THREADS];
+  struct rm_deque deques[RMTREE_MAX_THREADS];
+};
+
+struct rm_thread
+{
+  struct rm_pool *pool;
+  unsigned index;
+};
+
+static void format_node_path(struct rm_node *node, const char *name, char *buf, size_t size)
+{
+  const char *names[256];
+  unsigned count = 0;
+  if (name)
+    names[count++] = name;
+  for (; node && count < 256; node = node->parent)
+    names[count++] = node->name;
+  size_t offset = 0;
+  buf[0] = '\0';
+  while (count > 0 && offset < size) {
+    count--;
+    offset += snprintf(buf + offset, size - offset, "%s%s", names[count], count ? "/" : "");
+  }
+}
+
+static void rm_error(struct rm_pool *pool, struct rm_node *node, const char *name, const char *what)
+{
+  int saved_errno = errno;
+  char path[PATH_MAX];
+  format_node_path(node, name, path, sizeof(path));
+  errno = saved_errno;
+  errnof("%s '%s' failed", what, path);
+  atomic_fetch_add(&pool->error_count, 1);
+}
+
+// returns: 0 on success
+static int deque_push(struct rm_deque *deque, struct rm_node *node)
+{
+  pthread_mutex_lock(&deque->lock);
+  if (deque->bottom == deque->capacity) {
+    if (deque->top > 0) {
+      memmove(deque->nodes, deque->nodes + deque->top, (deque->bottom - deque->top) * sizeof(node));
+      deque->bottom -= deque->top;
+      deque->top = 0;
+    } else {
+      size_t new_capacity = deque->capacity ? deque->capacity * 2 : 64;
+      struct rm_node **new_nodes = realloc(deque->nodes, new_capacity * sizeof(node));
+      if (!new_nodes) {
+        pthread_mutex_unlock(&deque->lock);
+        return -1;
+      }
+      deque->nodes = new_nodes;
+      deque->capacity = new_capacity;
+    }
+  }
+  deque->nodes[deque->bottom++] = node;
+  pthread_mutex_unlock(&deque->lock);
+  return 0;
+}
+
+static struct rm_node *deque_pop_bottom(struct rm_deque *deque)
+{
+  struct rm_node *node = NULL;
+  pthread_mutex_lock(&deque->lock);
+  if (deque->bottom > deque->top)
+    node = deque->nodes[--deque->bottom];
+  pthread_mutex_unlock(&deque->lock);
+  return node;
+}
+
+static struct rm_node *deque_pop_top(struct rm_deque *deque)
+{
+  struct rm_node *node = NULL;
+  pthread_mutex_lock(&deque->lock);
+  if (deque->bottom > deque->top)
+    node = deque->nodes[deque->top++];
+  pthread_mutex_unlock(&deque->lock);
+  return node;
+}
+
+static size_t deque_size(struct rm_deque *deque)
+{
+  pthread_mutex_lock(&deque->lock);
+  size_t size = deque->bottom - deque->top;
+  pthread_mutex_unlock(&deque->lock);
+  return size;
+}
+
+// removes node and any parents it was the last pending subdirectory of
+static void finish_node(struct rm_pool *pool, struct rm_node *node)
+{
+  for (;;) {
+    if (node->fd != -1)
+      close(node->fd);
+    struct rm_node *parent = node->parent;
+    if (!node->keep) {
+      if (-1 == unlinkat(parent ? parent->fd : AT_FDCWD, node->name, AT_REMOVEDIR))
+        rm_error(pool, parent, node->name, "rmdir");
+    }
+    free(node);
+    if (!parent || atomic_fetch_sub(&parent->pending, 1) != 1)
+      return;
+    node = parent;
+  }
+}
+
+static void add_subdir(struct rm_pool *pool, unsigned self, struct rm_node *parent, const char *name)
+{
+  size_t name_size = strlen(name) + 1;
+  struct rm_node *node = malloc(sizeof(struct rm_node) + name_size);
+  if (!node) {
+    rm_error(pool, parent, name, "malloc for");
+    return;
+  }
+  node->parent = parent;
+  node->fd = -1;
+  node->keep = 0;
+  atomic_init(&node->pending, 1);
+  memcpy(node->name, name, name_size);
+
+  atomic_fetch_add(&parent->pending, 1);
+  atomic_fetch_add(&pool->unscanned, 1);
+  if (deque_push(&pool->deques[self], node)) {
+    rm_error(pool, parent, name, "queue");
+    atomic_fetch_sub(&pool->unscanned, 1);
+    atomic_fetch_sub(&parent->pending, 1);
+    free(node);
+    return;
+  }
+  pthread_cond_signal(&pool->idle_cond);
+}
+
+static void scan_node(struct rm_pool *pool, unsigned self, struct rm_node *node, char *buf)
+{
+  node->fd = openat(node->parent ? node->parent->fd : AT_FDCWD, node->name,
+                    O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+  if (node->fd == -1) {
+    rm_error(pool, node->parent, node->name, "open");
+    node->keep = 1;
+  } else {
+    struct statx dir_statx;
+    if (-1 == statx(node->fd, "", AT_EMPTY_PATH, STATX_BASIC_STATS, &dir_statx)) {
+      rm_error(pool, node->parent, node->name, "statx");
+      node->keep = 1;
+    } else if (makedev(dir_statx.stx_dev_major, dir_statx.stx_dev_minor) != pool->root_dev ||
+               (dir_statx.stx_attributes & dir_statx.stx_attributes_mask & STATX_ATTR_MOUNT_ROOT)) {
+      char path[PATH_MAX];
+      format_node_path(node, NULL, path, sizeof(path));
+      errf("'%s' is still a mount point, not removing it", path);
+      atomic_fetch_add(&pool->error_count, 1);
+      node->keep = 1;
+    }
+  }
+
+  while (!node->keep) {
+    ssize_t size = getdents64(node->fd, buf, RMTREE_DENTS_BUFFER_SIZE);
+    if (size == 0)
+      break;
+    if (size == -1) {
+      rm_error(pool, node->parent, node->name, "getdents");
+      break;
+    }
+    for (ssize_t offset = 0; offset < size; ) {
+      struct dirent64 *entry = (struct dirent64*)(buf + offset);
+      offset += entry->d_reclen;
+      if (is_dot_or_dot_dot(entry->d_name))
+        continue;
+      unsigned char type = entry->d_type;
+      if (type == DT_UNKNOWN) {
+        struct stat entry_stat;
+        if (-1 == fstatat(node->fd, entry->d_name, &entry_stat, AT_SYMLINK_NOFOLLOW)) {
+          rm_error(pool, node, entry->d_name, "lstat on");
+          continue;
+        }
+        type = S_ISDIR(entry_stat.st_mode) ? DT_DIR : DT_REG;
+      }
+      if (type == DT_DIR) {
+        add_subdir(pool, self, node, entry->d_name);
+      } else if (-1 == unlinkat(node->fd, entry->d_name, 0)) {
+        rm_error(pool, node, entry->d_name, "remove");
+      }
+    }
+  }
+
+  if (atomic_fetch_sub(&node->pending, 1) == 1)
+    finish_node(pool, node);
+  if (atomic_fetch_sub(&pool->unscanned, 1) == 1) {
+    // that was the last of the work, wake everyone up so they can exit
+    pthread_mutex_lock(&pool->idle_lock);
+    pthread_cond_broadcast(&pool->idle_cond);
+    pthread_mutex_unlock(&pool->idle_lock);
+  }
+}
+
+static struct rm_node *steal_node(struct rm_pool *pool, unsigned self)
+{
+  for (unsigned i = 1; i < pool->thread_count; i++) {
+    struct rm_node *node = deque_pop_top(&pool->deques[(self + i) % pool->thread_count]);
+    if (node)
+      return node;
+  }
+  return NULL;
+}
+
+static void *rm_thread_main(void *arg);
+
+static void spawn_helpers(struct rm_pool *pool, struct rm_thread *thread_args)
+{
+  for (unsigned i = pool->started; i < pool->thread_count; i++) {
+    thread_args[i].pool = pool;
+    thread_args[i].index = i;
+    int result = pthread_create(&pool->threads[i], NULL, rm_thread_main, &thread_args[i]);
+    if (result) {
+      errno = result;
+      errnof("pthread_create failed");
+      break;
+    }
+    pool->started++;
+  }
+}
+
+static void rm_thread_run(struct rm_pool *pool, unsigned self, struct rm_thread *thread_args)
+{
+  char *buf = malloc(RMTREE_DENTS_BUFFER_SIZE);
+  if (!buf) {
+    errnof("malloc failed");
+    if (self != 0)
+      return; // the calling thread has to see the work through
+    while (!(buf = malloc(RMTREE_DENTS_BUFFER_SIZE)))
+      sched_yield();
+  }
+  for (;;) {
+    struct rm_node *node = deque_pop_bottom(&pool->deques[self]);
+    if (!node)
+      node = steal_node(pool, self);
+    if (node) {
+      scan_node(pool, self, node, buf);
+      if (self == 0 && pool->started < pool->thread_count &&
+          deque_size(&pool->deques[0]) >= RMTREE_SPAWN_THRESHOLD)
+        spawn_helpers(pool, thread_args);
+      continue;
+    }
+    if (atomic_load(&pool->unscanned) == 0)
+      break;
+    // nodes being scanned by other threads may still produce more work
+    pthread_mutex_lock(&pool->idle_lock);
+    if (atomic_load(&pool->unscanned) != 0) {
+      struct timespec timeout;
+      clock_gettime(CLOCK_REALTIME, &timeout);
+      timeout.tv_nsec += 1000000;
+      if (timeout.tv_nsec >= 1000000000) {
+        timeout.tv_sec++;
+        timeout.tv_nsec -= 1000000000;
+      }
+      pthread_cond_timedwait(&pool->idle_cond, &pool->idle_lock, &timeout);
+    }
+    pthread_mutex_unlock(&pool->idle_lock);
+  }
+  free(buf);
+}
+
+static void *rm_thread_main(void *arg)
+{
+  struct rm_thread *thread = arg;
+  rm_thread_run(thread->pool, thread->index, NULL);
+  return NULL;
+}
+
+static unsigned default_rmtree_threads()
+{
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  if (cpus < 1)
+    return 1;
+  return (cpus > RMTREE_MAX_THREADS) ? RMTREE_MAX_THREADS : cpus;
+}
+
+// returns: the number of entries it failed to remove
+unsigned loggy_rmtree_threads(const char *dir, unsigned thread_count)
+{
+  logf("[DEBUG] rmtree '%s'", dir);
+  dev_t root_dev;
+  {
+    unsigned error_count = prepare_rmtree(dir, &root_dev);
+    if (error_count)
+      return error_count;
+  }
+
+  size_t dir_size = strlen(dir) + 1;
+  struct rm_node *root = malloc(sizeof(struct rm_node) + dir_size);
+  if (!root) {
+    errnof("malloc failed");
+    return 1;
+  }
+  root->parent = NULL;
+  root->fd = -1;
+  root->keep = 0;
+  atomic_init(&root->pending, 1);
+  memcpy(root->name, dir, dir_size);
+
+  struct rm_pool pool;
+  pool.root_dev = root_dev;
+  if (thread_count == 0)
+    thread_count = default_rmtree_threads();
+  pool.thread_count = (thread_count > RMTREE_MAX_THREADS) ? RMTREE_MAX_THREADS : thread_count;
+  pool.started = 1;
+  atomic_init(&pool.error_count, 0);
+  atomic_init(&pool.unscanned, 1);
+  pthread_mutex_init(&pool.idle_lock, NULL);
+  pthread_cond_init(&pool.idle_cond, NULL);
+  for (unsigned i = 0; i < pool.thread_count; i++) {
+    pthread_mutex_init(&pool.deques[i].lock, NULL);
+    pool.deques[i].nodes = NULL;
+    pool.deques[i].top = 0;
+    pool.deques[i].bottom = 0;
+    pool.deques[i].capacity = 0;
+  }
+
+  struct rm_thread thread_args[RMTREE_MAX_THREADS];
+  if (deque_push(&pool.deques[0], root)) {
+    errnof("malloc failed");
+    free(root);
+    return 1;
+  }
+  rm_thread_run(&pool, 0, thread_args);
+  for (unsigned i = 1; i < pool.started; i++)
+    pthread_join(pool.threads[i], NULL);
+
+  for (unsigned i = 0; i < pool.thread_count; i++) {
+    free(pool.deques[i].nodes);
+    pthread_mutex_destroy(&pool.deques[i].lock);
+  }
+  pthread_cond_destroy(&pool.idle_cond);
+  pthread_mutex_destroy(&pool.idle_lock);
+  return atomic_load(&pool.error_count);
+}
+
+unsigned loggy_rmtree(const char *dir)
+{
+  return loggy_rmtree_threads(dir, 0);
+}
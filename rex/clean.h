@@ -1,3 +1,10 @@
+// every root in /tmp/.rex has a lock file next to it that is held for as
+// long as the sandbox runs, see rex-clean.c
+#define REX_ROOT_LOCK_SUFFIX ".lock"
+
 unsigned char is_dot_or_dot_dot(const char *s);
+err_t get_start_time(pid_t pid, unsigned long long *start_time);
 err_t loggy_remove(const char *path);
 unsigned loggy_rmtree(const char *dir);
+unsigned loggy_rmtree_threads(const char *dir, unsigned thread_count);
+unsigned loggy_rmtree_serial(const char *dir);
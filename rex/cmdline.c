@@ -0,0 +1,231 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "common.h"
+#include "iface.h"
+#include "cmdline.h"
+
+struct classifier
+{
+  const struct iface *iface;
+  const struct iface_entry *positional;
+  uint32_t *counts; // of each entry
+  // the entry of an option like "-o" whose file is the next argument
+  const struct iface_entry *pending;
+  cmdline_file_callback callback;
+  void *context;
+};
+
+static err_t add_file(struct classifier *classifier, const struct iface_entry *entry, const char *file)
+{
+  const char *name = classifier->iface->strings + entry->name;
+  uint32_t *count = &classifier->counts[entry - classifier->iface->entries];
+  if (entry->max_count && *count == entry->max_count) {
+    errf("%s: more than %u given, '%s' is one too many", name, entry->max_count, file);
+    return 1;
+  }
+  (*count)++;
+  if (entry->must_exist) {
+    struct stat st;
+    if (-1 == stat(file, &st)) {
+      errnof("%s: '%s' must exist, stat failed", name, file);
+      return current_error;
+    }
+  }
+  return classifier->callback(entry->access, file, classifier->context);
+}
+
+static err_t classify_arg(struct classifier *classifier, const char *arg, unsigned depth);
+
+static int is_space(char c)
+{
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f' || c == '\v';
+}
+
+/*
+Splits a response file into arguments the way GCC does (libiberty's
+buildargv): whitespace separates them, single and double quotes group,
+and a backslash takes the next character as it is, even inside quotes.
+Each argument is unquoted into one reused buffer and classified before
+the next is read, so the file is never held as an argv.
+*/
+static err_t tokenize(struct classifier *classifier, const char *text, size_t size, unsigned depth)
+{
+  const char *end = text + size;
+  size_t buffer_size = 256;
+  char *buffer = malloc(buffer_size);
+  if (!buffer) {
+    errnof("malloc failed");
+    return 1;
+  }
+  err_t result = 0;
+  const char *next = text;
+  while (!result) {
+    while (next < end && is_space(*next))
+      next++;
+    if (next == end)
+      break;
+    size_t length = 0;
+    unsigned char squote = 0, dquote = 0, bsquote = 0;
+    for (; next < end; next++) {
+      char c = *next;
+      if (is_space(c) && !squote && !dquote && !bsquote)
+        break;
+      if (bsquote) {
+        bsquote = 0;
+      } else if (c == '\\') {
+        bsquote = 1;
+        continue;
+      } else if (squote) {
+        if (c == '\'') {
+          squote = 0;
+          continue;
+        }
+      } else if (dquote) {
+        if (c == '"') {
+          dquote = 0;
+          continue;
+        }
+      } else if (c == '\'') {
+        squote = 1;
+        continue;
+      } else if (c == '"') {
+        dquote = 1;
+        continue;
+      }
+      // + 1 for the null
+      if (length + 1 == buffer_size) {
+        char *bigger = realloc(buffer, buffer_size * 2);
+        if (!bigger) {
+          errnof("realloc failed");
+          free(buffer);
+          return 1;
+        }
+        buffer = bigger;
+        buffer_size *= 2;
+      }
+      buffer[length++] = c;
+    }
+    buffer[length] = '\0';
+    result = classify_arg(classifier, buffer, depth);
+  }
+  free(buffer);
+  return result;
+}
+
+/*
+Expands "@file" in place of the argument.  Like GCC, a file that can't be
+read, or is a directory, isn't a response file and the argument stays as it
+is.
+
+returns: 0 if file was expanded, ENOENT if it's not a response file, or
+         another error that's already logged
+*/
+static err_t expand_response_file(struct classifier *classifier, const char *file, unsigned depth)
+{
+  int fd = open(file, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return ENOENT;
+  struct stat st;
+  if (-1 == fstat(fd, &st) || S_ISDIR(st.st_mode)) {
+    close(fd);
+    return ENOENT;
+  }
+  if (depth == CMDLINE_MAX_RESPONSE_DEPTH) {
+    errf("response file '%s' is nested more than %u deep", file, CMDLINE_MAX_RESPONSE_DEPTH);
+    close(fd);
+    return 1;
+  }
+  // the response file is an input too
+  err_t result = classifier->callback(IFACE_ACCESS_READ, file, classifier->context);
+  if (result || st.st_size == 0) {
+    close(fd);
+    return result;
+  }
+  void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    errnof("mmap '%s' failed", file);
+    return current_error;
+  }
+  madvise(map, st.st_size, MADV_SEQUENTIAL);
+  result = tokenize(classifier, map, st.st_size, depth + 1);
+  munmap(map, st.st_size);
+  return result;
+}
+
+static err_t classify_arg(struct classifier *classifier, const char *arg, unsigned depth)
+{
+  // response files are expanded before anything looks at the arguments, so
+  // even the file of "-o @out.rsp" comes from out.rsp
+  if (arg[0] == '@' && arg[1]) {
+    err_t result = expand_response_file(classifier, arg + 1, depth);
+    if (result != ENOENT)
+      return result;
+  }
+  if (classifier->pending) {
+    const struct iface_entry *entry = classifier->pending;
+    classifier->pending = NULL;
+    return add_file(classifier, entry, arg);
+  }
+  const char *value;
+  uint32_t entry = iface_match(classifier->iface, arg, &value);
+  if (entry == IFACE_NO_ENTRY) {
+    // a lone "-" is stdin
+    if (arg[0] != '-' && classifier->positional)
+      return add_file(classifier, classifier->positional, arg);
+    return 0;
+  }
+  if (!value) {
+    classifier->pending = &classifier->iface->entries[entry];
+    return 0;
+  }
+  return add_file(classifier, &classifier->iface->entries[entry], value);
+}
+
+/*
+Classifies the arguments of a program, argv[0] is the first argument and
+not the program, and calls callback for each file they name.  Arguments
+that match no cmd_line pattern are files for the entry whose cmd_interface
+is null if they don't start with '-', and otherwise options that don't
+name files.  "@file" arguments are expanded recursively and file itself is
+reported as read.  max_count and must_exist are checked as it goes.
+*/
+err_t cmdline_classify(const struct iface *iface, int argc, const char *argv[],
+                       cmdline_file_callback callback, void *context)
+{
+  struct classifier classifier = {
+    .iface = iface,
+    .callback = callback,
+    .context = context,
+  };
+  for (uint32_t i = 0; i < iface->entry_count; i++) {
+    if (iface->entries[i].positional) {
+      classifier.positional = &iface->entries[i];
+      break;
+    }
+  }
+  classifier.counts = calloc(iface->entry_count, sizeof(*classifier.counts));
+  if (!classifier.counts) {
+    errnof("calloc failed");
+    return 1;
+  }
+
+  err_t result = 0;
+  for (int arg_index = 0; arg_index < argc && !result; arg_index++)
+    result = classify_arg(&classifier, argv[arg_index], 0);
+  if (!result && classifier.pending) {
+    errf("%s: the last option needs a file after it", iface->strings + classifier.pending->name);
+    result = 1;
+  }
+  free(classifier.counts);
+  return result;
+}
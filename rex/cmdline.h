@@ -0,0 +1,8 @@
+// response files nested deeper than this are an error, like one that includes itself
+#define CMDLINE_MAX_RESPONSE_DEPTH 32
+
+// called for each file in a command line with IFACE_ACCESS_* flags
+typedef err_t (*cmdline_file_callback)(unsigned access, const char *file, void *context);
+
+err_t cmdline_classify(const struct iface *iface, int argc, const char *argv[],
+                       cmdline_file_callback callback, void *context);
@@ -0,0 +1,344 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include <linux/limits.h>
+
+#include "common.h"
+#include "cachedir.h"
+#include "elfdeps.h"
+#include "depcache.h"
+
+struct depcache_stamp
+{
+  uint64_t dev;
+  uint64_t ino;
+  uint64_t size;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+};
+
+struct depcache_header
+{
+  char magic[8];
+  uint32_t size; // of the whole file
+  uint32_t bucket_count; // a power of 2
+  uint32_t record_count;
+  uint32_t reserved;
+  struct depcache_stamp ld_so_cache;
+};
+
+struct depcache_record
+{
+  struct depcache_stamp program;
+  uint64_t library_path_hash;
+  uint32_t next; // the record before this one in the bucket, or 0
+  uint32_t path_count;
+  uint32_t paths_size;
+  uint32_t reserved;
+};
+
+// records start on 8 byte boundaries
+#define RECORD_ALIGN(size) (((size) + 7) & ~(size_t)7)
+
+static uint64_t fnv1a(uint64_t hash, const void *data, size_t length)
+{
+  const unsigned char *bytes = data;
+  for (size_t i = 0; i < length; i++) {
+    hash ^= bytes[i];
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+static void get_stamp(const struct stat *st, struct depcache_stamp *stamp)
+{
+  memset(stamp, 0, sizeof(*stamp));
+  stamp->dev = st->st_dev;
+  stamp->ino = st->st_ino;
+  stamp->size = st->st_size;
+  stamp->mtime_sec = st->st_mtim.tv_sec;
+  stamp->mtime_nsec = st->st_mtim.tv_nsec;
+}
+
+static uint32_t bucket_of(const struct depcache_record *key, uint32_t bucket_count)
+{
+  uint64_t hash = fnv1a(0xcbf29ce484222325ULL, &key->program, sizeof(key->program));
+  hash = fnv1a(hash, &key->library_path_hash, sizeof(key->library_path_hash));
+  return hash & (bucket_count - 1);
+}
+
+struct table
+{
+  const unsigned char *data;
+  size_t size;
+  const struct depcache_header *header;
+  const uint32_t *buckets;
+  size_t records_offset;
+};
+
+static size_t records_offset(uint32_t bucket_count)
+{
+  return RECORD_ALIGN(sizeof(struct depcache_header) + sizeof(uint32_t) * (size_t)bucket_count);
+}
+
+// returns: the record at offset if it and its paths are inside the table, or NULL
+static const struct depcache_record *get_record(const struct table *table, size_t offset)
+{
+  if (offset < table->records_offset || offset % 8 || offset > table->size ||
+      table->size - offset < sizeof(struct depcache_record))
+    return NULL;
+  const struct depcache_record *record = (const struct depcache_record*)(table->data + offset);
+  if (record->paths_size > table->size - offset - sizeof(*record))
+    return NULL;
+  // every path is null-terminated, so the last byte is a null
+  const char *paths = (const char*)(record + 1);
+  if (record->paths_size ? paths[record->paths_size - 1] != '\0' : record->path_count != 0)
+    return NULL;
+  return record;
+}
+
+// maps the table if it's for the current ld.so.cache, otherwise table->data is NULL
+static void map_table(const char *cache_file, const struct depcache_stamp *ld_so_cache, struct table *table)
+{
+  memset(table, 0, sizeof(*table));
+  int fd = open(cache_file, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return;
+  struct stat st;
+  if (-1 == fstat(fd, &st) || st.st_size < (off_t)sizeof(struct depcache_header)) {
+    close(fd);
+    return;
+  }
+  void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED)
+    return;
+  const struct depcache_header *header = data;
+  if (0 != memcmp(header->magic, DEPCACHE_MAGIC, sizeof(header->magic)) || header->size != st.st_size ||
+      0 != memcmp(&header->ld_so_cache, ld_so_cache, sizeof(*ld_so_cache)) ||
+      header->bucket_count == 0 || (header->bucket_count & (header->bucket_count - 1)) ||
+      records_offset(header->bucket_count) > (size_t)st.st_size) {
+    munmap(data, st.st_size);
+    return;
+  }
+  table->data = data;
+  table->size = st.st_size;
+  table->header = header;
+  table->buckets = (const uint32_t*)(header + 1);
+  table->records_offset = records_offset(header->bucket_count);
+}
+
+static void unmap_table(struct table *table)
+{
+  if (table->data)
+    munmap((void*)table->data, table->size);
+  table->data = NULL;
+}
+
+// returns: the record for key, or NULL
+static const struct depcache_record *lookup(const struct table *table, const struct depcache_record *key)
+{
+  size_t offset = table->buckets[bucket_of(key, table->header->bucket_count)];
+  while (offset) {
+    const struct depcache_record *record = get_record(table, offset);
+    if (!record)
+      return NULL;
+    if (0 == memcmp(&record->program, &key->program, sizeof(key->program)) &&
+        record->library_path_hash == key->library_path_hash)
+      return record;
+    // records only link to earlier ones, so this ends
+    if (record->next >= offset)
+      return NULL;
+    offset = record->next;
+  }
+  return NULL;
+}
+
+// the paths found by elfdeps_resolve, on their way to the callback
+struct collector
+{
+  char *paths;
+  size_t paths_size;
+  uint32_t path_count;
+  err_t error;
+  elfdeps_callback callback;
+  void *context;
+};
+
+static err_t collect_path(const char *file, void *context)
+{
+  struct collector *collector = context;
+  size_t length = strlen(file) + 1;
+  char *paths = realloc(collector->paths, collector->paths_size + length);
+  if (!paths) {
+    errnof("realloc failed");
+    collector->error = 1;
+  } else {
+    memcpy(paths + collector->paths_size, file, length);
+    collector->paths = paths;
+    collector->paths_size += length;
+    collector->path_count++;
+  }
+  return collector->callback(file, collector->context);
+}
+
+// returns: whether record is for an older version of key's program, or is
+//          key's own record added by another rex since the table was read
+static int replaced_by(const struct depcache_record *record, const struct depcache_record *key)
+{
+  if (record->program.dev != key->program.dev || record->program.ino != key->program.ino)
+    return 0;
+  return 0 != memcmp(&record->program, &key->program, sizeof(key->program)) ||
+    record->library_path_hash == key->library_path_hash;
+}
+
+// writes the records of old that key doesn't replace, and the new record,
+// to a new table renamed over cache_file
+static err_t write_table(const char *cache_file, const struct table *old, const struct depcache_stamp *ld_so_cache,
+                         const struct depcache_record *key, const struct collector *collector)
+{
+  // the records to keep, by offset in old
+  size_t keep_size = 0;
+  uint32_t keep_count = 0;
+  if (old->data && old->header->record_count < DEPCACHE_MAX_RECORDS) {
+    size_t offset = old->records_offset;
+    for (uint32_t i = 0; i < old->header->record_count; i++) {
+      const struct depcache_record *record = get_record(old, offset);
+      if (!record)
+        break;
+      size_t record_size = RECORD_ALIGN(sizeof(*record) + record->paths_size);
+      if (!replaced_by(record, key)) {
+        keep_size += record_size;
+        keep_count++;
+      }
+      offset += record_size;
+    }
+  }
+
+  uint32_t bucket_count = 64;
+  while (bucket_count < (keep_count + 1) * 2)
+    bucket_count *= 2;
+  size_t size = records_offset(bucket_count) + keep_size +
+    RECORD_ALIGN(sizeof(struct depcache_record) + collector->paths_size);
+  if (size > UINT32_MAX)
+    return 1;
+  unsigned char *data = calloc(1, size);
+  if (!data) {
+    errnof("calloc failed");
+    return 1;
+  }
+  struct depcache_header *header = (struct depcache_header*)data;
+  memcpy(header->magic, DEPCACHE_MAGIC, sizeof(header->magic));
+  header->size = size;
+  header->bucket_count = bucket_count;
+  header->ld_so_cache = *ld_so_cache;
+  uint32_t *buckets = (uint32_t*)(header + 1);
+
+  size_t out = records_offset(bucket_count);
+  size_t offset = old->data ? old->records_offset : 0;
+  for (uint32_t i = 0; i < keep_count + 1;) {
+    const struct depcache_record *record;
+    const char *paths;
+    if (i < keep_count) {
+      record = get_record(old, offset);
+      offset += RECORD_ALIGN(sizeof(*record) + record->paths_size);
+      if (replaced_by(record, key))
+        continue;
+      paths = (const char*)(record + 1);
+    } else {
+      record = key;
+      paths = collector->paths;
+    }
+    struct depcache_record *copy = (struct depcache_record*)(data + out);
+    *copy = *record;
+    memcpy(copy + 1, paths, record->paths_size);
+    uint32_t *bucket = &buckets[bucket_of(record, bucket_count)];
+    copy->next = *bucket;
+    *bucket = out;
+    out += RECORD_ALIGN(sizeof(*record) + record->paths_size);
+    header->record_count++;
+    i++;
+  }
+
+  char temp[PATH_MAX];
+  err_t result = 1;
+  if (snprintf(temp, sizeof(temp), "%s.XXXXXX", cache_file) < (int)sizeof(temp)) {
+    int fd = mkstemp(temp);
+    if (fd != -1) {
+      if (size == (size_t)write(fd, data, size) &&
+          0 == fchmod(fd, S_IRUSR | S_IWUSR) &&
+          0 == close(fd)) {
+        result = (-1 == rename(temp, cache_file));
+      } else {
+        close(fd);
+      }
+      if (result)
+        unlink(temp);
+    }
+  }
+  free(data);
+  return result;
+}
+
+/*
+Calls callback with each library program loads like elfdeps_resolve, from
+the cache when program, LD_LIBRARY_PATH and ld.so.cache are the same as
+when it was resolved.  Only complete resolutions are cached.
+*/
+err_t depcache_resolve(const char *program, elfdeps_callback callback, void *context)
+{
+  struct stat st;
+  if (-1 == stat(program, &st)) {
+    errnof("stat '%s' failed", program);
+    return current_error;
+  }
+  struct depcache_record key = { 0 };
+  get_stamp(&st, &key.program);
+  // unset and empty are the same to ld.so
+  const char *library_path = getenv("LD_LIBRARY_PATH");
+  if (!library_path)
+    library_path = "";
+  key.library_path_hash = fnv1a(0xcbf29ce484222325ULL, library_path, strlen(library_path));
+  struct depcache_stamp ld_so_cache = { 0 };
+  if (0 == stat(ELFDEPS_LD_SO_CACHE, &st))
+    get_stamp(&st, &ld_so_cache);
+
+  char cache_file[PATH_MAX];
+  if (cache_dir_file(DEPCACHE_FILE_NAME, cache_file, sizeof(cache_file)))
+    return elfdeps_resolve(program, callback, context);
+
+  struct table table;
+  map_table(cache_file, &ld_so_cache, &table);
+  const struct depcache_record *record = table.data ? lookup(&table, &key) : NULL;
+  if (record) {
+    err_t result = 0;
+    const char *path = (const char*)(record + 1);
+    const char *end = path + record->paths_size;
+    for (uint32_t i = 0; i < record->path_count && path < end && !result; i++) {
+      result = callback(path, context);
+      path += strlen(path) + 1;
+    }
+    unmap_table(&table);
+    return result;
+  }
+
+  struct collector collector = { .callback = callback, .context = context };
+  err_t result = elfdeps_resolve(program, collect_path, &collector);
+  if (!result && !collector.error) {
+    key.path_count = collector.path_count;
+    key.paths_size = collector.paths_size;
+    // the cache is only an optimization, not being able to write it is fine
+    write_table(cache_file, &table, &ld_so_cache, &key, &collector);
+  }
+  unmap_table(&table);
+  free(collector.paths);
+  return result;
+}
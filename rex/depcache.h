@@ -0,0 +1,25 @@
+/*
+The libraries each program loads, as elfdeps_resolve found them, kept in
+the cache dir (see cachedir.h) and shared by every rex.  It's a hash table
+in one file:
+
+  struct depcache_header
+  uint32_t buckets[bucket_count] the offset of the last record in each, or 0
+  records                        each followed by its paths, null-terminated
+
+A record is keyed by the dev, inode, size and mtime of the program and by
+LD_LIBRARY_PATH.  The header records ld.so.cache, and the whole table is
+thrown away when that changes.
+
+The file is never written in place.  A writer builds a new table with its
+record added and renames it over the old one, so a reader only needs to
+map the file and look up one bucket, with no locks.  Two writers at once
+can lose one of their records, which is only a miss for the next rex.
+*/
+#define DEPCACHE_FILE_NAME "deps.cache"
+#define DEPCACHE_MAGIC "REXDEPS1"
+
+// a new record won't grow the table past this, it starts over instead
+#define DEPCACHE_MAX_RECORDS 4096
+
+err_t depcache_resolve(const char *program, elfdeps_callback callback, void *context);
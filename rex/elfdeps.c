@@ -0,0 +1,633 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <elf.h>
+
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include <linux/limits.h>
+
+#include "common.h"
+#include "elfdeps.h"
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define NATIVE_ELF_DATA ELFDATA2LSB
+#else
+#define NATIVE_ELF_DATA ELFDATA2MSB
+#endif
+
+// where ld.so looks last, multiarch dirs like /lib/x86_64-linux-gnu come from ld.so.cache
+static const char default_path_64[] = "/lib64:/usr/lib64:/lib:/usr/lib";
+static const char default_path_32[] = "/lib:/usr/lib";
+
+// the layout of glibc's ld.so.cache, see sysdeps/generic/dl-cache.h
+#define CACHE_MAGIC_OLD "ld.so-1.7.0"
+#define CACHE_MAGIC_NEW "glibc-ld.so.cache1.1"
+
+struct cache_header
+{
+  char magic[sizeof(CACHE_MAGIC_NEW) - 1];
+  uint32_t nlibs;
+  uint32_t len_strings;
+  uint8_t flags;
+  uint8_t padding[3];
+  uint32_t extension_offset;
+  uint32_t unused[3];
+};
+
+struct cache_entry
+{
+  int32_t flags;
+  uint32_t key;   // the soname
+  uint32_t value; // the path
+  uint32_t osversion;
+  uint64_t hwcap;
+};
+
+struct mapped_file
+{
+  const unsigned char *data;
+  size_t size;
+};
+
+struct elf_object
+{
+  char *path;
+  const char *name; // the DT_NEEDED it was loaded for, in the object that needs it
+  const char *soname;
+  dev_t dev;
+  ino_t ino;
+  struct mapped_file file;
+  unsigned char elf_class;
+  uint16_t machine;
+  unsigned char is_interp;
+  const char *interp;
+  const unsigned char *dynamic;
+  size_t dynamic_count;
+  const char *strtab;
+  size_t strtab_size;
+  const char *rpath;
+  const char *runpath;
+};
+
+struct resolver
+{
+  struct elf_object *objects; // objects[0] is the program
+  unsigned object_count;
+  unsigned object_capacity;
+  const struct cache_header *cache;
+  const struct cache_entry *cache_entries;
+  size_t cache_size; // from cache
+  struct mapped_file cache_file;
+  const char *library_path;
+};
+
+// returns: 0, or ENOENT if path isn't a regular file that can be mapped
+static err_t map_file(int fd, struct mapped_file *file, const struct stat *st)
+{
+  if (!S_ISREG(st->st_mode) || st->st_size == 0)
+    return ENOENT;
+  void *data = mmap(NULL, st->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (data == MAP_FAILED)
+    return ENOENT;
+  file->data = data;
+  file->size = st->st_size;
+  return 0;
+}
+
+static void unmap_file(struct mapped_file *file)
+{
+  if (file->data)
+    munmap((void*)file->data, file->size);
+  file->data = NULL;
+}
+
+// returns: whether [offset, offset + length) is inside the file
+static int in_file(const struct mapped_file *file, uint64_t offset, uint64_t length)
+{
+  return offset <= file->size && length <= file->size - offset;
+}
+
+static void read_phdr(const struct elf_object *object, uint64_t offset, Elf64_Phdr *phdr)
+{
+  if (object->elf_class == ELFCLASS64) {
+    memcpy(phdr, object->file.data + offset, sizeof(*phdr));
+    return;
+  }
+  Elf32_Phdr phdr32;
+  memcpy(&phdr32, object->file.data + offset, sizeof(phdr32));
+  phdr->p_type = phdr32.p_type;
+  phdr->p_offset = phdr32.p_offset;
+  phdr->p_vaddr = phdr32.p_vaddr;
+  phdr->p_filesz = phdr32.p_filesz;
+}
+
+static void read_dyn(const struct elf_object *object, size_t index, Elf64_Dyn *dyn)
+{
+  if (object->elf_class == ELFCLASS64) {
+    memcpy(dyn, object->dynamic + index * sizeof(*dyn), sizeof(*dyn));
+    return;
+  }
+  Elf32_Dyn dyn32;
+  memcpy(&dyn32, object->dynamic + index * sizeof(dyn32), sizeof(dyn32));
+  dyn->d_tag = dyn32.d_tag;
+  dyn->d_un.d_val = dyn32.d_un.d_val;
+}
+
+// returns: the string at offset in the dynamic string table, or NULL
+static const char *dyn_string(const struct elf_object *object, uint64_t offset)
+{
+  if (!object->strtab || offset >= object->strtab_size)
+    return NULL;
+  if (!memchr(object->strtab + offset, '\0', object->strtab_size - offset))
+    return NULL;
+  return object->strtab + offset;
+}
+
+/*
+Reads what's needed from the program headers and the dynamic section,
+checking every offset against the file.  Nothing is copied, the object
+points into its map.
+
+returns: 0, or ENOENT if the file isn't an ELF executable or library
+*/
+static err_t parse_elf(struct elf_object *object)
+{
+  const struct mapped_file *file = &object->file;
+  if (file->size < EI_NIDENT || 0 != memcmp(file->data, ELFMAG, SELFMAG) ||
+      file->data[EI_DATA] != NATIVE_ELF_DATA)
+    return ENOENT;
+  object->elf_class = file->data[EI_CLASS];
+  uint64_t phoff;
+  size_t phentsize, phnum;
+  uint16_t type;
+  if (object->elf_class == ELFCLASS64 && file->size >= sizeof(Elf64_Ehdr)) {
+    Elf64_Ehdr ehdr;
+    memcpy(&ehdr, file->data, sizeof(ehdr));
+    type = ehdr.e_type;
+    object->machine = ehdr.e_machine;
+    phoff = ehdr.e_phoff;
+    phentsize = sizeof(Elf64_Phdr);
+    phnum = (ehdr.e_phentsize == phentsize) ? ehdr.e_phnum : 0;
+  } else if (object->elf_class == ELFCLASS32 && file->size >= sizeof(Elf32_Ehdr)) {
+    Elf32_Ehdr ehdr;
+    memcpy(&ehdr, file->data, sizeof(ehdr));
+    type = ehdr.e_type;
+    object->machine = ehdr.e_machine;
+    phoff = ehdr.e_phoff;
+    phentsize = sizeof(Elf32_Phdr);
+    phnum = (ehdr.e_phentsize == phentsize) ? ehdr.e_phnum : 0;
+  } else {
+    return ENOENT;
+  }
+  if ((type != ET_EXEC && type != ET_DYN) || !in_file(file, phoff, (uint64_t)phnum * phentsize))
+    return ENOENT;
+
+  for (size_t i = 0; i < phnum; i++) {
+    Elf64_Phdr phdr;
+    read_phdr(object, phoff + i * phentsize, &phdr);
+    if (!in_file(file, phdr.p_offset, phdr.p_filesz))
+      continue;
+    if (phdr.p_type == PT_INTERP && phdr.p_filesz > 1 &&
+        file->data[phdr.p_offset + phdr.p_filesz - 1] == '\0') {
+      object->interp = (const char*)file->data + phdr.p_offset;
+    } else if (phdr.p_type == PT_DYNAMIC) {
+      object->dynamic = file->data + phdr.p_offset;
+      object->dynamic_count = phdr.p_filesz /
+        ((object->elf_class == ELFCLASS64) ? sizeof(Elf64_Dyn) : sizeof(Elf32_Dyn));
+    }
+  }
+  if (!object->dynamic)
+    return 0;
+
+  uint64_t strtab_vaddr = 0, soname = UINT64_MAX, rpath = UINT64_MAX, runpath = UINT64_MAX;
+  for (size_t i = 0; i < object->dynamic_count; i++) {
+    Elf64_Dyn dyn;
+    read_dyn(object, i, &dyn);
+    if (dyn.d_tag == DT_NULL) {
+      object->dynamic_count = i;
+      break;
+    }
+    switch (dyn.d_tag) {
+    case DT_STRTAB: strtab_vaddr = dyn.d_un.d_ptr; break;
+    case DT_STRSZ: object->strtab_size = dyn.d_un.d_val; break;
+    case DT_SONAME: soname = dyn.d_un.d_val; break;
+    case DT_RPATH: rpath = dyn.d_un.d_val; break;
+    case DT_RUNPATH: runpath = dyn.d_un.d_val; break;
+    }
+  }
+  // DT_STRTAB is an address, find the PT_LOAD segment that has it
+  for (size_t i = 0; i < phnum; i++) {
+    Elf64_Phdr phdr;
+    read_phdr(object, phoff + i * phentsize, &phdr);
+    if (phdr.p_type == PT_LOAD && strtab_vaddr >= phdr.p_vaddr &&
+        strtab_vaddr - phdr.p_vaddr < phdr.p_filesz) {
+      uint64_t offset = phdr.p_offset + (strtab_vaddr - phdr.p_vaddr);
+      if (in_file(file, offset, object->strtab_size))
+        object->strtab = (const char*)file->data + offset;
+      break;
+    }
+  }
+  if (!object->strtab)
+    object->strtab_size = 0;
+  object->soname = dyn_string(object, soname);
+  object->rpath = dyn_string(object, rpath);
+  object->runpath = dyn_string(object, runpath);
+  return 0;
+}
+
+/*
+Loads the object at path unless the same file is already loaded.  elf_class
+and machine are what the program is, a library that is something else is
+skipped like ld.so does, 0 takes anything.
+
+returns: 0 and the object's index, ENOENT if path can't be used, or another
+         error that's already logged
+*/
+static err_t load_object(struct resolver *resolver, const char *path, const char *name,
+                         unsigned char elf_class, uint16_t machine, unsigned *index)
+{
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return ENOENT;
+  struct stat st;
+  if (-1 == fstat(fd, &st)) {
+    close(fd);
+    return ENOENT;
+  }
+  for (unsigned i = 0; i < resolver->object_count; i++) {
+    if (resolver->objects[i].dev == st.st_dev && resolver->objects[i].ino == st.st_ino) {
+      close(fd);
+      *index = i;
+      return 0;
+    }
+  }
+  if (resolver->object_count == ELFDEPS_MAX_OBJECTS) {
+    errf("'%s' loads more than %u libraries", resolver->objects[0].path, ELFDEPS_MAX_OBJECTS);
+    close(fd);
+    return 1;
+  }
+
+  struct elf_object object = { .name = name, .dev = st.st_dev, .ino = st.st_ino };
+  err_t result = map_file(fd, &object.file, &st);
+  close(fd);
+  if (result)
+    return result;
+  if (parse_elf(&object) ||
+      (elf_class && (object.elf_class != elf_class || object.machine != machine))) {
+    unmap_file(&object.file);
+    return ENOENT;
+  }
+  object.path = strdup(path);
+  if (!object.path) {
+    errnof("strdup failed");
+    unmap_file(&object.file);
+    return 1;
+  }
+  if (resolver->object_count == resolver->object_capacity) {
+    unsigned capacity = resolver->object_capacity ? resolver->object_capacity * 2 : 16;
+    struct elf_object *objects = realloc(resolver->objects, sizeof(*objects) * capacity);
+    if (!objects) {
+      errnof("realloc failed");
+      free(object.path);
+      unmap_file(&object.file);
+      return 1;
+    }
+    resolver->objects = objects;
+    resolver->object_capacity = capacity;
+  }
+  *index = resolver->object_count;
+  resolver->objects[resolver->object_count++] = object;
+  return 0;
+}
+
+// the dir of an object's path, for $ORIGIN
+static void get_origin(const struct elf_object *object, char *origin, size_t size)
+{
+  const char *slash = strrchr(object->path, '/');
+  if (!slash)
+    snprintf(origin, size, ".");
+  else if (slash == object->path)
+    snprintf(origin, size, "/");
+  else
+    snprintf(origin, size, "%.*s", (int)(slash - object->path), object->path);
+}
+
+// expands $ORIGIN and $LIB in one search path dir
+// returns: 0, or 1 if the dir can't be used
+static err_t expand_dir(const char *dir, size_t length, const struct elf_object *object,
+                        char *expanded, size_t size)
+{
+  // an empty dir is the current one
+  if (length == 0) {
+    dir = ".";
+    length = 1;
+  }
+  size_t out = 0;
+  for (size_t i = 0; i < length;) {
+    if (dir[i] != '$') {
+      if (out + 1 >= size)
+        return 1;
+      expanded[out++] = dir[i++];
+      continue;
+    }
+    const char *rest = dir + i + 1;
+    size_t rest_length = length - i - 1;
+    char origin[PATH_MAX];
+    const char *value;
+    if ((rest_length >= 6 && 0 == memcmp(rest, "ORIGIN", 6)) ||
+        (rest_length >= 8 && 0 == memcmp(rest, "{ORIGIN}", 8))) {
+      get_origin(object, origin, sizeof(origin));
+      value = origin;
+      i += (rest[0] == '{') ? 9 : 7;
+    } else if ((rest_length >= 3 && 0 == memcmp(rest, "LIB", 3)) ||
+               (rest_length >= 5 && 0 == memcmp(rest, "{LIB}", 5))) {
+      value = (object->elf_class == ELFCLASS64) ? "lib64" : "lib";
+      i += (rest[0] == '{') ? 6 : 4;
+    } else {
+      return 1; // $PLATFORM and the like
+    }
+    size_t value_length = strlen(value);
+    if (out + value_length >= size)
+      return 1;
+    memcpy(expanded + out, value, value_length);
+    out += value_length;
+  }
+  expanded[out] = '\0';
+  return 0;
+}
+
+// searches a ':' separated list of dirs, $ORIGIN being the dir of object
+// returns: like load_object
+static err_t search_path(struct resolver *resolver, const char *path_list, unsigned object_index,
+                         const char *name, unsigned *index)
+{
+  const struct elf_object *program = &resolver->objects[0];
+  while (path_list) {
+    const char *end = strchrnul(path_list, ':');
+    char dir[PATH_MAX];
+    char path[PATH_MAX];
+    if (0 == expand_dir(path_list, end - path_list, &resolver->objects[object_index], dir, sizeof(dir)) &&
+        snprintf(path, sizeof(path), "%s/%s", dir, name) < (int)sizeof(path)) {
+      err_t result = load_object(resolver, path, name, program->elf_class, program->machine, index);
+      if (result != ENOENT)
+        return result;
+    }
+    path_list = (*end) ? end + 1 : NULL;
+  }
+  return ENOENT;
+}
+
+// glibc's _dl_cache_libcmp, numbers compare by value so libfoo.so.10 > libfoo.so.9
+static int cache_libcmp(const char *p1, const char *p2)
+{
+  while (*p1 != '\0') {
+    if (*p1 >= '0' && *p1 <= '9') {
+      if (*p2 >= '0' && *p2 <= '9') {
+        int value1 = *p1++ - '0';
+        int value2 = *p2++ - '0';
+        while (*p1 >= '0' && *p1 <= '9')
+          value1 = value1 * 10 + *p1++ - '0';
+        while (*p2 >= '0' && *p2 <= '9')
+          value2 = value2 * 10 + *p2++ - '0';
+        if (value1 != value2)
+          return value1 - value2;
+      } else {
+        return 1;
+      }
+    } else if (*p2 >= '0' && *p2 <= '9') {
+      return -1;
+    } else if (*p1 != *p2) {
+      return *p1 - *p2;
+    } else {
+      p1++;
+      p2++;
+    }
+  }
+  return *p1 - *p2;
+}
+
+static const char *cache_string(const struct resolver *resolver, uint32_t offset)
+{
+  if (offset >= resolver->cache_size)
+    return NULL;
+  const char *s = (const char*)resolver->cache + offset;
+  if (!memchr(s, '\0', resolver->cache_size - offset))
+    return NULL;
+  return s;
+}
+
+// maps ld.so.cache, a missing or unknown one just isn't searched
+static void load_cache(struct resolver *resolver)
+{
+  int fd = open(ELFDEPS_LD_SO_CACHE, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return;
+  struct stat st;
+  if (-1 == fstat(fd, &st) || map_file(fd, &resolver->cache_file, &st)) {
+    close(fd);
+    return;
+  }
+  close(fd);
+  const struct mapped_file *file = &resolver->cache_file;
+  size_t offset = 0;
+  // the old format can come first, the new one follows it aligned to 8
+  if (file->size >= 16 && 0 == memcmp(file->data, CACHE_MAGIC_OLD, sizeof(CACHE_MAGIC_OLD) - 1)) {
+    uint32_t nlibs;
+    memcpy(&nlibs, file->data + 12, sizeof(nlibs));
+    offset = (16 + (uint64_t)nlibs * 12 + 7) & ~7ULL;
+  }
+  if (!in_file(file, offset, sizeof(struct cache_header)) ||
+      0 != memcmp(file->data + offset, CACHE_MAGIC_NEW, sizeof(CACHE_MAGIC_NEW) - 1)) {
+    unmap_file(&resolver->cache_file);
+    return;
+  }
+  // the strings are relative to the new header
+  resolver->cache = (const struct cache_header*)(file->data + offset);
+  resolver->cache_size = file->size - offset;
+  if (!in_file(file, offset + sizeof(struct cache_header),
+               (uint64_t)resolver->cache->nlibs * sizeof(struct cache_entry))) {
+    resolver->cache = NULL;
+    unmap_file(&resolver->cache_file);
+    return;
+  }
+  resolver->cache_entries = (const struct cache_entry*)(resolver->cache + 1);
+}
+
+// returns: like load_object
+static err_t search_cache(struct resolver *resolver, const char *name, unsigned *index)
+{
+  if (!resolver->cache)
+    return ENOENT;
+  const struct elf_object *program = &resolver->objects[0];
+  // the entries are sorted by cache_libcmp, descending
+  int64_t left = 0, right = (int64_t)resolver->cache->nlibs - 1, found = -1;
+  while (left <= right) {
+    int64_t middle = (left + right) / 2;
+    const char *key = cache_string(resolver, resolver->cache_entries[middle].key);
+    if (!key)
+      return ENOENT;
+    int compare = cache_libcmp(name, key);
+    if (compare == 0) {
+      found = middle;
+      break;
+    }
+    if (compare < 0)
+      left = middle + 1;
+    else
+      right = middle - 1;
+  }
+  if (found == -1)
+    return ENOENT;
+  // there is an entry per arch, try them all in order
+  while (found > 0) {
+    const char *key = cache_string(resolver, resolver->cache_entries[found - 1].key);
+    if (!key || 0 != cache_libcmp(name, key))
+      break;
+    found--;
+  }
+  for (uint32_t i = found; i < resolver->cache->nlibs; i++) {
+    const char *key = cache_string(resolver, resolver->cache_entries[i].key);
+    const char *value = cache_string(resolver, resolver->cache_entries[i].value);
+    if (!key || !value || 0 != cache_libcmp(name, key))
+      break;
+    err_t result = load_object(resolver, value, name, program->elf_class, program->machine, index);
+    if (result != ENOENT)
+      return result;
+  }
+  return ENOENT;
+}
+
+// returns: like load_object, in ld.so's order
+static err_t find_needed(struct resolver *resolver, unsigned object_index, const char *name, unsigned *index)
+{
+  for (unsigned i = 0; i < resolver->object_count; i++) {
+    const struct elf_object *object = &resolver->objects[i];
+    if ((object->name && 0 == strcmp(object->name, name)) ||
+        (object->soname && 0 == strcmp(object->soname, name))) {
+      *index = i;
+      return 0;
+    }
+  }
+  const struct elf_object *program = &resolver->objects[0];
+  if (strchr(name, '/'))
+    return load_object(resolver, name, name, program->elf_class, program->machine, index);
+
+  err_t result = ENOENT;
+  // ld.so goes through the DT_RPATH of every object up the chain that loaded
+  // this one, the program's covers nearly every case
+  if (!resolver->objects[object_index].runpath) {
+    if (resolver->objects[object_index].rpath)
+      result = search_path(resolver, resolver->objects[object_index].rpath, object_index, name, index);
+    if (result == ENOENT && object_index != 0 && program->rpath && !program->runpath)
+      result = search_path(resolver, program->rpath, 0, name, index);
+  }
+  if (result == ENOENT && resolver->library_path)
+    result = search_path(resolver, resolver->library_path, 0, name, index);
+  if (result == ENOENT && resolver->objects[object_index].runpath)
+    result = search_path(resolver, resolver->objects[object_index].runpath, object_index, name, index);
+  if (result == ENOENT)
+    result = search_cache(resolver, name, index);
+  if (result == ENOENT) {
+    const char *default_path = (resolver->objects[0].elf_class == ELFCLASS64) ? default_path_64 : default_path_32;
+    result = search_path(resolver, default_path, 0, name, index);
+  }
+  return result;
+}
+
+// goes through the DT_NEEDED of each object breadth first, adding the ones
+// that aren't loaded yet to the end
+static err_t load_closure(struct resolver *resolver)
+{
+  err_t missing = 0;
+  for (unsigned object_index = 0; object_index < resolver->object_count; object_index++) {
+    for (size_t i = 0; i < resolver->objects[object_index].dynamic_count; i++) {
+      // objects may move as they're added, so look this one up every time
+      const struct elf_object *object = &resolver->objects[object_index];
+      Elf64_Dyn dyn;
+      read_dyn(object, i, &dyn);
+      if (dyn.d_tag != DT_NEEDED)
+        continue;
+      const char *name = dyn_string(object, dyn.d_un.d_val);
+      if (!name)
+        continue;
+      unsigned index;
+      err_t result = find_needed(resolver, object_index, name, &index);
+      if (result == ENOENT) {
+        errf("'%s' needed by '%s' not found", name, resolver->objects[object_index].path);
+        missing = 1;
+      } else if (result) {
+        return result; // error already logged
+      }
+    }
+  }
+  return missing;
+}
+
+/*
+Calls callback with the path of each library program loads and its dynamic
+loader.  A program that isn't ELF, like a script, has none.  Libraries that
+can't be found are logged and make it fail after the rest are reported.
+*/
+err_t elfdeps_resolve(const char *program, elfdeps_callback callback, void *context)
+{
+  // $ORIGIN of the program is where it really is, like /proc/self/exe
+  char real[PATH_MAX];
+  if (!realpath(program, real)) {
+    errnof("realpath '%s' failed", program);
+    return current_error;
+  }
+  struct resolver resolver = { .library_path = getenv("LD_LIBRARY_PATH") };
+  if (resolver.library_path && !resolver.library_path[0])
+    resolver.library_path = NULL;
+  unsigned index;
+  err_t result = load_object(&resolver, real, NULL, 0, 0, &index);
+  if (result == ENOENT)
+    return 0;
+  if (result)
+    return result; // error already logged
+
+  err_t missing = 0;
+  if (resolver.objects[0].interp) {
+    const char *interp = resolver.objects[0].interp;
+    result = load_object(&resolver, interp, NULL, resolver.objects[0].elf_class, resolver.objects[0].machine, &index);
+    if (result == 0) {
+      resolver.objects[index].is_interp = 1;
+    } else if (result == ENOENT) {
+      errf("'%s' needed by '%s' not found", interp, real);
+      missing = 1;
+      result = 0;
+    }
+  }
+  if (!result) {
+    load_cache(&resolver);
+    result = load_closure(&resolver);
+  }
+  if (!result)
+    result = missing;
+
+  // like ldd, the loader comes last
+  for (int pass = 0; pass < 2; pass++) {
+    for (unsigned i = 1; i < resolver.object_count; i++) {
+      if (resolver.objects[i].is_interp == pass) {
+        err_t callback_result = callback(resolver.objects[i].path, context);
+        if (callback_result && !result)
+          result = callback_result;
+      }
+    }
+  }
+
+  for (unsigned i = 0; i < resolver.object_count; i++) {
+    free(resolver.objects[i].path);
+    unmap_file(&resolver.objects[i].file);
+  }
+  free(resolver.objects);
+  unmap_file(&resolver.cache_file);
+  return result;
+}
@@ -0,0 +1,15 @@
+/*
+Finds the shared libraries a program loads without running it or its
+dynamic loader, the way ld.so would: PT_INTERP, then DT_NEEDED breadth
+first, searched for in DT_RPATH, LD_LIBRARY_PATH, DT_RUNPATH, ld.so.cache
+and the default dirs, with $ORIGIN expanded.  Each library is reported
+once, the loader last, like ldd.
+*/
+#define ELFDEPS_LD_SO_CACHE "/etc/ld.so.cache"
+
+// a program loading more than this many libraries is an error
+#define ELFDEPS_MAX_OBJECTS 4096
+
+typedef err_t (*elfdeps_callback)(const char *file, void *context);
+
+err_t elfdeps_resolve(const char *program, elfdeps_callback callback, void *context);
@@ -0,0 +1,552 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include <linux/limits.h>
+
+#include "common.h"
+#include "json.h"
+#include "cachedir.h"
+#include "iface.h"
+
+static uint64_t fnv1a(uint64_t hash, const void *data, size_t length)
+{
+  const unsigned char *bytes = data;
+  for (size_t i = 0; i < length; i++) {
+    hash ^= bytes[i];
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+static int source_matches(const struct iface_header *header, const struct stat *source)
+{
+  return header->source_dev == source->st_dev &&
+    header->source_ino == source->st_ino &&
+    header->source_size == (uint64_t)source->st_size &&
+    header->source_mtime_sec == source->st_mtim.tv_sec &&
+    header->source_mtime_nsec == source->st_mtim.tv_nsec;
+}
+
+// returns: 0 if map is a well-formed cache of source, it is only ever read
+//          through the bounds checked here
+static err_t validate(const void *map, size_t size, const struct stat *source)
+{
+  const struct iface_header *header = map;
+  if (size < sizeof(*header) || 0 != memcmp(header->magic, IFACE_MAGIC, sizeof(header->magic)))
+    return 1;
+  if (header->size != size || !source_matches(header, source))
+    return 1;
+  uint64_t expected = sizeof(*header) +
+    (uint64_t)header->entry_count * sizeof(struct iface_entry) +
+    (uint64_t)header->node_count * sizeof(struct iface_node) +
+    (uint64_t)header->edge_count * sizeof(struct iface_edge) +
+    header->strings_size;
+  if (expected != size || header->strings_size == 0 || header->node_count == 0)
+    return 1;
+
+  const struct iface_entry *entries = (const struct iface_entry*)(header + 1);
+  const struct iface_node *nodes = (const struct iface_node*)(entries + header->entry_count);
+  const struct iface_edge *edges = (const struct iface_edge*)(nodes + header->node_count);
+  const char *strings = (const char*)(edges + header->edge_count);
+  // the table ends with a null, so every offset inside it is a string
+  if (strings[header->strings_size - 1] != '\0')
+    return 1;
+  for (uint32_t i = 0; i < header->entry_count; i++) {
+    if (entries[i].name >= header->strings_size || entries[i].type != IFACE_TYPE_FILE)
+      return 1;
+  }
+  for (uint32_t i = 0; i < header->node_count; i++) {
+    const struct iface_node *node = &nodes[i];
+    if (node->first_edge > header->edge_count || node->edge_count > header->edge_count - node->first_edge)
+      return 1;
+    if ((node->exact_entry != IFACE_NO_ENTRY && node->exact_entry >= header->entry_count) ||
+        (node->prefix_entry != IFACE_NO_ENTRY && node->prefix_entry >= header->entry_count))
+      return 1;
+    for (uint32_t j = node->first_edge; j < node->first_edge + node->edge_count; j++) {
+      if (edges[j].child <= i || edges[j].child >= header->node_count)
+        return 1;
+      // iface_match does a binary search
+      if (j > node->first_edge && edges[j].byte <= edges[j - 1].byte)
+        return 1;
+    }
+  }
+  return 0;
+}
+
+static void set_tables(struct iface *iface, void *map, size_t size)
+{
+  const struct iface_header *header = map;
+  iface->entries = (const struct iface_entry*)(header + 1);
+  iface->entry_count = header->entry_count;
+  iface->nodes = (const struct iface_node*)(iface->entries + header->entry_count);
+  iface->node_count = header->node_count;
+  iface->edges = (const struct iface_edge*)(iface->nodes + header->node_count);
+  iface->strings = (const char*)(iface->edges + header->edge_count);
+  iface->map = map;
+  iface->map_size = size;
+}
+
+// returns: 0 and fills in iface if cache_file is valid for source
+static err_t map_cache(const char *cache_file, const struct stat *source, struct iface *iface)
+{
+  int fd = open(cache_file, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return 1;
+  struct stat st;
+  if (-1 == fstat(fd, &st) || st.st_size < (off_t)sizeof(struct iface_header)) {
+    close(fd);
+    return 1;
+  }
+  void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return 1;
+  if (validate(map, st.st_size, source)) {
+    munmap(map, st.st_size);
+    return 1;
+  }
+  set_tables(iface, map, st.st_size);
+  return 0;
+}
+
+// a trie node while it's being built, 0 is no child since the root is no one's child
+struct builder_node
+{
+  uint32_t exact_entry;
+  uint32_t prefix_entry;
+  uint32_t children[256];
+};
+
+// the compiled file as it's being built
+struct builder
+{
+  const char *file_name;
+  struct iface_entry *entries;
+  uint32_t entry_count;
+  struct builder_node *nodes;
+  uint32_t node_count;
+  uint32_t edge_count;
+  char *strings;
+  uint32_t strings_size;
+};
+
+// returns: the index of a new node, or UINT32_MAX on error
+static uint32_t add_node(struct builder *builder)
+{
+  struct builder_node *nodes = realloc(builder->nodes, sizeof(*nodes) * (builder->node_count + 1));
+  if (!nodes) {
+    errnof("realloc failed");
+    return UINT32_MAX;
+  }
+  memset(&nodes[builder->node_count], 0, sizeof(*nodes));
+  nodes[builder->node_count].exact_entry = IFACE_NO_ENTRY;
+  nodes[builder->node_count].prefix_entry = IFACE_NO_ENTRY;
+  builder->nodes = nodes;
+  return builder->node_count++;
+}
+
+// returns: the offset of s in the string table, or UINT32_MAX on error
+static uint32_t intern(struct builder *builder, const char *s)
+{
+  size_t length = strlen(s) + 1;
+  for (uint32_t offset = 0; offset < builder->strings_size; offset += strlen(builder->strings + offset) + 1) {
+    if (0 == strcmp(builder->strings + offset, s))
+      return offset;
+  }
+  char *strings = realloc(builder->strings, builder->strings_size + length);
+  if (!strings) {
+    errnof("realloc failed");
+    return UINT32_MAX;
+  }
+  memcpy(strings + builder->strings_size, s, length);
+  builder->strings = strings;
+  builder->strings_size += length;
+  return builder->strings_size - length;
+}
+
+static err_t compile_type(struct builder *builder, const struct json_value *type, struct iface_entry *entry)
+{
+  const struct json_value *name = json_member(type, "name");
+  if (!name || name->type != JSON_STRING || 0 != strcmp(name->string, "file")) {
+    errf("%s:%u: type name must be \"file\"", builder->file_name, type->line);
+    return 1;
+  }
+  entry->type = IFACE_TYPE_FILE;
+  const struct json_value *access = json_member(type, "access");
+  if (!access || access->type != JSON_ARRAY) {
+    errf("%s:%u: file type needs an \"access\" array", builder->file_name, type->line);
+    return 1;
+  }
+  for (const struct json_value *item = access->first; item; item = item->next) {
+    if (item->type == JSON_STRING && 0 == strcmp(item->string, "read")) {
+      entry->access |= IFACE_ACCESS_READ;
+    } else if (item->type == JSON_STRING && 0 == strcmp(item->string, "write")) {
+      entry->access |= IFACE_ACCESS_WRITE;
+    } else {
+      errf("%s:%u: access must be \"read\" or \"write\"", builder->file_name, item->line);
+      return 1;
+    }
+  }
+  const struct json_value *must_exist = json_member(type, "must_exist");
+  if (must_exist) {
+    if (must_exist->type != JSON_BOOL) {
+      errf("%s:%u: must_exist must be true or false", builder->file_name, must_exist->line);
+      return 1;
+    }
+    entry->must_exist = must_exist->boolean;
+  }
+  return 0;
+}
+
+static err_t compile_entry(struct builder *builder, const struct json_value *value)
+{
+  if (value->type != JSON_OBJECT) {
+    errf("%s:%u: interface '%s' must be an object", builder->file_name, value->line, value->key);
+    return 1;
+  }
+  struct iface_entry entry = { 0 };
+  entry.name = intern(builder, value->key);
+  if (entry.name == UINT32_MAX)
+    return 1; // error already logged
+
+  const struct json_value *type = json_member(value, "type");
+  if (!type || type->type != JSON_OBJECT) {
+    errf("%s:%u: interface '%s' needs a \"type\" object", builder->file_name, value->line, value->key);
+    return 1;
+  }
+  if (compile_type(builder, type, &entry))
+    return 1; // error already logged
+
+  const struct json_value *max_count = json_member(value, "max_count");
+  if (max_count) {
+    if (max_count->type != JSON_NUMBER || max_count->number < 1 || max_count->number > UINT32_MAX ||
+        max_count->number != (uint32_t)max_count->number) {
+      errf("%s:%u: max_count must be a positive integer", builder->file_name, max_count->line);
+      return 1;
+    }
+    entry.max_count = max_count->number;
+  }
+  const struct json_value *cmd_interface = json_member(value, "cmd_interface");
+  entry.positional = cmd_interface && cmd_interface->type == JSON_NULL;
+
+  struct iface_entry *entries = realloc(builder->entries, sizeof(*entries) * (builder->entry_count + 1));
+  if (!entries) {
+    errnof("realloc failed");
+    return 1;
+  }
+  entries[builder->entry_count++] = entry;
+  builder->entries = entries;
+  return 0;
+}
+
+static err_t compile_pattern(struct builder *builder, const struct json_value *value)
+{
+  const char *percent = strchr(value->key, '%');
+  if (value->key[0] == '\0' || (percent && percent[1] != '\0')) {
+    errf("%s:%u: '%%' can only end a cmd_line pattern", builder->file_name, value->line);
+    return 1;
+  }
+  if (value->type != JSON_STRING) {
+    errf("%s:%u: cmd_line '%s' must name an interface", builder->file_name, value->line, value->key);
+    return 1;
+  }
+  uint32_t entry;
+  for (entry = 0; entry < builder->entry_count; entry++) {
+    if (0 == strcmp(builder->strings + builder->entries[entry].name, value->string))
+      break;
+  }
+  if (entry == builder->entry_count) {
+    errf("%s:%u: unknown interface '%s'", builder->file_name, value->line, value->string);
+    return 1;
+  }
+
+  uint32_t node = 0;
+  for (const char *next = value->key; next != percent && *next; next++) {
+    unsigned char byte = *next;
+    if (builder->nodes[node].children[byte] == 0) {
+      uint32_t child = add_node(builder);
+      if (child == UINT32_MAX)
+        return 1; // error already logged
+      builder->nodes[node].children[byte] = child;
+      builder->edge_count++;
+    }
+    node = builder->nodes[node].children[byte];
+  }
+  uint32_t *end_entry = percent ? &builder->nodes[node].prefix_entry : &builder->nodes[node].exact_entry;
+  if (*end_entry != IFACE_NO_ENTRY) {
+    errf("%s:%u: duplicate cmd_line pattern '%s'", builder->file_name, value->line, value->key);
+    return 1;
+  }
+  *end_entry = entry;
+  return 0;
+}
+
+static err_t compile_document(struct builder *builder, const struct json_value *document)
+{
+  if (document->type != JSON_OBJECT) {
+    errf("%s: must be a JSON object", builder->file_name);
+    return 1;
+  }
+  const struct json_value *interface = json_member(document, "interface");
+  if (!interface || interface->type != JSON_OBJECT) {
+    errf("%s: needs an \"interface\" object", builder->file_name);
+    return 1;
+  }
+  for (const struct json_value *value = interface->first; value; value = value->next) {
+    if (compile_entry(builder, value))
+      return 1; // error already logged
+  }
+  if (builder->entry_count == 0) {
+    errf("%s: defines no interface", builder->file_name);
+    return 1;
+  }
+  const struct json_value *cmd_line = json_member(document, "cmd_line");
+  if (cmd_line) {
+    if (cmd_line->type != JSON_OBJECT) {
+      errf("%s:%u: cmd_line must be an object", builder->file_name, cmd_line->line);
+      return 1;
+    }
+    for (const struct json_value *value = cmd_line->first; value; value = value->next) {
+      if (compile_pattern(builder, value))
+        return 1; // error already logged
+    }
+  }
+  return 0;
+}
+
+// returns: the compiled file in a malloc'd buffer of header->size bytes, or NULL on error
+static struct iface_header *compile(const char *rex_file, int fd, const struct stat *source)
+{
+  char *text = malloc(source->st_size ? source->st_size : 1);
+  if (!text) {
+    errnof("malloc failed");
+    return NULL;
+  }
+  ssize_t length = pread(fd, text, source->st_size, 0);
+  if (length != source->st_size) {
+    if (length == -1)
+      errnof("read '%s' failed", rex_file);
+    else
+      errf("'%s' changed while reading it", rex_file);
+    free(text);
+    return NULL;
+  }
+  struct json_value *document = json_parse(text, length, rex_file);
+  free(text);
+  if (!document)
+    return NULL; // error already logged
+
+  struct builder builder = { .file_name = rex_file };
+  struct iface_header *header = NULL;
+  // the root
+  if (UINT32_MAX != add_node(&builder) && 0 == compile_document(&builder, document)) {
+    size_t entries_size = sizeof(struct iface_entry) * builder.entry_count;
+    size_t nodes_size = sizeof(struct iface_node) * builder.node_count;
+    size_t edges_size = sizeof(struct iface_edge) * builder.edge_count;
+    size_t size = sizeof(*header) + entries_size + nodes_size + edges_size + builder.strings_size;
+    header = calloc(1, size);
+    if (!header) {
+      errnof("calloc failed");
+    } else {
+      memcpy(header->magic, IFACE_MAGIC, sizeof(header->magic));
+      header->size = size;
+      header->entry_count = builder.entry_count;
+      header->node_count = builder.node_count;
+      header->edge_count = builder.edge_count;
+      header->strings_size = builder.strings_size;
+      header->source_dev = source->st_dev;
+      header->source_ino = source->st_ino;
+      header->source_size = source->st_size;
+      header->source_mtime_sec = source->st_mtim.tv_sec;
+      header->source_mtime_nsec = source->st_mtim.tv_nsec;
+      char *next = (char*)(header + 1);
+      memcpy(next, builder.entries, entries_size);
+      next += entries_size;
+      // each node's edges follow the ones before it, already sorted by byte
+      struct iface_node *nodes = (struct iface_node*)next;
+      struct iface_edge *edges = (struct iface_edge*)(next + nodes_size);
+      uint32_t edge_count = 0;
+      for (uint32_t i = 0; i < builder.node_count; i++) {
+        const struct builder_node *node = &builder.nodes[i];
+        nodes[i].first_edge = edge_count;
+        nodes[i].exact_entry = node->exact_entry;
+        nodes[i].prefix_entry = node->prefix_entry;
+        for (unsigned byte = 0; byte < 256; byte++) {
+          if (node->children[byte]) {
+            edges[edge_count].child = node->children[byte];
+            edges[edge_count].byte = byte;
+            edge_count++;
+          }
+        }
+        nodes[i].edge_count = edge_count - nodes[i].first_edge;
+      }
+      next += nodes_size + edges_size;
+      memcpy(next, builder.strings, builder.strings_size);
+    }
+  }
+  json_free(document);
+  free(builder.entries);
+  free(builder.nodes);
+  free(builder.strings);
+  return header;
+}
+
+// writes the cache to a temporary file renamed over cache_file, so readers
+// only ever see a complete file
+static err_t write_cache(const char *cache_file, const struct iface_header *header)
+{
+  char temp[PATH_MAX];
+  if (snprintf(temp, sizeof(temp), "%s.XXXXXX", cache_file) >= (int)sizeof(temp)) {
+    errno = ENAMETOOLONG;
+    return 1;
+  }
+  int fd = mkstemp(temp);
+  if (fd == -1)
+    return 1;
+  if (header->size != write(fd, header, header->size) ||
+      -1 == fchmod(fd, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH) ||
+      -1 == close(fd)) {
+    int saved_errno = errno;
+    close(fd);
+    unlink(temp);
+    errno = saved_errno;
+    return 1;
+  }
+  if (-1 == rename(temp, cache_file)) {
+    int saved_errno = errno;
+    unlink(temp);
+    errno = saved_errno;
+    return 1;
+  }
+  return 0;
+}
+
+// returns: the cache file for rex_file in the cache dir, creating the dir
+static err_t get_cache_dir_file(const char *rex_file, char *cache_file, size_t size)
+{
+  // the same .rex file reached through different paths shares one entry
+  char real[PATH_MAX];
+  if (!realpath(rex_file, real))
+    return 1;
+  char name[32];
+  uint64_t hash = fnv1a(0xcbf29ce484222325ULL, real, strlen(real));
+  snprintf(name, sizeof(name), "%016llx.rexc", (unsigned long long)hash);
+  return cache_dir_file(name, cache_file, size);
+}
+
+/*
+Loads the interface definition in rex_file, from its cache when that is
+still valid.  Otherwise rex_file is compiled and the cache is written next
+to it, or in the cache dir if that fails.  A missing rex_file fails with
+ENOENT without logging, since most programs won't have one.
+*/
+err_t iface_load(const char *rex_file, struct iface *iface)
+{
+  int fd = open(rex_file, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    if (errno == ENOENT)
+      return ENOENT;
+    errnof("open '%s' failed", rex_file);
+    return current_error;
+  }
+  struct stat source;
+  if (-1 == fstat(fd, &source)) {
+    errnof("fstat '%s' failed", rex_file);
+    close(fd);
+    return current_error;
+  }
+
+  char sibling_file[PATH_MAX];
+  if (snprintf(sibling_file, sizeof(sibling_file), "%sc", rex_file) >= (int)sizeof(sibling_file)) {
+    errf("path '%s' is too long", rex_file);
+    close(fd);
+    return 1;
+  }
+  if (0 == map_cache(sibling_file, &source, iface)) {
+    close(fd);
+    return 0;
+  }
+  char cache_file[PATH_MAX];
+  int have_cache_file = 0 == get_cache_dir_file(rex_file, cache_file, sizeof(cache_file));
+  if (have_cache_file && 0 == map_cache(cache_file, &source, iface)) {
+    close(fd);
+    return 0;
+  }
+
+  struct iface_header *header = compile(rex_file, fd, &source);
+  close(fd);
+  if (!header)
+    return 1; // error already logged
+  // the cache is only an optimization, not being able to write it is fine
+  if (write_cache(sibling_file, header) && have_cache_file)
+    write_cache(cache_file, header);
+
+  // use what was just compiled the same way as a cache that was read
+  void *map = mmap(NULL, header->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (map == MAP_FAILED) {
+    errnof("mmap failed");
+    free(header);
+    return current_error;
+  }
+  memcpy(map, header, header->size);
+  set_tables(iface, map, header->size);
+  free(header);
+  return 0;
+}
+
+/*
+Matches arg against the cmd_line patterns in one walk over its bytes.  A
+pattern without '%' has to match all of arg and wins, otherwise it's the
+longest pattern with '%' that leaves something for the file.
+
+returns: the entry arg is for, or IFACE_NO_ENTRY.  value is set to the file
+         in arg, or to NULL when the file is the next argument.
+*/
+uint32_t iface_match(const struct iface *iface, const char *arg, const char **value)
+{
+  const struct iface_node *node = &iface->nodes[0];
+  uint32_t prefix_entry = IFACE_NO_ENTRY;
+  for (const char *next = arg;; next++) {
+    if (*next == '\0') {
+      if (node->exact_entry != IFACE_NO_ENTRY) {
+        *value = NULL;
+        return node->exact_entry;
+      }
+      break;
+    }
+    if (node->prefix_entry != IFACE_NO_ENTRY) {
+      prefix_entry = node->prefix_entry;
+      *value = next;
+    }
+    const struct iface_edge *low = &iface->edges[node->first_edge];
+    const struct iface_edge *high = low + node->edge_count;
+    unsigned char byte = *next;
+    while (low < high) {
+      const struct iface_edge *middle = low + (high - low) / 2;
+      if (middle->byte < byte)
+        low = middle + 1;
+      else
+        high = middle;
+    }
+    if (low == &iface->edges[node->first_edge + node->edge_count] || low->byte != byte)
+      break;
+    node = &iface->nodes[low->child];
+  }
+  return prefix_entry;
+}
+
+void iface_unload(struct iface *iface)
+{
+  if (iface->map)
+    munmap(iface->map, iface->map_size);
+  iface->map = NULL;
+}
@@ -0,0 +1,91 @@
+#include <stdint.h>
+
+/*
+A program interface definition, see README.md.  The JSON in "<program>.rex"
+is compiled into a flat binary form that is cached in "<program>.rexc", or
+in the cache dir (see cachedir.h) when the program's dir isn't writable, so
+loading it is one mmap and a few bounds checks:
+
+  struct iface_header
+  struct iface_entry[entry_count] "interface"
+  struct iface_node[node_count]   "cmd_line" as a trie, nodes[0] is the root
+  struct iface_edge[edge_count]   the children of each node, sorted by byte
+  char strings[strings_size]      every string once, null-terminated
+
+All strings are offsets into the string table.  The header records the
+.rex file it came from and is thrown away when that file changes.
+
+The trie is over the bytes of the patterns without their '%', so matching
+an argument only walks its bytes once however many patterns there are.
+*/
+#define IFACE_MAGIC "REXIFC2"
+
+enum iface_type
+{
+  IFACE_TYPE_FILE,
+};
+
+#define IFACE_ACCESS_READ  0x1
+#define IFACE_ACCESS_WRITE 0x2
+
+struct iface_header
+{
+  char magic[8];
+  uint32_t size; // of the whole file
+  uint32_t entry_count;
+  uint32_t node_count;
+  uint32_t edge_count;
+  uint32_t strings_size;
+  uint32_t reserved;
+  // the .rex file
+  uint64_t source_dev;
+  uint64_t source_ino;
+  uint64_t source_size;
+  int64_t source_mtime_sec;
+  int64_t source_mtime_nsec;
+};
+
+struct iface_entry
+{
+  uint32_t name;
+  uint32_t type;
+  uint32_t access;
+  uint32_t max_count; // 0 is unlimited
+  uint8_t must_exist;
+  uint8_t positional; // "cmd_interface" is null, takes the plain arguments
+  uint8_t reserved[2];
+};
+
+#define IFACE_NO_ENTRY UINT32_MAX
+
+// "-o" takes the next argument, "-o%" and "-o=%" the rest of this one
+struct iface_node
+{
+  uint32_t first_edge;
+  uint32_t edge_count;
+  uint32_t exact_entry;  // a pattern without '%' ends here
+  uint32_t prefix_entry; // a pattern with '%' ends here
+};
+
+struct iface_edge
+{
+  uint32_t child; // always after the parent, so walks can't loop
+  uint8_t byte;
+  uint8_t reserved[3];
+};
+
+struct iface
+{
+  const struct iface_entry *entries;
+  uint32_t entry_count;
+  const struct iface_node *nodes;
+  uint32_t node_count;
+  const struct iface_edge *edges;
+  const char *strings;
+  void *map;
+  size_t map_size;
+};
+
+err_t iface_load(const char *rex_file, struct iface *iface);
+void iface_unload(struct iface *iface);
+uint32_t iface_match(const struct iface *iface, const char *arg, const char **value);
@@ -0,0 +1,109 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+
+#include <linux/limits.h>
+
+#include "common.h"
+#include "iface.h"
+#include "cmdline.h"
+#include "elfdeps.h"
+#include "depcache.h"
+#include "info.h"
+
+// finds program the way execvp would
+static err_t find_program(const char *program, char *path, size_t size)
+{
+  if (strchr(program, '/')) {
+    if (snprintf(path, size, "%s", program) >= (int)size) {
+      errf("path '%s' is too long", program);
+      return 1;
+    }
+    return 0;
+  }
+  const char *dirs = getenv("PATH");
+  if (!dirs)
+    dirs = "/usr/local/bin:/usr/bin:/bin";
+  while (*dirs) {
+    const char *end = strchrnul(dirs, ':');
+    // an empty entry is the current directory
+    int dir_length = end - dirs;
+    if (snprintf(path, size, "%.*s%s%s", dir_length, dirs, dir_length ? "/" : "", program) < (int)size) {
+      struct stat st;
+      if (0 == stat(path, &st) && S_ISREG(st.st_mode) && 0 == access(path, X_OK))
+        return 0;
+    }
+    dirs = (*end) ? end + 1 : end;
+  }
+  errf("'%s' not found in PATH", program);
+  return 1;
+}
+
+// loads "<program>.rex", and if there isn't one and program is a symlink,
+// the one next to what it links to, i.e. /usr/bin/gcc -> gcc-12
+static err_t load_program_iface(const char *program_path, struct iface *iface)
+{
+  char rex_file[PATH_MAX];
+  if (snprintf(rex_file, sizeof(rex_file), "%s.rex", program_path) >= (int)sizeof(rex_file)) {
+    errf("path '%s' is too long", program_path);
+    return 1;
+  }
+  err_t result = iface_load(rex_file, iface);
+  if (result != ENOENT)
+    return result;
+  char real[PATH_MAX];
+  if (!realpath(program_path, real) || 0 == strcmp(real, program_path))
+    return ENOENT;
+  if (snprintf(rex_file, sizeof(rex_file), "%s.rex", real) >= (int)sizeof(rex_file))
+    return ENOENT;
+  return iface_load(rex_file, iface);
+}
+
+static err_t print_file(unsigned access, const char *file, void *context)
+{
+  (void)context;
+  if (access & IFACE_ACCESS_WRITE)
+    printf("write: %s\n", file);
+  if (access & IFACE_ACCESS_READ)
+    printf("read: %s\n", file);
+  return 0;
+}
+
+static err_t print_library(const char *file, void *context)
+{
+  (void)context;
+  printf("read: %s\n", file);
+  return 0;
+}
+
+err_t info_main(int argc, const char *argv[])
+{
+  if (argc == 0) {
+    errf("-info needs a program");
+    return 1;
+  }
+  char program_path[PATH_MAX];
+  if (find_program(argv[0], program_path, sizeof(program_path)))
+    return 1; // error already logged
+  struct iface iface;
+  err_t result = load_program_iface(program_path, &iface);
+  if (result == ENOENT) {
+    errf("'%s' has no interface definition '%s.rex'", argv[0], program_path);
+    return 1;
+  }
+  if (result)
+    return result; // error already logged
+
+  result = cmdline_classify(&iface, argc - 1, argv + 1, print_file, NULL);
+  iface_unload(&iface);
+  if (result)
+    return result; // error already logged
+  // the program's libraries are read too, found without running it
+  return depcache_resolve(program_path, print_library, NULL);
+}
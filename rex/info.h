@@ -0,0 +1,2 @@
+// rex -info <program> <args>..., prints what the invocation reads and writes
+err_t info_main(int argc, const char *argv[]);
@@ -0,0 +1,304 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "common.h"
+#include "json.h"
+
+struct parser
+{
+  const char *next;
+  const char *end;
+  const char *file_name;
+  unsigned line;
+};
+
+static void parse_error(struct parser *parser, const char *what)
+{
+  errf("%s:%u: %s", parser->file_name, parser->line, what);
+}
+
+// skips whitespace and // and /* */ comments
+static void skip_space(struct parser *parser)
+{
+  while (parser->next < parser->end) {
+    char c = *parser->next;
+    if (c == '\n') {
+      parser->line++;
+      parser->next++;
+    } else if (c == ' ' || c == '\t' || c == '\r') {
+      parser->next++;
+    } else if (c == '/' && parser->next + 1 < parser->end && parser->next[1] == '/') {
+      while (parser->next < parser->end && *parser->next != '\n')
+        parser->next++;
+    } else if (c == '/' && parser->next + 1 < parser->end && parser->next[1] == '*') {
+      parser->next += 2;
+      while (parser->next + 1 < parser->end && !(parser->next[0] == '*' && parser->next[1] == '/')) {
+        if (*parser->next == '\n')
+          parser->line++;
+        parser->next++;
+      }
+      parser->next += 2;
+    } else {
+      return;
+    }
+  }
+}
+
+static int parse_hex4(const char *s, unsigned *value)
+{
+  *value = 0;
+  for (int i = 0; i < 4; i++) {
+    char c = s[i];
+    unsigned digit;
+    if (c >= '0' && c <= '9')
+      digit = c - '0';
+    else if (c >= 'a' && c <= 'f')
+      digit = c - 'a' + 10;
+    else if (c >= 'A' && c <= 'F')
+      digit = c - 'A' + 10;
+    else
+      return -1;
+    *value = (*value << 4) | digit;
+  }
+  return 0;
+}
+
+// returns: the string after the opening quote, unescaped, or NULL on error
+static char *parse_string(struct parser *parser)
+{
+  // the unescaped string is never longer than the escaped one
+  const char *start = parser->next;
+  const char *close = start;
+  while (close < parser->end && *close != '"') {
+    if (*close == '\\')
+      close++;
+    close++;
+  }
+  if (close >= parser->end) {
+    parse_error(parser, "unterminated string");
+    return NULL;
+  }
+  char *string = malloc(close - start + 1);
+  if (!string) {
+    errnof("malloc failed");
+    return NULL;
+  }
+  char *out = string;
+  while (parser->next < close) {
+    char c = *parser->next++;
+    if (c == '\n') {
+      parse_error(parser, "newline in string");
+      free(string);
+      return NULL;
+    }
+    if (c != '\\') {
+      *out++ = c;
+      continue;
+    }
+    c = *parser->next++;
+    switch (c) {
+    case '"': case '\\': case '/': *out++ = c; break;
+    case 'b': *out++ = '\b'; break;
+    case 'f': *out++ = '\f'; break;
+    case 'n': *out++ = '\n'; break;
+    case 'r': *out++ = '\r'; break;
+    case 't': *out++ = '\t'; break;
+    case 'u': {
+      unsigned code;
+      if (close - parser->next < 4 || parse_hex4(parser->next, &code) || code == 0) {
+        parse_error(parser, "invalid \\u escape");
+        free(string);
+        return NULL;
+      }
+      parser->next += 4;
+      // 6 bytes of "\uXXXX" always fit the 3 bytes of UTF-8, surrogates are
+      // passed through as they are
+      if (code < 0x80) {
+        *out++ = code;
+      } else if (code < 0x800) {
+        *out++ = 0xc0 | (code >> 6);
+        *out++ = 0x80 | (code & 0x3f);
+      } else {
+        *out++ = 0xe0 | (code >> 12);
+        *out++ = 0x80 | ((code >> 6) & 0x3f);
+        *out++ = 0x80 | (code & 0x3f);
+      }
+      break;
+    }
+    default:
+      parse_error(parser, "invalid escape in string");
+      free(string);
+      return NULL;
+    }
+  }
+  *out = '\0';
+  parser->next = close + 1;
+  return string;
+}
+
+static int match_word(struct parser *parser, const char *word)
+{
+  size_t length = strlen(word);
+  if ((size_t)(parser->end - parser->next) < length || 0 != memcmp(parser->next, word, length))
+    return 0;
+  parser->next += length;
+  return 1;
+}
+
+static struct json_value *parse_value(struct parser *parser, unsigned depth);
+
+// parses the elements or members after the opening bracket
+static int parse_children(struct parser *parser, struct json_value *value, char close, unsigned depth)
+{
+  struct json_value **link = &value->first;
+  for (;;) {
+    skip_space(parser);
+    if (parser->next < parser->end && *parser->next == close) {
+      parser->next++;
+      return 0;
+    }
+    char *key = NULL;
+    if (value->type == JSON_OBJECT) {
+      if (parser->next >= parser->end || *parser->next != '"') {
+        parse_error(parser, "expected a member name");
+        return -1;
+      }
+      parser->next++;
+      key = parse_string(parser);
+      if (!key)
+        return -1; // error already logged
+      skip_space(parser);
+      if (parser->next >= parser->end || *parser->next != ':') {
+        parse_error(parser, "expected ':'");
+        free(key);
+        return -1;
+      }
+      parser->next++;
+    }
+    struct json_value *child = parse_value(parser, depth + 1);
+    if (!child) {
+      free(key);
+      return -1; // error already logged
+    }
+    child->key = key;
+    *link = child;
+    link = &child->next;
+    skip_space(parser);
+    // a comma before the closing bracket is allowed
+    if (parser->next < parser->end && *parser->next == ',') {
+      parser->next++;
+    } else if (parser->next >= parser->end || *parser->next != close) {
+      parse_error(parser, (close == '}') ? "expected ',' or '}'" : "expected ',' or ']'");
+      return -1;
+    }
+  }
+}
+
+static struct json_value *parse_value(struct parser *parser, unsigned depth)
+{
+  if (depth > 64) {
+    parse_error(parser, "nested too deep");
+    return NULL;
+  }
+  skip_space(parser);
+  if (parser->next >= parser->end) {
+    parse_error(parser, "expected a value");
+    return NULL;
+  }
+  struct json_value *value = calloc(1, sizeof(*value));
+  if (!value) {
+    errnof("calloc failed");
+    return NULL;
+  }
+  value->line = parser->line;
+  char c = *parser->next;
+  if (c == '{' || c == '[') {
+    parser->next++;
+    value->type = (c == '{') ? JSON_OBJECT : JSON_ARRAY;
+    if (parse_children(parser, value, (c == '{') ? '}' : ']', depth)) {
+      json_free(value);
+      return NULL;
+    }
+  } else if (c == '"') {
+    parser->next++;
+    value->type = JSON_STRING;
+    value->string = parse_string(parser);
+    if (!value->string) {
+      free(value);
+      return NULL;
+    }
+  } else if (match_word(parser, "null")) {
+    value->type = JSON_NULL;
+  } else if (match_word(parser, "true")) {
+    value->type = JSON_BOOL;
+    value->boolean = 1;
+  } else if (match_word(parser, "false")) {
+    value->type = JSON_BOOL;
+  } else if (c == '-' || (c >= '0' && c <= '9')) {
+    // the text is not null-terminated, copy the number out
+    char number[64];
+    size_t length = 0;
+    while (parser->next + length < parser->end && length < sizeof(number) - 1 &&
+           strchr("+-.0123456789eE", parser->next[length]))
+      length++;
+    memcpy(number, parser->next, length);
+    number[length] = '\0';
+    char *end;
+    value->type = JSON_NUMBER;
+    value->number = strtod(number, &end);
+    if (end != number + length) {
+      parse_error(parser, "invalid number");
+      free(value);
+      return NULL;
+    }
+    parser->next += length;
+  } else {
+    parse_error(parser, "expected a value");
+    free(value);
+    return NULL;
+  }
+  return value;
+}
+
+// returns: the parsed document freed with json_free, or NULL on error
+struct json_value *json_parse(const char *text, size_t length, const char *file_name)
+{
+  struct parser parser = { .next = text, .end = text + length, .file_name = file_name, .line = 1 };
+  struct json_value *value = parse_value(&parser, 0);
+  if (!value)
+    return NULL;
+  skip_space(&parser);
+  if (parser.next < parser.end) {
+    parse_error(&parser, "unexpected text after the value");
+    json_free(value);
+    return NULL;
+  }
+  return value;
+}
+
+void json_free(struct json_value *value)
+{
+  while (value) {
+    struct json_value *next = value->next;
+    if (value->type == JSON_OBJECT || value->type == JSON_ARRAY)
+      json_free(value->first);
+    else if (value->type == JSON_STRING)
+      free(value->string);
+    free(value->key);
+    free(value);
+    value = next;
+  }
+}
+
+struct json_value *json_member(const struct json_value *object, const char *key)
+{
+  if (object->type != JSON_OBJECT)
+    return NULL;
+  for (struct json_value *member = object->first; member; member = member->next) {
+    if (0 == strcmp(member->key, key))
+      return member;
+  }
+  return NULL;
+}
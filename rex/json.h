@@ -0,0 +1,28 @@
+// a JSON reader for .rex files, which also allows comments and trailing commas
+enum json_type
+{
+  JSON_NULL,
+  JSON_BOOL,
+  JSON_NUMBER,
+  JSON_STRING,
+  JSON_ARRAY,
+  JSON_OBJECT,
+};
+
+struct json_value
+{
+  enum json_type type;
+  unsigned line;
+  char *key; // for the members of an object
+  struct json_value *next; // the next element or member
+  union {
+    int boolean;
+    double number;
+    char *string;
+    struct json_value *first; // the first element or member
+  };
+};
+
+struct json_value *json_parse(const char *text, size_t length, const char *file_name);
+void json_free(struct json_value *value);
+struct json_value *json_member(const struct json_value *object, const char *key);
@@ -0,0 +1,369 @@
+/*
+A pool of sandbox roots that have already been assembled.  Each entry lives
+in REX_POOL_DIR/<hash> where <hash> identifies the set of dirs it was built
+from:
+
+  <hash>/lock  - held shared by every process running in the root
+  <hash>/ready - the dirs the root was built from, exists once the root has
+                 been fully mounted
+  <hash>/root  - the root directory
+
+The lock file is left open across exec so the lock is held for as long as
+the sandboxed program runs.  Building a root takes the lock exclusively and
+eviction only removes entries it can lock exclusively without blocking.  The
+mtime of the lock file records when the entry was last used.
+
+A hit compares the dirs in ready with its own, so two sets of dirs with the
+same hash never share a root, the second one rebuilds it.  An evicted entry
+is renamed to REX_POOL_TOMBSTONE_PREFIX<hash>.<pid> while still locked before
+it is removed, so nobody who opens <hash>/lock afterwards can find a ready
+file that is about to go away.  rex-clean removes the tombstones of evictions
+that did not finish.
+
+A root is reused as it was mounted, nothing checks whether the dirs it was
+built from changed since.  Files changing below a plain bind mount show up
+in the root, but changing the lower dirs of an overlay while it is mounted
+is undefined behaviour for overlayfs, so a pool of roots with an upper dir
+is only safe while the lower dirs stay as they are.
+*/
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <stdint.h>
+
+#include <sys/stat.h>
+#include <sys/file.h>
+
+#include "common.h"
+#include "clean.h"
+#include "rootfs.h"
+#include "pool.h"
+
+struct pool_entry
+{
+  char name[REX_POOL_HASH_LENGTH + 1];
+  struct timespec last_used;
+};
+
+static uint64_t fnv1a(uint64_t hash, const void *data, size_t length)
+{
+  const unsigned char *bytes = data;
+  for (size_t i = 0; i < length; i++) {
+    hash ^= bytes[i];
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+struct pool_key
+{
+  char *data;
+  size_t size;
+};
+
+static void key_append(struct pool_key *key, const void *data, size_t size)
+{
+  memcpy(key->data + key->size, data, size);
+  key->size += size;
+}
+
+// sets key to what identifies the root, the flags and the dirs it is built
+// from, key->data is NULL on error
+static void make_key(struct rootfs *rootfs, unsigned char legacy_mount, struct pool_key *key)
+{
+  size_t size = 2;
+  for (int i = 0; i < rootfs->dir_count; i++) {
+    struct dir *dir = &rootfs->dirs[i];
+    size += strlen(dir->source) + 1;
+    size += dir->target_relative ? strlen(dir->target_relative) + 1 : 1;
+  }
+  key->size = 0;
+  key->data = malloc(size);
+  if (!key->data) {
+    errnof("malloc failed");
+    return;
+  }
+  unsigned char flags[2] = { rootfs->have_upper, legacy_mount };
+  key_append(key, flags, sizeof(flags));
+  for (int i = 0; i < rootfs->dir_count; i++) {
+    struct dir *dir = &rootfs->dirs[i];
+    // include the terminating nulls so "a" "bc" and "ab" "c" differ
+    key_append(key, dir->source, strlen(dir->source) + 1);
+    if (dir->target_relative)
+      key_append(key, dir->target_relative, strlen(dir->target_relative) + 1);
+    else
+      key_append(key, "\1", 1);
+  }
+}
+
+// returns: whether ready_file exists and holds key
+static unsigned char is_ready(const char *ready_file, const struct pool_key *key)
+{
+  int fd = open(ready_file, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return 0;
+  unsigned char match = 0;
+  char *data = malloc(key->size + 1);
+  if (data) {
+    // one more byte than the key so a longer file doesn't match
+    size_t size = 0;
+    ssize_t length;
+    while (size < key->size + 1 && (length = read(fd, data + size, key->size + 1 - size)) > 0)
+      size += length;
+    match = size == key->size && 0 == memcmp(data, key->data, key->size);
+    free(data);
+  }
+  close(fd);
+  return match;
+}
+
+// writes key to ready_file, which appears all at once
+static err_t write_ready(const char *ready_file, const struct pool_key *key)
+{
+  char temp[sizeof(REX_POOL_DIR) + REX_POOL_HASH_LENGTH + 14]; // /<hash>/ready.XXXXXX
+  snprintf(temp, sizeof(temp), "%s.XXXXXX", ready_file);
+  int fd = mkstemp(temp);
+  if (fd == -1) {
+    errnof("mkstemp '%s' failed", temp);
+    return 1;
+  }
+  ssize_t written = write(fd, key->data, key->size);
+  if (written != (ssize_t)key->size || -1 == close(fd)) {
+    errnof("write '%s' failed", temp);
+    if (written != (ssize_t)key->size)
+      close(fd);
+    unlink(temp);
+    return 1;
+  }
+  if (-1 == rename(temp, ready_file)) {
+    errnof("rename '%s' to '%s' failed", temp, ready_file);
+    unlink(temp);
+    return 1;
+  }
+  return 0;
+}
+
+static int mkdir_exist_ok(const char *dir, mode_t mode)
+{
+  if (-1 == mkdir(dir, mode) && errno != EEXIST) {
+    errnof("mkdir '%s' failed", dir);
+    return -1;
+  }
+  return 0;
+}
+
+// returns: an open file descriptor of the entry lock file locked with
+//          lock_op, or -1 on error
+static int lock_entry(const char *lock_file, int lock_op)
+{
+  for (;;) {
+    // not O_CLOEXEC, the lock needs to survive the exec
+    int fd = open(lock_file, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+    if (fd == -1) {
+      errnof("open '%s' failed", lock_file);
+      return -1;
+    }
+    if (-1 == flock(fd, lock_op)) {
+      errnof("flock '%s' failed", lock_file);
+      close(fd);
+      return -1;
+    }
+    // make sure the entry was not evicted while we waited on the lock
+    struct stat fd_stat, file_stat;
+    if (0 == fstat(fd, &fd_stat) && 0 == stat(lock_file, &file_stat) &&
+        fd_stat.st_dev == file_stat.st_dev && fd_stat.st_ino == file_stat.st_ino)
+      return fd;
+    close(fd);
+    // the entry directory may have been removed as well
+    char *slash = strrchr(lock_file, '/');
+    *slash = '\0';
+    int result = mkdir_exist_ok(lock_file, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH);
+    *slash = '/';
+    if (result == -1)
+      return -1;
+  }
+}
+
+static int compare_last_used(const void *a_ptr, const void *b_ptr)
+{
+  const struct pool_entry *a = a_ptr;
+  const struct pool_entry *b = b_ptr;
+  if (a->last_used.tv_sec != b->last_used.tv_sec)
+    return (a->last_used.tv_sec < b->last_used.tv_sec) ? -1 : 1;
+  if (a->last_used.tv_nsec != b->last_used.tv_nsec)
+    return (a->last_used.tv_nsec < b->last_used.tv_nsec) ? -1 : 1;
+  return 0;
+}
+
+// evict the least recently used entries that are not in use until
+// there are at most max_entries left
+static void evict_entries(unsigned max_entries, const char *keep)
+{
+  DIR *dir_handle = opendir(REX_POOL_DIR);
+  if (dir_handle == NULL) {
+    errnof("opendir '%s' failed", REX_POOL_DIR);
+    return;
+  }
+  unsigned count = 0;
+  unsigned capacity = 0;
+  struct pool_entry *entries = NULL;
+  for (;;) {
+    errno = 0;
+    struct dirent *entry = readdir(dir_handle);
+    if (entry == NULL) {
+      if (errno)
+        errnof("readdir '%s' failed", REX_POOL_DIR);
+      break;
+    }
+    if (strlen(entry->d_name) != REX_POOL_HASH_LENGTH || 0 == strcmp(entry->d_name, keep))
+      continue;
+    if (count == capacity) {
+      capacity = capacity ? capacity * 2 : 32;
+      struct pool_entry *new_entries = realloc(entries, capacity * sizeof(*entries));
+      if (!new_entries) {
+        errnof("realloc failed");
+        break;
+      }
+      entries = new_entries;
+    }
+    char lock_file[sizeof(REX_POOL_DIR) + sizeof(entry->d_name) + 6];
+    snprintf(lock_file, sizeof(lock_file), REX_POOL_DIR "/%s/lock", entry->d_name);
+    struct stat lock_stat;
+    if (-1 == stat(lock_file, &lock_stat))
+      continue; // being built or evicted by someone else
+    memcpy(entries[count].name, entry->d_name, REX_POOL_HASH_LENGTH + 1);
+    entries[count].last_used = lock_stat.st_mtim;
+    count++;
+  }
+  closedir(dir_handle);
+
+  // +1 for the entry we are keeping
+  if (count + 1 > max_entries) {
+    qsort(entries, count, sizeof(*entries), compare_last_used);
+    unsigned to_evict = count + 1 - max_entries;
+    for (unsigned i = 0; i < count && to_evict > 0; i++) {
+      char entry_dir[sizeof(REX_POOL_DIR) + REX_POOL_HASH_LENGTH + 1];
+      char lock_file[sizeof(REX_POOL_DIR) + REX_POOL_HASH_LENGTH + 6];
+      sprintf(entry_dir, REX_POOL_DIR "/%s", entries[i].name);
+      sprintf(lock_file, "%s/lock", entry_dir);
+      int fd = open(lock_file, O_RDWR | O_CLOEXEC);
+      if (fd == -1)
+        continue;
+      if (0 == flock(fd, LOCK_EX | LOCK_NB)) {
+        // anyone waiting on the lock finds it unlinked and starts over,
+        // anyone opening it from now on makes a new entry
+        char tombstone[sizeof(REX_POOL_DIR) + sizeof(REX_POOL_TOMBSTONE_PREFIX) + REX_POOL_HASH_LENGTH + 12];
+        snprintf(tombstone, sizeof(tombstone), REX_POOL_DIR "/" REX_POOL_TOMBSTONE_PREFIX "%s.%d",
+                 entries[i].name, (int)getpid());
+        if (-1 == rename(entry_dir, tombstone)) {
+          errnof("rename '%s' to '%s' failed", entry_dir, tombstone);
+        } else {
+          logf("evicting pool entry '%s'", entry_dir);
+          loggy_rmtree(tombstone);
+          to_evict--;
+        }
+      }
+      close(fd);
+    }
+  }
+  free(entries);
+}
+
+static err_t acquire_entry(struct rootfs *rootfs, const struct pool_key *key, unsigned max_entries,
+                           unsigned char legacy_mount)
+{
+  static char entry_dir[sizeof(REX_POOL_DIR) + REX_POOL_HASH_LENGTH + 1];
+  static char root_path[sizeof(entry_dir) + 5];
+  char lock_file[sizeof(entry_dir) + 5];
+  char ready_file[sizeof(entry_dir) + 6];
+
+  uint64_t hash = fnv1a(0xcbf29ce484222325ULL, key->data, key->size);
+  sprintf(entry_dir, REX_POOL_DIR "/%016llx", (unsigned long long)hash);
+  sprintf(root_path, "%s/root", entry_dir);
+  sprintf(lock_file, "%s/lock", entry_dir);
+  sprintf(ready_file, "%s/ready", entry_dir);
+  rootfs->path = root_path;
+  rootfs->path_length = strlen(root_path);
+
+  if (-1 == mkdir_exist_ok(REX_POOL_DIR, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) ||
+      -1 == mkdir_exist_ok(entry_dir, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH))
+    return 1; // error already logged
+
+  int lock_fd = lock_entry(lock_file, LOCK_SH);
+  if (lock_fd == -1)
+    return 1; // error already logged
+
+  if (is_ready(ready_file, key)) {
+    logf("pool hit '%s'", root_path);
+  } else {
+    // the lock is released before it is reacquired exclusively, so someone
+    // else may finish building the root in between
+    close(lock_fd);
+    lock_fd = lock_entry(lock_file, LOCK_EX);
+    if (lock_fd == -1)
+      return 1; // error already logged
+    if (is_ready(ready_file, key)) {
+      logf("pool hit '%s'", root_path);
+    } else {
+      // nobody runs in the root while we hold the lock exclusively, so a root
+      // built from other dirs with the same hash can be replaced as well
+      logf("pool miss '%s'", root_path);
+      if (-1 == unlink(ready_file) && errno != ENOENT) {
+        errnof("unlink '%s' failed", ready_file);
+        close(lock_fd);
+        return 1;
+      }
+      // remove anything left over from a build that failed
+      struct stat root_stat;
+      if (0 == stat(root_path, &root_stat) && loggy_rmtree(root_path)) {
+        close(lock_fd);
+        return 1; // error already logged
+      }
+      if (-1 == loggy_mkdir(root_path, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH)) {
+        close(lock_fd);
+        return 1; // error already logged
+      }
+      err_t result = rootfs_mount(rootfs, legacy_mount);
+      if (result) {
+        close(lock_fd);
+        return result; // error already logged
+      }
+      if (write_ready(ready_file, key)) {
+        close(lock_fd);
+        return 1; // error already logged
+      }
+      evict_entries(max_entries, entry_dir + sizeof(REX_POOL_DIR));
+    }
+    if (-1 == flock(lock_fd, LOCK_SH)) {
+      errnof("flock '%s' failed", lock_file);
+      close(lock_fd);
+      return 1;
+    }
+  }
+
+  // mark the entry as most recently used
+  if (-1 == futimens(lock_fd, NULL))
+    errnof("futimens '%s' failed", lock_file);
+  // lock_fd is intentionally left open
+  return 0;
+}
+
+/*
+Sets rootfs->path to a root from the pool that was assembled from the same
+dirs, building it first if there is not one already.
+returns: 0 on success
+*/
+err_t pool_acquire_root(struct rootfs *rootfs, unsigned max_entries, unsigned char legacy_mount)
+{
+  struct pool_key key;
+  make_key(rootfs, legacy_mount, &key);
+  if (!key.data)
+    return 1; // error already logged
+  err_t result = acquire_entry(rootfs, &key, max_entries, legacy_mount);
+  free(key.data);
+  return result;
+}
@@ -0,0 +1,8 @@
+#define REX_POOL_DIR "/tmp/.rex/pool"
+#define REX_POOL_DEFAULT_SIZE 16
+#define REX_POOL_HASH_LENGTH 16 // the name of an entry, a 64 bit hash in hex
+// an evicted entry is renamed to this followed by <hash>.<pid> before it is
+// removed, see pool.c
+#define REX_POOL_TOMBSTONE_PREFIX ".evicted."
+
+err_t pool_acquire_root(struct rootfs *rootfs, unsigned max_entries, unsigned char legacy_mount);
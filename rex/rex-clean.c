@@ -1,68 +1,520 @@
+/*
+Removes the roots of sandboxes that are no longer running:
+
+  rex-clean [-options]
+
+Every root rex creates in /tmp/.rex has a lock file next to it, <root>.lock,
+that rex locks before it builds the root and leaves open across exec, so the
+lock is held until the sandboxed program and everything it started exit.  A
+program that closes the fds it inherits drops the lock early, so rex also
+writes its pid and start time into the lock file, and a root is stale once
+its lock can be taken and that process is gone.  rex-clean takes the lock
+without blocking and keeps it while it removes the root, so a live sandbox
+is never touched and two sweepers never remove the same root.  Roots without a lock
+file are only removed once they are older than the age threshold.
+
+The pool (/tmp/.rex/pool) keeps its roots on purpose, only what a crashed
+rex left there is removed: entries whose build never finished, once their
+lock can be taken and they are older than the age threshold, and the
+tombstones of evictions whose rex is gone.  The private scratch directory
+is left alone.
+*/
+#define _GNU_SOURCE
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
 #include <dirent.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <signal.h>
 
 #include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include <linux/ioprio.h>
+#include <linux/limits.h>
 
 #include "common.h"
 #include "clean.h"
-/*
-err_t clean_tmp(const char *dir, DIR *dir_handle)
+#include "rootfs.h"
+#include "pool.h"
+
+#define REX_CLEAN_DEFAULT_MIN_AGE 60
+#define REX_CLEAN_MAX_JOBS 16
+
+struct stale_root
+{
+  char path[sizeof(TMP_REX_DIR) + NAME_MAX + 1];
+  int lock_fd; // held exclusively until the root is gone
+};
+
+struct sweep
+{
+  struct stale_root *roots;
+  size_t count;
+  atomic_size_t next;
+  atomic_uint error_count;
+};
+
+static unsigned min_age = REX_CLEAN_DEFAULT_MIN_AGE;
+static unsigned jobs = 0;
+static unsigned interval = 0;
+static unsigned char remove_all = 0;
+
+static const char *get_opt_arg(int argc, const char *argv[], int *arg_index)
+{
+  (*arg_index)++;
+  if (*arg_index >= argc) {
+    errf("option '%s' requires an argument", argv[(*arg_index) - 1]);
+    exit(1);
+  }
+  return argv[*arg_index];
+}
+
+static unsigned parse_unsigned(const char *option, const char *str)
+{
+  char *end;
+  unsigned long value = strtoul(str, &end, 10);
+  if (end == str || *end != '\0') {
+    errf("invalid value '%s' for '%s'", str, option);
+    exit(1);
+  }
+  return value;
+}
+
+// mkdtemp replaces XXXXXX with letters and digits
+static unsigned char is_root_name(const char *name)
+{
+  for (unsigned i = 0; i < 6; i++) {
+    char c = name[i];
+    if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')))
+      return 0;
+  }
+  return name[6] == '\0';
+}
+
+static unsigned char is_old_enough(const struct stat *st, time_t now)
+{
+  return now - st->st_ctim.tv_sec >= (time_t)min_age;
+}
+
+// returns: whether the rex that wrote the lock file fd, or the program it
+//          exec'd, is still running
+static unsigned char is_owner_alive(int fd)
+{
+  char buf[64];
+  ssize_t length = pread(fd, buf, sizeof(buf) - 1, 0);
+  if (length <= 0)
+    return 0; // made by rex-clean, or rex died before writing it
+  buf[length] = '\0';
+  int pid;
+  unsigned long long start_time, current_start_time;
+  int field_count = sscanf(buf, "%d %llu", &pid, &start_time);
+  if (field_count < 1 || pid <= 0)
+    return 0;
+  err_t error = get_start_time(pid, &current_start_time);
+  if (error == ENOENT)
+    return 0;
+  // without a start time, or one we can't read, assume the pid is still ours
+  return error || field_count < 2 || current_start_time == start_time;
+}
+
+// returns: the lock file descriptor locked exclusively if the root is stale,
+//          -1 if it is live, too young or on error
+static int claim_root(int rex_fd, const char *name, time_t now)
+{
+  char lock_name[NAME_MAX + 1];
+  if (snprintf(lock_name, sizeof(lock_name), "%s" REX_ROOT_LOCK_SUFFIX, name) >= (int)sizeof(lock_name))
+    return -1; // not a name rex made
+
+  // read only, the lock belongs to whoever ran rex and flock doesn't need
+  // write access, which we don't have without cap_dac_override
+  int fd = openat(rex_fd, lock_name, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+  if (fd == -1) {
+    if (errno != ENOENT) {
+      errnof("open '%s/%s' failed", TMP_REX_DIR, lock_name);
+      return -1;
+    }
+    // a root from a rex that predates lock files, or one whose rex has not
+    // created its lock yet, only the age tells them apart
+    struct stat root_stat;
+    if (-1 == fstatat(rex_fd, name, &root_stat, AT_SYMLINK_NOFOLLOW) || !is_old_enough(&root_stat, now))
+      return -1;
+    // rex creates its lock with O_EXCL as well, so only one of us wins
+    fd = openat(rex_fd, lock_name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    if (fd == -1) {
+      if (errno != EEXIST)
+        errnof("create '%s/%s' failed", TMP_REX_DIR, lock_name);
+      return -1;
+    }
+    if (-1 == flock(fd, LOCK_EX | LOCK_NB)) {
+      close(fd);
+      return -1;
+    }
+    return fd;
+  }
+
+  if (-1 == flock(fd, LOCK_EX | LOCK_NB)) {
+    if (errno != EWOULDBLOCK)
+      errnof("flock '%s/%s' failed", TMP_REX_DIR, lock_name);
+    else
+      logf("[DEBUG] '%s/%s' is in use", TMP_REX_DIR, name);
+    close(fd);
+    return -1;
+  }
+  // another sweeper may have removed the root and unlinked this lock file
+  // between our open and flock
+  struct stat fd_stat, file_stat;
+  if (-1 == fstat(fd, &fd_stat) ||
+      -1 == fstatat(rex_fd, lock_name, &file_stat, AT_SYMLINK_NOFOLLOW) ||
+      fd_stat.st_dev != file_stat.st_dev || fd_stat.st_ino != file_stat.st_ino ||
+      !is_old_enough(&fd_stat, now)) {
+    close(fd);
+    return -1;
+  }
+  if (is_owner_alive(fd)) {
+    logf("[DEBUG] '%s/%s' is in use, its lock was closed", TMP_REX_DIR, name);
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static void release_root(int rex_fd, struct stale_root *root)
 {
-  err_t result = 0;
-  size_t dir_length = strlen(dir);
+  const char *name = strrchr(root->path, '/') + 1;
+  char lock_name[NAME_MAX + 1];
+  snprintf(lock_name, sizeof(lock_name), "%s" REX_ROOT_LOCK_SUFFIX, name);
+  // unlink while still holding the lock so nobody can claim a lock file
+  // whose root is already gone
+  if (-1 == unlinkat(rex_fd, lock_name, 0) && errno != ENOENT)
+    errnof("unlink '%s/%s' failed", TMP_REX_DIR, lock_name);
+  close(root->lock_fd);
+}
 
+static void *sweep_thread(void *arg)
+{
+  struct sweep *sweep = arg;
+  for (;;) {
+    size_t index = atomic_fetch_add(&sweep->next, 1);
+    if (index >= sweep->count)
+      return NULL;
+    // the roots are already spread over the threads, one thread per root
+    unsigned error_count = loggy_rmtree_threads(sweep->roots[index].path, 1);
+    if (error_count) {
+      atomic_fetch_add(&sweep->error_count, error_count);
+      // keep the lock file so the next sweep tries again
+      close(sweep->roots[index].lock_fd);
+      sweep->roots[index].lock_fd = -1;
+    }
+  }
+}
+
+// removes lock files that are left over from roots that are already gone
+static void remove_orphan_lock(int rex_fd, const char *lock_name, time_t now)
+{
+  size_t name_length = strlen(lock_name) - strlen(REX_ROOT_LOCK_SUFFIX);
+  char name[NAME_MAX + 1];
+  memcpy(name, lock_name, name_length);
+  name[name_length] = '\0';
+  if (!is_root_name(name))
+    return;
+  struct stat root_stat;
+  if (0 == fstatat(rex_fd, name, &root_stat, AT_SYMLINK_NOFOLLOW) || errno != ENOENT)
+    return;
+  int fd = openat(rex_fd, lock_name, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+  if (fd == -1)
+    return;
+  struct stat lock_stat;
+  // the root is created before its lock, but give a young lock the benefit of
+  // the doubt anyway
+  if (0 == flock(fd, LOCK_EX | LOCK_NB) && 0 == fstat(fd, &lock_stat) && is_old_enough(&lock_stat, now) &&
+      !is_owner_alive(fd)) {
+    logf("[DEBUG] remove orphan lock '%s/%s'", TMP_REX_DIR, lock_name);
+    unlinkat(rex_fd, lock_name, 0);
+  }
+  close(fd);
+}
+
+static unsigned char is_pool_entry_name(const char *name)
+{
+  for (unsigned i = 0; i < REX_POOL_HASH_LENGTH; i++) {
+    char c = name[i];
+    if (!((c >= '0' && c <= '9') || (c >= 'a' && c <= 'f')))
+      return 0;
+  }
+  return name[REX_POOL_HASH_LENGTH] == '\0';
+}
+
+// returns: whether the rex that renamed an evicted entry to name is gone
+static unsigned char is_abandoned_tombstone(const char *name)
+{
+  const char *dot = strrchr(name, '.');
+  char *end;
+  long pid = strtol(dot + 1, &end, 10);
+  if (end == dot + 1 || *end != '\0' || pid <= 0)
+    return 0;
+  return -1 == kill(pid, 0) && errno == ESRCH;
+}
+
+// returns: 0 if the pool entry name was built, is in use, is too young or was
+//          removed, otherwise the number of errors removing it
+static unsigned sweep_pool_entry(int pool_fd, const char *name, time_t now)
+{
+  char lock_name[REX_POOL_HASH_LENGTH + 6];
+  char ready_name[REX_POOL_HASH_LENGTH + 7];
+  snprintf(lock_name, sizeof(lock_name), "%.*s/lock", REX_POOL_HASH_LENGTH, name);
+  snprintf(ready_name, sizeof(ready_name), "%.*s/ready", REX_POOL_HASH_LENGTH, name);
+
+  int fd = openat(pool_fd, lock_name, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+  if (fd == -1) {
+    if (errno != ENOENT)
+      return 0;
+    // rex crashed between making the entry and its lock, rex opens the lock
+    // without O_EXCL so whoever creates it first owns it
+    struct stat entry_stat;
+    if (-1 == fstatat(pool_fd, name, &entry_stat, AT_SYMLINK_NOFOLLOW) || !is_old_enough(&entry_stat, now))
+      return 0;
+    fd = openat(pool_fd, lock_name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    if (fd == -1)
+      return 0;
+  }
+  struct stat fd_stat, file_stat;
+  if (-1 == flock(fd, LOCK_EX | LOCK_NB) ||
+      -1 == fstat(fd, &fd_stat) ||
+      -1 == fstatat(pool_fd, lock_name, &file_stat, AT_SYMLINK_NOFOLLOW) ||
+      fd_stat.st_dev != file_stat.st_dev || fd_stat.st_ino != file_stat.st_ino ||
+      0 == faccessat(pool_fd, ready_name, F_OK, AT_SYMLINK_NOFOLLOW) ||
+      !is_old_enough(&fd_stat, now)) {
+    close(fd);
+    return 0;
+  }
+  // evict it the way rex does, renamed while locked so a rex waiting on the
+  // lock starts over with a new entry
+  char tombstone[sizeof(REX_POOL_TOMBSTONE_PREFIX) + REX_POOL_HASH_LENGTH + 12];
+  snprintf(tombstone, sizeof(tombstone), REX_POOL_TOMBSTONE_PREFIX "%.*s.%d",
+           REX_POOL_HASH_LENGTH, name, (int)getpid());
+  unsigned error_count = 0;
+  if (-1 == renameat(pool_fd, name, pool_fd, tombstone)) {
+    errnof("rename '%s/%s' failed", REX_POOL_DIR, name);
+    error_count = 1;
+  } else {
+    char path[sizeof(REX_POOL_DIR) + sizeof(tombstone)];
+    snprintf(path, sizeof(path), "%s/%s", REX_POOL_DIR, tombstone);
+    logf("[DEBUG] remove unfinished pool entry '%s/%s'", REX_POOL_DIR, name);
+    error_count = loggy_rmtree(path);
+  }
+  close(fd);
+  return error_count;
+}
+
+// returns: the number of entries it failed to remove
+static unsigned sweep_pool(time_t now)
+{
+  int pool_fd = open(REX_POOL_DIR, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (pool_fd == -1) {
+    if (errno == ENOENT)
+      return 0;
+    errnof("open '%s' failed", REX_POOL_DIR);
+    return 1;
+  }
+  DIR *dir_handle = fdopendir(dup(pool_fd));
+  if (!dir_handle) {
+    errnof("opendir '%s' failed", REX_POOL_DIR);
+    close(pool_fd);
+    return 1;
+  }
+  unsigned error_count = 0;
   for (;;) {
     errno = 0;
     struct dirent *entry = readdir(dir_handle);
     if (entry == NULL) {
       if (errno) {
-        result = 1;
-        errnof("readdir '%s' failed", dir);
+        errnof("readdir '%s' failed", REX_POOL_DIR);
+        error_count++;
       }
       break;
     }
-    if (0 == strncmp(entry->d_name, "rex.", 4)) {
-      printf("%s\n", entry->d_name);
-      size_t entry_name_length = dir_length + 1 + strlen(entry->d_name);
-      char *entry_name = malloc(entry_name_length + 1);
-      if (!entry_name) {
-        errnof("malloc failed");
-        continue;
+    if (0 == strncmp(entry->d_name, REX_POOL_TOMBSTONE_PREFIX, strlen(REX_POOL_TOMBSTONE_PREFIX))) {
+      if (is_abandoned_tombstone(entry->d_name)) {
+        char path[sizeof(REX_POOL_DIR) + NAME_MAX + 1];
+        snprintf(path, sizeof(path), "%s/%s", REX_POOL_DIR, entry->d_name);
+        logf("[DEBUG] remove abandoned pool tombstone '%s'", path);
+        error_count += loggy_rmtree(path);
       }
-      memcpy(entry_name, dir, dir_length);
-      entry_name[dir_length] = '/';
-      strcpy(entry_name + dir_length + 1, entry->d_name);
-      result |= loggy_rmtree(entry_name);
-      free(entry_name);
+    } else if (is_pool_entry_name(entry->d_name)) {
+      error_count += sweep_pool_entry(pool_fd, entry->d_name, now);
     }
   }
-  return result;
+  closedir(dir_handle);
+  close(pool_fd);
+  return error_count;
 }
-*/
-int main(int argc, char *argv[])
+
+// returns: the number of entries it failed to remove
+static unsigned sweep_once()
 {
-  const char *dir = "/tmp/.rex";
-  struct stat dir_stat;
-  if (-1 == stat(dir, &dir_stat)) {
-    if (errno == ENOENT) {
+  int rex_fd = open(TMP_REX_DIR, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (rex_fd == -1) {
+    if (errno == ENOENT)
       return 0;
-    }
-    errnof("stat '%s' failed", dir);
+    errnof("open '%s' failed", TMP_REX_DIR);
     return 1;
   }
-  return loggy_rmtree(dir);
-  /*
-  const char *dir = "/tmp";
-  DIR *dir_handle = opendir(dir);
-  if (dir_handle == NULL) {
-    errnof("opendir '%s' failed", dir);
+  DIR *dir_handle = fdopendir(dup(rex_fd));
+  if (!dir_handle) {
+    errnof("opendir '%s' failed", TMP_REX_DIR);
+    close(rex_fd);
     return 1;
   }
-  err_t result = clean_tmp(dir, dir_handle);
+
+  time_t now = time(NULL);
+  struct sweep sweep = { .roots = NULL, .count = 0 };
+  size_t capacity = 0;
+  unsigned error_count = 0;
+  for (;;) {
+    errno = 0;
+    struct dirent *entry = readdir(dir_handle);
+    if (entry == NULL) {
+      if (errno) {
+        errnof("readdir '%s' failed", TMP_REX_DIR);
+        error_count++;
+      }
+      break;
+    }
+    size_t name_length = strlen(entry->d_name);
+    size_t suffix_length = strlen(REX_ROOT_LOCK_SUFFIX);
+    if (name_length > suffix_length &&
+        0 == strcmp(entry->d_name + name_length - suffix_length, REX_ROOT_LOCK_SUFFIX)) {
+      remove_orphan_lock(rex_fd, entry->d_name, now);
+      continue;
+    }
+    if ((entry->d_type != DT_DIR && entry->d_type != DT_UNKNOWN) || !is_root_name(entry->d_name))
+      continue;
+    int lock_fd = claim_root(rex_fd, entry->d_name, now);
+    if (lock_fd == -1)
+      continue;
+    if (sweep.count == capacity) {
+      capacity = capacity ? capacity * 2 : 16;
+      struct stale_root *new_roots = realloc(sweep.roots, capacity * sizeof(struct stale_root));
+      if (!new_roots) {
+        errnof("malloc failed");
+        close(lock_fd);
+        break;
+      }
+      sweep.roots = new_roots;
+    }
+    struct stale_root *root = &sweep.roots[sweep.count++];
+    snprintf(root->path, sizeof(root->path), "%s/%s", TMP_REX_DIR, entry->d_name);
+    root->lock_fd = lock_fd;
+  }
   closedir(dir_handle);
-  return result;
-  */
+
+  if (sweep.count > 0) {
+    atomic_init(&sweep.next, 0);
+    atomic_init(&sweep.error_count, 0);
+    unsigned thread_count = jobs;
+    if (thread_count == 0) {
+      long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+      thread_count = (cpus > 0) ? cpus : 1;
+    }
+    if (thread_count > REX_CLEAN_MAX_JOBS)
+      thread_count = REX_CLEAN_MAX_JOBS;
+    if (thread_count > sweep.count)
+      thread_count = sweep.count;
+
+    pthread_t threads[REX_CLEAN_MAX_JOBS];
+    unsigned started = 1;
+    for (; started < thread_count; started++) {
+      int result = pthread_create(&threads[started], NULL, sweep_thread, &sweep);
+      if (result) {
+        errno = result;
+        errnof("pthread_create failed");
+        break;
+      }
+    }
+    sweep_thread(&sweep);
+    for (unsigned i = 1; i < started; i++)
+      pthread_join(threads[i], NULL);
+
+    for (size_t i = 0; i < sweep.count; i++) {
+      if (sweep.roots[i].lock_fd != -1)
+        release_root(rex_fd, &sweep.roots[i]);
+    }
+    error_count += atomic_load(&sweep.error_count);
+  }
+  free(sweep.roots);
+  close(rex_fd);
+  error_count += sweep_pool(now);
+  return error_count;
+}
+
+// a sweeper on a busy build host should only use what nobody else wants
+static void lower_priority()
+{
+  if (-1 == setpriority(PRIO_PROCESS, 0, 19))
+    errnof("setpriority failed");
+  if (-1 == syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 0)))
+    errnof("ioprio_set failed");
+}
+
+void usage()
+{
+  printf("Usage: rex-clean [-options]\n");
+  printf("Options:\n");
+  printf("  --min-age|-a <secs>  Only remove roots at least this old (default %u)\n", REX_CLEAN_DEFAULT_MIN_AGE);
+  printf("  --jobs|-j <n>        Roots to remove in parallel (default nproc)\n");
+  printf("  --loop|-l <secs>     Sweep every <secs> seconds at idle priority\n");
+  printf("  --all                Remove all of %s, even roots that are in use\n", TMP_REX_DIR);
+}
+
+int main(int argc, const char *argv[])
+{
+  for (int arg_index = 1; arg_index < argc; arg_index++) {
+    const char *arg = argv[arg_index];
+    if (0 == strcmp(arg, "-a") || 0 == strcmp(arg, "--min-age")) {
+      min_age = parse_unsigned(arg, get_opt_arg(argc, argv, &arg_index));
+    } else if (0 == strcmp(arg, "-j") || 0 == strcmp(arg, "--jobs")) {
+      jobs = parse_unsigned(arg, get_opt_arg(argc, argv, &arg_index));
+    } else if (0 == strcmp(arg, "-l") || 0 == strcmp(arg, "--loop")) {
+      interval = parse_unsigned(arg, get_opt_arg(argc, argv, &arg_index));
+      if (interval == 0) {
+        errf("the loop interval must be at least one second");
+        return 1;
+      }
+    } else if (0 == strcmp(arg, "--all")) {
+      remove_all = 1;
+    } else {
+      usage();
+      return 1;
+    }
+  }
+
+  if (remove_all) {
+    struct stat dir_stat;
+    if (-1 == stat(TMP_REX_DIR, &dir_stat)) {
+      if (errno == ENOENT) {
+        return 0;
+      }
+      errnof("stat '%s' failed", TMP_REX_DIR);
+      return 1;
+    }
+    return loggy_rmtree(TMP_REX_DIR);
+  }
+
+  if (interval == 0)
+    return sweep_once() ? 1 : 0;
+
+  lower_priority();
+  for (;;) {
+    sweep_once();
+    fflush(stdout);
+    sleep(interval);
+  }
 }
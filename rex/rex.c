@@ -3,20 +3,31 @@
 #include <string.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <fcntl.h>
 
 #include <sys/stat.h>
 #include <sys/mount.h>
+#include <sys/file.h>
 
 #include <linux/limits.h>
 
 #include "common.h"
 #include "clean.h"
+#include "rootfs.h"
+#include "pool.h"
+#include "timings.h"
+#include "info.h"
 
 static const char *root; // the root directory we will chroot to
 static size_t root_length;
 static const char *user_cd_option = NULL;
 static int forward_argc = 0;
 static const char **forward_argv;
+static unsigned char legacy_mount = 0;
+static unsigned char use_pool = 0;
+static unsigned char use_private = 0;
+static unsigned pool_size = REX_POOL_DEFAULT_SIZE;
+static int timings_fd = -1;
 
 const char *get_opt_arg(int argc, const char *argv[], int *arg_index)
 {
@@ -28,21 +39,6 @@ const char *get_opt_arg(int argc, const char *argv[], int *arg_index)
   return argv[*arg_index];
 }
 
-unsigned get_dir_length(const char *file)
-{
-  const char * s = strrchr(file, '/');
-  if (s == NULL) {
-    return 0;
-  }
-  return s - file;
-}
-
-char *realpath2(const char *path)
-{
-  char temp[PATH_MAX];
-  char *result = realpath(path, temp);
-  return result ? strdup(result) : NULL;
-}
 char *malloc_getcwd()
 {
   char temp[PATH_MAX];
@@ -54,41 +50,6 @@ char *malloc_getcwd()
   return strdup(result);
 }
 
-static int loggy_mkdir(const char *dir, mode_t mode)
-{
-  logf("mkdir -m %o %s", mode, dir);
-  if (-1 == mkdir(dir, mode)) {
-    errnof("mkdir '%s' failed", dir);
-    return -1;
-  }
-  return 0;
-}
-
-static int loggy_mount(const char *source, const char *target,
-                const char *filesystemtype, const char *options)
-{
-  logf("mount%s%s%s%s %s %s",
-       filesystemtype ? " -t " : "",
-       filesystemtype ? filesystemtype : "",
-       options ? " -o " : "", options ? options : "",
-       source, target);
-  if (-1 == mount(source, target, filesystemtype, 0, options)) {
-    errnof("mount failed");
-    return -1; // fail
-  }
-  return 0; // success
-}
-
-static int loggy_bind_mount(const char *source, const char *target)
-{
-  logf("mount --bind %s %s", source, target);
-  if (-1 == mount(source, target, NULL, MS_BIND, NULL)) {
-    errnof("bind mount failed");
-    return -1; // fail
-  }
-  return 0; // success
-}
-
 char *make_work_dir(const char *upper)
 {
   int upperlen = strlen(upper);
@@ -100,189 +61,22 @@ char *make_work_dir(const char *upper)
   return mkdtemp(template);
 }
 
-// returns: 0 on success
-err_t mkdirs_helper(char *dir, size_t length)
-{
-  if (dir[length] != '\0') {
-    errf("code bug: mkdirs was called with a string that did not end in null");
-    return 1;
-  }
-  //logf("[DEBUG] mkdirs '%s'", dir);
-  {
-    struct stat dir_stat;
-    if (0 == stat(dir, &dir_stat)) {
-      if (S_ISDIR(dir_stat.st_mode)) {
-        return 0; // success
-      }
-      errf("'%s' exists but is not a directory", dir);
-      return 1;
-    }
-  }
-  {
-    unsigned parent_dir_length = get_dir_length(dir);
-    if (parent_dir_length == length) {
-      errf("failed to create directory '%s'", dir);
-      return 1;
-    }
-    dir[parent_dir_length] = '\0';
-    int result = mkdirs_helper(dir, parent_dir_length);
-    dir[parent_dir_length] = '/';
-    if (result)
-      return result;
-  }
-  if (-1 == loggy_mkdir(dir, S_IRUSR | S_IWUSR | S_IXUSR | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH)) {
-    // error already logged
-    return current_error;
-  }
-  return 0; // success
-}
-err_t mkdirs(char *dir)
-{
-  return mkdirs_helper(dir, strlen(dir));
-}
-
-struct dir
-{
-  const char *arg;
-  const char *source;
-  const char *target_relative;
-  char *private_target_absolute;
-};
-
-char *dir_get_absolute_target(struct dir *dir)
-{
-  if (!dir->private_target_absolute) {
-    if (dir->target_relative == NULL) {
-      size_t dir_length = strlen(dir->source);
-      size_t total_length = root_length + dir_length;
-      dir->private_target_absolute = malloc(root_length + dir_length + 1);
-      if (dir->private_target_absolute == NULL) {
-        errnof("malloc failed");
-        return NULL;
-      }
-      memcpy(dir->private_target_absolute +           0, root, root_length);
-      memcpy(dir->private_target_absolute + root_length, dir->source, dir_length);
-      dir->private_target_absolute[total_length] = '\0';
-    } else {
-      errf("non-empty target not implemented");
-      return NULL;
-    }
-  }
-  return dir->private_target_absolute;
-}
-
-static unsigned char is_root_mount(struct dir *dir)
-{
-  return dir->target_relative != NULL && dir->target_relative[0] == '\0';
-}
-
 static err_t doit2(unsigned char have_upper, struct dir *dirs, int dir_count)
 {
-  unsigned non_root_mounts = 0;
-
-  // make the mount point directories
-  for (int i = 0; i < dir_count; i++) {
-    struct dir *dir = &dirs[i];
-    if (is_root_mount(dir))
-      continue;
-
-    non_root_mounts++;
-    char *target_dir = dir_get_absolute_target(dir);
-    if (target_dir == NULL) {
-      // error already printed
-      return 1;
-    }
-    {
-      err_t result = mkdirs(target_dir);
-      if (result)
-        return result;
-    }
-  }
-
-  // create the root mount overlay (do this before
-  // mounting anything inside this directory)
-  if (non_root_mounts < dir_count)
-  {
-    size_t lower_dirs_size = 0;
-    for (int i = 0; i < dir_count; i++) {
-      // TODO: handle upper dir properly
-      struct dir *dir = &dirs[i];
-      if (!is_root_mount(dir))
-        continue;
-      lower_dirs_size += 1 + strlen(dir->source);
-    }
-
-    // lowerdir=<lower_dirs>
-    // TODO: support upperdir
-    const int LOWERDIR_PREFIX_SIZE = 9;
-    size_t options_size = LOWERDIR_PREFIX_SIZE + root_length + lower_dirs_size;
-    char *options = malloc(options_size + 1);
-    if (!options) {
-      errnof("malloc failed");
-      return 1;
-    }
-    // TODO: do not add the rootfs as a lowerdir if there are no non-root mounts
-    size_t offset = 0;
-    memcpy(options + offset, "lowerdir=", LOWERDIR_PREFIX_SIZE);
-    offset += LOWERDIR_PREFIX_SIZE;
-    memcpy(options + offset, root, root_length);
-    offset += root_length;
-
-    for (int i = 0; i < dir_count; i++) {
-      // TODO: handle upper dir properly
-      struct dir *dir = &dirs[i];
-      if (!is_root_mount(dir))
-        continue;
-      options[offset++] = ':';
-      size_t len = strlen(dir->source);
-      memcpy(options + offset, dir->source, len);
-      offset += len;
-    }
-    if (offset != options_size) {
-      errf("code bug: options_size %lu != offset %lu", options_size, offset);
-      return 1;
-    }
-    options[offset] = '\0';
-    logf("options = '%s'", options);
-
-    if (-1 == loggy_mount("none", root, "overlay", options)) {
-      // error already logged
-      return 1;
-    }
-    free(options);
-  }
-
-  // now mount the non-root mounts
-  for (int i = 0; i < dir_count; i++) {
-    struct dir *dir = &dirs[i];
-    if (is_root_mount(dir))
-      continue;
-
-    char *target_dir = dir_get_absolute_target(dir);
-    if (target_dir == NULL) {
-      // error already printed
-      return 1;
-    }
-    if (-1 == loggy_bind_mount(dir->source, target_dir)) {
-      // error already printed
-      return 1; // fail
-    }
-
-    // remount it as readonly
-    // see https://lwn.net/Articles/281157/
-    // it looks like if you want bind mounts to be readonly, you need to mount
-    // them as writeable first, and then remount them as readonly
-    // mount -o remount,ro <mount_point>
-    /* NOT WORKING
-       if (!have_upper || i > 0) {
-       if (-1 == loggy_mount(NULL, target_dir, NULL, "remount,ro")) {
-       // error already logged
-       free(target_dir);
-       return 1; // fail
-        }
-        }
-    */
-  }
+  struct rootfs rootfs = {
+    .path = root,
+    .path_length = root_length,
+    .have_upper = have_upper,
+    .dirs = dirs,
+    .dir_count = dir_count,
+  };
+  err_t result = use_pool ?
+    pool_acquire_root(&rootfs, pool_size, legacy_mount) :
+    rootfs_mount(&rootfs, legacy_mount);
+  if (result)
+    return result; // error already logged
+  root = rootfs.path;
+  root_length = rootfs.path_length;
 
   char *original_cwd = malloc_getcwd();
   if (original_cwd == NULL) {
@@ -296,23 +90,34 @@ static err_t doit2(unsigned char have_upper, struct dir *dirs, int dir_count)
   } else {
     cd_abs_postfix = user_cd_option;
   }
-  char *cd_full = malloc(root_length + strlen(cd_abs_postfix) + 1);
-  if (cd_full == NULL) {
-    errnof("malloc failed");
-    return 1;
-  }
-  memcpy(cd_full, root, root_length);
-  strcpy(cd_full + root_length, cd_abs_postfix);
-  logf("cd '%s'", cd_full);
-  if (-1 == chdir(cd_full)) {
-    errnof("chdir '%s' failed", cd_full);
-    return 1;
-  }
+  unsigned long long start = timings_now();
+  if (use_private) {
+    if (rootfs_pivot_root(root, cd_abs_postfix))
+      return 1; // error already logged
+  } else {
+    char *cd_full = malloc(root_length + strlen(cd_abs_postfix) + 1);
+    if (cd_full == NULL) {
+      errnof("malloc failed");
+      return 1;
+    }
+    memcpy(cd_full, root, root_length);
+    strcpy(cd_full + root_length, cd_abs_postfix);
+    logf("cd '%s'", cd_full);
+    if (-1 == chdir(cd_full)) {
+      errnof("chdir '%s' failed", cd_full);
+      return 1;
+    }
 
-  logf("chroot '%s'", root);
-  if (-1 == chroot(root)) {
-    errnof("chroot '%s' failed", root);
-    return 1;
+    logf("chroot '%s'", root);
+    if (-1 == chroot(root)) {
+      errnof("chroot '%s' failed", root);
+      return 1;
+    }
+  }
+  timings_add(REX_PHASE_CHROOT, start);
+  if (timings_fd != -1) {
+    timings_report(timings_fd, root);
+    close(timings_fd);
   }
 
   // at this point we CANNOT cleanup directories
@@ -325,9 +130,6 @@ static err_t doit2(unsigned char have_upper, struct dir *dirs, int dir_count)
 
 err_t doit(unsigned char have_upper, struct dir *dirs, int dir_count)
 {
-  // mount a new tmpfs? If I do, then I'll need to add the unmount
-  // to the cleanup
-
   char *workdir = NULL;
   if (have_upper) {
     // create a work directory
@@ -346,15 +148,48 @@ err_t doit(unsigned char have_upper, struct dir *dirs, int dir_count)
   return result;
 }
 
+// returns: the fd of the lock file of root, locked exclusively and left open
+//          across exec, or -1 on error
+static int lock_root(const char *lock_file)
+{
+  // O_EXCL because rex-clean claims roots without a lock file the same way
+  int fd = open(lock_file, O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+  if (fd == -1) {
+    errnof("create '%s' failed", lock_file);
+    return -1;
+  }
+  if (-1 == flock(fd, LOCK_EX | LOCK_NB)) {
+    errnof("flock '%s' failed", lock_file);
+    close(fd);
+    unlink(lock_file);
+    return -1;
+  }
+  // the lock alone is dropped by programs that close the fds they inherit,
+  // so rex-clean also checks that this process is gone, the start time tells
+  // it apart from a later process with the same pid
+  unsigned long long start_time;
+  if (0 == get_start_time(getpid(), &start_time))
+    dprintf(fd, "%d %llu\n", getpid(), start_time);
+  else
+    dprintf(fd, "%d\n", getpid());
+  return fd;
+}
+
 void usage()
 {
   printf("Usage: rex [-options] <dirs>... -- <program> <args>...\n");
+  printf("       rex -info <program> <args>...\n");
   printf("Options:\n");
   printf("  --cd|-c <dir>       The directory to change to (defaults to CWD)\n");
   // TODO: remove the "--upper" option
   //       intead, make a way to make a writeable directory
   //       i.e. rex -w .
   printf("  --upper|-u <dir>    The upper directory\n");
+  printf("  --legacy-mount      Build the root with mount(2) instead of the new mount api\n");
+  printf("  --private|-p        Build the root on a tmpfs in a private mount namespace\n");
+  printf("  --pool              Reuse a root already built from the same dirs\n");
+  printf("  --pool-size <n>     The number of roots to keep in the pool (default %d)\n", REX_POOL_DEFAULT_SIZE);
+  printf("  --timings-fd <fd>   Write how long each phase took to fd before exec\n");
   // remap
   // <dir>:<target_dir>
   // so a sysroot
@@ -367,6 +202,10 @@ err_t main(int argc, const char *argv[])
   argc--;
   argv++;
 
+  // everything after -info is the program's command line, not ours
+  if (argc > 0 && (0 == strcmp(argv[0], "-info") || 0 == strcmp(argv[0], "--info")))
+    return info_main(argc - 1, argv + 1);
+
   const char *upper = NULL;
   {
     int old_argc = argc;
@@ -380,6 +219,28 @@ err_t main(int argc, const char *argv[])
         user_cd_option = get_opt_arg(old_argc, argv, &arg_index);
       } else if (0 == strcmp(arg, "-u") || 0 == strcmp(arg, "--upper")) {
         upper = get_opt_arg(old_argc, argv, &arg_index);
+      } else if (0 == strcmp(arg, "--legacy-mount")) {
+        legacy_mount = 1;
+      } else if (0 == strcmp(arg, "-p") || 0 == strcmp(arg, "--private")) {
+        use_private = 1;
+      } else if (0 == strcmp(arg, "--pool")) {
+        use_pool = 1;
+      } else if (0 == strcmp(arg, "--pool-size")) {
+        const char *size_str = get_opt_arg(old_argc, argv, &arg_index);
+        char *end;
+        pool_size = strtoul(size_str, &end, 10);
+        if (end == size_str || *end != '\0' || pool_size == 0) {
+          errf("invalid pool size '%s'", size_str);
+          return 1;
+        }
+      } else if (0 == strcmp(arg, "--timings-fd")) {
+        const char *fd_str = get_opt_arg(old_argc, argv, &arg_index);
+        char *end;
+        timings_fd = strtol(fd_str, &end, 10);
+        if (end == fd_str || *end != '\0' || timings_fd < 0) {
+          errf("invalid timings fd '%s'", fd_str);
+          return 1;
+        }
       } else if (0 == strcmp(arg, "--")) {
         forward_argc = old_argc - arg_index - 1;
         forward_argv = &argv[arg_index + 1];
@@ -398,6 +259,10 @@ err_t main(int argc, const char *argv[])
     usage();
     return 1;
   }
+  if (use_private && use_pool) {
+    errf("--private and --pool cannot be used together");
+    return 1;
+  }
 
   int dir_count = argc + (upper ? 1 : 0);
   struct dir *dirs = (struct dir*)malloc(sizeof(struct dir) * dir_count);
@@ -413,31 +278,13 @@ err_t main(int argc, const char *argv[])
     else
       dir->arg = argv[dir_index];
 
-    const char *colon_str = strchr(dir->arg, ':');
-    const char *arg_source;
-    if (colon_str) {
-      arg_source = strndup(dir->arg, colon_str - dir->arg);
-      dir->target_relative = colon_str + 1;
-    } else {
-      arg_source = dir->arg;
-      dir->target_relative = NULL;
-    }
-    struct stat path_stat;
-    if (-1 == stat(arg_source, &path_stat)) {
-      errnof("'%s'", arg_source);
-      return current_error;
-    }
-    dir->source = realpath2(arg_source);
-    if (dir->source == NULL) {
-      errnof("realpath('%s') failed", arg_source);
-      return current_error;
-    }
-    logf("source '%s' target '%s'", dir->source, dir->target_relative);
+    err_t result = dir_init(dir);
+    if (result)
+      return result; // error already logged
   }
 
   // if we have any sub-directories to mount, we can create a tmpfs, make the subdirectories
   // and then remount the tmpfs as readonly before mounting the final overlay
-  #define TMP_REX_DIR "/tmp/.rex"
   if (-1 == loggy_mkdir(TMP_REX_DIR, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH)) {
     if (errno != EEXIST) {
       // errlr already logged
@@ -445,6 +292,23 @@ err_t main(int argc, const char *argv[])
     }
   }
 
+  if (use_pool) {
+    // the root belongs to the pool, it is never removed here
+    return doit(upper != NULL, dirs, dir_count);
+  }
+  if (use_private) {
+    // the root is on a tmpfs that only exists in our mount namespace, so
+    // there is nothing to clean up
+    if (-1 == loggy_mkdir(REX_SCRATCH_DIR, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH) &&
+        errno != EEXIST)
+      return current_error; // error already logged
+    if (rootfs_enter_private_scratch(REX_SCRATCH_DIR))
+      return 1; // error already logged
+    root = REX_SCRATCH_DIR;
+    root_length = strlen(root);
+    return doit(upper != NULL, dirs, dir_count);
+  }
+
   // for now we're just going to construct the new rootfs in /tmp
   char tmp_name[] = TMP_REX_DIR "/XXXXXX";
   root = mkdtemp(tmp_name);
@@ -455,7 +319,19 @@ err_t main(int argc, const char *argv[])
   logf("root is '%s'", root);
   root_length = strlen(root);
 
+  char lock_file[sizeof(tmp_name) + sizeof(REX_ROOT_LOCK_SUFFIX) - 1];
+  strcpy(lock_file, root);
+  strcat(lock_file, REX_ROOT_LOCK_SUFFIX);
+  int lock_fd = lock_root(lock_file);
+  if (lock_fd == -1) {
+    loggy_rmtree(root);
+    return 1;
+  }
+
   int result = doit(upper != NULL, dirs, dir_count);
-  loggy_rmtree(root);
+  // on failure the lock file stays so rex-clean knows the root is stale
+  if (0 == loggy_rmtree(root))
+    unlink(lock_file);
+  close(lock_fd);
   return result;
 }
@@ -0,0 +1,182 @@
+/*
+A small client for rexd, runs a program in a sandbox the same way rex does:
+
+  rexd-client [-options] <dirs>... -- <program> <args>...
+
+and exits with the exit code of the program.
+*/
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <signal.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <poll.h>
+
+#include <linux/limits.h>
+
+#include "common.h"
+#include "rexd.h"
+
+static const char *get_opt_arg(int argc, const char *argv[], int *arg_index)
+{
+  (*arg_index)++;
+  if (*arg_index >= argc) {
+    errf("option '%s' requires an argument", argv[(*arg_index) - 1]);
+    exit(1);
+  }
+  return argv[*arg_index];
+}
+
+static size_t append_string(char *buf, size_t offset, const char *str)
+{
+  size_t length = strlen(str) + 1;
+  if (offset + length > REXD_MAX_REQUEST)
+    return REXD_MAX_REQUEST + 1;
+  memcpy(buf + offset, str, length);
+  return offset + length;
+}
+
+void usage()
+{
+  printf("Usage: rexd-client [-options] <dirs>... -- <program> <args>...\n");
+  printf("Options:\n");
+  printf("  --socket|-s <path>  The rexd socket (default %s)\n", REXD_DEFAULT_SOCKET);
+  printf("  --cd|-c <dir>       The directory to change to (defaults to CWD)\n");
+  printf("  --upper|-u <dir>    The upper directory\n");
+}
+
+int main(int argc, const char *argv[])
+{
+  const char *socket_path = REXD_DEFAULT_SOCKET;
+  const char *cd = NULL;
+  const char *upper = NULL;
+  int dir_count = 0;
+  const char **dirs = malloc(sizeof(char*) * argc);
+  int forward_argc = 0;
+  const char **forward_argv = NULL;
+  if (!dirs) {
+    errnof("malloc failed");
+    return 1;
+  }
+  for (int arg_index = 1; arg_index < argc; arg_index++) {
+    const char *arg = argv[arg_index];
+    if (arg[0] != '-') {
+      dirs[dir_count++] = arg;
+    } else if (0 == strcmp(arg, "-s") || 0 == strcmp(arg, "--socket")) {
+      socket_path = get_opt_arg(argc, argv, &arg_index);
+    } else if (0 == strcmp(arg, "-c") || 0 == strcmp(arg, "--cd")) {
+      cd = get_opt_arg(argc, argv, &arg_index);
+    } else if (0 == strcmp(arg, "-u") || 0 == strcmp(arg, "--upper")) {
+      upper = get_opt_arg(argc, argv, &arg_index);
+    } else if (0 == strcmp(arg, "--")) {
+      forward_argc = argc - arg_index - 1;
+      forward_argv = &argv[arg_index + 1];
+      break;
+    } else {
+      errf("unknown option '%s'", arg);
+      return 1;
+    }
+  }
+  if (forward_argc == 0) {
+    usage();
+    return 1;
+  }
+
+  char cwd[PATH_MAX];
+  if (cd == NULL) {
+    if (NULL == getcwd(cwd, sizeof(cwd))) {
+      errnof("getcwd failed");
+      return 1;
+    }
+    cd = cwd;
+  }
+
+  char *buf = malloc(REXD_MAX_REQUEST);
+  if (!buf) {
+    errnof("malloc failed");
+    return 1;
+  }
+  struct rexd_request *request = (struct rexd_request*)buf;
+  request->flags = upper ? REXD_FLAG_UPPER : 0;
+  request->dir_count = dir_count + (upper ? 1 : 0);
+  request->argc = forward_argc;
+  size_t offset = append_string(buf, sizeof(*request), cd);
+  if (upper)
+    offset = append_string(buf, offset, upper);
+  for (int i = 0; i < dir_count; i++)
+    offset = append_string(buf, offset, dirs[i]);
+  for (int i = 0; i < forward_argc; i++)
+    offset = append_string(buf, offset, forward_argv[i]);
+  if (offset > REXD_MAX_REQUEST) {
+    errf("request is larger than %d bytes", REXD_MAX_REQUEST);
+    return 1;
+  }
+  request->size = offset;
+
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+    errf("socket path '%s' is too long", socket_path);
+    return 1;
+  }
+  strcpy(addr.sun_path, socket_path);
+  int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (sock == -1) {
+    errnof("socket failed");
+    return 1;
+  }
+  if (-1 == connect(sock, (struct sockaddr*)&addr, sizeof(addr))) {
+    errnof("connect '%s' failed", socket_path);
+    return 1;
+  }
+  int fds[REXD_MAX_FDS] = { 0, 1, 2 };
+  if (-1 == rexd_send(sock, buf, request->size, fds, REXD_MAX_FDS)) {
+    errnof("send request failed");
+    return 1;
+  }
+
+  struct rexd_reply reply;
+  int pidfd;
+  int fd_count = 1;
+  ssize_t size = rexd_recv(sock, &reply, sizeof(reply), &pidfd, &fd_count);
+  if (size != sizeof(reply)) {
+    if (size == -1)
+      errnof("recv reply failed");
+    else
+      errf("rexd closed the connection");
+    return 1;
+  }
+  if (reply.error) {
+    errno = reply.error;
+    errnof("rexd failed to launch '%s'", forward_argv[0]);
+    return 1;
+  }
+  int have_pidfd = fd_count;
+  logf("[DEBUG] pid %d (pidfd %d)", reply.pid, have_pidfd ? pidfd : -1);
+
+  struct rexd_exit exit_reply;
+  fd_count = 0;
+  size = rexd_recv(sock, &exit_reply, sizeof(exit_reply), NULL, &fd_count);
+  if (size != sizeof(exit_reply)) {
+    // the pidfd still tells us when the program exits
+    if (size == -1)
+      errnof("recv exit status failed");
+    else
+      errf("rexd closed the connection");
+    if (have_pidfd) {
+      struct pollfd pollfd = { .fd = pidfd, .events = POLLIN };
+      poll(&pollfd, 1, -1);
+    }
+    return 1;
+  }
+  if (WIFEXITED(exit_reply.status))
+    return WEXITSTATUS(exit_reply.status);
+  if (WIFSIGNALED(exit_reply.status))
+    return 128 + WTERMSIG(exit_reply.status);
+  return 1;
+}
@@ -0,0 +1,81 @@
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "rexd.h"
+
+ssize_t rexd_send(int sock, const void *buf, size_t size, const int *fds, int fd_count)
+{
+  struct iovec iov = { .iov_base = (void*)buf, .iov_len = size };
+  union {
+    char buf[CMSG_SPACE(sizeof(int) * REXD_MAX_FDS)];
+    struct cmsghdr align;
+  } control;
+  struct msghdr msg = {
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+  };
+  if (fd_count > 0) {
+    msg.msg_control = control.buf;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * fd_count);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fd_count);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * fd_count);
+  }
+  for (;;) {
+    ssize_t result = sendmsg(sock, &msg, MSG_NOSIGNAL);
+    if (result != -1 || errno != EINTR)
+      return result;
+  }
+}
+
+// fd_count is the capacity of fds on input and the number received on output,
+// received fds are close-on-exec
+ssize_t rexd_recv(int sock, void *buf, size_t size, int *fds, int *fd_count)
+{
+  struct iovec iov = { .iov_base = buf, .iov_len = size };
+  union {
+    char buf[CMSG_SPACE(sizeof(int) * REXD_MAX_FDS)];
+    struct cmsghdr align;
+  } control;
+  struct msghdr msg = {
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+    .msg_control = control.buf,
+    .msg_controllen = sizeof(control.buf),
+  };
+  ssize_t result;
+  do {
+    result = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+  } while (result == -1 && errno == EINTR);
+
+  int received = 0;
+  if (result != -1) {
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+        continue;
+      int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      int *cmsg_fds = (int*)CMSG_DATA(cmsg);
+      for (int i = 0; i < count; i++) {
+        if (received < *fd_count)
+          fds[received++] = cmsg_fds[i];
+        else
+          close(cmsg_fds[i]);
+      }
+    }
+    if (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) {
+      for (int i = 0; i < received; i++)
+        close(fds[i]);
+      received = 0;
+      errno = EMSGSIZE;
+      result = -1;
+    }
+  }
+  *fd_count = received;
+  return result;
+}
@@ -0,0 +1,414 @@
+/*
+rexd: launches sandboxed programs on behalf of clients connected to a unix
+socket so that clients do not pay for a privileged exec of rex per launch.
+
+rexd keeps a number of idle pre-forked workers.  Each worker has already
+unshared its mount namespace and mounted a private tmpfs on REX_SCRATCH_DIR
+before it waits for a connection.  A worker handles exactly one request: it
+builds the root on its tmpfs, forks the program, replies with the program's
+pidfd and then with its wait status.  Since the mounts only exist in the
+worker's namespace they go away on their own once the program exits, and
+the daemon forks a replacement worker as soon as one gets a connection.
+*/
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <grp.h>
+
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include <sys/fsuid.h>
+#include <sys/signalfd.h>
+#include <sys/pidfd.h>
+#include <poll.h>
+
+#include "common.h"
+#include "rootfs.h"
+#include "rexd.h"
+
+#define DEFAULT_WORKER_COUNT 4
+
+static const char *get_opt_arg(int argc, const char *argv[], int *arg_index)
+{
+  (*arg_index)++;
+  if (*arg_index >= argc) {
+    errf("option '%s' requires an argument", argv[(*arg_index) - 1]);
+    exit(1);
+  }
+  return argv[*arg_index];
+}
+
+static void send_error(int conn, int error)
+{
+  struct rexd_reply reply = { .error = error, .pid = 0 };
+  if (-1 == rexd_send(conn, &reply, sizeof(reply), NULL, 0))
+    errnof("send error reply failed");
+}
+
+// returns: a pointer to the string after str or NULL if str is not terminated
+static const char *next_string(const char *str, const char *limit)
+{
+  const char *end = memchr(str, '\0', limit - str);
+  return end ? end + 1 : NULL;
+}
+
+// run in the forked program process, does not return
+static void exec_program(const char *root, const char *cwd, const char **argv,
+                         const int *fds, int fd_count, const struct ucred *cred)
+{
+  for (int i = 0; i < fd_count; i++) {
+    if (-1 == dup2(fds[i], i)) {
+      errnof("dup2 %d failed", i);
+      _exit(127);
+    }
+  }
+  if (rootfs_pivot_root(root, cwd))
+    _exit(127); // error already logged
+  // the program runs as the client, not with the privileges of rexd
+  if (-1 == setgroups(0, NULL) ||
+      -1 == setresgid(cred->gid, cred->gid, cred->gid) ||
+      -1 == setresuid(cred->uid, cred->uid, cred->uid)) {
+    errnof("failed to switch to uid %d gid %d", cred->uid, cred->gid);
+    _exit(127);
+  }
+  // nor can it get them back from a setuid or file capability binary in a
+  // directory the client passed in
+  if (-1 == prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0)) {
+    errnof("prctl PR_SET_NO_NEW_PRIVS failed");
+    _exit(127);
+  }
+  execvp(argv[0], (char *const*)argv);
+  errnof("execvp '%s' failed", argv[0]);
+  _exit(127);
+}
+
+// setfsuid and setfsgid don't report errors, so check what they left behind
+// returns: 0 on success
+static err_t set_fs_ids(uid_t uid, gid_t gid)
+{
+  setfsgid(gid);
+  setfsuid(uid);
+  if ((uid_t)setfsuid(-1) != uid || (gid_t)setfsgid(-1) != gid) {
+    errf("failed to switch to fsuid %d fsgid %d", uid, gid);
+    return 1;
+  }
+  return 0;
+}
+
+// returns: the exit code of the worker
+static int handle_request(int conn)
+{
+  char *buf = malloc(REXD_MAX_REQUEST);
+  if (!buf) {
+    errnof("malloc failed");
+    send_error(conn, ENOMEM);
+    return 1;
+  }
+  int fds[REXD_MAX_FDS];
+  int fd_count = REXD_MAX_FDS;
+  ssize_t size = rexd_recv(conn, buf, REXD_MAX_REQUEST, fds, &fd_count);
+  if (size == -1) {
+    errnof("recv request failed");
+    send_error(conn, errno);
+    return 1;
+  }
+
+  struct rexd_request *request = (struct rexd_request*)buf;
+  if (size < (ssize_t)sizeof(*request) || request->size != size ||
+      request->argc == 0 || request->dir_count > REXD_MAX_REQUEST / 2) {
+    errf("malformed request (size %ld)", (long)size);
+    send_error(conn, EINVAL);
+    return 1;
+  }
+  const char *limit = buf + size;
+  const char *cwd = buf + sizeof(*request);
+  const char *next = next_string(cwd, limit);
+  if (!next || cwd[0] != '/') {
+    errf("malformed request cwd");
+    send_error(conn, EINVAL);
+    return 1;
+  }
+  struct dir *dirs = calloc(request->dir_count, sizeof(struct dir));
+  const char **argv = calloc(request->argc + 1, sizeof(char*));
+  if (!dirs || !argv) {
+    errnof("calloc failed");
+    send_error(conn, ENOMEM);
+    return 1;
+  }
+  for (uint32_t i = 0; i < request->dir_count; i++) {
+    dirs[i].arg = next;
+    if (next == limit || !(next = next_string(next, limit))) {
+      errf("malformed request dirs");
+      send_error(conn, EINVAL);
+      return 1;
+    }
+  }
+  for (uint32_t i = 0; i < request->argc; i++) {
+    argv[i] = next;
+    if (next == limit || !(next = next_string(next, limit))) {
+      errf("malformed request argv");
+      send_error(conn, EINVAL);
+      return 1;
+    }
+  }
+
+  struct ucred cred;
+  socklen_t cred_length = sizeof(cred);
+  if (-1 == getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &cred_length)) {
+    errnof("getsockopt SO_PEERCRED failed");
+    send_error(conn, errno);
+    return 1;
+  }
+
+  // resolve and open the dirs with the filesystem access of the client, the
+  // mounts use what was opened, so nothing the client swaps in afterwards
+  // gets mounted with the access of rexd
+  if (set_fs_ids(cred.uid, cred.gid)) {
+    send_error(conn, EPERM);
+    return 1; // error already logged
+  }
+  for (uint32_t i = 0; i < request->dir_count; i++) {
+    err_t result = dir_init(&dirs[i]);
+    if (!result)
+      result = dir_open_source(&dirs[i]);
+    if (result) {
+      send_error(conn, result);
+      return 1;
+    }
+  }
+  if (set_fs_ids(geteuid(), getegid())) {
+    send_error(conn, EPERM);
+    return 1; // error already logged
+  }
+
+  struct rootfs rootfs = {
+    .path = REX_SCRATCH_DIR,
+    .path_length = strlen(REX_SCRATCH_DIR),
+    .have_upper = (request->flags & REXD_FLAG_UPPER) != 0,
+    .dirs = dirs,
+    .dir_count = request->dir_count,
+  };
+  {
+    err_t result = rootfs_mount(&rootfs, 0);
+    if (result) {
+      send_error(conn, result);
+      return 1;
+    }
+  }
+  for (uint32_t i = 0; i < request->dir_count; i++)
+    close(dirs[i].fd);
+
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == -1) {
+    errnof("fork failed");
+    send_error(conn, errno);
+    return 1;
+  }
+  if (pid == 0)
+    exec_program(rootfs.path, cwd, argv, fds, fd_count, &cred);
+  for (int i = 0; i < fd_count; i++)
+    close(fds[i]);
+
+  int pidfd = pidfd_open(pid, 0);
+  if (pidfd == -1) {
+    errnof("pidfd_open %d failed", pid);
+  } else {
+    struct rexd_reply reply = { .error = 0, .pid = pid };
+    if (-1 == rexd_send(conn, &reply, sizeof(reply), &pidfd, 1))
+      errnof("send reply failed");
+    close(pidfd);
+  }
+
+  int status;
+  while (-1 == waitpid(pid, &status, 0)) {
+    if (errno != EINTR) {
+      errnof("waitpid %d failed", pid);
+      return 1;
+    }
+  }
+  struct rexd_exit exit_reply = { .status = status };
+  if (-1 == rexd_send(conn, &exit_reply, sizeof(exit_reply), NULL, 0))
+    errnof("send exit status failed");
+  return 0;
+}
+
+static int worker_main(int listen_fd, int notify_fd, pid_t daemon_pid)
+{
+  // idle workers go away with the daemon
+  if (-1 == prctl(PR_SET_PDEATHSIG, SIGTERM)) {
+    errnof("prctl PR_SET_PDEATHSIG failed");
+    return 1;
+  }
+  // the daemon may have exited before the prctl, then there is no signal
+  if (getppid() != daemon_pid)
+    return 1;
+  if (rootfs_enter_private_scratch(REX_SCRATCH_DIR))
+    return 1; // error already logged
+
+  int conn;
+  do {
+    conn = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+  } while (conn == -1 && errno == EINTR);
+  if (conn == -1) {
+    errnof("accept failed");
+    return 1;
+  }
+  // tell the daemon to fork a replacement, this worker now belongs to the
+  // connection and lives as long as the program does
+  if (-1 == write(notify_fd, "", 1))
+    errnof("notify daemon failed");
+  close(listen_fd);
+  close(notify_fd);
+  prctl(PR_SET_PDEATHSIG, 0);
+  return handle_request(conn);
+}
+
+static pid_t spawn_worker(int listen_fd, int notify_fd)
+{
+  fflush(stdout);
+  pid_t daemon_pid = getpid();
+  pid_t pid = fork();
+  if (pid == -1) {
+    errnof("fork failed");
+    return -1;
+  }
+  if (pid == 0) {
+    sigset_t sigchld;
+    sigemptyset(&sigchld);
+    sigaddset(&sigchld, SIGCHLD);
+    sigprocmask(SIG_UNBLOCK, &sigchld, NULL);
+    exit(worker_main(listen_fd, notify_fd, daemon_pid));
+  }
+  return pid;
+}
+
+void usage()
+{
+  printf("Usage: rexd [-options]\n");
+  printf("Options:\n");
+  printf("  --socket|-s <path>  The socket to listen on (default %s)\n", REXD_DEFAULT_SOCKET);
+  printf("  --workers|-w <n>    The number of idle workers to keep (default %d)\n", DEFAULT_WORKER_COUNT);
+}
+
+int main(int argc, const char *argv[])
+{
+  const char *socket_path = REXD_DEFAULT_SOCKET;
+  unsigned worker_count = DEFAULT_WORKER_COUNT;
+  for (int arg_index = 1; arg_index < argc; arg_index++) {
+    const char *arg = argv[arg_index];
+    if (0 == strcmp(arg, "-s") || 0 == strcmp(arg, "--socket")) {
+      socket_path = get_opt_arg(argc, argv, &arg_index);
+    } else if (0 == strcmp(arg, "-w") || 0 == strcmp(arg, "--workers")) {
+      const char *count_str = get_opt_arg(argc, argv, &arg_index);
+      char *end;
+      worker_count = strtoul(count_str, &end, 10);
+      if (end == count_str || *end != '\0' || worker_count == 0) {
+        errf("invalid worker count '%s'", count_str);
+        return 1;
+      }
+    } else if (0 == strcmp(arg, "-h") || 0 == strcmp(arg, "--help")) {
+      usage();
+      return 0;
+    } else {
+      errf("unknown option '%s'", arg);
+      return 1;
+    }
+  }
+
+  if (-1 == loggy_mkdir(TMP_REX_DIR, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) && errno != EEXIST)
+    return 1; // error already logged
+  if (-1 == loggy_mkdir(REX_SCRATCH_DIR, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH) && errno != EEXIST)
+    return 1; // error already logged
+
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+    errf("socket path '%s' is too long", socket_path);
+    return 1;
+  }
+  strcpy(addr.sun_path, socket_path);
+  int listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (listen_fd == -1) {
+    errnof("socket failed");
+    return 1;
+  }
+  if (-1 == unlink(socket_path) && errno != ENOENT) {
+    errnof("unlink '%s' failed", socket_path);
+    return 1;
+  }
+  if (-1 == bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr))) {
+    errnof("bind '%s' failed", socket_path);
+    return 1;
+  }
+  // programs always run with the credentials of the client
+  if (-1 == chmod(socket_path, 0666)) {
+    errnof("chmod '%s' failed", socket_path);
+    return 1;
+  }
+  if (-1 == listen(listen_fd, SOMAXCONN)) {
+    errnof("listen failed");
+    return 1;
+  }
+
+  int notify_fds[2];
+  if (-1 == pipe2(notify_fds, O_CLOEXEC)) {
+    errnof("pipe failed");
+    return 1;
+  }
+  sigset_t sigchld;
+  sigemptyset(&sigchld);
+  sigaddset(&sigchld, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &sigchld, NULL);
+  int signal_fd = signalfd(-1, &sigchld, SFD_CLOEXEC);
+  if (signal_fd == -1) {
+    errnof("signalfd failed");
+    return 1;
+  }
+
+  for (unsigned i = 0; i < worker_count; i++) {
+    if (-1 == spawn_worker(listen_fd, notify_fds[1]))
+      return 1;
+  }
+  logf("rexd listening on '%s' with %u workers", socket_path, worker_count);
+  fflush(stdout);
+
+  for (;;) {
+    struct pollfd pollfds[2] = {
+      { .fd = notify_fds[0], .events = POLLIN },
+      { .fd = signal_fd, .events = POLLIN },
+    };
+    if (-1 == poll(pollfds, 2, -1)) {
+      if (errno == EINTR)
+        continue;
+      errnof("poll failed");
+      return 1;
+    }
+    if (pollfds[0].revents & POLLIN) {
+      char accepted[64];
+      ssize_t count = read(notify_fds[0], accepted, sizeof(accepted));
+      for (ssize_t i = 0; i < count; i++)
+        spawn_worker(listen_fd, notify_fds[1]);
+    }
+    if (pollfds[1].revents & POLLIN) {
+      struct signalfd_siginfo info;
+      if (-1 == read(signal_fd, &info, sizeof(info)))
+        errnof("read signalfd failed");
+      int status;
+      pid_t pid;
+      while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        // a worker that fails before accepting is not replaced, it would
+        // most likely fail the same way again
+        if (WIFSIGNALED(status) || (WIFEXITED(status) && WEXITSTATUS(status) != 0))
+          errf("worker %d failed (status 0x%x)", pid, status);
+      }
+    }
+  }
+}
@@ -0,0 +1,37 @@
+#include <stdint.h>
+
+#define REXD_DEFAULT_SOCKET "/tmp/.rex/rexd.sock"
+#define REXD_MAX_REQUEST (128 * 1024)
+#define REXD_MAX_FDS 3 // stdin, stdout and stderr
+
+#define REXD_FLAG_UPPER 0x1 // the first dir is the upper directory
+
+/*
+A launch request is a single SOCK_SEQPACKET message, optionally passing up to
+REXD_MAX_FDS file descriptors with SCM_RIGHTS that become fds 0, 1 and 2 of
+the program.  The header is followed by null-terminated strings:
+  <cwd> <dirs>... <argv>...
+*/
+struct rexd_request
+{
+  uint32_t size; // the size of the whole request including the strings
+  uint32_t flags;
+  uint32_t dir_count;
+  uint32_t argc;
+};
+
+// the first reply, on success the pidfd of the program is passed with it
+struct rexd_reply
+{
+  int32_t error; // 0 or an errno value
+  int32_t pid;
+};
+
+// the second reply, sent once the program exits
+struct rexd_exit
+{
+  int32_t status; // the wait status
+};
+
+ssize_t rexd_send(int sock, const void *buf, size_t size, const int *fds, int fd_count);
+ssize_t rexd_recv(int sock, void *buf, size_t size, int *fds, int *fd_count);
@@ -0,0 +1,582 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sched.h>
+
+#include <sys/stat.h>
+#include <sys/mount.h>
+#include <sys/syscall.h>
+
+#include <linux/limits.h>
+
+#include "common.h"
+#include "rootfs.h"
+#include "timings.h"
+
+int loggy_mkdir(const char *dir, mode_t mode)
+{
+  logf("mkdir -m %o %s", mode, dir);
+  if (-1 == mkdir(dir, mode)) {
+    errnof("mkdir '%s' failed", dir);
+    return -1;
+  }
+  return 0;
+}
+
+static int loggy_mount(const char *source, const char *target,
+                const char *filesystemtype, const char *options)
+{
+  logf("mount%s%s%s%s %s %s",
+       filesystemtype ? " -t " : "",
+       filesystemtype ? filesystemtype : "",
+       options ? " -o " : "", options ? options : "",
+       source, target);
+  if (-1 == mount(source, target, filesystemtype, 0, options)) {
+    errnof("mount failed");
+    return -1; // fail
+  }
+  return 0; // success
+}
+
+static int loggy_bind_mount(const char *source, const char *target)
+{
+  logf("mount --bind %s %s", source, target);
+  if (-1 == mount(source, target, NULL, MS_BIND, NULL)) {
+    errnof("bind mount failed");
+    return -1; // fail
+  }
+  return 0; // success
+}
+
+static unsigned get_dir_length(const char *file)
+{
+  const char * s = strrchr(file, '/');
+  if (s == NULL) {
+    return 0;
+  }
+  return s - file;
+}
+
+// returns: 0 on success
+static err_t mkdirs_helper(char *dir, size_t length)
+{
+  if (dir[length] != '\0') {
+    errf("code bug: mkdirs was called with a string that did not end in null");
+    return 1;
+  }
+  //logf("[DEBUG] mkdirs '%s'", dir);
+  {
+    struct stat dir_stat;
+    if (0 == stat(dir, &dir_stat)) {
+      if (S_ISDIR(dir_stat.st_mode)) {
+        return 0; // success
+      }
+      errf("'%s' exists but is not a directory", dir);
+      return 1;
+    }
+  }
+  {
+    unsigned parent_dir_length = get_dir_length(dir);
+    if (parent_dir_length == length) {
+      errf("failed to create directory '%s'", dir);
+      return 1;
+    }
+    dir[parent_dir_length] = '\0';
+    int result = mkdirs_helper(dir, parent_dir_length);
+    dir[parent_dir_length] = '/';
+    if (result)
+      return result;
+  }
+  if (-1 == loggy_mkdir(dir, S_IRUSR | S_IWUSR | S_IXUSR | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH)) {
+    // error already logged
+    return current_error;
+  }
+  return 0; // success
+}
+err_t mkdirs(char *dir)
+{
+  return mkdirs_helper(dir, strlen(dir));
+}
+
+static char *realpath2(const char *path)
+{
+  char temp[PATH_MAX];
+  char *result = realpath(path, temp);
+  return result ? strdup(result) : NULL;
+}
+
+// resolves dir->arg, "<source>[:<target>]", into the dir source and target
+// returns: 0 on success
+err_t dir_init(struct dir *dir)
+{
+  const char *colon_str = strchr(dir->arg, ':');
+  const char *arg_source;
+  if (colon_str) {
+    arg_source = strndup(dir->arg, colon_str - dir->arg);
+    dir->target_relative = colon_str + 1;
+  } else {
+    arg_source = dir->arg;
+    dir->target_relative = NULL;
+  }
+  struct stat path_stat;
+  if (-1 == stat(arg_source, &path_stat)) {
+    errnof("'%s'", arg_source);
+    return current_error;
+  }
+  dir->source = realpath2(arg_source);
+  if (dir->source == NULL) {
+    errnof("realpath('%s') failed", arg_source);
+    return current_error;
+  }
+  dir->private_target_absolute = NULL;
+  dir->fd = -1;
+  logf("source '%s' target '%s'", dir->source, dir->target_relative);
+  return 0;
+}
+
+/*
+Pins the directory dir->source names now, with the filesystem access of the
+caller, so it is what gets mounted even if the path changes before the mount
+or would resolve differently with the credentials of the mount.
+returns: 0 on success
+*/
+err_t dir_open_source(struct dir *dir)
+{
+  dir->fd = open(dir->source, O_PATH | O_NOFOLLOW | O_DIRECTORY | O_CLOEXEC);
+  if (dir->fd == -1) {
+    errnof("open '%s' failed", dir->source);
+    return current_error;
+  }
+  return 0;
+}
+
+// the "/proc/self/fd/<n>" of a pinned dir, which names exactly what it opened
+#define DIR_FD_PATH_SIZE 32
+
+// returns: the path to mount dir from, buf if it is pinned
+static const char *dir_mount_source(const struct dir *dir, char *buf)
+{
+  if (dir->fd == -1)
+    return dir->source;
+  snprintf(buf, DIR_FD_PATH_SIZE, "/proc/self/fd/%d", dir->fd);
+  return buf;
+}
+
+unsigned char is_root_mount(struct dir *dir)
+{
+  return dir->target_relative != NULL && dir->target_relative[0] == '\0';
+}
+
+char *dir_get_absolute_target(struct rootfs *rootfs, struct dir *dir)
+{
+  if (!dir->private_target_absolute) {
+    if (dir->target_relative == NULL) {
+      size_t dir_length = strlen(dir->source);
+      size_t total_length = rootfs->path_length + dir_length;
+      dir->private_target_absolute = malloc(total_length + 1);
+      if (dir->private_target_absolute == NULL) {
+        errnof("malloc failed");
+        return NULL;
+      }
+      memcpy(dir->private_target_absolute +                   0, rootfs->path, rootfs->path_length);
+      memcpy(dir->private_target_absolute + rootfs->path_length, dir->source, dir_length);
+      dir->private_target_absolute[total_length] = '\0';
+    } else {
+      errf("non-empty target not implemented");
+      return NULL;
+    }
+  }
+  return dir->private_target_absolute;
+}
+
+// a bind mount is only writeable if it is the upper directory
+static unsigned char is_readonly_mount(struct rootfs *rootfs, int dir_index)
+{
+  return !rootfs->have_upper || dir_index > 0;
+}
+
+// make the mount point directories
+// returns: the number of non-root mounts or -1 on error
+static int make_mount_points(struct rootfs *rootfs)
+{
+  int non_root_mounts = 0;
+  for (int i = 0; i < rootfs->dir_count; i++) {
+    struct dir *dir = &rootfs->dirs[i];
+    if (is_root_mount(dir))
+      continue;
+
+    non_root_mounts++;
+    char *target_dir = dir_get_absolute_target(rootfs, dir);
+    if (target_dir == NULL) {
+      // error already printed
+      return -1;
+    }
+    if (mkdirs(target_dir))
+      return -1;
+  }
+  return non_root_mounts;
+}
+
+// returns: the overlay lower directories "<root>:<dir>:<dir>..." prefixed with
+//          "lowerdir=" if with_option is set
+static char *make_lower_dirs(struct rootfs *rootfs, unsigned char with_option)
+{
+  size_t lower_dirs_size = 0;
+  for (int i = 0; i < rootfs->dir_count; i++) {
+    // TODO: handle upper dir properly
+    struct dir *dir = &rootfs->dirs[i];
+    if (!is_root_mount(dir))
+      continue;
+    char fd_path[DIR_FD_PATH_SIZE];
+    lower_dirs_size += 1 + strlen(dir_mount_source(dir, fd_path));
+  }
+
+  // TODO: support upperdir
+  const int LOWERDIR_PREFIX_SIZE = with_option ? 9 : 0;
+  size_t options_size = LOWERDIR_PREFIX_SIZE + rootfs->path_length + lower_dirs_size;
+  char *options = malloc(options_size + 1);
+  if (!options) {
+    errnof("malloc failed");
+    return NULL;
+  }
+  // TODO: do not add the rootfs as a lowerdir if there are no non-root mounts
+  size_t offset = 0;
+  memcpy(options + offset, "lowerdir=", LOWERDIR_PREFIX_SIZE);
+  offset += LOWERDIR_PREFIX_SIZE;
+  memcpy(options + offset, rootfs->path, rootfs->path_length);
+  offset += rootfs->path_length;
+
+  for (int i = 0; i < rootfs->dir_count; i++) {
+    // TODO: handle upper dir properly
+    struct dir *dir = &rootfs->dirs[i];
+    if (!is_root_mount(dir))
+      continue;
+    options[offset++] = ':';
+    char fd_path[DIR_FD_PATH_SIZE];
+    const char *source = dir_mount_source(dir, fd_path);
+    size_t len = strlen(source);
+    memcpy(options + offset, source, len);
+    offset += len;
+  }
+  if (offset != options_size) {
+    errf("code bug: options_size %lu != offset %lu", options_size, offset);
+    free(options);
+    return NULL;
+  }
+  options[offset] = '\0';
+  return options;
+}
+
+static err_t rootfs_mount_legacy(struct rootfs *rootfs)
+{
+  unsigned long long start = timings_now();
+  int non_root_mounts = make_mount_points(rootfs);
+  timings_add(REX_PHASE_MKDIRS, start);
+  if (non_root_mounts == -1)
+    return 1; // error already logged
+
+  // create the root mount overlay (do this before
+  // mounting anything inside this directory)
+  start = timings_now();
+  if (non_root_mounts < rootfs->dir_count) {
+    char *options = make_lower_dirs(rootfs, 1);
+    if (!options)
+      return 1; // error already logged
+    logf("options = '%s'", options);
+
+    if (-1 == loggy_mount("none", rootfs->path, "overlay", options)) {
+      // error already logged
+      return 1;
+    }
+    free(options);
+  }
+  timings_add(REX_PHASE_OVERLAY, start);
+
+  // now mount the non-root mounts
+  start = timings_now();
+  for (int i = 0; i < rootfs->dir_count; i++) {
+    struct dir *dir = &rootfs->dirs[i];
+    if (is_root_mount(dir))
+      continue;
+
+    char *target_dir = dir_get_absolute_target(rootfs, dir);
+    if (target_dir == NULL) {
+      // error already printed
+      return 1;
+    }
+    char fd_path[DIR_FD_PATH_SIZE];
+    if (-1 == loggy_bind_mount(dir_mount_source(dir, fd_path), target_dir)) {
+      // error already printed
+      return 1; // fail
+    }
+
+    // remount it as readonly
+    // see https://lwn.net/Articles/281157/
+    // it looks like if you want bind mounts to be readonly, you need to mount
+    // them as writeable first, and then remount them as readonly
+    // mount -o remount,ro <mount_point>
+    /* NOT WORKING
+       if (is_readonly_mount(rootfs, i)) {
+       if (-1 == loggy_mount(NULL, target_dir, NULL, "remount,ro")) {
+       // error already logged
+       free(target_dir);
+       return 1; // fail
+        }
+        }
+    */
+  }
+  timings_add(REX_PHASE_BINDS, start);
+  return 0;
+}
+
+// Add each lower directory as its own "lowerdir+" parameter.  fsconfig limits
+// string values to 256 bytes so a single "lowerdir=a:b:c" does not scale to
+// many root dirs, but "lowerdir+" requires a newer kernel, so fall back to
+// the single string when it is not supported.
+static err_t overlay_config_lower_dirs(int fs_fd, struct rootfs *rootfs)
+{
+  logf("fsconfig overlay lowerdir+ %s", rootfs->path);
+  if (-1 == fsconfig(fs_fd, FSCONFIG_SET_STRING, "lowerdir+", rootfs->path, 0)) {
+    if (errno != EINVAL) {
+      errnof("fsconfig lowerdir+ '%s' failed", rootfs->path);
+      return 1;
+    }
+    char *lower_dirs = make_lower_dirs(rootfs, 0);
+    if (!lower_dirs)
+      return 1; // error already logged
+    logf("fsconfig overlay lowerdir=%s", lower_dirs);
+    int result = fsconfig(fs_fd, FSCONFIG_SET_STRING, "lowerdir", lower_dirs, 0);
+    if (result == -1)
+      errnof("fsconfig lowerdir '%s' failed", lower_dirs);
+    free(lower_dirs);
+    return (result == -1) ? 1 : 0;
+  }
+  for (int i = 0; i < rootfs->dir_count; i++) {
+    struct dir *dir = &rootfs->dirs[i];
+    if (!is_root_mount(dir))
+      continue;
+    char fd_path[DIR_FD_PATH_SIZE];
+    const char *source = dir_mount_source(dir, fd_path);
+    logf("fsconfig overlay lowerdir+ %s", source);
+    if (-1 == fsconfig(fs_fd, FSCONFIG_SET_STRING, "lowerdir+", source, 0)) {
+      errnof("fsconfig lowerdir+ '%s' failed", source);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// returns: a detached overlay mount of the root dirs or -1 on error
+static int fsmount_overlay(struct rootfs *rootfs)
+{
+  logf("fsopen overlay");
+  int fs_fd = fsopen("overlay", FSOPEN_CLOEXEC);
+  if (fs_fd == -1) {
+    if (errno != ENOSYS)
+      errnof("fsopen overlay failed");
+    return -1;
+  }
+  int mount_fd = -1;
+  if (0 == overlay_config_lower_dirs(fs_fd, rootfs)) {
+    if (-1 == fsconfig(fs_fd, FSCONFIG_CMD_CREATE, NULL, NULL, 0)) {
+      errnof("fsconfig create overlay failed");
+    } else {
+      mount_fd = fsmount(fs_fd, FSMOUNT_CLOEXEC, 0);
+      if (mount_fd == -1)
+        errnof("fsmount overlay failed");
+    }
+  }
+  close(fs_fd);
+  return mount_fd;
+}
+
+static int loggy_open_tree_clone(const char *path)
+{
+  logf("open_tree --clone %s", path);
+  int tree_fd = open_tree(AT_FDCWD, path, OPEN_TREE_CLONE | OPEN_TREE_CLOEXEC);
+  if (tree_fd == -1 && errno != ENOSYS)
+    errnof("open_tree '%s' failed", path);
+  return tree_fd;
+}
+
+static int loggy_open_tree_clone_dir(const struct dir *dir)
+{
+  if (dir->fd == -1)
+    return loggy_open_tree_clone(dir->source);
+  logf("open_tree --clone %s (fd %d)", dir->source, dir->fd);
+  int tree_fd = open_tree(dir->fd, "", AT_EMPTY_PATH | OPEN_TREE_CLONE | OPEN_TREE_CLOEXEC);
+  if (tree_fd == -1 && errno != ENOSYS)
+    errnof("open_tree '%s' failed", dir->source);
+  return tree_fd;
+}
+
+static int loggy_attach(int tree_fd, const char *target)
+{
+  logf("move_mount %s", target);
+  if (-1 == move_mount(tree_fd, "", AT_FDCWD, target, MOVE_MOUNT_F_EMPTY_PATH)) {
+    errnof("move_mount to '%s' failed", target);
+    return -1;
+  }
+  return 0;
+}
+
+// Builds the whole mount tree detached from the filesystem and attaches it
+// to the root directory with a single move_mount.  Kernels that cannot mount
+// onto a detached tree get the root attached first and the bind mounts
+// moved onto it afterwards.
+// returns: 0 on success, ENOSYS if the kernel does not have the new mount api
+static err_t rootfs_mount_detached(struct rootfs *rootfs)
+{
+  unsigned long long start = timings_now();
+  int non_root_mounts = make_mount_points(rootfs);
+  timings_add(REX_PHASE_MKDIRS, start);
+  if (non_root_mounts == -1)
+    return 1; // error already logged
+
+  start = timings_now();
+  int root_fd = (non_root_mounts < rootfs->dir_count) ?
+    fsmount_overlay(rootfs) : loggy_open_tree_clone(rootfs->path);
+  timings_add(REX_PHASE_OVERLAY, start);
+  if (root_fd == -1)
+    return (errno == ENOSYS) ? ENOSYS : 1; // error already logged
+
+  start = timings_now();
+  unsigned char attached = 0;
+  err_t result = 0;
+  for (int i = 0; i < rootfs->dir_count; i++) {
+    struct dir *dir = &rootfs->dirs[i];
+    if (is_root_mount(dir))
+      continue;
+
+    char *target_dir = dir_get_absolute_target(rootfs, dir);
+    if (target_dir == NULL) {
+      result = 1; // error already printed
+      break;
+    }
+    int tree_fd = loggy_open_tree_clone_dir(dir);
+    if (tree_fd == -1) {
+      result = 1; // error already printed
+      break;
+    }
+    if (is_readonly_mount(rootfs, i)) {
+      struct mount_attr attr = { .attr_set = MOUNT_ATTR_RDONLY };
+      if (-1 == mount_setattr(tree_fd, "", AT_EMPTY_PATH | AT_RECURSIVE, &attr, sizeof(attr))) {
+        errnof("mount_setattr readonly '%s' failed", dir->source);
+        close(tree_fd);
+        result = 1;
+        break;
+      }
+    }
+    // the target relative to the root mount
+    const char *target_relative = target_dir + rootfs->path_length + 1;
+    if (!attached && target_relative[0] == '\0') {
+      // mounting onto the root itself completely covers it, so the tree
+      // just becomes the new root
+      close(root_fd);
+      root_fd = tree_fd;
+      continue;
+    }
+    if (!attached) {
+      logf("move_mount %s (detached)", target_dir);
+      if (0 == move_mount(tree_fd, "", root_fd, target_relative, MOVE_MOUNT_F_EMPTY_PATH)) {
+        close(tree_fd);
+        continue;
+      }
+      if (errno != EINVAL) {
+        errnof("move_mount to '%s' failed", target_dir);
+        close(tree_fd);
+        result = 1;
+        break;
+      }
+      logf("kernel cannot mount onto a detached tree, attaching the root first");
+      if (-1 == loggy_attach(root_fd, rootfs->path)) {
+        close(tree_fd);
+        result = 1;
+        break;
+      }
+      attached = 1;
+    }
+    if (-1 == loggy_attach(tree_fd, target_dir))
+      result = 1;
+    close(tree_fd);
+    if (result)
+      break;
+  }
+
+  if (result == 0 && !attached) {
+    if (-1 == loggy_attach(root_fd, rootfs->path))
+      result = 1;
+  }
+  close(root_fd);
+  timings_add(REX_PHASE_BINDS, start);
+  return result;
+}
+
+err_t rootfs_mount(struct rootfs *rootfs, unsigned char legacy)
+{
+  if (!legacy) {
+    err_t result = rootfs_mount_detached(rootfs);
+    if (result != ENOSYS)
+      return result;
+    logf("new mount api not supported, falling back to mount(2)");
+  }
+  return rootfs_mount_legacy(rootfs);
+}
+
+/*
+Moves this process into a new mount namespace where nothing propagates back
+to the parent namespace and mounts a tmpfs on scratch_dir to build the root
+on.  Everything mounted afterwards goes away with the namespace once the last
+process in it exits, so there is nothing to unmount or remove.
+*/
+err_t rootfs_enter_private_scratch(const char *scratch_dir)
+{
+  logf("unshare --mount");
+  if (-1 == unshare(CLONE_NEWNS)) {
+    errnof("unshare CLONE_NEWNS failed");
+    return 1;
+  }
+  if (-1 == mount(NULL, "/", NULL, MS_REC | MS_PRIVATE, NULL)) {
+    errnof("mount --make-rprivate / failed");
+    return 1;
+  }
+  if (-1 == loggy_mount("rex", scratch_dir, "tmpfs", "mode=0755")) {
+    // error already logged
+    return 1;
+  }
+  return 0;
+}
+
+/*
+Makes root, which must be a mount point, the root of the mount namespace and
+changes to cwd inside it.  Unlike chroot the old root is detached so it is
+no longer reachable from inside the new root.
+*/
+err_t rootfs_pivot_root(const char *root, const char *cwd)
+{
+  logf("cd '%s'", root);
+  if (-1 == chdir(root)) {
+    errnof("chdir '%s' failed", root);
+    return 1;
+  }
+  // stack the old root on top of the new one and then detach it
+  logf("pivot_root '%s'", root);
+  if (-1 == syscall(SYS_pivot_root, ".", ".")) {
+    errnof("pivot_root '%s' failed", root);
+    return 1;
+  }
+  if (-1 == umount2(".", MNT_DETACH)) {
+    errnof("umount old root failed");
+    return 1;
+  }
+  logf("cd '%s'", cwd);
+  if (-1 == chdir(cwd)) {
+    errnof("chdir '%s' failed", cwd);
+    return 1;
+  }
+  return 0;
+}
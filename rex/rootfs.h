@@ -0,0 +1,31 @@
+#define TMP_REX_DIR "/tmp/.rex"
+// each private mount namespace mounts its own tmpfs here
+#define REX_SCRATCH_DIR TMP_REX_DIR "/scratch"
+
+struct dir
+{
+  const char *arg;
+  const char *source;
+  const char *target_relative;
+  char *private_target_absolute;
+  int fd; // O_PATH of source to mount instead of the path, or -1
+};
+
+struct rootfs
+{
+  const char *path; // the directory the new root is mounted on
+  size_t path_length;
+  unsigned char have_upper; // dirs[0] is the writeable upper directory
+  struct dir *dirs;
+  int dir_count;
+};
+
+int loggy_mkdir(const char *dir, mode_t mode);
+err_t mkdirs(char *dir);
+err_t dir_init(struct dir *dir);
+err_t dir_open_source(struct dir *dir);
+unsigned char is_root_mount(struct dir *dir);
+char *dir_get_absolute_target(struct rootfs *rootfs, struct dir *dir);
+err_t rootfs_mount(struct rootfs *rootfs, unsigned char legacy);
+err_t rootfs_enter_private_scratch(const char *scratch_dir);
+err_t rootfs_pivot_root(const char *root, const char *cwd);
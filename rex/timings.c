@@ -0,0 +1,37 @@
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "common.h"
+#include "timings.h"
+
+static unsigned long long phase_ns[REX_PHASE_COUNT];
+
+// CLOCK_MONOTONIC is the same in every process, so a parent can subtract
+unsigned long long timings_now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void timings_add(enum rex_phase phase, unsigned long long start)
+{
+  phase_ns[phase] += timings_now() - start;
+}
+
+/*
+Writes one line:
+
+  root=<dir> mkdirs_ns=<n> overlay_ns=<n> binds_ns=<n> chroot_ns=<n> exec_ns=<time>
+
+where exec_ns is CLOCK_MONOTONIC right before exec.
+*/
+void timings_report(int fd, const char *root)
+{
+  if (0 > dprintf(fd, "root=%s mkdirs_ns=%llu overlay_ns=%llu binds_ns=%llu chroot_ns=%llu exec_ns=%llu\n",
+                  root, phase_ns[REX_PHASE_MKDIRS], phase_ns[REX_PHASE_OVERLAY],
+                  phase_ns[REX_PHASE_BINDS], phase_ns[REX_PHASE_CHROOT], timings_now()))
+    errnof("write timings failed");
+}
@@ -0,0 +1,17 @@
+/*
+The phases of building a sandbox.  rex times each of them and, when it is
+run with --timings-fd, reports them just before it execs the program, see
+bench-launch.c.
+*/
+enum rex_phase
+{
+  REX_PHASE_MKDIRS,  // the mount points for the non-root dirs
+  REX_PHASE_OVERLAY, // the overlay of the root dirs
+  REX_PHASE_BINDS,   // the non-root dirs, and attaching the tree
+  REX_PHASE_CHROOT,  // chroot or pivot_root, and the cd into it
+  REX_PHASE_COUNT,
+};
+
+unsigned long long timings_now();
+void timings_add(enum rex_phase phase, unsigned long long start);
+void timings_report(int fd, const char *root);
@@ -0,0 +1,2 @@
+#define errorf(fmt,...) fprintf(stderr, "Error: " fmt "\n", ##__VA_ARGS__)
+#define errnof(fmt,...) fprintf(stderr, "Error(%d) " fmt ": %s\n", errno, ##__VA_ARGS__, strerror(errno))
@@ -0,0 +1,625 @@
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+#include "log.h"
+#include "lower.h"
+
+#define SHARD_COUNT 64 // a power of 2
+
+// IN_CLOSE_WRITE instead of IN_MODIFY, a file being written only changes once
+#define WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB | \
+                    IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+/*
+Nodes are keyed by (parent, name).  A shard lock protects its buckets and
+the attributes and listings of the nodes that hash to it.
+
+The lower filesystem is asked without the lock, so an inotify event can be
+handled in between and find nothing to drop yet.  Every invalidation bumps
+changes in the shard it drops from, and what was read is only cached if
+changes didn't move while it was being read.
+*/
+struct shard {
+  pthread_mutex_t mutex;
+  struct lower_node **buckets;
+  size_t bucket_count; // a power of 2
+  size_t node_count;
+  unsigned long changes;
+};
+
+struct watch {
+  struct watch *next;
+  int wd;
+  struct lower_node *node; // not referenced, the node removes its watch when it is freed
+};
+
+static struct shard shards[SHARD_COUNT];
+static struct lower_node *root;
+static int inotify_fd = -1;
+static pthread_mutex_t watches_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct watch *watches[256];
+
+static uint32_t name_hash(const struct lower_node *parent, const char *name, size_t length)
+{
+  // FNV-1a, salted with the parent
+  uint64_t hash = 0xcbf29ce484222325ULL ^ ((uintptr_t)parent >> 4);
+  size_t i;
+  for (i = 0; i < length; i++)
+    hash = (hash ^ (unsigned char)name[i]) * 0x100000001b3ULL;
+  return (uint32_t)(hash ^ (hash >> 32));
+}
+
+static struct shard *node_shard(const struct lower_node *node)
+{
+  return &shards[node->hash & (SHARD_COUNT - 1)];
+}
+
+static struct lower_node **bucket_of(struct shard *shard, uint32_t hash)
+{
+  // the low bits pick the shard
+  return &shard->buckets[(hash / SHARD_COUNT) & (shard->bucket_count - 1)];
+}
+
+void lower_node_get(struct lower_node *node)
+{
+  __atomic_add_fetch(&node->refs, 1, __ATOMIC_RELAXED);
+}
+
+// for nodes found through a watch, which can be on their way to being freed
+static int node_tryget(struct lower_node *node)
+{
+  unsigned long refs = __atomic_load_n(&node->refs, __ATOMIC_RELAXED);
+  while (refs) {
+    if (__atomic_compare_exchange_n(&node->refs, &refs, refs + 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+      return 1;
+  }
+  return 0;
+}
+
+static void remove_watch(struct lower_node *node)
+{
+  struct watch **link;
+  int still_used = 0;
+  pthread_mutex_lock(&watches_mutex);
+  for (link = &watches[node->watch & 255]; *link; ) {
+    if ((*link)->node == node) {
+      struct watch *watch = *link;
+      *link = watch->next;
+      free(watch);
+      continue;
+    }
+    still_used |= ((*link)->wd == node->watch);
+    link = &(*link)->next;
+  }
+  pthread_mutex_unlock(&watches_mutex);
+  // the same directory can be cached under several parents, through bind mounts
+  if (!still_used)
+    inotify_rm_watch(inotify_fd, node->watch);
+}
+
+void lower_node_put(struct lower_node *node)
+{
+  while (node && __atomic_sub_fetch(&node->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+    struct lower_node *parent = node->parent;
+    if (node->watch != -1)
+      remove_watch(node);
+    if (node->listing)
+      lower_listing_put(node->listing);
+    if (node->fd != -1)
+      close(node->fd);
+    free(node);
+    node = parent;
+  }
+}
+
+void lower_listing_put(struct lower_listing *listing)
+{
+  if (__atomic_sub_fetch(&listing->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+    free(listing->entries);
+    free(listing->names);
+    free(listing);
+  }
+}
+
+static void add_watch(struct lower_node *node)
+{
+  char fd_path[64];
+  struct watch *watch = malloc(sizeof(*watch));
+  if (!watch)
+    return; // not watched, only stays stale until the cache entry is dropped
+  snprintf(fd_path, sizeof(fd_path), "/proc/self/fd/%d", node->fd);
+  node->watch = inotify_add_watch(inotify_fd, fd_path, WATCH_MASK);
+  if (node->watch == -1) {
+    static int logged;
+    if (!__atomic_exchange_n(&logged, 1, __ATOMIC_RELAXED))
+      errnof("inotify_add_watch failed, directories will not be invalidated (raise fs.inotify.max_user_watches)");
+    free(watch);
+    return;
+  }
+  watch->wd = node->watch;
+  watch->node = node;
+  pthread_mutex_lock(&watches_mutex);
+  watch->next = watches[node->watch & 255];
+  watches[node->watch & 255] = watch;
+  pthread_mutex_unlock(&watches_mutex);
+}
+
+static struct lower_node *new_node(struct lower_node *parent, const char *name, size_t name_length, uint32_t hash)
+{
+  struct lower_node *node = malloc(sizeof(*node) + name_length + 1);
+  if (!node)
+    return NULL;
+  node->next = NULL;
+  node->parent = parent;
+  if (parent)
+    lower_node_get(parent);
+  node->refs = 1;
+  node->cached = 0;
+  node->attr_valid = 0;
+  node->fd = -1;
+  node->watch = -1;
+  node->hash = hash;
+  node->listing = NULL;
+  node->name_length = name_length;
+  memcpy(node->name, name, name_length);
+  node->name[name_length] = '\0';
+  return node;
+}
+
+// caller holds the shard lock
+static void grow_shard(struct shard *shard)
+{
+  size_t new_count = shard->bucket_count * 2;
+  struct lower_node **new_buckets = calloc(new_count, sizeof(*new_buckets));
+  size_t i;
+  if (!new_buckets)
+    return; // longer chains, still correct
+  for (i = 0; i < shard->bucket_count; i++) {
+    struct lower_node *node = shard->buckets[i];
+    while (node) {
+      struct lower_node *next = node->next;
+      struct lower_node **bucket = &new_buckets[(node->hash / SHARD_COUNT) & (new_count - 1)];
+      node->next = *bucket;
+      *bucket = node;
+      node = next;
+    }
+  }
+  free(shard->buckets);
+  shard->buckets = new_buckets;
+  shard->bucket_count = new_count;
+}
+
+// caller holds the shard lock
+static struct lower_node *find_node(struct shard *shard, struct lower_node *dir, const char *name,
+                                    size_t name_length, uint32_t hash)
+{
+  struct lower_node *node;
+  for (node = *bucket_of(shard, hash); node; node = node->next) {
+    if (node->hash == hash && node->parent == dir && node->name_length == name_length &&
+        0 == memcmp(node->name, name, name_length))
+      return node;
+  }
+  return NULL;
+}
+
+// caller holds the shard lock, returns the reference the table held
+static struct lower_node *unlink_node(struct shard *shard, struct lower_node *node)
+{
+  struct lower_node **link = bucket_of(shard, node->hash);
+  while (*link != node)
+    link = &(*link)->next;
+  *link = node->next;
+  node->next = NULL;
+  node->cached = 0;
+  node->attr_valid = 0;
+  shard->node_count--;
+  return node;
+}
+
+/*
+Looks name up in dir.  Returns 0 with a reference to the node and its
+attributes, or an errno.  ENOENT is cached like any other node.  cacheable
+is cleared, for ENOENT as well, if the result was not cached because dir
+changed while it was looked up, then it may already be stale.
+*/
+int lower_lookup(struct lower_node *dir, const char *name, struct lower_node **result, struct stat *attr,
+                 int *cacheable)
+{
+  size_t name_length = strlen(name);
+  uint32_t hash = name_hash(dir, name, name_length);
+  struct shard *shard = &shards[hash & (SHARD_COUNT - 1)];
+  struct lower_node *node;
+  struct lower_node *existing;
+  unsigned long changes;
+
+  *cacheable = 1;
+  pthread_mutex_lock(&shard->mutex);
+  node = find_node(shard, dir, name, name_length, hash);
+  if (node && (node->fd == -1 || node->attr_valid)) {
+    int fd = node->fd;
+    if (fd != -1) {
+      lower_node_get(node);
+      *attr = node->attr;
+    }
+    pthread_mutex_unlock(&shard->mutex);
+    if (fd == -1)
+      return ENOENT;
+    *result = node;
+    return 0;
+  }
+  changes = shard->changes;
+  pthread_mutex_unlock(&shard->mutex);
+
+  // a miss, or a file whose attributes changed: ask the lower filesystem
+  node = new_node(dir, name, name_length, hash);
+  if (!node)
+    return ENOMEM;
+  node->fd = openat(dir->fd, name, O_PATH | O_NOFOLLOW | O_CLOEXEC);
+  if (node->fd == -1) {
+    int error = errno;
+    if (error != ENOENT) {
+      lower_node_put(node);
+      return error;
+    }
+  } else if (-1 == fstatat(node->fd, "", &node->attr, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW)) {
+    int error = errno;
+    lower_node_put(node);
+    return error;
+  } else {
+    node->attr_valid = 1;
+    if (S_ISDIR(node->attr.st_mode))
+      add_watch(node);
+  }
+
+  pthread_mutex_lock(&shard->mutex);
+  if (shard->changes != changes) {
+    // answer this lookup, but leave the cache to the next one
+    pthread_mutex_unlock(&shard->mutex);
+    *cacheable = 0;
+    if (node->fd == -1) {
+      lower_node_put(node);
+      return ENOENT;
+    }
+    node->attr_valid = 0;
+    *attr = node->attr;
+    *result = node;
+    return 0;
+  }
+  existing = find_node(shard, dir, name, name_length, hash);
+  if (existing) {
+    // same file as the cached node: refresh it, keep its listing
+    if (existing->fd != -1 && node->fd != -1 &&
+        existing->attr.st_ino == node->attr.st_ino && existing->attr.st_dev == node->attr.st_dev) {
+      existing->attr = node->attr;
+      existing->attr_valid = 1;
+      lower_node_get(existing);
+      *attr = existing->attr;
+      pthread_mutex_unlock(&shard->mutex);
+      lower_node_put(node);
+      *result = existing;
+      return 0;
+    }
+    // replaced by another file, or raced with another lookup of a missing name
+    lower_node_put(unlink_node(shard, existing));
+  }
+  node->cached = 1;
+  node->next = *bucket_of(shard, hash);
+  *bucket_of(shard, hash) = node;
+  shard->node_count++;
+  if (shard->node_count > shard->bucket_count)
+    grow_shard(shard);
+  if (node->fd == -1) {
+    pthread_mutex_unlock(&shard->mutex);
+    return ENOENT;
+  }
+  lower_node_get(node);
+  *attr = node->attr;
+  pthread_mutex_unlock(&shard->mutex);
+  *result = node;
+  return 0;
+}
+
+// cacheable is cleared if the attributes were not cached, see lower_lookup
+int lower_getattr(struct lower_node *node, struct stat *attr, int *cacheable)
+{
+  struct shard *shard = node_shard(node);
+  struct stat fresh;
+  unsigned long changes;
+  pthread_mutex_lock(&shard->mutex);
+  if (node->attr_valid) {
+    *attr = node->attr;
+    pthread_mutex_unlock(&shard->mutex);
+    *cacheable = 1;
+    return 0;
+  }
+  changes = shard->changes;
+  pthread_mutex_unlock(&shard->mutex);
+  if (-1 == fstatat(node->fd, "", &fresh, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW))
+    return errno;
+  pthread_mutex_lock(&shard->mutex);
+  node->attr = fresh;
+  // only the table's nodes are invalidated, the others must keep asking
+  node->attr_valid = (node->cached || node == root) && shard->changes == changes;
+  *cacheable = node->attr_valid;
+  pthread_mutex_unlock(&shard->mutex);
+  *attr = fresh;
+  return 0;
+}
+
+static int read_listing(struct lower_node *dir, struct lower_listing **result)
+{
+  struct lower_listing *listing = calloc(1, sizeof(*listing));
+  size_t capacity = 64;
+  size_t names_capacity = 1024;
+  size_t names_size = 0;
+  struct dirent *entry;
+  DIR *stream;
+  int fd;
+  if (!listing)
+    return ENOMEM;
+  fd = openat(dir->fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd == -1) {
+    int error = errno;
+    free(listing);
+    return error;
+  }
+  stream = fdopendir(fd);
+  if (!stream) {
+    int error = errno;
+    close(fd);
+    free(listing);
+    return error;
+  }
+  listing->refs = 1;
+  listing->entries = malloc(capacity * sizeof(*listing->entries));
+  listing->names = malloc(names_capacity);
+  if (!listing->entries || !listing->names)
+    goto out_of_memory;
+  for (;;) {
+    size_t name_length;
+    errno = 0;
+    entry = readdir(stream);
+    if (!entry)
+      break;
+    name_length = strlen(entry->d_name);
+    if (listing->count == capacity) {
+      struct lower_dirent *entries = realloc(listing->entries, 2 * capacity * sizeof(*entries));
+      if (!entries)
+        goto out_of_memory;
+      listing->entries = entries;
+      capacity *= 2;
+    }
+    if (names_size + name_length + 1 > names_capacity) {
+      char *names;
+      while (names_size + name_length + 1 > names_capacity)
+        names_capacity *= 2;
+      names = realloc(listing->names, names_capacity);
+      if (!names)
+        goto out_of_memory;
+      listing->names = names;
+    }
+    listing->entries[listing->count].ino = entry->d_ino;
+    listing->entries[listing->count].type = entry->d_type;
+    listing->entries[listing->count].name_offset = names_size;
+    listing->entries[listing->count].name_length = name_length;
+    memcpy(listing->names + names_size, entry->d_name, name_length + 1);
+    names_size += name_length + 1;
+    listing->count++;
+  }
+  if (errno) {
+    int error = errno;
+    closedir(stream);
+    lower_listing_put(listing);
+    return error;
+  }
+  closedir(stream);
+  *result = listing;
+  return 0;
+out_of_memory:
+  closedir(stream);
+  lower_listing_put(listing);
+  return ENOMEM;
+}
+
+// returns: 0 with a reference to the entries of dir, or an errno, cacheable
+//          is cleared if they were not cached, see lower_lookup
+int lower_get_listing(struct lower_node *dir, struct lower_listing **result, int *cacheable)
+{
+  struct shard *shard = node_shard(dir);
+  struct lower_listing *listing;
+  unsigned long changes;
+  int error;
+  pthread_mutex_lock(&shard->mutex);
+  if (dir->listing) {
+    *result = dir->listing;
+    __atomic_add_fetch(&dir->listing->refs, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&shard->mutex);
+    *cacheable = 1;
+    return 0;
+  }
+  changes = shard->changes;
+  pthread_mutex_unlock(&shard->mutex);
+
+  error = read_listing(dir, &listing);
+  if (error)
+    return error;
+  pthread_mutex_lock(&shard->mutex);
+  // only watched directories are told when their listing goes stale
+  *cacheable = dir->watch != -1 && shard->changes == changes;
+  if (!dir->listing && *cacheable) {
+    dir->listing = listing;
+    __atomic_add_fetch(&listing->refs, 1, __ATOMIC_RELAXED);
+  }
+  pthread_mutex_unlock(&shard->mutex);
+  *result = listing;
+  return 0;
+}
+
+static void drop_listing(struct lower_node *node)
+{
+  struct shard *shard = node_shard(node);
+  struct lower_listing *listing;
+  pthread_mutex_lock(&shard->mutex);
+  listing = node->listing;
+  node->listing = NULL;
+  node->attr_valid = 0;
+  shard->changes++;
+  pthread_mutex_unlock(&shard->mutex);
+  if (listing)
+    lower_listing_put(listing);
+}
+
+// drops everything, after inotify lost events
+static void drop_all(void)
+{
+  unsigned i;
+  for (i = 0; i < SHARD_COUNT; i++) {
+    struct shard *shard = &shards[i];
+    struct lower_node *unlinked = NULL;
+    size_t j;
+    pthread_mutex_lock(&shard->mutex);
+    shard->changes++;
+    for (j = 0; j < shard->bucket_count; j++) {
+      while (shard->buckets[j]) {
+        struct lower_node *node = unlink_node(shard, shard->buckets[j]);
+        node->next = unlinked;
+        unlinked = node;
+      }
+    }
+    pthread_mutex_unlock(&shard->mutex);
+    while (unlinked) {
+      struct lower_node *next = unlinked->next;
+      lower_node_put(unlinked);
+      unlinked = next;
+    }
+  }
+  drop_listing(root);
+}
+
+// handles one event on the directory dir
+static void handle_change(struct lower_node *dir, const struct inotify_event *event,
+                          lower_change_callback callback, void *context)
+{
+  struct lower_node *child = NULL;
+  if (event->len == 0) {
+    // the directory itself
+    drop_listing(dir);
+    callback(dir, NULL, NULL, 1, context);
+    return;
+  }
+  {
+    size_t name_length = strlen(event->name);
+    uint32_t hash = name_hash(dir, event->name, name_length);
+    struct shard *shard = &shards[hash & (SHARD_COUNT - 1)];
+    pthread_mutex_lock(&shard->mutex);
+    // even with nothing to drop, a lookup of the name may be in flight
+    shard->changes++;
+    child = find_node(shard, dir, event->name, name_length, hash);
+    if (child)
+      unlink_node(shard, child);
+    pthread_mutex_unlock(&shard->mutex);
+  }
+  {
+    int listing_changed = (event->mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)) != 0;
+    if (listing_changed)
+      drop_listing(dir);
+    callback(dir, event->name, child, listing_changed, context);
+  }
+  if (child)
+    lower_node_put(child);
+}
+
+void lower_read_changes(lower_change_callback callback, void *context)
+{
+  char buffer[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+  for (;;) {
+    ssize_t length = read(inotify_fd, buffer, sizeof(buffer));
+    char *offset;
+    if (length <= 0) {
+      if (length == -1 && errno != EAGAIN && errno != EINTR)
+        errnof("read inotify failed");
+      return;
+    }
+    for (offset = buffer; offset < buffer + length; ) {
+      const struct inotify_event *event = (const struct inotify_event*)offset;
+      offset += sizeof(*event) + event->len;
+      if (event->mask & IN_Q_OVERFLOW) {
+        errorf("inotify queue overflowed, dropping the whole lower cache");
+        drop_all();
+        callback(NULL, NULL, NULL, 1, context);
+        continue;
+      }
+      if (event->mask & IN_IGNORED)
+        continue; // the node removes its own watch
+      {
+        // collect the nodes first, the callbacks can't run under the lock
+        struct lower_node *nodes[16];
+        unsigned node_count = 0;
+        unsigned i;
+        struct watch *watch;
+        pthread_mutex_lock(&watches_mutex);
+        for (watch = watches[event->wd & 255]; watch && node_count < 16; watch = watch->next) {
+          if (watch->wd == event->wd && node_tryget(watch->node))
+            nodes[node_count++] = watch->node;
+        }
+        pthread_mutex_unlock(&watches_mutex);
+        for (i = 0; i < node_count; i++) {
+          handle_change(nodes[i], event, callback, context);
+          lower_node_put(nodes[i]);
+        }
+      }
+    }
+  }
+}
+
+int lower_watch_fd(void)
+{
+  return inotify_fd;
+}
+
+struct lower_node *lower_root(void)
+{
+  return root;
+}
+
+int lower_init(const char *source)
+{
+  unsigned i;
+  for (i = 0; i < SHARD_COUNT; i++) {
+    pthread_mutex_init(&shards[i].mutex, NULL);
+    shards[i].bucket_count = 64;
+    shards[i].buckets = calloc(shards[i].bucket_count, sizeof(*shards[i].buckets));
+    if (!shards[i].buckets) {
+      errorf("out of memory");
+      return 1;
+    }
+  }
+  inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (inotify_fd == -1) {
+    errnof("inotify_init1 failed");
+    return 1;
+  }
+  root = new_node(NULL, "", 0, 0);
+  if (!root) {
+    errorf("out of memory");
+    return 1;
+  }
+  root->fd = open(source, O_PATH | O_DIRECTORY | O_CLOEXEC);
+  if (root->fd == -1) {
+    errnof("open '%s' failed", source);
+    return 1;
+  }
+  add_watch(root);
+  return 0;
+}
@@ -0,0 +1,63 @@
+/*
+The cache of the lower filesystem shared by every view.  A node is one name
+looked up in a lower directory, with an O_PATH fd, its attributes and for
+directories its entries.  Names that don't exist are cached as nodes with no
+fd.  Directories are watched with inotify and every change drops what it
+made stale, so stat traffic to the lower filesystem is one per unique file,
+however many views look it up.
+*/
+struct lower_dirent {
+  ino_t ino;
+  uint32_t name_offset;
+  uint16_t name_length;
+  unsigned char type; // DT_*
+};
+
+// an immutable snapshot of a directory
+struct lower_listing {
+  unsigned long refs;
+  size_t count;
+  struct lower_dirent *entries;
+  char *names;
+};
+
+struct lower_node {
+  struct lower_node *next; // in its shard bucket
+  struct lower_node *parent; // referenced, NULL for the root
+  unsigned long refs;
+  unsigned cached : 1; // in the table, the table holds a reference
+  unsigned attr_valid : 1;
+  int fd; // O_PATH, -1 for a name that does not exist
+  int watch; // inotify watch descriptor of a directory, or -1
+  uint32_t hash;
+  struct stat attr; // protected by the shard lock while attr_valid can change
+  struct lower_listing *listing; // NULL until read, or after a change
+  uint16_t name_length;
+  char name[];
+};
+
+int lower_init(const char *source);
+struct lower_node *lower_root(void);
+void lower_node_get(struct lower_node *node);
+void lower_node_put(struct lower_node *node);
+
+// cacheable is cleared when the result was read while the lower directory
+// changed, the kernel must not cache it either
+int lower_lookup(struct lower_node *dir, const char *name, struct lower_node **node, struct stat *attr,
+                 int *cacheable);
+int lower_getattr(struct lower_node *node, struct stat *attr, int *cacheable);
+int lower_get_listing(struct lower_node *dir, struct lower_listing **listing, int *cacheable);
+void lower_listing_put(struct lower_listing *listing);
+
+/*
+Called for every change inotify reports, after the cache dropped what it
+made stale: name changed in dir, and child is the node that was cached for
+it or NULL.  listing_changed is set if names were added or removed.  name
+is NULL for a change to dir itself, and dir is NULL when events were lost
+and everything may have changed.
+*/
+typedef void (*lower_change_callback)(struct lower_node *dir, const char *name, struct lower_node *child,
+                                      int listing_changed, void *context);
+
+int lower_watch_fd(void);
+void lower_read_changes(lower_change_callback callback, void *context);
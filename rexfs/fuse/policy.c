@@ -0,0 +1,358 @@
+#define _GNU_SOURCE // qsort_r
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#include "log.h"
+#include "policy.h"
+
+struct rule {
+  const char *path; // components separated by a single '/'
+  uint32_t length;
+  uint16_t flags;
+};
+
+// orders paths component by component so that every path comes right before
+// the paths below it
+static int compare_rules(const void *a, const void *b)
+{
+  const struct rule *rule_a = a;
+  const struct rule *rule_b = b;
+  uint32_t length = (rule_a->length < rule_b->length) ? rule_a->length : rule_b->length;
+  uint32_t i;
+  for (i = 0; i < length; i++) {
+    unsigned char char_a = (rule_a->path[i] == '/') ? 0 : rule_a->path[i];
+    unsigned char char_b = (rule_b->path[i] == '/') ? 0 : rule_b->path[i];
+    if (char_a != char_b)
+      return (char_a < char_b) ? -1 : 1;
+  }
+  if (rule_a->length != rule_b->length)
+    return (rule_a->length < rule_b->length) ? -1 : 1;
+  return 0;
+}
+
+static int compare_name(const struct policy *policy, const struct policy_node *node,
+                        const char *name, size_t name_length)
+{
+  if (node->name_length != name_length)
+    return (node->name_length < name_length) ? -1 : 1;
+  return memcmp(policy->names + node->name_offset, name, name_length);
+}
+
+struct build_node {
+  const char *name;
+  uint16_t name_length;
+  uint16_t flags;
+  uint32_t first_child; // 0 for none, the root is never a child
+  uint32_t last_child;
+  uint32_t next_sibling;
+  uint32_t child_count;
+};
+
+static int compare_children(const void *a, const void *b, void *context)
+{
+  const struct build_node *nodes = context;
+  const struct build_node *node_a = &nodes[*(const uint32_t*)a];
+  const struct build_node *node_b = &nodes[*(const uint32_t*)b];
+  if (node_a->name_length != node_b->name_length)
+    return (node_a->name_length < node_b->name_length) ? -1 : 1;
+  return memcmp(node_a->name, node_b->name, node_a->name_length);
+}
+
+/*
+The same two passes as the kernel: build the trie from sorted rules with a
+stack, then lay it out breadth first so the children of every node are
+contiguous.
+*/
+static struct policy *policy_build(struct rule *rules, uint32_t rule_count)
+{
+  struct build_node *nodes = NULL;
+  uint32_t *stack = NULL;
+  uint32_t *order = NULL; // new index -> build index
+  struct policy *policy = NULL;
+  uint32_t node_count = 1;
+  size_t max_nodes = 1;
+  size_t max_depth = 0;
+  size_t names_size = 0;
+  uint32_t i;
+
+  for (i = 0; i < rule_count; i++) {
+    size_t depth = 0;
+    uint32_t j;
+    for (j = 0; j < rules[i].length; j++)
+      depth += (rules[i].path[j] == '/');
+    if (rules[i].length > 0)
+      depth++;
+    max_nodes += depth;
+    if (depth > max_depth)
+      max_depth = depth;
+  }
+  if (max_nodes > UINT32_MAX) {
+    errorf("policy has too many paths");
+    return NULL;
+  }
+  nodes = calloc(max_nodes, sizeof(*nodes));
+  stack = malloc((max_depth + 1) * sizeof(*stack));
+  if (!nodes || !stack) {
+    errorf("out of memory building a policy of %zu nodes", max_nodes);
+    goto out;
+  }
+
+  qsort(rules, rule_count, sizeof(*rules), compare_rules);
+  stack[0] = 0;
+  for (i = 0; i < rule_count; i++) {
+    const char *component = rules[i].path;
+    const char *end = rules[i].path + rules[i].length;
+    uint32_t depth = 0;
+    int matching = 1;
+    while (component < end) {
+      const char *slash = memchr(component, '/', end - component);
+      uint32_t length = (slash ? slash : end) - component;
+      uint32_t parent = stack[depth];
+      // the stack still holds the previous path, share its prefix
+      if (matching && nodes[parent].last_child) {
+        struct build_node *last = &nodes[nodes[parent].last_child];
+        if (last->name_length == length && 0 == memcmp(last->name, component, length)) {
+          stack[++depth] = nodes[parent].last_child;
+          component += length + 1;
+          continue;
+        }
+      }
+      matching = 0;
+      {
+        uint32_t index = node_count++;
+        struct build_node *node = &nodes[index];
+        node->name = component;
+        node->name_length = length;
+        if (nodes[parent].last_child)
+          nodes[nodes[parent].last_child].next_sibling = index;
+        else
+          nodes[parent].first_child = index;
+        nodes[parent].last_child = index;
+        nodes[parent].child_count++;
+        names_size += length;
+        stack[++depth] = index;
+      }
+      component += length + 1;
+    }
+    nodes[stack[depth]].flags |= rules[i].flags;
+  }
+
+  order = malloc(node_count * sizeof(*order));
+  policy = malloc(sizeof(*policy) + node_count * sizeof(struct policy_node) + names_size);
+  if (!order || !policy) {
+    errorf("out of memory building a policy of %u nodes", node_count);
+    free(policy);
+    policy = NULL;
+    goto out;
+  }
+  policy->node_count = node_count;
+  policy->nodes = (struct policy_node*)(policy + 1);
+  policy->names = (char*)(policy->nodes + node_count);
+
+  {
+    uint32_t next_index = 1;
+    size_t names_offset = 0;
+    order[0] = 0;
+    for (i = 0; i < node_count; i++) {
+      struct build_node *node = &nodes[order[i]];
+      struct policy_node *out = &policy->nodes[i];
+      uint32_t first = next_index;
+      uint32_t child;
+      out->name_offset = names_offset;
+      out->name_length = node->name_length;
+      out->flags = node->flags;
+      out->first_child = next_index;
+      out->child_count = node->child_count;
+      memcpy(policy->names + names_offset, node->name, node->name_length);
+      names_offset += node->name_length;
+      for (child = node->first_child; child; child = nodes[child].next_sibling)
+        order[next_index++] = child;
+      qsort_r(order + first, next_index - first, sizeof(*order), compare_children, nodes);
+    }
+  }
+
+out:
+  free(order);
+  free(stack);
+  free(nodes);
+  return policy;
+}
+
+static int normalize_path(const char *path, size_t length, char *out, uint32_t *out_length)
+{
+  const char *end = path + length;
+  uint32_t offset = 0;
+  while (path < end) {
+    const char *slash = memchr(path, '/', end - path);
+    size_t component_length = (slash ? slash : end) - path;
+    if (component_length == 0 || (component_length == 1 && path[0] == '.')) {
+      // skip
+    } else if (component_length == 2 && path[0] == '.' && path[1] == '.') {
+      return -1;
+    } else if (component_length > NAME_MAX) {
+      return -1;
+    } else {
+      if (offset > 0)
+        out[offset++] = '/';
+      memcpy(out + offset, path, component_length);
+      offset += component_length;
+    }
+    path += component_length + 1;
+  }
+  *out_length = offset;
+  return 0;
+}
+
+struct policy *policy_parse(const char *text, size_t size)
+{
+  const char *end = text + size;
+  const char *line;
+  struct rule *rules;
+  char *paths;
+  uint32_t rule_count = 0;
+  size_t paths_offset = 0;
+  size_t line_count = 1;
+  struct policy *policy = NULL;
+
+  for (line = text; line < end; line++)
+    line_count += (*line == '\n');
+  rules = malloc(line_count * sizeof(*rules));
+  paths = malloc(size + 1);
+  if (!rules || !paths) {
+    errorf("out of memory parsing a config of %zu bytes", size);
+    goto out;
+  }
+
+  for (line = text; line < end; ) {
+    const char *newline = memchr(line, '\n', end - line);
+    const char *line_end = newline ? newline : end;
+    const char *path;
+    uint16_t flags;
+    size_t length = line_end - line;
+    if (length == 0 || line[0] == '#') {
+      line = line_end + 1;
+      continue;
+    }
+    if (length >= 5 && 0 == memcmp(line, "read:", 5)) {
+      path = line + 5;
+      flags = POLICY_ALLOW_READ;
+    } else if (length >= 6 && 0 == memcmp(line, "write:", 6)) {
+      path = line + 6;
+      flags = POLICY_ALLOW_READ | POLICY_ALLOW_WRITE;
+    } else {
+      errorf("invalid config line '%.*s'", (int)length, line);
+      goto out;
+    }
+    {
+      uint32_t path_length;
+      if (normalize_path(path, line_end - path, paths + paths_offset, &path_length)) {
+        errorf("invalid config path '%.*s'", (int)(line_end - path), path);
+        goto out;
+      }
+      rules[rule_count].path = paths + paths_offset;
+      rules[rule_count].length = path_length;
+      rules[rule_count].flags = flags;
+      rule_count++;
+      paths_offset += path_length + 1;
+    }
+    line = line_end + 1;
+  }
+  policy = policy_build(rules, rule_count);
+out:
+  free(paths);
+  free(rules);
+  return policy;
+}
+
+struct policy *policy_load(const char *filename)
+{
+  struct policy *policy;
+  struct stat file_stat;
+  char *text;
+  ssize_t length;
+  int fd = open(filename, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    errnof("open '%s' failed", filename);
+    return NULL;
+  }
+  if (-1 == fstat(fd, &file_stat)) {
+    errnof("fstat '%s' failed", filename);
+    close(fd);
+    return NULL;
+  }
+  text = malloc(file_stat.st_size + 1);
+  if (!text) {
+    errorf("out of memory reading '%s'", filename);
+    close(fd);
+    return NULL;
+  }
+  length = read(fd, text, file_stat.st_size);
+  close(fd);
+  if (length != file_stat.st_size) {
+    if (length == -1)
+      errnof("read '%s' failed", filename);
+    else
+      errorf("read '%s' returned %zd, expected %zu", filename, length, (size_t)file_stat.st_size);
+    free(text);
+    return NULL;
+  }
+  policy = policy_parse(text, length);
+  free(text);
+  return policy;
+}
+
+void policy_free(struct policy *policy)
+{
+  free(policy);
+}
+
+struct policy_match policy_root_match(const struct policy *policy)
+{
+  struct policy_match match;
+  if (!policy) {
+    match.node = 0;
+    match.type = POLICY_MATCH_BELOW;
+    match.flags = POLICY_ALLOW_READ | POLICY_ALLOW_WRITE;
+  } else {
+    match.node = 0;
+    match.type = POLICY_MATCH_NODE;
+    match.flags = policy->nodes[0].flags;
+  }
+  return match;
+}
+
+struct policy_match policy_child_match(const struct policy *policy, struct policy_match parent,
+                                       const char *name, size_t name_length)
+{
+  struct policy_match match;
+  match.flags = parent.flags;
+  if (parent.type == POLICY_MATCH_NODE) {
+    const struct policy_node *node = &policy->nodes[parent.node];
+    uint32_t low = node->first_child;
+    uint32_t high = node->first_child + node->child_count;
+    while (low < high) {
+      uint32_t middle = low + (high - low) / 2;
+      int cmp = compare_name(policy, &policy->nodes[middle], name, name_length);
+      if (cmp == 0) {
+        match.node = middle;
+        match.type = POLICY_MATCH_NODE;
+        match.flags |= policy->nodes[middle].flags;
+        return match;
+      }
+      if (cmp < 0)
+        low = middle + 1;
+      else
+        high = middle;
+    }
+  }
+  match.node = 0;
+  match.type = match.flags ? POLICY_MATCH_BELOW : POLICY_MATCH_OUTSIDE;
+  return match;
+}
@@ -0,0 +1,45 @@
+/*
+The userspace version of the policy in ../kernel/policy.c.  A config has the
+same lines as REXFS_IOC_SET_CONFIG:
+
+  read:<path>   allow reading <path> and everything below it
+  write:<path>  allow reading and writing <path> and everything below it
+
+and is compiled into an immutable trie of path components.  The children of
+a node are contiguous and sorted by (name_length, name).
+*/
+#define POLICY_ALLOW_READ  0x1
+#define POLICY_ALLOW_WRITE 0x2
+
+#define POLICY_MATCH_NODE    0 // the path is a node of the policy
+#define POLICY_MATCH_BELOW   1 // the path is below a node that allows it
+#define POLICY_MATCH_OUTSIDE 2 // the policy does not allow the path at all
+
+struct policy_node {
+  uint32_t name_offset;
+  uint16_t name_length;
+  uint16_t flags; // POLICY_ALLOW_* for this path and everything below it
+  uint32_t first_child;
+  uint32_t child_count;
+};
+
+struct policy {
+  uint32_t node_count;
+  struct policy_node *nodes;
+  char *names;
+};
+
+struct policy_match {
+  uint32_t node; // for POLICY_MATCH_NODE
+  uint8_t type;
+  uint8_t flags; // POLICY_ALLOW_* inherited by the path
+};
+
+struct policy *policy_load(const char *filename);
+struct policy *policy_parse(const char *text, size_t size);
+void policy_free(struct policy *policy);
+
+// policy can be NULL for a view that allows everything
+struct policy_match policy_root_match(const struct policy *policy);
+struct policy_match policy_child_match(const struct policy *policy, struct policy_match parent,
+                                       const char *name, size_t name_length);
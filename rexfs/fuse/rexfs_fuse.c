@@ -1,40 +1,1123 @@
+/*
+rexfs over FUSE, for hosts that can't load the kernel module.  It is a
+passthrough of a source directory (/ by default) that enforces the same
+config as REXFS_IOC_SET_CONFIG: names outside the policy don't exist,
+directories leading to a rule can be walked but not listed, and files can
+only be opened for what the policy allows.
+
+Usage: rexfs [-o config=FILE,source=DIR,timeout=SECONDS,control=SOCKET] [MOUNTPOINT]
+
+One process serves any number of views of the source, each its own mount
+with its own policy: the one on the command line, and the ones mounted
+through the control socket while it runs.  Each view is a separate FUSE
+session, so the kernel never shares a cached dentry between two policies.
+What they share is the cache of the lower filesystem in lower.c, so a
+64-way build stats each file of /usr/include once, not 64 times.
+
+The control socket takes one request per connection, a line of
+
+  mount MOUNTPOINT [CONFIG]
+  unmount MOUNTPOINT
+
+and answers "ok" or "error <reason>", e.g. with
+echo mount /tmp/job1 /tmp/job1.config | nc -U /run/rexfs.sock.
+
+It uses the low-level API with a multithreaded session loop per view.  Data
+is spliced, and when the kernel supports FUSE_PASSTHROUGH, reads and writes
+of open files go straight to the lower file without reaching this process
+at all.  Entries, attributes, pages and directory listings are cached by
+the kernel for a long time, and inotify on the lower directories tells
+every view's kernel cache what changed.
+*/
+#define _GNU_SOURCE
+#define FUSE_USE_VERSION 34
+
+#include <fuse_lowlevel.h>
+
 #include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mount.h>
+#include <sys/wait.h>
+#include <sys/signalfd.h>
+#include <sys/eventfd.h>
 
-#include <fuse.h>
+#include "log.h"
+#include "policy.h"
+#include "lower.h"
 
-#define errorf(fmt,...) fprintf(stderr, "Error: " fmt "\n", ##__VA_ARGS__)
+/*
+An inode is one lower node reached with one policy match.  The same lower
+file reached through paths the policy treats differently gets one inode per
+match, so the match of an inode never depends on how it was found.
+*/
+struct view_inode {
+  struct view_inode *next; // in its bucket
+  struct lower_node *node; // referenced
+  struct policy_match match;
+  uint64_t nlookup;
+};
+
+struct view {
+  struct view *next; // in server.views
+  struct policy *policy; // NULL to allow everything
+  struct fuse_session *session;
+  char *mountpoint;
+  int passthrough;
+  int stopping; // protected by server.mutex
+  struct view_inode root;
+  pthread_mutex_t mutex; // protects the table and nlookup
+  struct view_inode **buckets;
+  size_t bucket_count;
+  size_t inode_count;
+};
+
+static struct {
+  double timeout;
+  int passthrough;
+  int proc_self_fd;
+  int singlethread;
+  int clone_fd;
+  unsigned max_idle_threads;
+  struct fuse_args args; // passed to every session
+  int wake_fd; // an eventfd, written when a view exits
+  pthread_mutex_t mutex; // protects views, and sessions from being destroyed
+  struct view *views;
+  size_t view_count;
+} server = { .mutex = PTHREAD_MUTEX_INITIALIZER };
 
-int rexfs_getattr(const char *path, struct stat *statbuf)
+struct rexfs_file {
+  int fd;
+  int backing_id; // 0 unless the kernel reads and writes the fd directly
+};
+
+static struct view *get_view(fuse_req_t req)
 {
-  errorf("getattr not implemented");
-  return 1; // error
+  return fuse_req_userdata(req);
 }
-int rexfs_readlink(const char *path, char *link, size_t size)
+
+static struct view_inode *get_inode(fuse_req_t req, fuse_ino_t ino)
 {
-  errorf("readlink not implemented");
-  return 1; // error
+  if (ino == FUSE_ROOT_ID)
+    return &get_view(req)->root;
+  return (struct view_inode*)(uintptr_t)ino;
 }
-/*
-int rexfs_open(const char *path, struct fuse_file_info *fi)
+
+static int is_dot_or_dot_dot(const char *name)
 {
-  errorf("open not implemented");
-  return 1; // error
+  return name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'));
 }
-int rexfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+
+// by node only, so invalidation finds the inodes of every match
+static size_t inode_hash(const struct lower_node *node)
+{
+  uint64_t hash = (uint64_t)(uintptr_t)node * 0x9e3779b97f4a7c15ULL;
+  return (size_t)(hash ^ (hash >> 29));
+}
+
+static int same_match(struct policy_match a, struct policy_match b)
+{
+  return a.node == b.node && a.type == b.type && a.flags == b.flags;
+}
+
+// caller holds the mutex
+static void grow_table(struct view *view)
 {
-  errorf("read not implemented");
-  return 1; // error
+  size_t new_count = view->bucket_count * 2;
+  struct view_inode **new_buckets = calloc(new_count, sizeof(*new_buckets));
+  size_t i;
+  if (!new_buckets)
+    return; // longer chains, still correct
+  for (i = 0; i < view->bucket_count; i++) {
+    struct view_inode *inode = view->buckets[i];
+    while (inode) {
+      struct view_inode *next = inode->next;
+      size_t bucket = inode_hash(inode->node) & (new_count - 1);
+      inode->next = new_buckets[bucket];
+      new_buckets[bucket] = inode;
+      inode = next;
+    }
+  }
+  free(view->buckets);
+  view->buckets = new_buckets;
+  view->bucket_count = new_count;
 }
+
+/*
+Returns the inode for node with one more lookup reference, creating it if
+needed.  Always takes ownership of the node reference.
 */
+static struct view_inode *ref_inode(struct view *view, struct lower_node *node, struct policy_match match)
+{
+  struct view_inode *inode;
+  size_t bucket;
+  pthread_mutex_lock(&view->mutex);
+  bucket = inode_hash(node) & (view->bucket_count - 1);
+  for (inode = view->buckets[bucket]; inode; inode = inode->next) {
+    if (inode->node == node && same_match(inode->match, match)) {
+      inode->nlookup++;
+      pthread_mutex_unlock(&view->mutex);
+      lower_node_put(node);
+      return inode;
+    }
+  }
+  inode = malloc(sizeof(*inode));
+  if (!inode) {
+    pthread_mutex_unlock(&view->mutex);
+    lower_node_put(node);
+    return NULL;
+  }
+  inode->node = node;
+  inode->match = match;
+  inode->nlookup = 1;
+  inode->next = view->buckets[bucket];
+  view->buckets[bucket] = inode;
+  view->inode_count++;
+  if (view->inode_count > view->bucket_count)
+    grow_table(view);
+  pthread_mutex_unlock(&view->mutex);
+  return inode;
+}
+
+static void unref_inode(struct view *view, struct view_inode *inode, uint64_t count)
+{
+  struct view_inode **link;
+  if (inode == &view->root)
+    return;
+  pthread_mutex_lock(&view->mutex);
+  inode->nlookup -= count;
+  if (inode->nlookup > 0) {
+    pthread_mutex_unlock(&view->mutex);
+    return;
+  }
+  link = &view->buckets[inode_hash(inode->node) & (view->bucket_count - 1)];
+  while (*link != inode)
+    link = &(*link)->next;
+  *link = inode->next;
+  view->inode_count--;
+  pthread_mutex_unlock(&view->mutex);
+  lower_node_put(inode->node);
+  free(inode);
+}
+
+// returns: 0 or an errno, ENOENT for names the policy hides
+static int do_lookup(fuse_req_t req, fuse_ino_t parent, const char *name, struct fuse_entry_param *entry)
+{
+  struct view *view = get_view(req);
+  struct view_inode *dir = get_inode(req, parent);
+  struct view_inode *inode;
+  struct lower_node *node;
+  struct policy_match match;
+  int cacheable;
+  int error;
+
+  memset(entry, 0, sizeof(*entry));
+  entry->attr_timeout = server.timeout;
+  entry->entry_timeout = server.timeout;
+  // "." and ".." only come from NFS exports, which are not supported
+  if (is_dot_or_dot_dot(name))
+    return ENOENT;
+  match = policy_child_match(view->policy, dir->match, name, strlen(name));
+  if (match.type == POLICY_MATCH_OUTSIDE)
+    return ENOENT;
 
-struct fuse_operations ops = {
+  error = lower_lookup(dir->node, name, &node, &entry->attr, &cacheable);
+  if (!cacheable) {
+    entry->attr_timeout = 0;
+    entry->entry_timeout = 0;
+  }
+  if (error)
+    return error;
+  inode = ref_inode(view, node, match);
+  if (!inode)
+    return ENOMEM;
+  entry->ino = (uintptr_t)inode;
+  return 0;
+}
+
+static void rexfs_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+  struct fuse_entry_param entry;
+  int error = do_lookup(req, parent, name, &entry);
+  if (error == ENOENT) {
+    // a zero ino caches the miss for entry_timeout, inotify drops it if the name appears
+    entry.ino = 0;
+    fuse_reply_entry(req, &entry);
+  } else if (error) {
+    fuse_reply_err(req, error);
+  } else {
+    fuse_reply_entry(req, &entry);
+  }
+}
+
+static void rexfs_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup)
+{
+  unref_inode(get_view(req), get_inode(req, ino), nlookup);
+  fuse_reply_none(req);
+}
+
+static void rexfs_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data *forgets)
+{
+  size_t i;
+  for (i = 0; i < count; i++)
+    unref_inode(get_view(req), get_inode(req, forgets[i].ino), forgets[i].nlookup);
+  fuse_reply_none(req);
+}
+
+static void rexfs_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+  struct stat file_stat;
+  int cacheable;
+  int error = lower_getattr(get_inode(req, ino)->node, &file_stat, &cacheable);
+  if (error) {
+    fuse_reply_err(req, error);
+    return;
+  }
+  fuse_reply_attr(req, &file_stat, cacheable ? server.timeout : 0);
+}
+
+static void rexfs_readlink(fuse_req_t req, fuse_ino_t ino)
+{
+  char target[PATH_MAX + 1];
+  ssize_t length = readlinkat(get_inode(req, ino)->node->fd, "", target, sizeof(target));
+  if (length == -1) {
+    fuse_reply_err(req, errno);
+    return;
+  }
+  if (length == sizeof(target)) {
+    fuse_reply_err(req, ENAMETOOLONG);
+    return;
+  }
+  target[length] = '\0';
+  fuse_reply_readlink(req, target);
+}
+
+// opens the lower file of inode again with real access, through /proc/self/fd
+static int reopen(struct view_inode *inode, int flags)
+{
+  char fd_name[32];
+  snprintf(fd_name, sizeof(fd_name), "%d", inode->node->fd);
+  return openat(server.proc_self_fd, fd_name, flags | O_CLOEXEC);
+}
+
+static void rexfs_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+  struct view *view = get_view(req);
+  struct view_inode *inode = get_inode(req, ino);
+  struct rexfs_file *file;
+  int access = fi->flags & O_ACCMODE;
+  int want_read = (access != O_WRONLY);
+  int want_write = (access != O_RDONLY) || (fi->flags & O_TRUNC);
+
+  if ((want_read && !(inode->match.flags & POLICY_ALLOW_READ)) ||
+      (want_write && !(inode->match.flags & POLICY_ALLOW_WRITE))) {
+    fuse_reply_err(req, EACCES);
+    return;
+  }
+  file = malloc(sizeof(*file));
+  if (!file) {
+    fuse_reply_err(req, ENOMEM);
+    return;
+  }
+  file->fd = reopen(inode, fi->flags & ~(O_NOFOLLOW | O_CREAT | O_EXCL | O_NOCTTY));
+  if (file->fd == -1) {
+    fuse_reply_err(req, errno);
+    free(file);
+    return;
+  }
+  file->backing_id = 0;
+#ifdef FUSE_CAP_PASSTHROUGH
+  if (view->passthrough) {
+    // falls back to splicing through this process if the kernel refuses
+    int backing_id = fuse_passthrough_open(req, file->fd);
+    if (backing_id > 0) {
+      file->backing_id = backing_id;
+      fi->backing_id = backing_id;
+    }
+  }
+#endif
+  fi->fh = (uintptr_t)file;
+  fi->keep_cache = 1;
+  fuse_reply_open(req, fi);
+}
+
+static struct rexfs_file *get_file(struct fuse_file_info *fi)
+{
+  return (struct rexfs_file*)(uintptr_t)fi->fh;
+}
+
+static void rexfs_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+  struct rexfs_file *file = get_file(fi);
+#ifdef FUSE_CAP_PASSTHROUGH
+  if (file->backing_id)
+    fuse_passthrough_close(req, file->backing_id);
+#endif
+  close(file->fd);
+  free(file);
+  fuse_reply_err(req, 0);
+}
+
+static void rexfs_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+  // libfuse splices from the fd into the request pipe
+  struct fuse_bufvec buffer = FUSE_BUFVEC_INIT(size);
+  buffer.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+  buffer.buf[0].fd = get_file(fi)->fd;
+  buffer.buf[0].pos = offset;
+  fuse_reply_data(req, &buffer, FUSE_BUF_SPLICE_MOVE);
+}
+
+static void rexfs_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *in,
+                            off_t offset, struct fuse_file_info *fi)
+{
+  struct fuse_bufvec out = FUSE_BUFVEC_INIT(fuse_buf_size(in));
+  ssize_t written;
+  out.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+  out.buf[0].fd = get_file(fi)->fd;
+  out.buf[0].pos = offset;
+  written = fuse_buf_copy(&out, in, 0);
+  if (written < 0)
+    fuse_reply_err(req, -written);
+  else
+    fuse_reply_write(req, written);
+}
+
+static void rexfs_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+  // report errors close would report without closing the fd
+  int result = close(dup(get_file(fi)->fd));
+  fuse_reply_err(req, (result == -1) ? errno : 0);
+}
+
+static void rexfs_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi)
+{
+  int fd = get_file(fi)->fd;
+  int result = datasync ? fdatasync(fd) : fsync(fd);
+  fuse_reply_err(req, (result == -1) ? errno : 0);
+}
+
+static void rexfs_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+  struct view_inode *inode = get_inode(req, ino);
+  struct lower_listing *listing;
+  int cacheable;
+  int error;
+  // the directories leading to a rule can be walked through but not listed
+  if (!(inode->match.flags & POLICY_ALLOW_READ)) {
+    fuse_reply_err(req, EACCES);
+    return;
+  }
+  // a snapshot shared with every view that lists it before it changes
+  error = lower_get_listing(inode->node, &listing, &cacheable);
+  if (error) {
+    fuse_reply_err(req, error);
+    return;
+  }
+  fi->fh = (uintptr_t)listing;
+  fi->keep_cache = cacheable;
+  fi->cache_readdir = cacheable;
+  fuse_reply_open(req, fi);
+}
+
+// offsets are the index of the next entry in the listing, plus one
+static void do_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+                       struct fuse_file_info *fi, int plus)
+{
+  struct view *view = get_view(req);
+  struct view_inode *inode = get_inode(req, ino);
+  struct lower_listing *listing = (struct lower_listing*)(uintptr_t)fi->fh;
+  char *buffer = malloc(size);
+  size_t remaining = size;
+  size_t index;
+  int error = 0;
+  if (!buffer) {
+    fuse_reply_err(req, ENOMEM);
+    return;
+  }
+  for (index = offset; index < listing->count; index++) {
+    const struct lower_dirent *dirent = &listing->entries[index];
+    const char *name = listing->names + dirent->name_offset;
+    size_t entry_size;
+    fuse_ino_t entry_ino = 0;
+    if (!is_dot_or_dot_dot(name) &&
+        policy_child_match(view->policy, inode->match, name, dirent->name_length).type == POLICY_MATCH_OUTSIDE)
+      continue; // hidden names are not listed either
+    if (plus) {
+      struct fuse_entry_param entry;
+      if (is_dot_or_dot_dot(name)) {
+        memset(&entry, 0, sizeof(entry));
+        entry.attr.st_ino = dirent->ino;
+        entry.attr.st_mode = dirent->type << 12;
+      } else {
+        int lookup_error = do_lookup(req, ino, name, &entry);
+        if (lookup_error == ENOENT)
+          continue; // removed since it was read
+        if (lookup_error) {
+          error = lookup_error;
+          break;
+        }
+        entry_ino = entry.ino;
+      }
+      entry_size = fuse_add_direntry_plus(req, buffer + size - remaining, remaining, name, &entry, index + 1);
+    } else {
+      struct stat file_stat;
+      memset(&file_stat, 0, sizeof(file_stat));
+      file_stat.st_ino = dirent->ino;
+      file_stat.st_mode = dirent->type << 12;
+      entry_size = fuse_add_direntry(req, buffer + size - remaining, remaining, name, &file_stat, index + 1);
+    }
+    if (entry_size > remaining) {
+      // the entry was not added, the kernel won't count its lookup
+      if (entry_ino)
+        unref_inode(view, (struct view_inode*)(uintptr_t)entry_ino, 1);
+      break;
+    }
+    remaining -= entry_size;
+  }
+  // entries already added must be returned, their lookups were counted
+  if (error && remaining == size)
+    fuse_reply_err(req, error);
+  else
+    fuse_reply_buf(req, buffer, size - remaining);
+  free(buffer);
+}
+
+static void rexfs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+  do_readdir(req, ino, size, offset, fi, 0);
+}
+
+static void rexfs_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+  do_readdir(req, ino, size, offset, fi, 1);
+}
+
+static void rexfs_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+  lower_listing_put((struct lower_listing*)(uintptr_t)fi->fh);
+  fuse_reply_err(req, 0);
+}
+
+static void rexfs_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+  struct statvfs fs_stat;
+  if (-1 == fstatvfs(get_inode(req, ino)->node->fd, &fs_stat)) {
+    fuse_reply_err(req, errno);
+    return;
+  }
+  fuse_reply_statfs(req, &fs_stat);
+}
+
+static void rexfs_init(void *userdata, struct fuse_conn_info *conn)
+{
+  struct view *view = userdata;
+  if (conn->capable & FUSE_CAP_SPLICE_READ)
+    conn->want |= FUSE_CAP_SPLICE_READ;
+  if (conn->capable & FUSE_CAP_SPLICE_WRITE)
+    conn->want |= FUSE_CAP_SPLICE_WRITE;
+  if (conn->capable & FUSE_CAP_SPLICE_MOVE)
+    conn->want |= FUSE_CAP_SPLICE_MOVE;
+  // a listing is almost always followed by a stat of every entry
+  if (conn->capable & FUSE_CAP_READDIRPLUS)
+    conn->want |= FUSE_CAP_READDIRPLUS;
+  conn->want &= ~FUSE_CAP_READDIRPLUS_AUTO;
+#ifdef FUSE_CAP_CACHE_SYMLINKS
+  if (conn->capable & FUSE_CAP_CACHE_SYMLINKS)
+    conn->want |= FUSE_CAP_CACHE_SYMLINKS;
+#endif
+#ifdef FUSE_CAP_PASSTHROUGH
+  if (view->passthrough && (conn->capable & FUSE_CAP_PASSTHROUGH))
+    conn->want |= FUSE_CAP_PASSTHROUGH;
+  else
+    view->passthrough = 0;
+#else
+  view->passthrough = 0;
+#endif
+}
+
+static const struct fuse_lowlevel_ops rexfs_ops = {
+  .init = rexfs_init,
+  .lookup = rexfs_lookup,
+  .forget = rexfs_forget,
+  .forget_multi = rexfs_forget_multi,
   .getattr = rexfs_getattr,
   .readlink = rexfs_readlink,
-  //.open = rexfs_open
-  //.read = rexfs_read
+  .open = rexfs_open,
+  .read = rexfs_read,
+  .write_buf = rexfs_write_buf,
+  .flush = rexfs_flush,
+  .fsync = rexfs_fsync,
+  .release = rexfs_release,
+  .opendir = rexfs_opendir,
+  .readdir = rexfs_readdir,
+  .readdirplus = rexfs_readdirplus,
+  .releasedir = rexfs_releasedir,
+  .statfs = rexfs_statfs,
+};
+
+// caller holds the view mutex
+static size_t collect_inodes(struct view *view, const struct lower_node *node, fuse_ino_t *inos, size_t max)
+{
+  struct view_inode *inode;
+  size_t count = 0;
+  if (view->root.node == node && count < max)
+    inos[count++] = FUSE_ROOT_ID;
+  for (inode = view->buckets[inode_hash(node) & (view->bucket_count - 1)]; inode; inode = inode->next) {
+    if (inode->node == node && count < max)
+      inos[count++] = (uintptr_t)inode;
+  }
+  return count;
+}
+
+// after lost events: everything the kernel has cached, except names, which expire with the timeout
+static void invalidate_all(struct view *view)
+{
+  fuse_ino_t *inos;
+  size_t count = 0;
+  size_t i;
+  pthread_mutex_lock(&view->mutex);
+  inos = malloc((view->inode_count + 1) * sizeof(*inos));
+  if (inos) {
+    struct view_inode *inode;
+    inos[count++] = FUSE_ROOT_ID;
+    for (i = 0; i < view->bucket_count; i++) {
+      for (inode = view->buckets[i]; inode; inode = inode->next)
+        inos[count++] = (uintptr_t)inode;
+    }
+  }
+  pthread_mutex_unlock(&view->mutex);
+  if (!inos) {
+    errorf("out of memory, the kernel cache of '%s' stays stale", view->mountpoint);
+    return;
+  }
+  for (i = 0; i < count; i++)
+    fuse_lowlevel_notify_inval_inode(view->session, inos[i], 0, 0);
+  free(inos);
+}
+
+/*
+Tells the kernel of every view what a lower change made stale.  It runs on
+the main thread, never in a request handler, since the kernel can wait for
+requests to finish before it invalidates.  An inode can be forgotten after
+its id was collected, which at worst invalidates an unrelated inode.
+*/
+static void invalidate(struct lower_node *dir, const char *name, struct lower_node *child,
+                       int listing_changed, void *context)
+{
+  struct view *view;
+  pthread_mutex_lock(&server.mutex);
+  for (view = server.views; view; view = view->next) {
+    fuse_ino_t dir_inos[8];
+    fuse_ino_t child_inos[8];
+    size_t dir_count;
+    size_t child_count = 0;
+    size_t i;
+    if (!dir) {
+      invalidate_all(view);
+      continue;
+    }
+    pthread_mutex_lock(&view->mutex);
+    dir_count = collect_inodes(view, dir, dir_inos, 8);
+    if (child)
+      child_count = collect_inodes(view, child, child_inos, 8);
+    pthread_mutex_unlock(&view->mutex);
+    for (i = 0; i < dir_count; i++) {
+      if (name)
+        fuse_lowlevel_notify_inval_entry(view->session, dir_inos[i], name, strlen(name));
+      if (listing_changed)
+        fuse_lowlevel_notify_inval_inode(view->session, dir_inos[i], 0, 0);
+    }
+    for (i = 0; i < child_count; i++)
+      fuse_lowlevel_notify_inval_inode(view->session, child_inos[i], 0, 0);
+  }
+  pthread_mutex_unlock(&server.mutex);
+}
+
+static void free_view(struct view *view)
+{
+  size_t i;
+  // the kernel is gone, so are all its lookups
+  for (i = 0; i < view->bucket_count; i++) {
+    struct view_inode *inode = view->buckets[i];
+    while (inode) {
+      struct view_inode *next = inode->next;
+      lower_node_put(inode->node);
+      free(inode);
+      inode = next;
+    }
+  }
+  free(view->buckets);
+  lower_node_put(view->root.node);
+  policy_free(view->policy);
+  free(view->mountpoint);
+  pthread_mutex_destroy(&view->mutex);
+  free(view);
+}
+
+// returns: a view mounted on mountpoint but not served yet, or NULL
+static struct view *new_view(const char *mountpoint, const char *config)
+{
+  struct view *view = calloc(1, sizeof(*view));
+  struct fuse_args args = FUSE_ARGS_INIT(0, NULL);
+  int i;
+  if (!view) {
+    errorf("out of memory");
+    return NULL;
+  }
+  pthread_mutex_init(&view->mutex, NULL);
+  view->root.node = lower_root();
+  lower_node_get(view->root.node);
+  view->passthrough = server.passthrough;
+  view->mountpoint = strdup(mountpoint);
+  view->bucket_count = 1024;
+  view->buckets = calloc(view->bucket_count, sizeof(*view->buckets));
+  if (!view->mountpoint || !view->buckets) {
+    errorf("out of memory");
+    goto out_view;
+  }
+  if (config) {
+    view->policy = policy_load(config);
+    if (!view->policy)
+      goto out_view; // error already logged
+  }
+  view->root.match = policy_root_match(view->policy);
+  view->root.nlookup = 2;
+
+  // fuse_session_new consumes its arguments
+  for (i = 0; i < server.args.argc; i++) {
+    if (fuse_opt_add_arg(&args, server.args.argv[i]) == -1)
+      goto out_args;
+  }
+  view->session = fuse_session_new(&args, &rexfs_ops, sizeof(rexfs_ops), view);
+  if (!view->session)
+    goto out_args; // error already logged
+  if (fuse_session_mount(view->session, mountpoint) != 0)
+    goto out_session;
+  fuse_opt_free_args(&args);
+  return view;
+out_session:
+  fuse_session_destroy(view->session);
+out_args:
+  fuse_opt_free_args(&args);
+out_view:
+  free_view(view);
+  return NULL;
+}
+
+static void *serve_view(void *arg)
+{
+  struct view *view = arg;
+  struct view **link;
+  uint64_t one = 1;
+  if (server.singlethread) {
+    fuse_session_loop(view->session);
+  } else {
+    struct fuse_loop_config loop_config;
+    loop_config.clone_fd = server.clone_fd;
+    loop_config.max_idle_threads = server.max_idle_threads;
+    fuse_session_loop_mt(view->session, &loop_config);
+  }
+  pthread_mutex_lock(&server.mutex);
+  for (link = &server.views; *link != view; link = &(*link)->next)
+    ;
+  *link = view->next;
+  server.view_count--;
+  pthread_mutex_unlock(&server.mutex);
+  // a no-op if it was unmounted already
+  fuse_session_unmount(view->session);
+  fuse_session_destroy(view->session);
+  free_view(view);
+  if (-1 == write(server.wake_fd, &one, sizeof(one)))
+    errnof("write eventfd failed");
+  return NULL;
+}
+
+static int start_view(struct view *view)
+{
+  pthread_attr_t attr;
+  pthread_t thread;
+  int error;
+  pthread_mutex_lock(&server.mutex);
+  view->next = server.views;
+  server.views = view;
+  server.view_count++;
+  pthread_mutex_unlock(&server.mutex);
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  error = pthread_create(&thread, &attr, serve_view, view);
+  pthread_attr_destroy(&attr);
+  if (error) {
+    errno = error;
+    errnof("pthread_create failed");
+    // unmounting ends nothing, serve it on this thread
+    pthread_mutex_lock(&server.mutex);
+    server.views = view->next;
+    server.view_count--;
+    pthread_mutex_unlock(&server.mutex);
+    fuse_session_unmount(view->session);
+    fuse_session_destroy(view->session);
+    free_view(view);
+    return 1;
+  }
+  return 0;
+}
+
+/*
+Unmounts a view from outside its session loop, with server.mutex held.  The
+loop sees the connection end and the view's thread cleans up after it.
+*/
+static void stop_view(struct view *view)
+{
+  if (view->stopping)
+    return;
+  view->stopping = 1;
+  fuse_session_exit(view->session);
+  if (-1 == umount2(view->mountpoint, MNT_DETACH)) {
+    char *const argv[] = { "fusermount3", "-u", "-z", "--", view->mountpoint, NULL };
+    pid_t pid;
+    int status;
+    if (errno != EPERM) {
+      errnof("umount2 '%s' failed", view->mountpoint);
+      return;
+    }
+    errno = posix_spawnp(&pid, "fusermount3", NULL, NULL, argv, environ);
+    if (errno) {
+      errnof("posix_spawnp fusermount3 failed");
+      return;
+    }
+    while (-1 == waitpid(pid, &status, 0) && errno == EINTR)
+      ;
+  }
+}
+
+static void stop_all_views(void)
+{
+  struct view *view;
+  pthread_mutex_lock(&server.mutex);
+  for (view = server.views; view; view = view->next)
+    stop_view(view);
+  pthread_mutex_unlock(&server.mutex);
+}
+
+// returns: 0 or an errno
+static int handle_request(char *request)
+{
+  char *position;
+  char *command = strtok_r(request, " \n", &position);
+  char *mountpoint = command ? strtok_r(NULL, " \n", &position) : NULL;
+  char *config = mountpoint ? strtok_r(NULL, " \n", &position) : NULL;
+  if (!mountpoint)
+    return EINVAL;
+  if (0 == strcmp(command, "mount")) {
+    struct view *view = new_view(mountpoint, config);
+    if (!view)
+      return EIO; // error already logged
+    return start_view(view) ? EIO : 0;
+  }
+  if (0 == strcmp(command, "unmount")) {
+    struct view *view;
+    int error = ENOENT;
+    pthread_mutex_lock(&server.mutex);
+    for (view = server.views; view; view = view->next) {
+      if (0 == strcmp(view->mountpoint, mountpoint)) {
+        stop_view(view);
+        error = 0;
+        break;
+      }
+    }
+    pthread_mutex_unlock(&server.mutex);
+    return error;
+  }
+  return EINVAL;
+}
+
+// one request per connection, from our own user or root
+static void accept_request(int control_fd)
+{
+  char request[2 * PATH_MAX + 16];
+  char reply[128];
+  size_t size = 0;
+  struct ucred peer;
+  socklen_t peer_size = sizeof(peer);
+  struct timeval timeout = { .tv_sec = 1 };
+  int error;
+  int fd = accept4(control_fd, NULL, NULL, SOCK_CLOEXEC);
+  if (fd == -1) {
+    if (errno != EAGAIN && errno != EINTR)
+      errnof("accept failed");
+    return;
+  }
+  if (-1 == getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &peer, &peer_size) ||
+      (peer.uid != 0 && peer.uid != getuid())) {
+    close(fd);
+    return;
+  }
+  // a stuck client must not stop the invalidations
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  while (size < sizeof(request) - 1 && !memchr(request, '\n', size)) {
+    ssize_t length = read(fd, request + size, sizeof(request) - 1 - size);
+    if (length <= 0)
+      break;
+    size += length;
+  }
+  request[size] = '\0';
+  error = handle_request(request);
+  if (error)
+    snprintf(reply, sizeof(reply), "error %s\n", strerror(error));
+  else
+    snprintf(reply, sizeof(reply), "ok\n");
+  if (-1 == send(fd, reply, strlen(reply), MSG_NOSIGNAL))
+    errnof("send failed");
+  close(fd);
+}
+
+// returns: a listening socket, or -1
+static int listen_control(const char *path)
+{
+  struct sockaddr_un address = { .sun_family = AF_UNIX };
+  int fd;
+  if (strlen(path) >= sizeof(address.sun_path)) {
+    errorf("control socket path '%s' is too long", path);
+    return -1;
+  }
+  strcpy(address.sun_path, path);
+  fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+  if (fd == -1) {
+    errnof("socket failed");
+    return -1;
+  }
+  unlink(path);
+  if (-1 == bind(fd, (struct sockaddr*)&address, sizeof(address))) {
+    errnof("bind '%s' failed", path);
+    close(fd);
+    return -1;
+  }
+  if (-1 == chmod(path, 0600))
+    errnof("chmod '%s' failed", path);
+  if (-1 == listen(fd, 64)) {
+    errnof("listen '%s' failed", path);
+    close(fd);
+    unlink(path);
+    return -1;
+  }
+  return fd;
+}
+
+/*
+The main thread only waits: for lower changes to pass on to the kernel, for
+control requests, for views to exit and for SIGINT or SIGTERM.  It returns
+when the last view exits, unless the control socket can still mount more.
+*/
+static void main_loop(int signal_fd, int control_fd)
+{
+  int stopping = 0;
+  for (;;) {
+    struct pollfd fds[4] = {
+      { .fd = lower_watch_fd(), .events = POLLIN },
+      { .fd = server.wake_fd, .events = POLLIN },
+      { .fd = signal_fd, .events = POLLIN },
+      { .fd = stopping ? -1 : control_fd, .events = POLLIN },
+    };
+    size_t view_count;
+    if (-1 == poll(fds, 4, -1)) {
+      if (errno == EINTR)
+        continue;
+      errnof("poll failed");
+      return;
+    }
+    if (fds[0].revents)
+      lower_read_changes(invalidate, NULL);
+    if (fds[1].revents) {
+      uint64_t count;
+      if (-1 == read(server.wake_fd, &count, sizeof(count)))
+        errnof("read eventfd failed");
+    }
+    if (fds[2].revents) {
+      struct signalfd_siginfo info;
+      if (-1 == read(signal_fd, &info, sizeof(info)))
+        errnof("read signalfd failed");
+      stopping = 1;
+      stop_all_views();
+    }
+    if (fds[3].revents)
+      accept_request(control_fd);
+    pthread_mutex_lock(&server.mutex);
+    view_count = server.view_count;
+    pthread_mutex_unlock(&server.mutex);
+    if (view_count == 0 && (stopping || control_fd == -1))
+      return;
+  }
+}
+
+struct rexfs_options {
+  const char *source;
+  const char *config;
+  const char *control;
+  double timeout;
+  int passthrough;
+};
+
+static const struct fuse_opt rexfs_opts[] = {
+  { "source=%s", offsetof(struct rexfs_options, source), 0 },
+  { "config=%s", offsetof(struct rexfs_options, config), 0 },
+  { "control=%s", offsetof(struct rexfs_options, control), 0 },
+  { "timeout=%lf", offsetof(struct rexfs_options, timeout), 0 },
+  { "passthrough", offsetof(struct rexfs_options, passthrough), 1 },
+  { "no_passthrough", offsetof(struct rexfs_options, passthrough), 0 },
+  FUSE_OPT_END
 };
 
+static void usage(const char *program)
+{
+  printf("Usage: %s [options] [<mountpoint>]\n"
+         "\n"
+         "    -o source=DIR        the directory to pass through (default: /)\n"
+         "    -o config=FILE       the read:/write: config to enforce on mountpoint (default: allow everything)\n"
+         "    -o control=SOCKET    mount and unmount more views through this unix socket\n"
+         "    -o timeout=SECONDS   how long the kernel caches entries and attributes (default: 86400)\n"
+         "    -o no_passthrough    always read and write through this process\n"
+         "\n", program);
+  fuse_cmdline_help();
+  fuse_lowlevel_help();
+}
+
+// every cached lower node holds an fd, allow as many as we can
+static void raise_fd_limit(void)
+{
+  struct rlimit limit;
+  if (0 == getrlimit(RLIMIT_NOFILE, &limit) && limit.rlim_cur < limit.rlim_max) {
+    limit.rlim_cur = limit.rlim_max;
+    if (-1 == setrlimit(RLIMIT_NOFILE, &limit))
+      errnof("setrlimit(RLIMIT_NOFILE, %llu) failed", (unsigned long long)limit.rlim_max);
+  }
+}
+
 int main(int argc, char *argv[])
 {
-  return fuse_main(argc, argv, &ops, NULL);
+  struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+  struct fuse_cmdline_opts cmdline;
+  struct rexfs_options options = { .source = "/", .timeout = 86400, .passthrough = 1 };
+  struct view *first_view = NULL;
+  sigset_t signals;
+  int signal_fd;
+  int control_fd = -1;
+  int result = 1;
+
+  if (fuse_parse_cmdline(&args, &cmdline) != 0)
+    return 1;
+  if (cmdline.show_help) {
+    usage(argv[0]);
+    result = 0;
+    goto out_args;
+  }
+  if (cmdline.show_version) {
+    printf("FUSE library version %s\n", fuse_pkgversion());
+    fuse_lowlevel_version();
+    result = 0;
+    goto out_args;
+  }
+  if (fuse_opt_parse(&args, &options, rexfs_opts, NULL) == -1)
+    goto out_args;
+  if (!cmdline.mountpoint && !options.control) {
+    usage(argv[0]);
+    goto out_args;
+  }
+  // the kernel checks modes and owners against the attributes we return
+  if (fuse_opt_add_arg(&args, "-odefault_permissions") == -1)
+    goto out_args;
+
+  server.args = args;
+  server.timeout = options.timeout;
+  server.passthrough = options.passthrough;
+  server.singlethread = cmdline.singlethread;
+  server.clone_fd = cmdline.clone_fd;
+  server.max_idle_threads = cmdline.max_idle_threads;
+  raise_fd_limit();
+  server.proc_self_fd = open("/proc/self/fd", O_PATH | O_CLOEXEC);
+  if (server.proc_self_fd == -1) {
+    errnof("open '/proc/self/fd' failed");
+    goto out_args;
+  }
+  if (lower_init(options.source) != 0)
+    goto out_proc; // error already logged
+  server.wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (server.wake_fd == -1) {
+    errnof("eventfd failed");
+    goto out_proc;
+  }
+
+  // blocked before any thread starts, only the main thread reads them
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  sigaddset(&signals, SIGHUP);
+  pthread_sigmask(SIG_BLOCK, &signals, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  if (cmdline.mountpoint) {
+    first_view = new_view(cmdline.mountpoint, options.config);
+    if (!first_view)
+      goto out_wake; // error already logged
+  }
+  if (options.control) {
+    control_fd = listen_control(options.control);
+    if (control_fd == -1)
+      goto out_first_view; // error already logged
+  }
+  // forks, so before any thread
+  fuse_daemonize(cmdline.foreground);
+  signal_fd = signalfd(-1, &signals, SFD_CLOEXEC | SFD_NONBLOCK);
+  if (signal_fd == -1) {
+    errnof("signalfd failed");
+    goto out_control;
+  }
+  if (first_view) {
+    int error = start_view(first_view);
+    first_view = NULL;
+    if (error)
+      goto out_signal; // error already logged
+  }
+  main_loop(signal_fd, control_fd);
+  // the loop only returns early on errors
+  stop_all_views();
+  result = 0;
+out_signal:
+  close(signal_fd);
+out_control:
+  if (control_fd != -1) {
+    close(control_fd);
+    unlink(options.control);
+  }
+out_first_view:
+  if (first_view) {
+    fuse_session_unmount(first_view->session);
+    fuse_session_destroy(first_view->session);
+    free_view(first_view);
+  }
+out_wake:
+  close(server.wake_fd);
+out_proc:
+  // the lower cache is reclaimed with the process
+  close(server.proc_self_fd);
+out_args:
+  free(cmdline.mountpoint);
+  fuse_opt_free_args(&args);
+  return result;
 }
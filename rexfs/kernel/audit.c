@@ -0,0 +1,182 @@
+#include <linux/module.h>
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/percpu.h>
+#include <linux/poll.h>
+#include <linux/wait.h>
+#include <linux/anon_inodes.h>
+#include <linux/capability.h>
+#include <linux/jump_label.h>
+#include <linux/refcount.h>
+#include <linux/timekeeping.h>
+#include <linux/kdev_t.h>
+
+#include "log.h"
+
+#include "audit.h"
+#include "policy.h"
+#include "rexfs.h"
+
+#define REXFS_AUDIT_RECORDS 4096 // per CPU, a power of 2
+
+/*
+One ring per CPU, written with preemption disabled so the only writer of a
+ring is the CPU it belongs to and no lock or atomic is needed.  The mapping
+is shared with the consumer, so rexfs keeps its own head and treats
+everything the consumer can write as a hint: a bogus tail only loses or
+overwrites the consumer's own records.
+*/
+struct rexfs_audit_cpu {
+  struct rexfs_audit_ring *shared; // NULL until the ring is first opened
+  struct rexfs_audit_record *records;
+  u64 head;
+  u64 lost;
+  int poll_armed; // set by a poller, cleared by the writer that wakes it
+  wait_queue_head_t wait;
+  atomic_t open;
+};
+
+static DEFINE_PER_CPU(struct rexfs_audit_cpu, rexfs_audit_cpus);
+DEFINE_STATIC_KEY_FALSE(rexfs_audit_key);
+
+static size_t ring_size(void)
+{
+  return PAGE_SIZE + REXFS_AUDIT_RECORDS * sizeof(struct rexfs_audit_record);
+}
+
+void rexfs_audit(unsigned op, const struct inode *lower, const struct inode *lower_dir,
+                 const struct qstr *name, int mask, int result)
+{
+  struct rexfs_audit_cpu *cpu = get_cpu_ptr(&rexfs_audit_cpus);
+  // pairs with smp_store_release in rexfs_audit_open
+  struct rexfs_audit_ring *shared = smp_load_acquire(&cpu->shared);
+  if (shared) {
+    u64 head = cpu->head;
+    if (head - READ_ONCE(shared->tail) >= REXFS_AUDIT_RECORDS) {
+      cpu->lost++;
+      WRITE_ONCE(shared->lost, cpu->lost);
+    } else {
+      struct rexfs_audit_record *record = &cpu->records[head & (REXFS_AUDIT_RECORDS - 1)];
+      unsigned name_length = name ? name->len : 0;
+      record->time = ktime_get_ns();
+      record->ino = lower ? lower->i_ino : 0;
+      record->dir_ino = lower_dir ? lower_dir->i_ino : 0;
+      record->dev = lower ? new_encode_dev(lower->i_sb->s_dev) :
+                    lower_dir ? new_encode_dev(lower_dir->i_sb->s_dev) : 0;
+      record->pid = task_tgid_nr(current);
+      record->mask = mask & ~MAY_NOT_BLOCK;
+      record->result = result;
+      record->op = op;
+      record->name_length = min(name_length, 255U);
+      memset(record->name, 0, REXFS_AUDIT_NAME_MAX);
+      memcpy(record->name, name ? (const char*)name->name : "", min(name_length, (unsigned)REXFS_AUDIT_NAME_MAX));
+      smp_store_release(&shared->head, head + 1);
+      cpu->head = head + 1;
+      // pairs with smp_mb in audit_poll, either it sees the new head or we
+      // see it armed
+      smp_mb();
+      if (READ_ONCE(cpu->poll_armed)) {
+        WRITE_ONCE(cpu->poll_armed, 0);
+        wake_up_interruptible(&cpu->wait);
+      }
+    }
+  }
+  put_cpu_ptr(&rexfs_audit_cpus);
+}
+
+static __poll_t audit_poll(struct file *file, poll_table *wait)
+{
+  struct rexfs_audit_cpu *cpu = file->private_data;
+  poll_wait(file, &cpu->wait, wait);
+  WRITE_ONCE(cpu->poll_armed, 1);
+  smp_mb();
+  if (READ_ONCE(cpu->head) != READ_ONCE(cpu->shared->tail))
+    return EPOLLIN | EPOLLRDNORM;
+  return 0;
+}
+
+static int audit_mmap(struct file *file, struct vm_area_struct *vma)
+{
+  struct rexfs_audit_cpu *cpu = file->private_data;
+  return remap_vmalloc_range(vma, cpu->shared, vma->vm_pgoff);
+}
+
+static int audit_release(struct inode *inode, struct file *file)
+{
+  struct rexfs_audit_cpu *cpu = file->private_data;
+  static_branch_dec(&rexfs_audit_key);
+  atomic_set(&cpu->open, 0);
+  return 0;
+}
+
+static const struct file_operations rexfs_audit_fops = {
+  .owner = THIS_MODULE,
+  .poll = audit_poll,
+  .mmap = audit_mmap,
+  .release = audit_release,
+  .llseek = noop_llseek,
+};
+
+// returns: a file for the ring of cpu_number, or a negative errno
+long rexfs_audit_open(unsigned long cpu_number)
+{
+  struct rexfs_audit_cpu *cpu;
+  int fd;
+  if (!capable(CAP_SYS_ADMIN))
+    return -EPERM;
+  {
+    // a sandboxed process must not watch what the rest of the system does
+    bool restricted;
+    rcu_read_lock();
+    restricted = rexfs_current_policy() != NULL;
+    rcu_read_unlock();
+    if (restricted)
+      return -EPERM;
+  }
+  if (cpu_number >= nr_cpu_ids || !cpu_possible(cpu_number))
+    return -EINVAL;
+  cpu = per_cpu_ptr(&rexfs_audit_cpus, cpu_number);
+  if (atomic_cmpxchg(&cpu->open, 0, 1))
+    return -EBUSY;
+
+  // rings are allocated on first use and kept until the module is unloaded
+  if (!cpu->shared) {
+    struct rexfs_audit_ring *shared = vmalloc_user(ring_size());
+    if (!shared) {
+      err("vmalloc_user(%zu) failed", ring_size());
+      atomic_set(&cpu->open, 0);
+      return -ENOMEM;
+    }
+    shared->record_count = REXFS_AUDIT_RECORDS;
+    shared->record_offset = PAGE_SIZE;
+    cpu->records = (struct rexfs_audit_record*)((char*)shared + PAGE_SIZE);
+    smp_store_release(&cpu->shared, shared);
+  }
+
+  static_branch_inc(&rexfs_audit_key);
+  fd = anon_inode_getfd("[rexfs-audit]", &rexfs_audit_fops, cpu, O_RDWR | O_CLOEXEC);
+  if (fd < 0) {
+    static_branch_dec(&rexfs_audit_key);
+    atomic_set(&cpu->open, 0);
+  }
+  return fd;
+}
+
+void rexfs_audit_init(void)
+{
+  int cpu_number;
+  for_each_possible_cpu(cpu_number)
+    init_waitqueue_head(&per_cpu_ptr(&rexfs_audit_cpus, cpu_number)->wait);
+}
+
+// the files hold a module reference, so no ring is open anymore
+void rexfs_audit_cleanup(void)
+{
+  int cpu_number;
+  for_each_possible_cpu(cpu_number) {
+    struct rexfs_audit_cpu *cpu = per_cpu_ptr(&rexfs_audit_cpus, cpu_number);
+    vfree(cpu->shared);
+    cpu->shared = NULL;
+  }
+}
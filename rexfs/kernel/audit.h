@@ -0,0 +1,14 @@
+DECLARE_STATIC_KEY_FALSE(rexfs_audit_key);
+
+// true while a consumer has an audit ring open, compiles to a patched jump
+static inline bool rexfs_audit_enabled(void)
+{
+  return static_branch_unlikely(&rexfs_audit_key);
+}
+
+void rexfs_audit(unsigned op, const struct inode *lower, const struct inode *lower_dir,
+                 const struct qstr *name, int mask, int result);
+
+void rexfs_audit_init(void);
+void rexfs_audit_cleanup(void);
+long rexfs_audit_open(unsigned long cpu_number);
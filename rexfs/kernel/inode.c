@@ -2,106 +2,167 @@
 #include <linux/fs.h>
 #include <linux/slab.h>
 #include <linux/namei.h>
+#include <linux/mount.h>
+#include <linux/cred.h>
+#include <linux/fs_stack.h>
+#include <linux/uaccess.h>
+#include <linux/mm.h>
+#include <linux/uio.h>
+#include <linux/fadvise.h>
+#include <linux/refcount.h>
+#include <linux/jump_label.h>
+#include <linux/sched/clock.h>
+#include <linux/log2.h>
 
 #include "log.h"
 
+#include "audit.h"
+#include "inode.h"
+#include "policy.h"
+#include "rexfs.h"
+#include "stats.h"
+#include "trace.h"
+
 MODULE_LICENSE("GPL");
 
-// Note: keep loop logic in sync with fill_rexfs_path
-unsigned get_rexfs_path_size(struct dentry *dentry)
+/*
+Every rexfs dentry holds a reference to the path it shows in the lower
+filesystem.  A lookup resolves one name against the lower dentry of its
+parent instead of rebuilding and walking the whole path from the root.
+
+Negative dentries are kept as well so probes for missing files are answered
+from the dcache.  A name that does not exist below holds the negative lower
+dentry, which turns positive or is unhashed when the name is created or the
+lower directory changes.
+
+The dcache is shared by every process, whatever its policy, so a dentry only
+ever reflects the lower filesystem.  A name the policy of the current process
+hides is never added: its lookup fails with -ENOENT, and when another process
+already added it, permission and getattr fail with -ENOENT instead.
+*/
+struct rexfs_dentry_info {
+  struct path lower;
+  atomic64_t policy_match; // the last match against a policy, see policy.h
+};
+
+static struct kmem_cache *rexfs_dentry_cachep;
+
+int rexfs_dentry_cache_init(void)
 {
-  unsigned size;
-  struct dentry *parent = dentry->d_parent;
-  if (parent == dentry) {
-    BUG_ON(dentry->d_name.len != 1);
-    return 1;
-  }
-  size = 0;
-  for (;;) {
-    size += 1 + dentry->d_name.len;
-    dentry = parent;
-    parent = dentry->d_parent;
-    if (parent == dentry)
-      return size;
+  rexfs_dentry_cachep = KMEM_CACHE(rexfs_dentry_info, SLAB_RECLAIM_ACCOUNT);
+  if (!rexfs_dentry_cachep) {
+    err("kmem_cache_create(rexfs_dentry_info) failed");
+    return -ENOMEM;
   }
+  return 0;
 }
-// Note: keep loop logic in sync with get_rexfs_path_size
-void fill_rexfs_path(struct dentry *dentry, char *buffer, unsigned size)
+void rexfs_dentry_cache_destroy(void)
 {
-  struct dentry *parent = dentry->d_parent;
-  buffer[size] = '\0';
-  if (parent == dentry) {
-    BUG_ON(dentry->d_name.len != 1);
-    BUG_ON(size != 1);
-    buffer[0] = '/';
-    return;
-  }
-
-  for (;;) {
-    {
-      unsigned name_len = dentry->d_name.len;
-      size -= name_len;
-      memcpy(buffer + size, dentry->d_name.name, name_len);
-      size--;
-      buffer[size] = '/';
-    }
-    dentry = parent;
-    parent = dentry->d_parent;
-    if (parent == dentry) {
-      BUG_ON(size != 0);
-      return;
-    }
-  }
+  kmem_cache_destroy(rexfs_dentry_cachep);
 }
-char *kmalloc_rexfs_path(struct dentry *dentry)
+
+struct path *rexfs_lower_path(const struct dentry *dentry)
 {
-  unsigned rexfs_path_size;
-  char *rexfs_path;
-  // TODO: other functions like d_path do an rcu_read_lock before
-  //       going through dentries
-  rexfs_path_size = get_rexfs_path_size(dentry);
-  rexfs_path = kmalloc(rexfs_path_size + 1, GFP_KERNEL);
-  if (!rexfs_path)
-    return ERR_PTR(-ENOMEM);
+  return &((struct rexfs_dentry_info*)dentry->d_fsdata)->lower;
+}
 
-  fill_rexfs_path(dentry, rexfs_path, rexfs_path_size);
-  //devlog("kmalloc_rexfs_path(inode %lu) '%s'", dentry->d_inode->i_ino, rexfs_path);
-  devlog("kmalloc_rexfs_path '%s'", rexfs_path);
-  return rexfs_path;
+// takes ownership of the references in lower
+int rexfs_dentry_set_lower(struct dentry *dentry, struct path *lower)
+{
+  struct rexfs_dentry_info *info = kmem_cache_alloc(rexfs_dentry_cachep, GFP_KERNEL);
+  if (!info) {
+    err("kmem_cache_alloc(rexfs_dentry_info) failed");
+    return -ENOMEM;
+  }
+  info->lower = *lower;
+  atomic64_set(&info->policy_match, 0);
+  dentry->d_fsdata = info;
+  return 0;
 }
 
-int big_heirarchy_kern_path(struct dentry *dentry, struct path *path)
+static void rexfs_d_release(struct dentry *dentry)
 {
-  char *rexfs_path;
+  struct rexfs_dentry_info *info = dentry->d_fsdata;
+  if (info) {
+    path_put(&info->lower);
+    kmem_cache_free(rexfs_dentry_cachep, info);
+  }
+}
 
-  // TODO: alloca instead?
-  rexfs_path = kmalloc_rexfs_path(dentry);
-  if (IS_ERR(rexfs_path))
-    return PTR_ERR(rexfs_path);
+static struct inode *lower_inode(const struct inode *inode)
+{
+  return REXFS_I(inode)->lower;
+}
 
-  {
-    int ret = kern_path(rexfs_path, 0, path);
-    kfree(rexfs_path);
-    return ret;
+void rexfs_evict_inode(struct inode *inode)
+{
+  truncate_inode_pages_final(&inode->i_data);
+  clear_inode(inode);
+  if (REXFS_I(inode)->lower) {
+    iput(REXFS_I(inode)->lower);
+    REXFS_I(inode)->lower = NULL;
   }
 }
-struct file *big_heirarchy_open(struct dentry *dentry, int flags, umode_t mode)
+
+/*
+rexfs inodes are hashed by their lower inode, so every dentry that shows the
+same lower file, like a header reached through two hard links or looked up
+again after its dentry was pruned, gets the same rexfs inode.  Directories are
+not hashed, a directory can only have one dentry and a lower directory can
+appear in several places when it is bind mounted.
+*/
+static int rexfs_inode_test(struct inode *inode, void *lower)
+{
+  return REXFS_I(inode)->lower == lower;
+}
+static int rexfs_inode_set(struct inode *inode, void *lower)
+{
+  ihold(lower);
+  REXFS_I(inode)->lower = lower;
+  return 0;
+}
+
+static struct inode *rexfs_get_inode(struct super_block *sb, const struct inode *dir, struct inode *lower)
 {
-  char *rexfs_path;
+  struct inode *inode;
+  if (S_ISDIR(lower->i_mode)) {
+    inode = new_inode(sb);
+    if (!inode) {
+      err("new_inode failed");
+      return ERR_PTR(-ENOMEM);
+    }
+    rexfs_inode_set(inode, lower);
+  } else {
+    inode = iget5_locked(sb, (unsigned long)lower, rexfs_inode_test, rexfs_inode_set, lower);
+    if (!inode) {
+      err("iget5_locked failed");
+      return ERR_PTR(-ENOMEM);
+    }
+    if (!(inode->i_state & I_NEW))
+      return inode;
+  }
 
-  // TODO: alloca instead?
-  rexfs_path = kmalloc_rexfs_path(dentry);
-  if (IS_ERR(rexfs_path))
-    return (struct file*)rexfs_path;
   {
-    struct file *ret = filp_open(rexfs_path, flags, mode);
-    kfree(rexfs_path);
-    return ret;
+    int result = rexfs_init_inode(inode, dir, lower->i_mode);
+    if (result) {
+      if (inode->i_state & I_NEW)
+        iget_failed(inode);
+      else
+        iput(inode);
+      return ERR_PTR(result);
+    }
   }
+  // the same number the lower filesystem reports through getattr
+  inode->i_ino = lower->i_ino;
+  if (S_ISCHR(lower->i_mode) || S_ISBLK(lower->i_mode) || S_ISFIFO(lower->i_mode) || S_ISSOCK(lower->i_mode))
+    init_special_inode(inode, lower->i_mode, lower->i_rdev);
+  fsstack_copy_attr_all(inode, lower);
+  fsstack_copy_inode_size(inode, lower);
+  if (inode->i_state & I_NEW)
+    unlock_new_inode(inode);
+  return inode;
 }
 
-
-
 static int create(struct inode *inode, struct dentry *dentry, umode_t mode, bool what_is_this)
 {
   err("create not implemented");
@@ -142,18 +203,85 @@ static int rename(struct inode *inode1, struct dentry *dentry1, struct inode *in
   err("rename not implemented");
   return -ENOSYS; // fail
 }
-static int readlink(struct dentry *dentry, char __user *what_is_this1, int what_is_this2)
+/*
+Matches dentry against policy.  Every dentry caches its match tagged with the
+generation of the policy, so during a path walk each component is matched
+against its parent's cached match with one binary search.  rexfs dentries are
+never renamed, so the names and parents read here are stable.
+*/
+static u64 dentry_policy_match(const struct rexfs_policy *policy, struct dentry *dentry)
 {
-  err("readlink not implemented");
-  return -ENOSYS; // fail
+  for (;;) {
+    struct dentry *d = dentry;
+    u64 parent_match = 0;
+    u64 match;
+    // find the highest ancestor that has not been matched against policy
+    for (;;) {
+      match = atomic64_read(&((struct rexfs_dentry_info*)d->d_fsdata)->policy_match);
+      if (rexfs_match_cached(policy, match)) {
+        if (d == dentry)
+          return match;
+        break;
+      }
+      if (IS_ROOT(d))
+        break;
+      parent_match = atomic64_read(&((struct rexfs_dentry_info*)d->d_parent->d_fsdata)->policy_match);
+      if (rexfs_match_cached(policy, parent_match))
+        break;
+      d = d->d_parent;
+    }
+    if (IS_ROOT(d))
+      match = rexfs_policy_root_match(policy);
+    else
+      match = rexfs_policy_child_match(policy, parent_match, d->d_name.name, d->d_name.len);
+    atomic64_set(&((struct rexfs_dentry_info*)d->d_fsdata)->policy_match, match);
+    if (d == dentry)
+      return match;
+  }
 }
-static const char *get_link(struct dentry *dentry, struct inode *inode, struct delayed_call *what_is_this)
+
+// returns: 0 if the policy of the current process allows desired on inode
+static int policy_permission(struct inode *inode, int desired)
 {
-  err("get_link not implemented");
-  return NULL; // fail
+  const struct rexfs_policy *policy;
+  int result = 0;
+  desired &= ~MAY_NOT_BLOCK;
+  rcu_read_lock();
+  policy = rexfs_current_policy();
+  if (policy) {
+    struct dentry *alias;
+    int hidden = 1;
+    result = -EACCES;
+    // a file with several hard links is allowed if any of its paths is
+    spin_lock(&inode->i_lock);
+    hlist_for_each_entry(alias, &inode->i_dentry, d_u.d_alias) {
+      u64 match = dentry_policy_match(policy, alias);
+      int allowed = rexfs_policy_allowed_mask(match);
+      if ((desired & ~allowed) == 0) {
+        result = 0;
+        break;
+      }
+      if (rexfs_match_type(match) != REXFS_MATCH_OUTSIDE)
+        hidden = 0;
+    }
+    spin_unlock(&inode->i_lock);
+    // added to the dcache by a process with another policy, it doesn't exist here
+    if (result && hidden)
+      result = -ENOENT;
+    if (result)
+      rexfs_stats_count(REXFS_COUNT_POLICY_DENIALS);
+  }
+  rcu_read_unlock();
+  return result;
 }
-static int permission(struct inode *inode, int desired)
+
+static int check_permission(struct inode *inode, int desired)
 {
+  {
+    int result = policy_permission(inode, desired);
+    if (result)
+      return result;
+  }
   if (inode->i_sb->s_root->d_inode == inode) {
     int denied;
     int allowed = MAY_NOT_BLOCK | MAY_EXEC | MAY_READ | MAY_ACCESS | MAY_OPEN | MAY_CHDIR;
@@ -167,8 +295,18 @@ static int permission(struct inode *inode, int desired)
     devlog("permission(inode=%lu) granted (desired=0x%x, allowed=0x%x)", inode->i_ino, desired, allowed);
     return 0; // success
   }
-  err("permission(inode=%lu) not implemented (desired=0x%x)", inode->i_ino, desired);
-  return -ENOSYS; // fail
+  return inode_permission(lower_inode(inode), desired);
+}
+
+static int permission(struct inode *inode, int desired)
+{
+  u64 start = rexfs_stats_start();
+  int result = check_permission(inode, desired);
+  u64 ns = rexfs_stats_end(REXFS_STAT_PERMISSION, start, result != 0);
+  trace_rexfs_permission(inode, desired, result, ns);
+  if (rexfs_audit_enabled())
+    rexfs_audit(REXFS_AUDIT_PERMISSION, lower_inode(inode), NULL, NULL, desired, result);
+  return result;
 }
 /*
 int get_acl(struct inode *inode, int)
@@ -189,39 +327,206 @@ int tmpfile(struct inode *inode, struct dentry *dentry, umode_t);
 */
 
 
-static struct dentry *dir_lookup(struct inode *dir, struct dentry *dentry, unsigned int flags)
+// returns: the match of dentry if the current policy hides it, otherwise 0
+static u64 hidden_match(struct dentry *dentry)
+{
+  const struct rexfs_policy *policy;
+  u64 match = 0;
+  rcu_read_lock();
+  policy = rexfs_current_policy();
+  if (policy) {
+    u64 child_match = rexfs_policy_child_match(policy, dentry_policy_match(policy, READ_ONCE(dentry->d_parent)),
+                                               dentry->d_name.name, dentry->d_name.len);
+    if (rexfs_match_type(child_match) == REXFS_MATCH_OUTSIDE)
+      match = child_match;
+  }
+  rcu_read_unlock();
+  return match;
+}
+
+// returns: whether the current policy hides dentry, which is in the dcache
+static int dentry_hidden(struct dentry *dentry)
+{
+  const struct rexfs_policy *policy;
+  int hidden = 0;
+  rcu_read_lock();
+  policy = rexfs_current_policy();
+  if (policy)
+    hidden = rexfs_match_type(dentry_policy_match(policy, dentry)) == REXFS_MATCH_OUTSIDE;
+  rcu_read_unlock();
+  return hidden;
+}
+
+static int readlink(struct dentry *dentry, char __user *buffer, int buflen)
+{
+  if (dentry_hidden(dentry))
+    return -ENOENT;
+  return vfs_readlink(rexfs_lower_path(dentry)->dentry, buffer, buflen);
+}
+static const char *get_link(struct dentry *dentry, struct inode *inode, struct delayed_call *done)
+{
+  if (!dentry)
+    return ERR_PTR(-ECHILD); // the lower filesystem may need to block
+  if (dentry_hidden(dentry))
+    return ERR_PTR(-ENOENT);
+  return vfs_get_link(rexfs_lower_path(dentry)->dentry, done);
+}
+static int getattr(const struct path *path, struct kstat *stat, u32 request_mask, unsigned int flags)
+{
+  if (dentry_hidden(path->dentry))
+    return -ENOENT;
+  return vfs_getattr(rexfs_lower_path(path->dentry), stat, request_mask, flags);
+}
+
+static struct file *real_file(const struct file *file);
+
+/*
+Attribute changes, including the truncation of open(O_TRUNC), go to the lower
+inode, rexfs only keeps a copy of its attributes.
+*/
+static int setattr(struct dentry *dentry, struct iattr *ia)
+{
+  struct inode *inode = d_inode(dentry);
+  struct path *lower = rexfs_lower_path(dentry);
+  struct inode *lower_inode = d_inode(lower->dentry);
+  struct iattr lower_ia = *ia;
+  int result;
+
+  if (dentry_hidden(dentry))
+    return -ENOENT;
+  // the root shows the real root, it is read only like in check_permission
+  if (inode == inode->i_sb->s_root->d_inode)
+    return -EPERM;
+  result = policy_permission(inode, MAY_WRITE);
+  if (result)
+    return result;
+  if (ia->ia_valid & ATTR_FILE)
+    lower_ia.ia_file = real_file(ia->ia_file);
+  // the lower filesystem works out the mode from its own inode
+  if (lower_ia.ia_valid & (ATTR_KILL_SUID | ATTR_KILL_SGID))
+    lower_ia.ia_valid &= ~ATTR_MODE;
+
+  result = mnt_want_write(lower->mnt);
+  if (result)
+    return result;
+  // like do_truncate, don't truncate a file that is being executed
+  if (ia->ia_valid & ATTR_SIZE) {
+    result = get_write_access(lower_inode);
+    if (result) {
+      mnt_drop_write(lower->mnt);
+      return result;
+    }
+  }
+  inode_lock(lower_inode);
+  result = notify_change(lower->dentry, &lower_ia, NULL);
+  inode_unlock(lower_inode);
+  if (ia->ia_valid & ATTR_SIZE)
+    put_write_access(lower_inode);
+  mnt_drop_write(lower->mnt);
+
+  fsstack_copy_attr_all(inode, lower_inode);
+  fsstack_copy_inode_size(inode, lower_inode);
+  return result;
+}
+
+static void audit_lookup(struct inode *dir, struct dentry *dentry, struct inode *lower, int result)
+{
+  if (rexfs_audit_enabled())
+    rexfs_audit(REXFS_AUDIT_LOOKUP, lower, lower_inode(dir), &dentry->d_name, 0, result);
+}
+
+static struct dentry *lookup(struct inode *dir, struct dentry *dentry, unsigned int flags)
 {
-  //char *rexfs_path;
+  struct path *parent_lower = rexfs_lower_path(dentry->d_parent);
+  struct path lower;
+  struct inode *inode;
 
   devlog("dir_lookup(inode=%lu, flags=0x%x)", dir->i_ino, flags);
-  if (dir->i_sb->s_root->d_inode != dir) {
-    err("dir_lookup, inode %lu is not root, not sure what to do", dir->i_ino);
+  {
+    // names outside the policy do not exist, the lower filesystem is not
+    // asked and nothing is added to the dcache, which other policies share
+    if (hidden_match(dentry)) {
+      rexfs_stats_count(REXFS_COUNT_HIDDEN_LOOKUPS);
+      audit_lookup(dir, dentry, NULL, -ENOENT);
+      return ERR_PTR(-ENOENT);
+    }
+  }
+  {
+    u64 start = rexfs_stats_start();
+    u64 ns;
+    lower.dentry = lookup_one_len_unlocked(dentry->d_name.name, parent_lower->dentry, dentry->d_name.len);
+    ns = rexfs_stats_end(REXFS_STAT_LOWER_LOOKUP, start, IS_ERR(lower.dentry));
+    trace_rexfs_lower_lookup(dir, &dentry->d_name, PTR_ERR_OR_ZERO(lower.dentry), ns);
+  }
+  if (IS_ERR(lower.dentry))
+    return lower.dentry;
+  lower.mnt = mntget(parent_lower->mnt);
+  if (d_is_negative(lower.dentry)) {
+    // keep the negative lower dentry, d_revalidate watches it
+    int result = rexfs_dentry_set_lower(dentry, &lower);
+    if (result) {
+      path_put(&lower);
+      return ERR_PTR(result);
+    }
+    rexfs_stats_count(REXFS_COUNT_NEGATIVE_LOOKUPS);
+    audit_lookup(dir, dentry, NULL, -ENOENT);
+    d_add(dentry, NULL);
     return NULL;
   }
+  // rexfs shows whatever is mounted on the lower dentry, like a path walk would
+  while (d_mountpoint(lower.dentry) && follow_down_one(&lower))
+    ;
 
-  // dir
+  inode = rexfs_get_inode(dir->i_sb, dir, d_inode(lower.dentry));
+  if (IS_ERR(inode)) {
+    path_put(&lower);
+    return ERR_CAST(inode);
+  }
   {
-    struct path path;
-    int result = big_heirarchy_kern_path(dentry, &path);
-    if (result)
+    int result = rexfs_dentry_set_lower(dentry, &lower);
+    if (result) {
+      iput(inode);
+      path_put(&lower);
       return ERR_PTR(result);
-    return path.dentry;
+    }
   }
+  audit_lookup(dir, dentry, lower_inode(inode), 0);
+  return d_splice_alias(inode, dentry);
+}
 
-  /*
-  rexfs_path = kmalloc_rexfs_path(dentry);
-  if (IS_ERR(rexfs_path)) {
-    err("kmalloc_rexfs_path failed (e=%lu)", PTR_ERR(rexfs_path));
-    return (struct dentry*)rexfs_path;
-  }
+static struct dentry *dir_lookup(struct inode *dir, struct dentry *dentry, unsigned int flags)
+{
+  u64 start = rexfs_stats_start();
+  struct dentry *result = lookup(dir, dentry, flags);
+  u64 ns = rexfs_stats_end(REXFS_STAT_DIR_LOOKUP, start, IS_ERR(result));
+  trace_rexfs_dir_lookup(dir, &dentry->d_name, PTR_ERR_OR_ZERO(result), ns);
+  return result;
+}
 
-  devlog("dir_lookup: dentry='%s' (not implemented)", rexfs_path);
-  dump_stack();
-  kfree(rexfs_path);
-  return ERR_PTR(-ENOSYS);
-  */
+/*
+Runs for every cached dentry on every path walk, including in RCU mode, so it
+only reads the lower dentry and never blocks.  Whether the dentry is valid
+doesn't depend on the policy of the process walking, see rexfs_dentry_info.
+*/
+static int rexfs_d_revalidate(struct dentry *dentry, unsigned int flags)
+{
+  struct rexfs_dentry_info *info = READ_ONCE(dentry->d_fsdata);
+  struct dentry *lower;
+  if (!info)
+    return 1;
+
+  lower = info->lower.dentry;
+  // IS_ROOT for the root of a filesystem mounted in the lower tree
+  if (d_unhashed(lower) && !IS_ROOT(lower))
+    return 0;
+  return d_is_negative(lower) == d_is_negative(dentry);
 }
 
+const struct dentry_operations rexfs_dentry_ops = {
+  .d_revalidate = rexfs_d_revalidate,
+  .d_release = rexfs_d_release,
+};
+
 /*
 static int dir_atomic_open(struct inode *dir, struct dentry *dentry, struct file *file,
                        unsigned open_flag, umode_t create_mode, int *opened)
@@ -250,9 +555,14 @@ static struct inode_operations rexfs_dir_inode_ops = {
   .readlink = readlink,
   .get_link = get_link,
   .permission = permission,
+  .setattr = setattr,
+  .getattr = getattr,
   //.atomic_open = dir_atomic_open,
 };
 static struct inode_operations rexfs_file_inode_ops = {
+  .permission = permission,
+  .setattr = setattr,
+  .getattr = getattr,
   /*
   .create = create,
   .lookup = lookup,
@@ -282,6 +592,7 @@ static struct inode_operations rexfs_link_inode_ops = {
   .readlink = readlink,
   .get_link = get_link,
   .permission = permission,
+  .getattr = getattr,
   //.atomic_open = atomic_open,
 };
 
@@ -298,20 +609,29 @@ int get_big_heiarchy_by_name(struct dentry *dentry, struct dentry **big_heiarchy
 */
 
 
+static void audit_open(struct file *file, int result)
+{
+  struct dentry *dentry = file->f_path.dentry;
+  int mask = ((file->f_mode & FMODE_READ) ? MAY_READ : 0) | ((file->f_mode & FMODE_WRITE) ? MAY_WRITE : 0);
+  rexfs_audit(REXFS_AUDIT_OPEN, lower_inode(d_inode(dentry)),
+              IS_ROOT(dentry) ? NULL : lower_inode(d_inode(dentry->d_parent)), &dentry->d_name, mask, result);
+}
+
 int dir_open(struct inode *inode, struct file *file)
 {
+  u64 start = rexfs_stats_start();
+  u64 ns;
   devlog("dir_open(inode=%lu)", inode->i_ino);
-  if (inode == inode->i_sb->s_root->d_inode) {
-    file->private_data = big_heirarchy_open(file->f_path.dentry, O_DIRECTORY, 0);
-    if (IS_ERR(file->private_data))
-      return PTR_ERR(file->private_data);
+  file->private_data = dentry_open(rexfs_lower_path(file->f_path.dentry), O_RDONLY | O_DIRECTORY, current_cred());
+  ns = rexfs_stats_end(REXFS_STAT_DIR_OPEN, start, IS_ERR(file->private_data));
+  trace_rexfs_dir_open(inode, MAY_READ, PTR_ERR_OR_ZERO(file->private_data), ns);
+  if (rexfs_audit_enabled())
+    audit_open(file, PTR_ERR_OR_ZERO(file->private_data));
+  if (IS_ERR(file->private_data))
+    return PTR_ERR(file->private_data);
 
-    //devlog("private_data=%p", file->private_data);
-    return 0;
-  } else {
-    err("inode is not root, not sure what to do");
-    return -ENOSYS;
-  }
+  //devlog("private_data=%p", file->private_data);
+  return 0;
   /*
   from fs/libfs.c: (file->private_data = d_alloc_cursor(file->f_path.dentry))
                    return file->private_data ? 0 : -ENOMEM;
@@ -335,27 +655,258 @@ loff_t dir_llseek(struct file *file, loff_t offset, int whence)
 }
 int dir_iterate_shared(struct file *file, struct dir_context *ctx)
 {
+  u64 start;
+  u64 ns;
+  int result;
   // TODO: can f_op be NULL?
   if (!((struct file*)file->private_data)->f_op->iterate_shared) {
     err("underlying dir does not have an interate_shared function");
     return -ENOSYS;
   }
-  return ((struct file*)file->private_data)->f_op->iterate_shared(file->private_data, ctx);
+  start = rexfs_stats_start();
+  result = ((struct file*)file->private_data)->f_op->iterate_shared(file->private_data, ctx);
+  ns = rexfs_stats_end(REXFS_STAT_DIR_ITERATE, start, result != 0);
+  trace_rexfs_dir_iterate_shared(file_inode(file), MAY_READ, result, ns);
+  return result;
+}
+#define REXFS_MAX_CONFIG_SIZE (16 * 1024 * 1024)
+
+static long set_config(struct rexfs_config __user *user_config)
+{
+  struct rexfs_config config;
+  struct rexfs_policy *policy;
+  char *text;
+  if (copy_from_user(&config, user_config, sizeof(config)))
+    return -EFAULT;
+  if (config.flags)
+    return -EINVAL;
+  if (config.size > REXFS_MAX_CONFIG_SIZE)
+    return -E2BIG;
+  text = kvmalloc(config.size, GFP_KERNEL);
+  if (!text)
+    return -ENOMEM;
+  if (copy_from_user(text, u64_to_user_ptr(config.data), config.size)) {
+    kvfree(text);
+    return -EFAULT;
+  }
+  policy = rexfs_policy_parse_text(text, config.size);
+  kvfree(text);
+  if (IS_ERR(policy))
+    return PTR_ERR(policy);
+  return rexfs_set_task_policy(0, policy);
+}
+
+#define REXFS_MAX_POLICY_SIZE (64 * 1024 * 1024)
+
+static long set_policy(struct rexfs_policy_upload __user *user_upload)
+{
+  struct rexfs_policy_upload upload;
+  struct rexfs_policy *policy;
+  void *data;
+  if (copy_from_user(&upload, user_upload, sizeof(upload)))
+    return -EFAULT;
+  if (upload.size > REXFS_MAX_POLICY_SIZE)
+    return -E2BIG;
+  data = kvmalloc(upload.size, GFP_KERNEL);
+  if (!data)
+    return -ENOMEM;
+  if (copy_from_user(data, u64_to_user_ptr(upload.data), upload.size)) {
+    kvfree(data);
+    return -EFAULT;
+  }
+  policy = rexfs_policy_parse_binary(data, upload.size);
+  kvfree(data);
+  if (IS_ERR(policy))
+    return PTR_ERR(policy);
+  return rexfs_set_task_policy(upload.pid, policy);
+}
+
+long dir_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+  switch (cmd) {
+  case REXFS_IOC_SET_CONFIG:
+    return set_config((struct rexfs_config __user*)arg);
+  case REXFS_IOC_SET_POLICY:
+    return set_policy((struct rexfs_policy_upload __user*)arg);
+  case REXFS_IOC_AUDIT_OPEN:
+    return rexfs_audit_open(arg);
+  }
+  return -ENOTTY;
 }
+
 static const struct file_operations rexfs_dir_file_ops = {
   .open = dir_open,
   .release = dir_release,
   .llseek = dir_llseek,
   .read = generic_read_dir, // just returns -EISDIR
   .iterate_shared = dir_iterate_shared,
+  .unlocked_ioctl = dir_ioctl,
+  .compat_ioctl = dir_ioctl,
   //.fsync = dir_fsync,
 };
+/*
+Regular files forward everything to a lower file opened alongside them, the
+data and the page cache are the lower file's.  Splice goes through
+read_iter/write_iter with pipe iterators, so pages are moved, not copied, and
+mmap maps the lower file directly.
+*/
+static struct file *real_file(const struct file *file)
+{
+  return file->private_data;
+}
+
+int file_open(struct inode *inode, struct file *file)
+{
+  struct file *real;
+  devlog("file_open(inode=%lu)", inode->i_ino);
+  // creation happened through the rexfs inode, the vfs truncates for O_TRUNC
+  // after the open, through setattr with this file, which passes it on to the
+  // lower file
+  real = dentry_open(rexfs_lower_path(file->f_path.dentry),
+                     file->f_flags & ~(O_CREAT | O_EXCL | O_NOCTTY | O_TRUNC), current_cred());
+  if (rexfs_audit_enabled())
+    audit_open(file, PTR_ERR_OR_ZERO(real));
+  if (IS_ERR(real))
+    return PTR_ERR(real);
+  file->private_data = real;
+  return 0;
+}
+int file_release(struct inode *inode, struct file *file)
+{
+  fput(real_file(file));
+  return 0;
+}
+
+static rwf_t iocb_to_rwf(struct kiocb *iocb)
+{
+  int ifl = iocb->ki_flags;
+  rwf_t flags = 0;
+  if (ifl & IOCB_NOWAIT)
+    flags |= RWF_NOWAIT;
+  if (ifl & IOCB_HIPRI)
+    flags |= RWF_HIPRI;
+  if (ifl & IOCB_DSYNC)
+    flags |= RWF_DSYNC;
+  if (ifl & IOCB_SYNC)
+    flags |= RWF_SYNC;
+  return flags;
+}
+
+static void copy_attr_from_lower(struct file *file)
+{
+  struct inode *inode = file_inode(file);
+  struct inode *lower = file_inode(real_file(file));
+  fsstack_copy_inode_size(inode, lower);
+  inode->i_mtime = lower->i_mtime;
+  inode->i_ctime = lower->i_ctime;
+}
+
+ssize_t file_read_iter(struct kiocb *iocb, struct iov_iter *iter)
+{
+  if (!iov_iter_count(iter))
+    return 0;
+  return vfs_iter_read(real_file(iocb->ki_filp), iter, &iocb->ki_pos, iocb_to_rwf(iocb));
+}
+ssize_t file_write_iter(struct kiocb *iocb, struct iov_iter *iter)
+{
+  struct file *file = iocb->ki_filp;
+  struct file *real = real_file(file);
+  ssize_t result;
+  if (!iov_iter_count(iter))
+    return 0;
+  file_start_write(real);
+  result = vfs_iter_write(real, iter, &iocb->ki_pos, iocb_to_rwf(iocb));
+  file_end_write(real);
+  copy_attr_from_lower(file);
+  return result;
+}
+
+loff_t file_llseek(struct file *file, loff_t offset, int whence)
+{
+  struct file *real = real_file(file);
+  loff_t result;
+  // the position lives in the rexfs file, the lower file only computes it,
+  // which matters for SEEK_END, SEEK_DATA and SEEK_HOLE
+  inode_lock(file_inode(file));
+  real->f_pos = file->f_pos;
+  result = vfs_llseek(real, offset, whence);
+  file->f_pos = real->f_pos;
+  inode_unlock(file_inode(file));
+  return result;
+}
+
+int file_fsync(struct file *file, loff_t start, loff_t end, int datasync)
+{
+  return vfs_fsync_range(real_file(file), start, end, datasync);
+}
+
+int file_mmap(struct file *file, struct vm_area_struct *vma)
+{
+  struct file *real = real_file(file);
+  int result;
+  if (!real->f_op->mmap)
+    return -ENODEV;
+  if (WARN_ON(file != vma->vm_file))
+    return -EIO;
+  // the mapping belongs to the lower file from here on, its pages are the
+  // lower page cache and faults never go through rexfs
+  vma->vm_file = get_file(real);
+  result = call_mmap(real, vma);
+  if (result) {
+    vma->vm_file = file;
+    fput(real);
+  } else {
+    fput(file);
+  }
+  file_accessed(file);
+  return result;
+}
+
+static const struct file_operations rexfs_file_file_ops;
+
+ssize_t file_copy_file_range(struct file *file_in, loff_t pos_in, struct file *file_out,
+                             loff_t pos_out, size_t length, unsigned int flags)
+{
+  ssize_t result;
+  // only a rexfs file has a real file, the vfs splices the other cases instead
+  if (file_in->f_op != &rexfs_file_file_ops || file_out->f_op != &rexfs_file_file_ops)
+    return -EXDEV;
+  result = vfs_copy_file_range(real_file(file_in), pos_in, real_file(file_out), pos_out,
+                               length, flags);
+  copy_attr_from_lower(file_out);
+  return result;
+}
+
+long file_fallocate(struct file *file, int mode, loff_t offset, loff_t length)
+{
+  long result = vfs_fallocate(real_file(file), mode, offset, length);
+  copy_attr_from_lower(file);
+  return result;
+}
+
+int file_fadvise(struct file *file, loff_t offset, loff_t length, int advice)
+{
+  return vfs_fadvise(real_file(file), offset, length, advice);
+}
+
 static const struct file_operations rexfs_file_file_ops = {
+  .open = file_open,
+  .release = file_release,
+  .llseek = file_llseek,
+  .read_iter = file_read_iter,
+  .write_iter = file_write_iter,
+  .fsync = file_fsync,
+  .mmap = file_mmap,
+  .fallocate = file_fallocate,
+  .fadvise = file_fadvise,
+  .splice_read = generic_file_splice_read,
+  .splice_write = iter_file_splice_write,
+  .copy_file_range = file_copy_file_range,
 };
 
+// the caller sets i_ino
 int rexfs_init_inode(struct inode *inode, const struct inode *parent, umode_t mode)
 {
-  inode->i_ino = get_next_ino();
   inode_init_owner(inode, parent, mode);
   inode->i_atime = inode->i_mtime = inode->i_ctime = current_time(inode);
   switch (mode & S_IFMT) {
@@ -372,6 +923,13 @@ int rexfs_init_inode(struct inode *inode, const struct inode *parent, umode_t mo
     inode->i_op  = &rexfs_link_inode_ops;
     //inode->i_fop = &rexfs_file_ops;
     break;
+  case S_IFCHR:
+  case S_IFBLK:
+  case S_IFIFO:
+  case S_IFSOCK:
+    inode->i_op  = &rexfs_file_inode_ops;
+    // i_fop is set by init_special_inode
+    break;
   default:
     err("unknown inode mode 0x%x", mode & S_IFMT);
     return -EINVAL;
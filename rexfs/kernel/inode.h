@@ -1 +1,19 @@
+struct rexfs_inode {
+  struct inode vfs_inode;
+  struct inode *lower; // pinned for as long as the rexfs inode exists
+};
+
+static inline struct rexfs_inode *REXFS_I(const struct inode *inode)
+{
+  return container_of(inode, struct rexfs_inode, vfs_inode);
+}
+
+extern const struct dentry_operations rexfs_dentry_ops;
+
 int rexfs_init_inode(struct inode *inode, const struct inode *parent, umode_t mode);
+void rexfs_evict_inode(struct inode *inode);
+
+int rexfs_dentry_cache_init(void);
+void rexfs_dentry_cache_destroy(void);
+struct path *rexfs_lower_path(const struct dentry *dentry);
+int rexfs_dentry_set_lower(struct dentry *dentry, struct path *lower);
@@ -1,2 +1,8 @@
+// devlog runs on every lookup and permission check, build with
+// "make REXFS_DEBUG=1" to enable it
+#ifdef REXFS_DEBUG
 #define devlog(fmt,...) pr_err("rexfs: DEBUG " fmt "\n", ##__VA_ARGS__)
+#else
+#define devlog(fmt,...) no_printk("rexfs: DEBUG " fmt "\n", ##__VA_ARGS__)
+#endif
 #define err(fmt,...) pr_err("rexfs: Error: " fmt "\n", ##__VA_ARGS__)
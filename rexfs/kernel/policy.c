@@ -0,0 +1,865 @@
+#include <linux/module.h>
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/sort.h>
+#include <linux/stringhash.h>
+#include <linux/hashtable.h>
+#include <linux/rculist.h>
+#include <linux/sched.h>
+#include <linux/pid.h>
+#include <linux/sched/signal.h>
+#include <linux/refcount.h>
+#include <linux/tracepoint.h>
+
+#include "log.h"
+
+#include "policy.h"
+#include "rexfs.h"
+
+static atomic_t rexfs_policy_generation = ATOMIC_INIT(0);
+
+static int compare_child(const struct rexfs_policy *policy, const struct rexfs_policy_node *node,
+                         u32 hash, const unsigned char *name, unsigned name_length)
+{
+  if (node->hash != hash)
+    return (node->hash < hash) ? -1 : 1;
+  if (node->name_length != name_length)
+    return (node->name_length < name_length) ? -1 : 1;
+  return memcmp(policy->names + node->name_offset, name, name_length);
+}
+
+u64 rexfs_policy_root_match(const struct rexfs_policy *policy)
+{
+  unsigned flags = policy->nodes[0].flags;
+  return rexfs_match_make(policy->generation, REXFS_MATCH_NODE, flags, 0);
+}
+
+u64 rexfs_policy_child_match(const struct rexfs_policy *policy, u64 parent_match,
+                             const unsigned char *name, unsigned name_length)
+{
+  unsigned flags = rexfs_match_flags(parent_match);
+  if (rexfs_match_type(parent_match) == REXFS_MATCH_NODE) {
+    const struct rexfs_policy_node *parent = &policy->nodes[rexfs_match_index(parent_match)];
+    u32 hash = full_name_hash(NULL, name, name_length);
+    u32 low = parent->first_child;
+    u32 high = parent->first_child + parent->child_count;
+    while (low < high) {
+      u32 middle = low + (high - low) / 2;
+      int cmp = compare_child(policy, &policy->nodes[middle], hash, name, name_length);
+      if (cmp == 0)
+        return rexfs_match_make(policy->generation, REXFS_MATCH_NODE,
+                                flags | policy->nodes[middle].flags, middle);
+      if (cmp < 0)
+        low = middle + 1;
+      else
+        high = middle;
+    }
+  }
+  return rexfs_match_make(policy->generation, flags ? REXFS_MATCH_BELOW : REXFS_MATCH_OUTSIDE, flags, 0);
+}
+
+int rexfs_policy_allowed_mask(u64 match)
+{
+  int allowed = 0;
+  unsigned flags = rexfs_match_flags(match);
+  // the directories leading to a rule can be walked through but not listed
+  if (rexfs_match_type(match) == REXFS_MATCH_NODE)
+    allowed |= MAY_EXEC | MAY_CHDIR;
+  if (flags & REXFS_ALLOW_READ)
+    allowed |= MAY_EXEC | MAY_READ | MAY_ACCESS | MAY_OPEN | MAY_CHDIR;
+  if (flags & REXFS_ALLOW_WRITE)
+    allowed |= MAY_WRITE | MAY_APPEND;
+  return allowed;
+}
+
+//
+// Compiling a policy
+//
+struct rexfs_rule {
+  const char *path; // components separated by a single '/'
+  u32 length;
+  u16 flags;
+};
+
+// orders paths component by component so that every path comes right before
+// the paths below it
+static int compare_rules(const void *a, const void *b)
+{
+  const struct rexfs_rule *rule_a = a;
+  const struct rexfs_rule *rule_b = b;
+  u32 length = min(rule_a->length, rule_b->length);
+  u32 i;
+  for (i = 0; i < length; i++) {
+    unsigned char char_a = (rule_a->path[i] == '/') ? 0 : rule_a->path[i];
+    unsigned char char_b = (rule_b->path[i] == '/') ? 0 : rule_b->path[i];
+    if (char_a != char_b)
+      return (char_a < char_b) ? -1 : 1;
+  }
+  if (rule_a->length != rule_b->length)
+    return (rule_a->length < rule_b->length) ? -1 : 1;
+  return 0;
+}
+
+struct build_node {
+  const char *name;
+  u16 name_length;
+  u16 flags;
+  u32 hash;
+  u32 first_child; // 0 for none, the root is never a child
+  u32 last_child;
+  u32 next_sibling;
+  u32 child_count;
+};
+
+struct child_key {
+  u32 hash;
+  u16 name_length;
+  const char *name;
+  u32 index;
+};
+
+static int compare_child_keys(const void *a, const void *b)
+{
+  const struct child_key *key_a = a;
+  const struct child_key *key_b = b;
+  if (key_a->hash != key_b->hash)
+    return (key_a->hash < key_b->hash) ? -1 : 1;
+  if (key_a->name_length != key_b->name_length)
+    return (key_a->name_length < key_b->name_length) ? -1 : 1;
+  return memcmp(key_a->name, key_b->name, key_a->name_length);
+}
+
+/*
+Builds the policy from rules whose paths are already normalized.  The rules
+are sorted so the trie can be built with a stack in one pass, then it is laid
+out breadth first so the children of every node are contiguous.
+*/
+static struct rexfs_policy *rexfs_policy_build(struct rexfs_rule *rules, u32 rule_count)
+{
+  struct build_node *nodes = NULL;
+  u32 *stack = NULL;
+  u32 *order = NULL; // new index -> build index
+  struct child_key *children = NULL;
+  struct rexfs_policy *policy = NULL;
+  u32 node_count = 1;
+  u32 max_nodes = 1;
+  u32 max_depth = 0;
+  size_t names_size = 0;
+  u32 generation;
+  u32 i;
+
+  for (i = 0; i < rule_count; i++) {
+    u32 depth = 0;
+    u32 j;
+    for (j = 0; j < rules[i].length; j++)
+      depth += (rules[i].path[j] == '/');
+    if (rules[i].length > 0)
+      depth++;
+    max_nodes += depth;
+    max_depth = max(max_depth, depth);
+  }
+  if (max_nodes > REXFS_POLICY_MAX_NODES)
+    return ERR_PTR(-E2BIG);
+
+  nodes = kvmalloc_array(max_nodes, sizeof(*nodes), GFP_KERNEL | __GFP_ZERO);
+  stack = kvmalloc_array(max_depth + 1, sizeof(*stack), GFP_KERNEL);
+  if (!nodes || !stack) {
+    policy = ERR_PTR(-ENOMEM);
+    goto out;
+  }
+
+  sort(rules, rule_count, sizeof(*rules), compare_rules, NULL);
+  stack[0] = 0;
+  for (i = 0; i < rule_count; i++) {
+    const char *component = rules[i].path;
+    const char *end = rules[i].path + rules[i].length;
+    u32 depth = 0;
+    unsigned char matching = 1;
+    while (component < end) {
+      const char *slash = memchr(component, '/', end - component);
+      u32 length = (slash ? slash : end) - component;
+      u32 parent = stack[depth];
+      // the stack still holds the previous path, share its prefix
+      if (matching && nodes[parent].last_child) {
+        struct build_node *last = &nodes[nodes[parent].last_child];
+        if (last->name_length == length && 0 == memcmp(last->name, component, length)) {
+          stack[++depth] = nodes[parent].last_child;
+          component += length + 1;
+          continue;
+        }
+      }
+      matching = 0;
+      {
+        u32 index = node_count++;
+        struct build_node *node = &nodes[index];
+        node->name = component;
+        node->name_length = length;
+        node->hash = full_name_hash(NULL, component, length);
+        if (nodes[parent].last_child)
+          nodes[nodes[parent].last_child].next_sibling = index;
+        else
+          nodes[parent].first_child = index;
+        nodes[parent].last_child = index;
+        nodes[parent].child_count++;
+        names_size += length;
+        stack[++depth] = index;
+      }
+      component += length + 1;
+    }
+    nodes[stack[depth]].flags |= rules[i].flags;
+  }
+
+  order = kvmalloc_array(node_count, sizeof(*order), GFP_KERNEL);
+  children = kvmalloc_array(node_count, sizeof(*children), GFP_KERNEL);
+  policy = kvmalloc(sizeof(*policy) + node_count * sizeof(struct rexfs_policy_node) + names_size, GFP_KERNEL);
+  if (!order || !children || !policy) {
+    kvfree(policy);
+    policy = ERR_PTR(-ENOMEM);
+    goto out;
+  }
+  refcount_set(&policy->refs, 1);
+  // a reused generation would let dentries trust matches made for an older policy
+  generation = atomic_fetch_add_unless(&rexfs_policy_generation, 1, -1);
+  if (generation == U32_MAX) {
+    err("policy generations exhausted, reload the module");
+    kvfree(policy);
+    policy = ERR_PTR(-EOVERFLOW);
+    goto out;
+  }
+  policy->generation = generation + 1;
+  policy->node_count = node_count;
+  policy->nodes = (struct rexfs_policy_node*)(policy + 1);
+  policy->names = (char*)(policy->nodes + node_count);
+
+  {
+    u32 next_index = 1;
+    size_t names_offset = 0;
+    order[0] = 0;
+    for (i = 0; i < node_count; i++) {
+      struct build_node *node = &nodes[order[i]];
+      struct rexfs_policy_node *out = &policy->nodes[i];
+      u32 child_count = 0;
+      u32 child;
+      out->hash = node->hash;
+      out->name_offset = names_offset;
+      out->name_length = node->name_length;
+      out->flags = node->flags;
+      out->first_child = next_index;
+      out->child_count = node->child_count;
+      memcpy(policy->names + names_offset, node->name, node->name_length);
+      names_offset += node->name_length;
+
+      for (child = node->first_child; child; child = nodes[child].next_sibling) {
+        children[child_count].hash = nodes[child].hash;
+        children[child_count].name_length = nodes[child].name_length;
+        children[child_count].name = nodes[child].name;
+        children[child_count].index = child;
+        child_count++;
+      }
+      sort(children, child_count, sizeof(*children), compare_child_keys, NULL);
+      for (child = 0; child < child_count; child++)
+        order[next_index++] = children[child].index;
+    }
+  }
+
+out:
+  kvfree(children);
+  kvfree(order);
+  kvfree(stack);
+  kvfree(nodes);
+  return policy;
+}
+
+static int normalize_path(const char *path, size_t length, char *out, u32 *out_length)
+{
+  const char *end = path + length;
+  u32 offset = 0;
+  while (path < end) {
+    const char *slash = memchr(path, '/', end - path);
+    size_t component_length = (slash ? slash : end) - path;
+    if (component_length == 0 || (component_length == 1 && path[0] == '.')) {
+      // skip
+    } else if (component_length == 2 && path[0] == '.' && path[1] == '.') {
+      return -EINVAL;
+    } else if (component_length > NAME_MAX) {
+      return -ENAMETOOLONG;
+    } else {
+      if (offset > 0)
+        out[offset++] = '/';
+      memcpy(out + offset, path, component_length);
+      offset += component_length;
+    }
+    path += component_length + 1;
+  }
+  *out_length = offset;
+  return 0;
+}
+
+struct rexfs_policy *rexfs_policy_parse_text(const char *text, size_t size)
+{
+  const char *end = text + size;
+  const char *line;
+  struct rexfs_rule *rules;
+  char *paths;
+  u32 rule_count = 0;
+  u32 paths_offset = 0;
+  size_t line_count = 1;
+  struct rexfs_policy *policy;
+
+  for (line = text; line < end; line++)
+    line_count += (*line == '\n');
+  rules = kvmalloc_array(line_count, sizeof(*rules), GFP_KERNEL);
+  paths = kvmalloc(size + 1, GFP_KERNEL);
+  if (!rules || !paths) {
+    policy = ERR_PTR(-ENOMEM);
+    goto out;
+  }
+
+  for (line = text; line < end; ) {
+    const char *newline = memchr(line, '\n', end - line);
+    const char *line_end = newline ? newline : end;
+    const char *path;
+    u16 flags;
+    size_t length = line_end - line;
+    if (length == 0 || line[0] == '#') {
+      line = line_end + 1;
+      continue;
+    }
+    if (length >= 5 && 0 == memcmp(line, "read:", 5)) {
+      path = line + 5;
+      flags = REXFS_ALLOW_READ;
+    } else if (length >= 6 && 0 == memcmp(line, "write:", 6)) {
+      path = line + 6;
+      flags = REXFS_ALLOW_READ | REXFS_ALLOW_WRITE;
+    } else {
+      err("invalid config line '%.*s'", (int)min_t(size_t, length, 64), line);
+      policy = ERR_PTR(-EINVAL);
+      goto out;
+    }
+    {
+      u32 path_length;
+      int result = normalize_path(path, line_end - path, paths + paths_offset, &path_length);
+      if (result) {
+        err("invalid config path '%.*s'", (int)min_t(size_t, line_end - path, 64), path);
+        policy = ERR_PTR(result);
+        goto out;
+      }
+      rules[rule_count].path = paths + paths_offset;
+      rules[rule_count].length = path_length;
+      rules[rule_count].flags = flags;
+      rule_count++;
+      paths_offset += path_length + 1;
+    }
+    line = line_end + 1;
+  }
+  policy = rexfs_policy_build(rules, rule_count);
+out:
+  kvfree(paths);
+  kvfree(rules);
+  return policy;
+}
+
+// binary paths must already be in the form the builder uses, "a/b/c"
+static int check_binary_path(const char *path, u32 length)
+{
+  const char *end = path + length;
+  while (path < end) {
+    const char *slash = memchr(path, '/', end - path);
+    u32 component_length = (slash ? slash : end) - path;
+    if (component_length == 0 || component_length > NAME_MAX ||
+        (component_length == 1 && path[0] == '.') ||
+        (component_length == 2 && path[0] == '.' && path[1] == '.') ||
+        memchr(path, '\0', component_length))
+      return -EINVAL;
+    if (slash && slash + 1 == end)
+      return -EINVAL; // trailing slash
+    path += component_length + 1;
+  }
+  return 0;
+}
+
+/*
+Compiles a policy in the format described in rexfs.h.  The rules refer to
+the uploaded buffer, so data must stay alive until this returns.
+*/
+struct rexfs_policy *rexfs_policy_parse_binary(const void *data, size_t size)
+{
+  const struct rexfs_policy_header *header = data;
+  const struct rexfs_policy_rule *binary_rules;
+  const char *strings;
+  struct rexfs_rule *rules;
+  struct rexfs_policy *policy;
+  u32 i;
+
+  if (size < sizeof(*header) || header->magic != REXFS_POLICY_MAGIC)
+    return ERR_PTR(-EINVAL);
+  if (header->version != REXFS_POLICY_VERSION)
+    return ERR_PTR(-EPROTONOSUPPORT);
+  if (header->flags != 0 ||
+      header->rule_count > (size - sizeof(*header)) / sizeof(*binary_rules) ||
+      header->strings_size != size - sizeof(*header) - header->rule_count * sizeof(*binary_rules))
+    return ERR_PTR(-EINVAL);
+  binary_rules = (const struct rexfs_policy_rule*)(header + 1);
+  strings = (const char*)(binary_rules + header->rule_count);
+
+  rules = kvmalloc_array(header->rule_count, sizeof(*rules), GFP_KERNEL);
+  if (!rules && header->rule_count)
+    return ERR_PTR(-ENOMEM);
+  for (i = 0; i < header->rule_count; i++) {
+    const struct rexfs_policy_rule *rule = &binary_rules[i];
+    if (rule->path_offset > header->strings_size ||
+        rule->path_length > header->strings_size - rule->path_offset ||
+        (rule->flags & ~(REXFS_ALLOW_READ | REXFS_ALLOW_WRITE)) ||
+        check_binary_path(strings + rule->path_offset, rule->path_length)) {
+      kvfree(rules);
+      return ERR_PTR(-EINVAL);
+    }
+    rules[i].path = strings + rule->path_offset;
+    rules[i].length = rule->path_length;
+    rules[i].flags = rule->flags;
+    // writing implies reading, the same as write: in a text config
+    if (rules[i].flags & REXFS_ALLOW_WRITE)
+      rules[i].flags |= REXFS_ALLOW_READ;
+  }
+  policy = rexfs_policy_build(rules, header->rule_count);
+  kvfree(rules);
+  return policy;
+}
+
+//
+// Narrowing a policy
+//
+// the REXFS_ALLOW_* flags policy gives a path in the form the builder uses
+static unsigned path_flags(const struct rexfs_policy *policy, const char *path, u32 length)
+{
+  const char *end = path + length;
+  u64 match = rexfs_policy_root_match(policy);
+  while (path < end && rexfs_match_type(match) == REXFS_MATCH_NODE) {
+    const char *slash = memchr(path, '/', end - path);
+    u32 component_length = (slash ? slash : end) - path;
+    match = rexfs_policy_child_match(policy, match, (const unsigned char*)path, component_length);
+    path += component_length + 1;
+  }
+  return rexfs_match_flags(match);
+}
+
+struct rule_frame {
+  u32 node;
+  u32 next_child;
+  u32 path_length;
+};
+
+/*
+Calls visit with the path of every node of policy that has flags, depth
+first.  The path is only valid during the call.
+*/
+static int for_each_policy_rule(const struct rexfs_policy *policy,
+                                void (*visit)(void *context, const char *path, u32 length),
+                                void *context)
+{
+  struct rule_frame *frames;
+  char *path;
+  size_t path_size = 1;
+  u32 depth = 0;
+  u32 i;
+  for (i = 0; i < policy->node_count; i++)
+    path_size += policy->nodes[i].name_length + 1;
+  frames = kvmalloc_array(policy->node_count, sizeof(*frames), GFP_KERNEL);
+  path = kvmalloc(path_size, GFP_KERNEL);
+  if (!frames || !path) {
+    kvfree(path);
+    kvfree(frames);
+    return -ENOMEM;
+  }
+
+  if (policy->nodes[0].flags)
+    visit(context, path, 0);
+  frames[0].node = 0;
+  frames[0].next_child = 0;
+  frames[0].path_length = 0;
+  for (;;) {
+    struct rule_frame *frame = &frames[depth];
+    const struct rexfs_policy_node *node = &policy->nodes[frame->node];
+    if (frame->next_child == node->child_count) {
+      if (depth == 0)
+        break;
+      depth--;
+      continue;
+    }
+    {
+      u32 child_index = node->first_child + frame->next_child++;
+      const struct rexfs_policy_node *child = &policy->nodes[child_index];
+      u32 length = frame->path_length;
+      if (length > 0)
+        path[length++] = '/';
+      memcpy(path + length, policy->names + child->name_offset, child->name_length);
+      length += child->name_length;
+      if (child->flags)
+        visit(context, path, length);
+      depth++;
+      frames[depth].node = child_index;
+      frames[depth].next_child = 0;
+      frames[depth].path_length = length;
+    }
+  }
+  kvfree(path);
+  kvfree(frames);
+  return 0;
+}
+
+struct intersect_context {
+  const struct rexfs_policy *a;
+  const struct rexfs_policy *b;
+  struct rexfs_rule *rules;
+  u32 rule_count;
+  char *paths;
+  size_t paths_offset;
+};
+
+static void count_rule(void *context, const char *path, u32 length)
+{
+  struct intersect_context *intersect = context;
+  intersect->rule_count++;
+  intersect->paths_offset += length;
+}
+
+static void add_intersected_rule(void *context, const char *path, u32 length)
+{
+  struct intersect_context *intersect = context;
+  unsigned flags = path_flags(intersect->a, path, length) & path_flags(intersect->b, path, length);
+  if (!flags)
+    return;
+  memcpy(intersect->paths + intersect->paths_offset, path, length);
+  intersect->rules[intersect->rule_count].path = intersect->paths + intersect->paths_offset;
+  intersect->rules[intersect->rule_count].length = length;
+  intersect->rules[intersect->rule_count].flags = flags;
+  intersect->rule_count++;
+  intersect->paths_offset += length;
+}
+
+/*
+Compiles a policy that allows what both a and b allow.  Its rules are the
+paths of both policies, each with the flags both give it.  The flags only
+grow going down a path, so anything below those paths gets the flags of the
+deepest one, which are again what both policies give it.
+*/
+static struct rexfs_policy *rexfs_policy_intersect(const struct rexfs_policy *a, const struct rexfs_policy *b)
+{
+  struct intersect_context context = { .a = a, .b = b };
+  struct rexfs_policy *policy;
+  int result = for_each_policy_rule(a, count_rule, &context);
+  if (!result)
+    result = for_each_policy_rule(b, count_rule, &context);
+  if (result)
+    return ERR_PTR(result);
+
+  context.rules = kvmalloc_array(context.rule_count, sizeof(*context.rules), GFP_KERNEL);
+  context.paths = kvmalloc(context.paths_offset + 1, GFP_KERNEL);
+  if (!context.rules || !context.paths) {
+    policy = ERR_PTR(-ENOMEM);
+    goto out;
+  }
+  context.rule_count = 0;
+  context.paths_offset = 0;
+  result = for_each_policy_rule(a, add_intersected_rule, &context);
+  if (!result)
+    result = for_each_policy_rule(b, add_intersected_rule, &context);
+  policy = result ? ERR_PTR(result) : rexfs_policy_build(context.rules, context.rule_count);
+out:
+  kvfree(context.paths);
+  kvfree(context.rules);
+  return policy;
+}
+
+//
+// Per process policies
+//
+/*
+Policies are keyed by the struct pid of the thread group they apply to.  A
+process forked by a restricted process gets an entry of its own as it is
+created, sharing its parent's policy, and every entry is removed when its
+process exits.  Looking up the policy of a process never walks the process
+tree and no policy is copied at fork.
+
+Readers look entries up and read their policy under RCU.  Entries are only
+added and removed, and their policies only swapped, under
+rexfs_task_policies_lock.  Each entry holds a reference on its policy, the
+policy is freed a grace period after the last one is dropped, so a reader
+sees either the old or the new policy, never a mix.
+*/
+struct rexfs_task_policy {
+  struct hlist_node link;
+  struct pid *pid;
+  struct rexfs_policy __rcu *policy;
+  struct rcu_head rcu;
+};
+
+static DEFINE_HASHTABLE(rexfs_task_policies, 8);
+static DEFINE_SPINLOCK(rexfs_task_policies_lock);
+static atomic_t rexfs_task_policy_count = ATOMIC_INIT(0);
+
+// only for policies that were never published
+void rexfs_policy_free(struct rexfs_policy *policy)
+{
+  kvfree(policy);
+}
+
+static void rexfs_policy_free_callback(struct rcu_head *head)
+{
+  kvfree(container_of(head, struct rexfs_policy, rcu));
+}
+
+static void rexfs_policy_put(struct rexfs_policy *policy)
+{
+  if (refcount_dec_and_test(&policy->refs))
+    call_rcu(&policy->rcu, rexfs_policy_free_callback);
+}
+
+static void rexfs_task_policy_free_callback(struct rcu_head *head)
+{
+  struct rexfs_task_policy *entry = container_of(head, struct rexfs_task_policy, rcu);
+  put_pid(entry->pid);
+  rexfs_policy_put(rcu_dereference_protected(entry->policy, 1));
+  kfree(entry);
+}
+
+static struct rexfs_task_policy *find_task_policy(struct pid *pid)
+{
+  struct rexfs_task_policy *entry;
+  hash_for_each_possible_rcu(rexfs_task_policies, entry, link, (unsigned long)pid) {
+    if (entry->pid == pid)
+      return entry;
+  }
+  return NULL;
+}
+
+// caller holds the lock
+static void add_task_policy(struct rexfs_task_policy *entry)
+{
+  hash_add_rcu(rexfs_task_policies, &entry->link, (unsigned long)entry->pid);
+  atomic_inc(&rexfs_task_policy_count);
+}
+
+// caller holds the lock
+static void remove_task_policy(struct rexfs_task_policy *entry)
+{
+  hash_del_rcu(&entry->link);
+  atomic_dec(&rexfs_task_policy_count);
+  call_rcu(&entry->rcu, rexfs_task_policy_free_callback);
+}
+
+// caller holds rcu_read_lock
+struct rexfs_policy *rexfs_current_policy(void)
+{
+  struct rexfs_task_policy *entry;
+  if (atomic_read(&rexfs_task_policy_count) == 0)
+    return NULL;
+  entry = find_task_policy(task_tgid(current));
+  return entry ? rcu_dereference(entry->policy) : NULL;
+}
+
+/*
+Called for every new task, after it is fully set up but before it first
+runs, so it can never run without the policy of the process that forked it.
+*/
+static void rexfs_sched_process_fork(void *data, struct task_struct *parent, struct task_struct *child)
+{
+  struct rexfs_task_policy *parent_entry;
+  // threads use the entry of their thread group
+  if (atomic_read(&rexfs_task_policy_count) == 0 || !thread_group_leader(child))
+    return;
+  spin_lock(&rexfs_task_policies_lock);
+  rcu_read_lock();
+  parent_entry = find_task_policy(task_tgid(parent));
+  if (parent_entry) {
+    // probes run with preemption disabled
+    struct rexfs_task_policy *entry = kmalloc(sizeof(*entry), GFP_ATOMIC);
+    if (entry) {
+      struct rexfs_policy *policy = rcu_dereference_protected(parent_entry->policy,
+                                      lockdep_is_held(&rexfs_task_policies_lock));
+      refcount_inc(&policy->refs);
+      entry->pid = get_pid(task_tgid(child));
+      RCU_INIT_POINTER(entry->policy, policy);
+      add_task_policy(entry);
+    } else {
+      // the child must not get out of its parent's sandbox
+      err("out of memory inheriting the policy of pid %d, killing pid %d",
+          task_tgid_nr(parent), task_pid_nr(child));
+      send_sig(SIGKILL, child, 1);
+    }
+  }
+  rcu_read_unlock();
+  spin_unlock(&rexfs_task_policies_lock);
+}
+
+static void rexfs_sched_process_exit(void *data, struct task_struct *task)
+{
+  struct rexfs_task_policy *entry;
+  // do_exit has already counted this thread out, the last one drops the entry
+  if (atomic_read(&rexfs_task_policy_count) == 0 || atomic_read(&task->signal->live))
+    return;
+  spin_lock(&rexfs_task_policies_lock);
+  rcu_read_lock();
+  entry = find_task_policy(task_tgid(task));
+  if (entry)
+    remove_task_policy(entry);
+  rcu_read_unlock();
+  spin_unlock(&rexfs_task_policies_lock);
+}
+
+/*
+Installs policy for the process pid, 0 for the calling process.  A process
+can set the policy of itself or of one of its own children, typically
+between fork and exec.  A restricted process can only narrow: the policy it
+installs is intersected with its own first.  Setting it again swaps the
+whole policy at once.  Always takes ownership of policy.
+*/
+int rexfs_set_task_policy(pid_t pid, struct rexfs_policy *policy)
+{
+  struct rexfs_task_policy *entry = NULL;
+  struct rexfs_policy *restriction;
+  struct pid *tgid = NULL;
+  int result = 0;
+
+  rcu_read_lock();
+  if (pid == 0) {
+    tgid = get_pid(task_tgid(current));
+  } else {
+    struct task_struct *task = find_task_by_vpid(pid);
+    if (!task || !thread_group_leader(task)) {
+      result = -ESRCH;
+    } else if (!same_thread_group(rcu_dereference(task->real_parent), current)) {
+      result = -EPERM;
+    } else {
+      tgid = get_pid(task_tgid(task));
+    }
+  }
+  // a policy whose last reference is gone was just swapped out, read the new one
+  do {
+    restriction = rexfs_current_policy();
+  } while (restriction && !refcount_inc_not_zero(&restriction->refs));
+  rcu_read_unlock();
+  if (result)
+    goto out;
+
+  if (restriction) {
+    struct rexfs_policy *narrowed = rexfs_policy_intersect(restriction, policy);
+    if (IS_ERR(narrowed)) {
+      result = PTR_ERR(narrowed);
+      goto out;
+    }
+    rexfs_policy_free(policy);
+    policy = narrowed;
+  }
+
+  entry = kmalloc(sizeof(*entry), GFP_KERNEL);
+  if (!entry) {
+    result = -ENOMEM;
+    goto out;
+  }
+
+  spin_lock(&rexfs_task_policies_lock);
+  rcu_read_lock();
+  {
+    struct task_struct *task = pid_task(tgid, PIDTYPE_PID);
+    struct rexfs_task_policy *existing = find_task_policy(tgid);
+    if (!task || atomic_read(&task->signal->live) == 0) {
+      // its exit probe already ran, an entry added now would never be removed
+      result = -ESRCH;
+    } else if (existing) {
+      struct rexfs_policy *old = rcu_dereference_protected(existing->policy,
+                                   lockdep_is_held(&rexfs_task_policies_lock));
+      rcu_assign_pointer(existing->policy, policy);
+      rexfs_policy_put(old);
+      policy = NULL;
+    } else {
+      entry->pid = tgid;
+      RCU_INIT_POINTER(entry->policy, policy);
+      add_task_policy(entry);
+      tgid = NULL;
+      entry = NULL;
+      policy = NULL;
+    }
+  }
+  rcu_read_unlock();
+  spin_unlock(&rexfs_task_policies_lock);
+
+out:
+  if (restriction)
+    rexfs_policy_put(restriction);
+  if (policy)
+    rexfs_policy_free(policy);
+  put_pid(tgid);
+  kfree(entry);
+  return result;
+}
+
+struct rexfs_tracepoint {
+  const char *name;
+  void *probe;
+  struct tracepoint *tracepoint;
+};
+
+static struct rexfs_tracepoint rexfs_tracepoints[] = {
+  { "sched_process_fork", rexfs_sched_process_fork },
+  { "sched_process_exit", rexfs_sched_process_exit },
+};
+
+static void find_tracepoint(struct tracepoint *tracepoint, void *priv)
+{
+  unsigned i;
+  for (i = 0; i < ARRAY_SIZE(rexfs_tracepoints); i++) {
+    if (0 == strcmp(tracepoint->name, rexfs_tracepoints[i].name))
+      rexfs_tracepoints[i].tracepoint = tracepoint;
+  }
+}
+
+static void unregister_probes(unsigned count)
+{
+  while (count > 0) {
+    count--;
+    tracepoint_probe_unregister(rexfs_tracepoints[count].tracepoint,
+                                rexfs_tracepoints[count].probe, NULL);
+  }
+  tracepoint_synchronize_unregister();
+}
+
+// attaches policies to processes as they fork and exit
+int rexfs_policy_init(void)
+{
+  unsigned i;
+  for_each_kernel_tracepoint(find_tracepoint, NULL);
+  for (i = 0; i < ARRAY_SIZE(rexfs_tracepoints); i++) {
+    int result;
+    if (!rexfs_tracepoints[i].tracepoint) {
+      err("tracepoint %s not found", rexfs_tracepoints[i].name);
+      unregister_probes(i);
+      return -ENOENT;
+    }
+    result = tracepoint_probe_register(rexfs_tracepoints[i].tracepoint,
+                                       rexfs_tracepoints[i].probe, NULL);
+    if (result) {
+      err("tracepoint_probe_register(%s) failed (e=%d)", rexfs_tracepoints[i].name, result);
+      unregister_probes(i);
+      return result;
+    }
+  }
+  return 0;
+}
+
+void rexfs_policy_cleanup(void)
+{
+  struct rexfs_task_policy *entry;
+  struct hlist_node *tmp;
+  int bucket;
+  unregister_probes(ARRAY_SIZE(rexfs_tracepoints));
+  spin_lock(&rexfs_task_policies_lock);
+  hash_for_each_safe(rexfs_task_policies, bucket, tmp, entry, link) {
+    remove_task_policy(entry);
+  }
+  spin_unlock(&rexfs_task_policies_lock);
+  // the entries put their policies from their own callbacks
+  rcu_barrier();
+  rcu_barrier();
+}
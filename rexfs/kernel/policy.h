@@ -0,0 +1,76 @@
+// REXFS_ALLOW_* are defined in rexfs.h
+
+/*
+A node is one path component.  The children of a node are contiguous and
+sorted by (hash, name_length, name) so they can be binary searched.  Node 0 is
+the root.
+*/
+struct rexfs_policy_node {
+  u32 hash;
+  u32 name_offset;
+  u16 name_length;
+  u16 flags; // REXFS_ALLOW_* for this path and everything below it
+  u32 first_child;
+  u32 child_count;
+};
+
+/*
+A compiled policy is immutable and lives in one allocation.  It is shared by
+every process it applies to, only ever replaced as a whole and freed an RCU
+grace period after its last reference is dropped, so readers never take a
+lock.
+*/
+struct rexfs_policy {
+  struct rcu_head rcu;
+  refcount_t refs;
+  u32 generation; // unique per policy and never 0, tags cached matches
+  u32 node_count;
+  struct rexfs_policy_node *nodes;
+  char *names;
+};
+
+/*
+The result of matching a path against a policy, cached in each dentry:
+
+  bits 63..32  the policy generation it was computed for
+  bits 31..30  REXFS_MATCH_*
+  bits 29..28  the REXFS_ALLOW_* flags inherited by the path
+  bits 27..0   the node index for REXFS_MATCH_NODE
+*/
+#define REXFS_MATCH_NONE    0 // not cached
+#define REXFS_MATCH_NODE    1 // the path is a node of the policy
+#define REXFS_MATCH_BELOW   2 // the path is below a node that allows it
+#define REXFS_MATCH_OUTSIDE 3 // the policy does not allow the path at all
+
+#define REXFS_POLICY_MAX_NODES (1 << 28)
+
+static inline u64 rexfs_match_make(u32 generation, unsigned type, unsigned flags, u32 index)
+{
+  return ((u64)generation << 32) | ((u64)type << 30) | ((u64)flags << 28) | index;
+}
+static inline u32 rexfs_match_generation(u64 match) { return match >> 32; }
+static inline unsigned rexfs_match_type(u64 match) { return (match >> 30) & 0x3; }
+static inline unsigned rexfs_match_flags(u64 match) { return (match >> 28) & 0x3; }
+static inline u32 rexfs_match_index(u64 match) { return match & (REXFS_POLICY_MAX_NODES - 1); }
+
+// returns: whether match was computed for policy, only then may it be used with it
+static inline bool rexfs_match_cached(const struct rexfs_policy *policy, u64 match)
+{
+  unsigned type = rexfs_match_type(match);
+  return rexfs_match_generation(match) == policy->generation && type != REXFS_MATCH_NONE &&
+         (type != REXFS_MATCH_NODE || rexfs_match_index(match) < policy->node_count);
+}
+
+u64 rexfs_policy_root_match(const struct rexfs_policy *policy);
+u64 rexfs_policy_child_match(const struct rexfs_policy *policy, u64 parent_match,
+                             const unsigned char *name, unsigned name_length);
+int rexfs_policy_allowed_mask(u64 match);
+
+struct rexfs_policy *rexfs_policy_parse_text(const char *text, size_t size);
+struct rexfs_policy *rexfs_policy_parse_binary(const void *data, size_t size);
+void rexfs_policy_free(struct rexfs_policy *policy);
+
+struct rexfs_policy *rexfs_current_policy(void);
+int rexfs_set_task_policy(pid_t pid, struct rexfs_policy *policy);
+int rexfs_policy_init(void);
+void rexfs_policy_cleanup(void);
@@ -0,0 +1,124 @@
+/*
+The interface between rexfs and userspace.  Requests are ioctls on any
+directory opened through rexfs and apply to the calling process and the
+processes it starts.
+*/
+#ifndef _UAPI_REXFS_H
+#define _UAPI_REXFS_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+struct rexfs_config {
+  __u64 data; // pointer to the config text
+  __u32 size; // size of the config text in bytes
+  __u32 flags; // must be 0
+};
+
+/*
+Restrict the calling process to the paths in a text config, one rule per line:
+
+  read:<path>   allow reading <path> and everything below it
+  write:<path>  allow reading and writing <path> and everything below it
+
+Paths are relative to the rexfs root, empty lines and lines starting with '#'
+are ignored.  The directories above each path can be traversed but not
+listed.  Processes forked afterwards share the config of their parent.  A
+process that is already restricted can still set a config, but only to
+narrow it: a path stays allowed only as far as both configs allow it.
+*/
+#define REXFS_IOC_SET_CONFIG _IOW('r', 1, struct rexfs_config)
+
+#define REXFS_ALLOW_READ  0x1
+#define REXFS_ALLOW_WRITE 0x2 // implies REXFS_ALLOW_READ
+
+/*
+A binary policy is one buffer:
+
+  struct rexfs_policy_header
+  struct rexfs_policy_rule[rule_count]
+  char strings[strings_size]
+
+Each rule's path is a slice of strings of the form "a/b/c", relative to the
+rexfs root, without empty, "." or ".." components.  An empty path is the
+root.  Paths don't need to be null-terminated or sorted, and several rules
+can share the same string.
+*/
+#define REXFS_POLICY_MAGIC   0x50786572 // "rexP"
+#define REXFS_POLICY_VERSION 1
+
+struct rexfs_policy_header {
+  __u32 magic;
+  __u16 version;
+  __u16 flags; // must be 0
+  __u32 rule_count;
+  __u32 strings_size;
+};
+
+struct rexfs_policy_rule {
+  __u32 path_offset; // into strings
+  __u16 path_length;
+  __u16 flags; // REXFS_ALLOW_*
+};
+
+struct rexfs_policy_upload {
+  __u64 data; // pointer to the policy
+  __u32 size; // size of the policy in bytes
+  __s32 pid; // 0 for the calling process, or the pid of one of its children
+};
+
+/*
+Compile a binary policy and install it for a process in one step.  A process
+can set the policy of one of its children, typically between fork and exec,
+and can replace it the same way later.  The child must not fork before then,
+the processes it already started keep the policy they had.  A restricted
+process narrows the new policy to its own, the same as with
+REXFS_IOC_SET_CONFIG.  The new policy is compiled first and then swapped in,
+the process never sees half of it.
+*/
+#define REXFS_IOC_SET_POLICY _IOW('r', 2, struct rexfs_policy_upload)
+
+
+/*
+Access auditing.  rexfs records every lookup, open and permission decision
+into one ring per CPU.  REXFS_IOC_AUDIT_OPEN takes a CPU number as its
+argument and returns a file for that CPU's ring, to be mmap'd and polled
+for POLLIN.  Only one file per ring can be open, only by an unrestricted
+process with CAP_SYS_ADMIN, and nothing is recorded while no ring is open.
+
+The mapping starts with struct rexfs_audit_ring, followed by record_count
+records at record_offset.  Record n is at index n % record_count.  A
+consumer reads head with acquire semantics, reads the records from tail up
+to head, then stores the new tail with release semantics.  Records that
+arrive while the ring is full are dropped and counted in lost.
+*/
+#define REXFS_IOC_AUDIT_OPEN _IO('r', 3)
+
+#define REXFS_AUDIT_LOOKUP     1
+#define REXFS_AUDIT_OPEN       2
+#define REXFS_AUDIT_PERMISSION 3
+
+#define REXFS_AUDIT_NAME_MAX 24
+
+struct rexfs_audit_ring {
+  __u64 head; // records written, only written by rexfs
+  __u64 tail; // records consumed, only written by the consumer
+  __u64 lost; // records dropped because the ring was full
+  __u32 record_count; // a power of 2
+  __u32 record_offset; // from the start of the mapping
+};
+
+struct rexfs_audit_record {
+  __u64 time; // CLOCK_MONOTONIC in nanoseconds
+  __u64 ino; // of the lower inode, 0 for a name that does not exist or is hidden
+  __u64 dir_ino; // of the lower directory the name is in, 0 without a name
+  __u32 dev; // of the lower inode or directory, in the st_dev encoding
+  __s32 pid; // the thread group in the initial pid namespace
+  __u32 mask; // the MAY_* bits that were asked for, MAY_READ/MAY_WRITE for an open
+  __s16 result; // 0 if allowed, otherwise the negative errno
+  __u8 op; // REXFS_AUDIT_*
+  __u8 name_length; // the length of the full name, only the first REXFS_AUDIT_NAME_MAX bytes are kept
+  char name[REXFS_AUDIT_NAME_MAX]; // not null-terminated, empty for REXFS_AUDIT_PERMISSION
+};
+
+#endif
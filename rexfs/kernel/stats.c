@@ -0,0 +1,122 @@
+#include <linux/module.h>
+#include <linux/fs.h>
+#include <linux/percpu.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <linux/sched/clock.h>
+#include <linux/log2.h>
+#include <linux/capability.h>
+
+#include "log.h"
+
+#include "stats.h"
+
+#define CREATE_TRACE_POINTS
+#include "trace.h"
+
+DEFINE_PER_CPU(struct rexfs_stats, rexfs_stats);
+
+static const char *const rexfs_op_names[REXFS_STAT_OP_COUNT] = {
+  [REXFS_STAT_DIR_LOOKUP] = "dir_lookup",
+  [REXFS_STAT_DIR_OPEN] = "dir_open",
+  [REXFS_STAT_DIR_ITERATE] = "dir_iterate_shared",
+  [REXFS_STAT_PERMISSION] = "permission",
+  [REXFS_STAT_LOWER_LOOKUP] = "lower_lookup",
+};
+
+static const char *const rexfs_count_names[REXFS_COUNT_COUNT] = {
+  [REXFS_COUNT_POLICY_DENIALS] = "policy_denials",
+  [REXFS_COUNT_HIDDEN_LOOKUPS] = "hidden_lookups",
+  [REXFS_COUNT_NEGATIVE_LOOKUPS] = "negative_lookups",
+};
+
+/*
+Prints one line per op and one per counter:
+
+  <op> calls=<n> errors=<n> total_ns=<n> hist=<ns>:<count>,...
+  <counter> <n>
+
+where each hist entry is the lower bound of a non-empty bucket.  The sums
+are not a snapshot, CPUs keep counting while they are read.
+*/
+static int stats_show(struct seq_file *m, void *v)
+{
+  unsigned op;
+  unsigned i;
+  for (op = 0; op < REXFS_STAT_OP_COUNT; op++) {
+    struct rexfs_op_stats sum;
+    int cpu;
+    const char *separator = "";
+    memset(&sum, 0, sizeof(sum));
+    for_each_possible_cpu(cpu) {
+      const struct rexfs_op_stats *stats = &per_cpu_ptr(&rexfs_stats, cpu)->ops[op];
+      sum.calls += stats->calls;
+      sum.errors += stats->errors;
+      sum.total_ns += stats->total_ns;
+      for (i = 0; i < REXFS_STAT_BUCKETS; i++)
+        sum.buckets[i] += stats->buckets[i];
+    }
+    seq_printf(m, "%s calls=%llu errors=%llu total_ns=%llu hist=", rexfs_op_names[op],
+               sum.calls, sum.errors, sum.total_ns);
+    for (i = 0; i < REXFS_STAT_BUCKETS; i++) {
+      if (sum.buckets[i]) {
+        seq_printf(m, "%s%llu:%llu", separator, i ? 1ULL << i : 0ULL, sum.buckets[i]);
+        separator = ",";
+      }
+    }
+    seq_putc(m, '\n');
+  }
+  for (i = 0; i < REXFS_COUNT_COUNT; i++) {
+    u64 sum = 0;
+    int cpu;
+    for_each_possible_cpu(cpu)
+      sum += per_cpu_ptr(&rexfs_stats, cpu)->counts[i];
+    seq_printf(m, "%s %llu\n", rexfs_count_names[i], sum);
+  }
+  return 0;
+}
+
+static int stats_open(struct inode *inode, struct file *file)
+{
+  return single_open(file, stats_show, NULL);
+}
+
+// any write resets the stats, e.g. between a native and a sandboxed run
+static ssize_t stats_write(struct file *file, const char __user *buffer, size_t size, loff_t *offset)
+{
+  int cpu;
+  if (!capable(CAP_SYS_ADMIN))
+    return -EPERM;
+  for_each_possible_cpu(cpu)
+    memset(per_cpu_ptr(&rexfs_stats, cpu), 0, sizeof(struct rexfs_stats));
+  return size;
+}
+
+static const struct file_operations rexfs_stats_fops = {
+  .owner = THIS_MODULE,
+  .open = stats_open,
+  .read = seq_read,
+  .write = stats_write,
+  .llseek = seq_lseek,
+  .release = single_release,
+};
+
+int rexfs_stats_init(void)
+{
+  struct proc_dir_entry *dir = proc_mkdir("fs/rexfs", NULL);
+  if (!dir) {
+    err("proc_mkdir(fs/rexfs) failed");
+    return -ENOMEM;
+  }
+  if (!proc_create("stats", 0644, dir, &rexfs_stats_fops)) {
+    err("proc_create(fs/rexfs/stats) failed");
+    remove_proc_subtree("fs/rexfs", NULL);
+    return -ENOMEM;
+  }
+  return 0;
+}
+
+void rexfs_stats_cleanup(void)
+{
+  remove_proc_subtree("fs/rexfs", NULL);
+}
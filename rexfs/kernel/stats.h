@@ -0,0 +1,60 @@
+/*
+Per CPU counters and latency histograms, printed by /proc/fs/rexfs/stats.
+They are always on: an update is a few this_cpu ops and two reads of
+local_clock.
+*/
+#define REXFS_STAT_DIR_LOOKUP    0
+#define REXFS_STAT_DIR_OPEN      1
+#define REXFS_STAT_DIR_ITERATE   2
+#define REXFS_STAT_PERMISSION    3
+#define REXFS_STAT_LOWER_LOOKUP  4
+#define REXFS_STAT_OP_COUNT      5
+
+#define REXFS_COUNT_POLICY_DENIALS   0 // permission checks the policy refused
+#define REXFS_COUNT_HIDDEN_LOOKUPS   1 // names the policy hid without asking the lower filesystem
+#define REXFS_COUNT_NEGATIVE_LOOKUPS 2 // names that do not exist in the lower filesystem
+#define REXFS_COUNT_COUNT            3
+
+#define REXFS_STAT_BUCKETS 32 // bucket n counts durations in [2^n, 2^(n+1)) ns, the last one everything longer
+
+struct rexfs_op_stats {
+  u64 calls;
+  u64 errors;
+  u64 total_ns;
+  u64 buckets[REXFS_STAT_BUCKETS];
+};
+
+struct rexfs_stats {
+  struct rexfs_op_stats ops[REXFS_STAT_OP_COUNT];
+  u64 counts[REXFS_COUNT_COUNT];
+};
+
+DECLARE_PER_CPU(struct rexfs_stats, rexfs_stats);
+
+static inline u64 rexfs_stats_start(void)
+{
+  return local_clock();
+}
+
+// returns: the duration of the op in ns
+static inline u64 rexfs_stats_end(unsigned op, u64 start, bool error)
+{
+  s64 ns = local_clock() - start;
+  // the task moved to a CPU whose clock is a little behind
+  if (ns < 0)
+    ns = 0;
+  this_cpu_inc(rexfs_stats.ops[op].calls);
+  if (error)
+    this_cpu_inc(rexfs_stats.ops[op].errors);
+  this_cpu_add(rexfs_stats.ops[op].total_ns, ns);
+  this_cpu_inc(rexfs_stats.ops[op].buckets[ns ? min(ilog2(ns), REXFS_STAT_BUCKETS - 1) : 0]);
+  return ns;
+}
+
+static inline void rexfs_stats_count(unsigned counter)
+{
+  this_cpu_inc(rexfs_stats.counts[counter]);
+}
+
+int rexfs_stats_init(void);
+void rexfs_stats_cleanup(void);
@@ -2,38 +2,71 @@
 #include <linux/module.h>
 #include <linux/fs.h>
 #include <linux/slab.h>
+#include <linux/fs_struct.h>
+#include <linux/sched.h>
+#include <linux/refcount.h>
+#include <linux/jump_label.h>
 
 #include "log.h"
 
+#include "audit.h"
 #include "inode.h"
+#include "policy.h"
+#include "stats.h"
 
 #define REXFS_MAGIC 0xceeabc8f // just a random number (not sure if this is necessary)
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Jonathan Marler");
 
-struct rexfs_inode {
-  struct inode ai_inode;
-  // TODO more members
-};
+static struct kmem_cache *rexfs_inode_cachep;
+
+static void rexfs_inode_init_once(void *object)
+{
+  struct rexfs_inode *inode = object;
+  inode_init_once(&inode->vfs_inode);
+}
+
+static int rexfs_inode_cache_init(void)
+{
+  rexfs_inode_cachep = kmem_cache_create("rexfs_inode", sizeof(struct rexfs_inode), 0,
+                                         SLAB_RECLAIM_ACCOUNT | SLAB_MEM_SPREAD | SLAB_ACCOUNT,
+                                         rexfs_inode_init_once);
+  if (!rexfs_inode_cachep) {
+    err("kmem_cache_create(rexfs_inode) failed");
+    return -ENOMEM;
+  }
+  return 0;
+}
+
+static void rexfs_inode_cache_destroy(void)
+{
+  // wait for the inodes still waiting to be freed by rexfs_i_callback
+  rcu_barrier();
+  kmem_cache_destroy(rexfs_inode_cachep);
+}
 
 struct inode *rexfs_alloc_inode(struct super_block *sb)
 {
-  struct rexfs_inode *inode;
-  devlog("alloc_inode");
-  // TODO: probably want to use a kmem_cache
-  inode = (struct rexfs_inode*)kzalloc(sizeof(struct rexfs_inode), GFP_KERNEL);
+  struct rexfs_inode *inode = kmem_cache_alloc(rexfs_inode_cachep, GFP_KERNEL);
   if (!inode) {
-    err("kmalloc(%lu, GFP_KERNEL) failed", sizeof(struct rexfs_inode));
+    err("kmem_cache_alloc(rexfs_inode) failed");
     return NULL;
   }
-  return &inode->ai_inode;
+  inode->lower = NULL;
+  return &inode->vfs_inode;
+}
+
+static void rexfs_i_callback(struct rcu_head *head)
+{
+  struct inode *inode = container_of(head, struct inode, i_rcu);
+  kmem_cache_free(rexfs_inode_cachep, REXFS_I(inode));
 }
 
 void rexfs_destroy_inode(struct inode *inode)
 {
-  devlog("destroy_inode");
-  kfree(inode);
+  // permission() can still be looking at the inode during an RCU walk
+  call_rcu(&inode->i_rcu, rexfs_i_callback);
 }
 
 void rexfs_put_super(struct super_block *sb)
@@ -45,8 +78,9 @@ void rexfs_put_super(struct super_block *sb)
 }
 
 static struct super_operations const rexfs_super_ops = {
-  //.alloc_inode = rexfs_alloc_inode,
-  //.destroy_inode = rexfs_destroy_inode,
+  .alloc_inode = rexfs_alloc_inode,
+  .destroy_inode = rexfs_destroy_inode,
+  .evict_inode = rexfs_evict_inode,
   //.put_super = rexfs_put_super,
 };
 
@@ -59,6 +93,7 @@ static int rexfs_fill_super(struct super_block *sb, void *data, int flags)
   sb->s_blocksize = PAGE_SIZE; // not sure if this is needed
   sb->s_blocksize_bits = PAGE_SHIFT; // sure sure if this is needed
   sb->s_time_gran = 1; // not sure if this is needed
+  sb->s_d_op = &rexfs_dentry_ops;
 
   {
     //struct inode *rexfs_make_inode(struct super_block *sb, const struct inode *dir, umode_t mode);
@@ -67,6 +102,7 @@ static int rexfs_fill_super(struct super_block *sb, void *data, int flags)
       err("new_node failed");
       return -ENOMEM;
     }
+    root_inode->i_ino = get_next_ino();
     {
       int result = rexfs_init_inode(root_inode, NULL, S_IFDIR | (S_IRUSR | S_IXUSR) |
                      (S_IRGRP | S_IXGRP) | (S_IROTH | S_IXOTH));
@@ -80,6 +116,19 @@ static int rexfs_fill_super(struct super_block *sb, void *data, int flags)
       err("root inode creation failed");
       return -ENOMEM;
     }
+    // the root shows the root of whoever mounted rexfs
+    {
+      struct path lower_root;
+      int result;
+      get_fs_root(current->fs, &lower_root);
+      result = rexfs_dentry_set_lower(sb->s_root, &lower_root);
+      if (result) {
+        path_put(&lower_root);
+        return result;
+      }
+      ihold(d_inode(lower_root.dentry));
+      REXFS_I(root_inode)->lower = d_inode(lower_root.dentry);
+    }
   }
   devlog("fill_super -");
   return 0;
@@ -111,10 +160,9 @@ struct dentry *rexfs_mount(struct file_system_type * fs_type, int flags,
 void rexfs_kill_sb(struct super_block *sb)
 {
   devlog("kill_sb");
-  // free superblock that was allocated in rexfs_mount
-  // currently it uses mount_nodev, which uses "sget"
-  //kill_anon_super(sb);
-  kill_litter_super(sb);
+  // free superblock that was allocated in rexfs_mount by mount_single,
+  // the dentries aren't pinned like ramfs ones so there's no litter
+  kill_anon_super(sb);
 }
 
 static struct file_system_type rexfs_file_system_type = {
@@ -126,21 +174,99 @@ static struct file_system_type rexfs_file_system_type = {
 };
 
 #define INIT_STATE_INITIAL             0
-#define INIT_STATE_MOUNT_POINT_CREATED 1
-#define INIT_STATE_FS_REGISTERED       2
+#define INIT_STATE_CACHES_CREATED      1
+#define INIT_STATE_PROBES_REGISTERED   2
+#define INIT_STATE_STATS_CREATED       3
+#define INIT_STATE_MOUNT_POINT_CREATED 4
+#define INIT_STATE_FS_REGISTERED       5
 
 static unsigned char init_state = INIT_STATE_INITIAL;
 
+// undoes each init state, newest first
+static void unwind_init(void)
+{
+  switch (init_state) {
+  case INIT_STATE_FS_REGISTERED:
+    devlog("- unregister_filesystem");
+    {
+      int ret = unregister_filesystem(&rexfs_file_system_type);
+      if (ret) {
+        err("unregister_filesystem failed (e=%d)", ret);
+      }
+    }
+    // continue to next state
+  case INIT_STATE_MOUNT_POINT_CREATED:
+    devlog("- remove mount point");
+    sysfs_remove_mount_point(fs_kobj, "rex");
+    // continue to next state
+  case INIT_STATE_STATS_CREATED:
+    devlog("- remove stats");
+    rexfs_stats_cleanup();
+    // continue to next state
+  case INIT_STATE_PROBES_REGISTERED:
+    devlog("- unregister probes");
+    rexfs_policy_cleanup();
+    // continue to next state
+  case INIT_STATE_CACHES_CREATED:
+    devlog("- destroy caches");
+    rexfs_dentry_cache_destroy();
+    rexfs_inode_cache_destroy();
+    rexfs_audit_cleanup();
+    // continue to next state
+  case INIT_STATE_INITIAL:
+    break;
+  }
+  init_state = INIT_STATE_INITIAL;
+}
+
 int __init init_module(void)
 {
   devlog("--------------------------------------------------------------------------------");
   devlog("init_module");
+  {
+    int ret;
+    devlog("- create caches");
+    ret = rexfs_inode_cache_init();
+    if (ret)
+      return ret;
+    ret = rexfs_dentry_cache_init();
+    if (ret) {
+      rexfs_inode_cache_destroy();
+      return ret;
+    }
+    // after the caches, so a failure above has nothing of it to undo
+    rexfs_audit_init();
+  }
+  init_state++;
+  {
+    int ret;
+    devlog("- register probes");
+    ret = rexfs_policy_init();
+    if (ret) {
+      // error already logged
+      unwind_init();
+      return ret;
+    }
+  }
+  init_state++;
+  {
+    int ret;
+    devlog("- create stats");
+    ret = rexfs_stats_init();
+    if (ret) {
+      // error already logged
+      unwind_init();
+      return ret;
+    }
+  }
+  init_state++;
   {
     int ret;
     devlog("- create_mount_point");
     ret = sysfs_create_mount_point(fs_kobj, "rex");
     if (ret) {
       err("sysfs_create_mount_point failed (e=%d)", ret);
+      unwind_init();
       return ret;
     }
   }
@@ -151,6 +277,7 @@ int __init init_module(void)
     ret = register_filesystem(&rexfs_file_system_type);
     if (ret) {
       err("register_filesystem failed (e=%d)", ret);
+      unwind_init();
       return ret;
     }
   }
@@ -161,21 +288,5 @@ int __init init_module(void)
 void __exit cleanup_module(void)
 {
   devlog("cleanup_module");
-  switch (init_state) {
-  case INIT_STATE_MOUNT_POINT_CREATED:
-    devlog("- remove mount point");
-    sysfs_remove_mount_point(fs_kobj, "rex");
-    // continue to next state
-  case INIT_STATE_FS_REGISTERED:
-    devlog("- unregister_filesystem");
-    {
-      int ret = unregister_filesystem(&rexfs_file_system_type);
-      if (ret) {
-        err("unregister_filesystem failed (e=%d)", ret);
-      }
-    }
-    // continue to next state
-  case INIT_STATE_INITIAL:
-    break;
-  }
+  unwind_init();
 }
@@ -0,0 +1,69 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM rexfs
+
+#if !defined(_REXFS_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _REXFS_TRACE_H
+
+#include <linux/tracepoint.h>
+
+// one event per op counted in stats.h, with the duration it was counted with
+DECLARE_EVENT_CLASS(rexfs_name_op,
+  TP_PROTO(const struct inode *dir, const struct qstr *name, int result, u64 ns),
+  TP_ARGS(dir, name, result, ns),
+  TP_STRUCT__entry(
+    __field(unsigned long, dir)
+    __string(name, name->name)
+    __field(int, result)
+    __field(u64, ns)
+  ),
+  TP_fast_assign(
+    __entry->dir = dir->i_ino;
+    __assign_str(name, name->name);
+    __entry->result = result;
+    __entry->ns = ns;
+  ),
+  TP_printk("dir=%lu name=%s result=%d ns=%llu", __entry->dir, __get_str(name), __entry->result, __entry->ns)
+);
+
+DEFINE_EVENT(rexfs_name_op, rexfs_dir_lookup,
+  TP_PROTO(const struct inode *dir, const struct qstr *name, int result, u64 ns),
+  TP_ARGS(dir, name, result, ns));
+DEFINE_EVENT(rexfs_name_op, rexfs_lower_lookup,
+  TP_PROTO(const struct inode *dir, const struct qstr *name, int result, u64 ns),
+  TP_ARGS(dir, name, result, ns));
+
+DECLARE_EVENT_CLASS(rexfs_inode_op,
+  TP_PROTO(const struct inode *inode, int mask, int result, u64 ns),
+  TP_ARGS(inode, mask, result, ns),
+  TP_STRUCT__entry(
+    __field(unsigned long, ino)
+    __field(int, mask)
+    __field(int, result)
+    __field(u64, ns)
+  ),
+  TP_fast_assign(
+    __entry->ino = inode->i_ino;
+    __entry->mask = mask;
+    __entry->result = result;
+    __entry->ns = ns;
+  ),
+  TP_printk("ino=%lu mask=0x%x result=%d ns=%llu", __entry->ino, __entry->mask, __entry->result, __entry->ns)
+);
+
+DEFINE_EVENT(rexfs_inode_op, rexfs_dir_open,
+  TP_PROTO(const struct inode *inode, int mask, int result, u64 ns),
+  TP_ARGS(inode, mask, result, ns));
+DEFINE_EVENT(rexfs_inode_op, rexfs_dir_iterate_shared,
+  TP_PROTO(const struct inode *inode, int mask, int result, u64 ns),
+  TP_ARGS(inode, mask, result, ns));
+DEFINE_EVENT(rexfs_inode_op, rexfs_permission,
+  TP_PROTO(const struct inode *inode, int mask, int result, u64 ns),
+  TP_ARGS(inode, mask, result, ns));
+
+#endif
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE trace
+#include <trace/define_trace.h>